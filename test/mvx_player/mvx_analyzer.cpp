@@ -0,0 +1,345 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include "mvx_analyzer.hpp"
+
+#include <fstream>
+#include <iomanip>
+
+#include "mvx_player.hpp"
+
+using namespace std;
+
+/****************************************************************************
+ * Bitstream analyzer
+ ****************************************************************************/
+
+BitstreamAnalyzer::BitstreamAnalyzer(uint32_t format, uint32_t fps,
+                                     size_t window)
+    : slices(NULL),
+      fps(fps > 0 ? fps : 30),
+      window(window),
+      windowBits(0),
+      totalBits(0),
+      peakBitrate(0),
+      minQp(-1),
+      maxQp(-1),
+      hrdBitrate(0),
+      hrdSize(0),
+      hrdFullness(0),
+      underflows(0) {
+  if (format == V4L2_PIX_FMT_H264) {
+    slices = new h264_parser();
+  } else if (format == V4L2_PIX_FMT_HEVC) {
+    slices = new hevc_parser();
+  } else {
+    throw Exception("Bitstream analysis needs H.264 or HEVC. format=%08x.",
+                    format);
+  }
+
+  /* One second of frames by default. */
+  if (this->window == 0) {
+    this->window = static_cast<size_t>(this->fps + 0.5);
+  }
+}
+
+BitstreamAnalyzer::~BitstreamAnalyzer() { delete slices; }
+
+void BitstreamAnalyzer::setHrd(uint32_t bitrate, uint32_t bufferSize) {
+  hrdBitrate = bitrate;
+  hrdSize = bufferSize;
+  hrdFullness = bufferSize;
+}
+
+/*
+ * Buffers without a frame type flag carry codec config or part of a frame;
+ * they are held and counted into the frame that completes them, the same way
+ * OutputIVF groups them.
+ */
+void BitstreamAnalyzer::add(const iovec *iov, size_t count, uint32_t flags) {
+  for (size_t i = 0; i < count; ++i) {
+    const uint8_t *p = static_cast<const uint8_t *>(iov[i].iov_base);
+    pending.insert(pending.end(), p, p + iov[i].iov_len);
+  }
+
+  if (pending.empty() ||
+      (flags & (V4L2_BUF_FLAG_KEYFRAME | V4L2_BUF_FLAG_PFRAME |
+                V4L2_BUF_FLAG_BFRAME)) == 0) {
+    return;
+  }
+
+  Frame frame;
+  frame.type = (flags & V4L2_BUF_FLAG_KEYFRAME)  ? 'I'
+               : (flags & V4L2_BUF_FLAG_PFRAME) ? 'P'
+                                                : 'B';
+  frame.size = pending.size();
+  parseFrame(frame);
+  pending.clear();
+
+  /* Bitrate over the last window of frames at the nominal frame rate. */
+  windowSizes.push_back(frame.size);
+  windowBits += frame.size * 8ull;
+  if (windowSizes.size() > window) {
+    windowBits -= windowSizes.front() * 8ull;
+    windowSizes.pop_front();
+  }
+  frame.bitrate = windowBits * fps / windowSizes.size();
+  if (windowSizes.size() == window && frame.bitrate > peakBitrate) {
+    peakBitrate = frame.bitrate;
+  }
+  totalBits += frame.size * 8ull;
+
+  /*
+   * Leaky bucket filled at the target bitrate and drained a frame at a time.
+   * The fullness kept per frame is the level right after its removal.
+   */
+  frame.hrdFullness = 0;
+  if (hrdSize != 0) {
+    hrdFullness -= frame.size * 8ll;
+    if (hrdFullness < 0) {
+      underflows++;
+      hrdFullness = 0;
+    }
+    frame.hrdFullness = hrdFullness;
+    hrdFullness += static_cast<int64_t>(hrdBitrate / fps);
+    if (hrdFullness > hrdSize) {
+      hrdFullness = hrdSize;
+    }
+  }
+
+  frames.push_back(frame);
+}
+
+void BitstreamAnalyzer::parseFrame(Frame &frame) {
+  const uint8_t *data = &pending[0];
+  size_t size = pending.size();
+  size_t start = size;
+  int qpSum = 0;
+
+  frame.slices = 0;
+  frame.minQp = -1;
+  frame.maxQp = -1;
+
+  /* Split on 00 00 01 start codes, the trailing zero of a 4 byte code is
+   * stripped from the previous NAL. */
+  for (size_t i = 0; i + 3 <= size; ++i) {
+    if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+      continue;
+    }
+
+    if (start < size) {
+      size_t end = i;
+      while (end > start && data[end - 1] == 0) {
+        end--;
+      }
+      parseNal(&data[start], end - start, frame, qpSum);
+    }
+
+    start = i + 3;
+    i += 2;
+  }
+
+  if (start < size) {
+    parseNal(&data[start], size - start, frame, qpSum);
+  }
+
+  frame.qp = -1;
+  if (frame.slices > 0) {
+    frame.qp = static_cast<double>(qpSum) / frame.slices;
+    minQp = minQp < 0 || frame.minQp < minQp ? frame.minQp : minQp;
+    maxQp = frame.maxQp > maxQp ? frame.maxQp : maxQp;
+  }
+}
+
+void BitstreamAnalyzer::parseNal(const uint8_t *nal, size_t size, Frame &frame,
+                                 int &qpSum) {
+  size_t n = size < ANALYZER_NAL_BYTES ? size : ANALYZER_NAL_BYTES;
+  size_t zeros = 0;
+
+  if (size == 0) {
+    return;
+  }
+
+  /* Drop emulation prevention bytes, the parsers read raw RBSP. */
+  scratch.clear();
+  for (size_t i = 0; i < n; ++i) {
+    if (zeros >= 2 && nal[i] == 3) {
+      zeros = 0;
+      continue;
+    }
+
+    zeros = nal[i] == 0 ? zeros + 1 : 0;
+    scratch.push_back(nal[i]);
+  }
+
+  reader::packet_info packet(&scratch[0], scratch.size());
+  parser::info info;
+  slices->parse(packet, info);
+
+  if (!info.slice || info.qp < 0) {
+    return;
+  }
+
+  /* Slices that are not followed to their QP do not count towards it. */
+  frame.slices++;
+  qpSum += info.qp;
+  if (frame.minQp < 0 || info.qp < frame.minQp) {
+    frame.minQp = info.qp;
+  }
+  if (info.qp > frame.maxQp) {
+    frame.maxQp = info.qp;
+  }
+}
+
+size_t BitstreamAnalyzer::getFrames(char type) const {
+  size_t n = 0;
+
+  for (size_t i = 0; i < frames.size(); ++i) {
+    n += frames[i].type == type;
+  }
+
+  return n;
+}
+
+double BitstreamAnalyzer::getBitrate() const {
+  return frames.empty() ? 0 : totalBits * fps / frames.size();
+}
+
+/* Streams shorter than the window only have their average. */
+double BitstreamAnalyzer::getPeakBitrate() const {
+  return frames.size() < window ? getBitrate() : peakBitrate;
+}
+
+double BitstreamAnalyzer::getAverageQp() const {
+  double sum = 0;
+  size_t n = 0;
+
+  for (size_t i = 0; i < frames.size(); ++i) {
+    if (frames[i].qp >= 0) {
+      sum += frames[i].qp;
+      n++;
+    }
+  }
+
+  return n > 0 ? sum / n : -1;
+}
+
+void BitstreamAnalyzer::writeSummary(ostream &os) const {
+  static const char types[] = {'I', 'P', 'B'};
+
+  os << fixed << setprecision(1);
+  os << "Rate control. frames=" << frames.size()
+     << ", bitrate=" << getBitrate() / 1000
+     << " kbps, peak=" << getPeakBitrate() / 1000 << " kbps over " << window
+     << " frames, qp=" << getAverageQp() << " [" << minQp << ", " << maxQp
+     << "]." << endl;
+
+  for (size_t t = 0; t < sizeof(types); ++t) {
+    uint64_t bytes = 0;
+    double qp = 0;
+    size_t n = 0;
+    size_t nqp = 0;
+
+    for (size_t i = 0; i < frames.size(); ++i) {
+      if (frames[i].type != types[t]) {
+        continue;
+      }
+
+      n++;
+      bytes += frames[i].size;
+      if (frames[i].qp >= 0) {
+        qp += frames[i].qp;
+        nqp++;
+      }
+    }
+
+    if (n == 0) {
+      continue;
+    }
+
+    os << "  " << types[t] << " frames=" << n << ", avg_bytes=" << bytes / n
+       << ", avg_qp=" << (nqp > 0 ? qp / nqp : -1.0) << "." << endl;
+  }
+
+  if (hrdSize != 0) {
+    int64_t low = hrdSize;
+    for (size_t i = 0; i < frames.size(); ++i) {
+      low = frames[i].hrdFullness < low ? frames[i].hrdFullness : low;
+    }
+
+    os << "  HRD buffer=" << hrdSize << " bits, bitrate=" << hrdBitrate
+       << ", min_fullness=" << low << " bits, underflows=" << underflows
+       << "." << endl;
+  }
+
+  os.unsetf(ios::floatfield);
+}
+
+void BitstreamAnalyzer::write(ostream &os) const {
+  os << "frame,type,bytes,slices,qp,qp_min,qp_max,bitrate_kbps";
+  if (hrdSize != 0) {
+    os << ",hrd_fullness_bits";
+  }
+  os << endl;
+
+  os << fixed;
+  for (size_t i = 0; i < frames.size(); ++i) {
+    const Frame &f = frames[i];
+
+    os << i << "," << f.type << "," << f.size << "," << f.slices << ",";
+    if (f.qp >= 0) {
+      os << setprecision(2) << f.qp;
+    }
+    os << "," << f.minQp << "," << f.maxQp << "," << setprecision(1)
+       << f.bitrate / 1000;
+    if (hrdSize != 0) {
+      os << "," << f.hrdFullness;
+    }
+    os << endl;
+  }
+  os.unsetf(ios::floatfield);
+}
+
+void BitstreamAnalyzer::write(const char *path) const {
+  ofstream os(path);
+
+  if (!os) {
+    throw Exception("Failed to open analysis file. path=%s.", path);
+  }
+
+  write(os);
+}
@@ -0,0 +1,119 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+#ifndef __MVX_ANALYZER_H__
+#define __MVX_ANALYZER_H__
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <deque>
+#include <ostream>
+#include <vector>
+
+class parser;
+
+/****************************************************************************
+ * Bitstream analyzer
+ ****************************************************************************/
+
+/* Bytes of each NAL unit unescaped before it is handed to the parser. */
+#define ANALYZER_NAL_BYTES 4096
+
+/*
+ * Rate control statistics of an H.264 or HEVC stream, gathered from encoder
+ * capture buffers as they are dequeued. The frame type comes from the buffer
+ * flags and the QP from the slice headers. Bitrate is measured over a sliding
+ * window of frames at the nominal frame rate, and an optional leaky bucket
+ * models the HRD buffer a decoder would need.
+ */
+class BitstreamAnalyzer {
+ public:
+  BitstreamAnalyzer(uint32_t format, uint32_t fps, size_t window = 0);
+  ~BitstreamAnalyzer();
+
+  void setHrd(uint32_t bitrate, uint32_t bufferSize);
+  void add(const iovec *iov, size_t count, uint32_t flags);
+
+  size_t getFrames() const { return frames.size(); }
+  size_t getFrames(char type) const;
+  double getBitrate() const;
+  double getPeakBitrate() const;
+  double getAverageQp() const;
+  int getMinQp() const { return minQp; }
+  int getMaxQp() const { return maxQp; }
+  uint64_t getUnderflows() const { return underflows; }
+  bool hasHrd() const { return hrdSize != 0; }
+
+  void writeSummary(std::ostream &os) const;
+  void write(std::ostream &os) const;
+  void write(const char *path) const;
+
+ private:
+  struct Frame {
+    char type;
+    uint32_t size;
+    uint32_t slices;
+    int minQp;
+    int maxQp;
+    double qp;
+    double bitrate;
+    int64_t hrdFullness;
+  };
+
+  void parseFrame(Frame &frame);
+  void parseNal(const uint8_t *nal, size_t size, Frame &frame, int &qpSum);
+
+  parser *slices;
+  double fps;
+  size_t window;
+  std::vector<uint8_t> pending;
+  std::vector<uint8_t> scratch;
+  std::vector<Frame> frames;
+  std::deque<uint32_t> windowSizes;
+  uint64_t windowBits;
+  uint64_t totalBits;
+  double peakBitrate;
+  int minQp;
+  int maxQp;
+  uint32_t hrdBitrate;
+  uint32_t hrdSize;
+  int64_t hrdFullness;
+  uint64_t underflows;
+};
+
+#endif /* __MVX_ANALYZER_H__ */
@@ -0,0 +1,525 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+/*
+ * Host side microbenchmarks for the CPU work in the player hot loop. Every
+ * benchmark runs on synthetic input in memory, no device is opened, so the
+ * numbers can be compared across hosts and between commits.
+ */
+
+#include <string.h>
+
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+
+#include "md5.h"
+#include "mvx_argparse.h"
+#include "mvx_player.hpp"
+
+using namespace std;
+
+/****************************************************************************
+ * Synthetic input
+ ****************************************************************************/
+
+/* Deterministic payload bytes that are never zero, so never a start code. */
+static void fillPayload(char *p, size_t size, uint32_t &seed) {
+  for (size_t i = 0; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    p[i] = static_cast<char>(1 + (seed >> 16) % 255);
+  }
+}
+
+static void appendNalu(string &s, uint8_t header, size_t size,
+                       uint32_t &seed) {
+  static const char startCode[] = {0, 0, 0, 1};
+  size_t n;
+
+  s.append(startCode, sizeof(startCode));
+  s.push_back(static_cast<char>(header));
+
+  n = s.size();
+  s.resize(n + size);
+  fillPayload(&s[n], size, seed);
+
+  /* first_mb_in_slice is ue(v) 0, the frame finder keys on it. */
+  s[n] = static_cast<char>(0x88);
+}
+
+/* H.264 Annex B stream, one SPS and PPS followed by one slice per frame. */
+static string makeH264(size_t frames, size_t frameSize) {
+  uint32_t seed = 1;
+  string s;
+
+  appendNalu(s, 0x67, 16, seed);
+  appendNalu(s, 0x68, 4, seed);
+  for (size_t i = 0; i < frames; ++i) {
+    appendNalu(s, i == 0 ? 0x65 : 0x41, frameSize, seed);
+  }
+
+  return s;
+}
+
+static string makeRaw(size_t size) {
+  uint32_t seed = 2;
+  string s(size, '\0');
+
+  fillPayload(&s[0], size, seed);
+
+  return s;
+}
+
+static string makeROI(size_t frames, size_t regions) {
+  ostringstream os;
+
+  for (size_t i = 0; i < frames; ++i) {
+    os << "pic=" << i << " num_roi=" << regions << " qp=30";
+    for (size_t j = 0; j < regions; ++j) {
+      os << " roi={" << j << "," << j + 4 << "," << j << "," << j + 4
+         << ",5}";
+    }
+    os << "\n";
+  }
+
+  return os.str();
+}
+
+static string makeEPR(size_t frames, size_t width, size_t height) {
+  size_t cols = (width + 31) >> 5;
+  size_t rows = (height + 31) >> 5;
+  ostringstream os;
+
+  for (size_t i = 0; i < frames; ++i) {
+    os << "pic=" << i << " num_efp=1 qp={30}\n";
+    os << "pic=" << i << " num_row=" << rows << " type=0xff\n";
+    for (size_t r = 0; r < rows; ++r) {
+      os << "pic=" << i << " row=" << r << " num_bpr=" << cols;
+      for (size_t c = 0; c < cols; ++c) {
+        os << " bpr={0,0,0,0,0}";
+      }
+      os << "\n";
+    }
+  }
+
+  return os.str();
+}
+
+/* USERPTR buffer backed by anonymous memory, sized for the format. */
+static Buffer *createBuffer(v4l2_buf_type type, uint32_t format,
+                            size_t width, size_t height) {
+  v4l2_format fmt;
+  v4l2_buffer buf;
+  v4l2_plane planes[VIDEO_MAX_PLANES];
+  size_t nplanes;
+  size_t stride[3];
+  size_t size[3];
+
+  memset(&fmt, 0, sizeof(fmt));
+  memset(&buf, 0, sizeof(buf));
+  memset(planes, 0, sizeof(planes));
+
+  fmt.type = type;
+  buf.type = type;
+  buf.memory = V4L2_MEMORY_USERPTR;
+
+  if (V4L2_TYPE_IS_MULTIPLANAR(type)) {
+    Codec::getSize(format, width, height, 1, nplanes, stride, size);
+    fmt.fmt.pix_mp.pixelformat = format;
+    fmt.fmt.pix_mp.width = width;
+    fmt.fmt.pix_mp.height = height;
+    fmt.fmt.pix_mp.num_planes = nplanes;
+    for (size_t i = 0; i < nplanes; ++i) {
+      fmt.fmt.pix_mp.plane_fmt[i].bytesperline = stride[i];
+      fmt.fmt.pix_mp.plane_fmt[i].sizeimage = size[i];
+      planes[i].length = size[i];
+    }
+    buf.length = nplanes;
+    buf.m.planes = planes;
+  } else {
+    fmt.fmt.pix.pixelformat = format;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.sizeimage = width * height * 2;
+    buf.length = fmt.fmt.pix.sizeimage;
+  }
+
+  return new Buffer(buf, -1, fmt);
+}
+
+/* Keeps parser chatter on cout out of the measurement. */
+class MuteCout {
+ public:
+  MuteCout() : null("/dev/null"), old(cout.rdbuf(null.rdbuf())) {}
+  ~MuteCout() { cout.rdbuf(old); }
+
+ private:
+  ofstream null;
+  streambuf *old;
+};
+
+/****************************************************************************
+ * Runner
+ ****************************************************************************/
+
+/*
+ * A pass processes the whole synthetic input once and adds the number of
+ * frames and bytes it handled. Passes that handle no bytes have no rate. Passes repeat until the time budget is spent,
+ * after one untimed warm up pass.
+ */
+typedef function<void(uint64_t &frames, uint64_t &bytes)> Pass;
+
+class Runner {
+ public:
+  Runner(uint64_t budget, const char *filter, Report *report)
+      : budget(budget), filter(filter), report(report) {
+    cout << left << setw(24) << "benchmark" << right << setw(10) << "passes"
+         << setw(12) << "frames" << setw(14) << "ns/frame" << setw(10)
+         << "GB/s" << endl;
+  }
+
+  bool selected(const string &name) const {
+    return filter == NULL || name.find(filter) != string::npos;
+  }
+
+  void run(const string &name, const Pass &pass) {
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t passes = 0;
+    uint64_t start;
+    uint64_t elapsed;
+
+    if (!selected(name)) {
+      return;
+    }
+
+    pass(frames, bytes);
+    frames = 0;
+    bytes = 0;
+
+    start = Timer::now();
+    do {
+      pass(frames, bytes);
+      passes++;
+      elapsed = Timer::now() - start;
+    } while (elapsed < budget);
+
+    double nsPerFrame = frames > 0 ? double(elapsed) / frames : 0;
+    double gbps = double(bytes) / elapsed;
+
+    cout << left << setw(24) << name << right << setw(10) << passes
+         << setw(12) << frames << setw(14) << fixed << setprecision(1)
+         << nsPerFrame << setw(10) << setprecision(3);
+    if (bytes > 0) {
+      cout << gbps << endl;
+    } else {
+      cout << "-" << endl;
+    }
+
+    if (report != NULL) {
+      ReportRecord &record = report->add();
+
+      record.set("benchmark", name);
+      record.set("passes", passes);
+      record.set("frames", frames);
+      record.set("bytes", bytes);
+      record.set("elapsed_ns", elapsed);
+      record.set("ns_per_frame", nsPerFrame);
+      if (bytes > 0) {
+        record.set("gb_per_s", gbps);
+      }
+    }
+  }
+
+ private:
+  uint64_t budget;
+  const char *filter;
+  Report *report;
+};
+
+/****************************************************************************
+ * Benchmarks
+ ****************************************************************************/
+
+static void benchBitstream(Runner &runner, size_t width, size_t height,
+                           size_t frames, size_t frameSize) {
+  const string clip = makeH264(frames, frameSize);
+  Buffer *buf = createBuffer(V4L2_BUF_TYPE_VIDEO_OUTPUT, V4L2_PIX_FMT_H264,
+                             width, height);
+  static const struct {
+    const char *name;
+    int nalu;
+  } modes[] = {
+      {"startcode_scan", V4L2_OPT_NALU_FORMAT_ONE_NALU_PER_BUFFER},
+      {"frame_find", V4L2_OPT_NALU_FORMAT_ONE_FRAME_PER_BUFFER},
+  };
+
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+    runner.run(modes[m].name, [&](uint64_t &nframes, uint64_t &bytes) {
+      istringstream is(clip);
+      InputFile input(is, V4L2_PIX_FMT_H264);
+
+      input.setNaluFormat(modes[m].nalu);
+      while (!input.eof()) {
+        input.prepare(*buf);
+        nframes++;
+      }
+      bytes += clip.size();
+    });
+  }
+
+  delete buf;
+}
+
+static void benchFrames(Runner &runner, size_t width, size_t height,
+                        size_t frames) {
+  static const char *formats[] = {
+      "yuv420",      "yuv420_nv12", "yuv420_nv21", "yuv420_p010",
+      "yuv420_y0l2", "yuv422_yuy2", "yuv422_uyvy", "yuv422_y210",
+      "rgba"};
+
+  for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+    const string name = string("prepare_") + formats[f];
+    if (!runner.selected(name)) {
+      continue;
+    }
+
+    uint32_t format = Codec::to4cc(formats[f]);
+    size_t nplanes;
+    size_t stride[3];
+    size_t size[3];
+    size_t frameSize = Codec::getSize(format, width, height, 1, nplanes,
+                                      stride, size);
+    const string clip = makeRaw(frameSize * frames);
+    Buffer *buf = createBuffer(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, format,
+                               width, height);
+
+    runner.run(name, [&](uint64_t &nframes, uint64_t &bytes) {
+      istringstream is(clip);
+      InputFileFrame input(is, format, width, height, 1);
+
+      for (size_t i = 0; i < frames; ++i) {
+        input.prepare(*buf);
+      }
+      nframes += frames;
+      bytes += clip.size();
+    });
+
+    delete buf;
+  }
+}
+
+static void benchBuffer(Runner &runner, size_t width, size_t height) {
+  static const size_t calls = 1000;
+  Buffer *buf = createBuffer(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+                             V4L2_PIX_FMT_P010, width, height);
+  v4l2_buffer &b = buf->getBuffer();
+  uint64_t frameSize = 0;
+
+  for (uint32_t i = 0; i < b.length; ++i) {
+    b.m.planes[i].bytesused = b.m.planes[i].length;
+    frameSize += b.m.planes[i].length;
+  }
+
+  /* A dequeue replaces the buffer, which drops the cached plane view. */
+  runner.run("bytes_used", [&](uint64_t &nframes, uint64_t &) {
+    for (size_t i = 0; i < calls; ++i) {
+      buf->update(b);
+      buf->getBytesUsed();
+    }
+    nframes += calls;
+  });
+
+  runner.run("convert_10bit", [&](uint64_t &nframes, uint64_t &bytes) {
+    buf->convert10Bit();
+    nframes++;
+    bytes += frameSize;
+  });
+
+  delete buf;
+}
+
+static void benchMD5(Runner &runner) {
+  static const size_t blockSize = 1024 * 1024;
+  const string block = makeRaw(blockSize);
+
+  /* Counts one frame per MB hashed, so ns/frame reads as ns per MB. */
+  runner.run("md5_per_mb", [&](uint64_t &nframes, uint64_t &bytes) {
+    MD5_CTX ctx;
+    unsigned char digest[16];
+
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, block.data(), block.size());
+    MD5_Final(digest, &ctx);
+    nframes++;
+    bytes += block.size();
+  });
+}
+
+static void benchIVF(Runner &runner, size_t width, size_t height,
+                     size_t frameSize) {
+  static const size_t frames = 64;
+  Buffer *buf = createBuffer(V4L2_BUF_TYPE_VIDEO_CAPTURE, V4L2_PIX_FMT_VP9,
+                             width, height);
+  PlaneView iov = buf->getImageSize();
+  ofstream os("/dev/null", ios::binary);
+  uint32_t seed = 3;
+
+  fillPayload(static_cast<char *>(iov[0].iov_base), frameSize, seed);
+  iov[0].iov_len = frameSize;
+  buf->setBytesUsed(iov);
+  buf->getBuffer().flags |= V4L2_BUF_FLAG_KEYFRAME;
+
+  runner.run("ivf_finalize", [&](uint64_t &nframes, uint64_t &bytes) {
+    MuteCout mute;
+    OutputIVF output(os, V4L2_PIX_FMT_VP9, width, height);
+
+    for (size_t i = 0; i < frames; ++i) {
+      output.finalize(*buf);
+    }
+    nframes += frames;
+    bytes += frames * frameSize;
+  });
+
+  delete buf;
+}
+
+static void benchConfig(Runner &runner, size_t width, size_t height,
+                        size_t frames) {
+  const string roi = makeROI(frames, 8);
+  const string epr = makeEPR(frames, width, height);
+  uint32_t format = V4L2_PIX_FMT_NV12;
+  istringstream empty;
+
+  runner.run("roi_parse", [&](uint64_t &nframes, uint64_t &bytes) {
+    istringstream is(roi);
+    InputFileFrameWithROI input(empty, format, width, height, 1, is);
+
+    nframes += frames;
+    bytes += roi.size();
+  });
+
+  RoiConfig config;
+  istringstream text(roi);
+  ostringstream compiled;
+  config.load(text);
+  config.write(compiled);
+  const string binary = compiled.str();
+
+  runner.run("roi_load_compiled", [&](uint64_t &nframes, uint64_t &bytes) {
+    istringstream is(binary);
+    InputFileFrameWithROI input(empty, format, width, height, 1, is);
+
+    nframes += frames;
+    bytes += binary.size();
+  });
+
+  /* The EPR config is read as the encode goes, so walk every picture. */
+  Buffer *buf = createBuffer(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, format,
+                             width, height);
+
+  runner.run("epr_parse", [&](uint64_t &nframes, uint64_t &bytes) {
+    MuteCout mute;
+    istringstream is(epr);
+    istringstream raw;
+    InputFileFrameWithEPR input(raw, format, width, height, 1, is,
+                                V4L2_PIX_FMT_H264);
+
+    for (size_t i = 0; i < frames; ++i) {
+      input.prepare(*buf);
+      input.prepare(*buf);
+    }
+    nframes += frames;
+    bytes += epr.size();
+  });
+
+  delete buf;
+}
+
+int main(int argc, const char *argv[]) {
+  int ret;
+  mvx_argparse argp;
+
+  mvx_argp_construct(&argp);
+  mvx_argp_add_opt(&argp, 't', "time", true, 1, "200",
+                   "Time budget per benchmark in milliseconds.");
+  mvx_argp_add_opt(&argp, 'w', "width", true, 1, "1920", "Frame width.");
+  mvx_argp_add_opt(&argp, 'h', "height", true, 1, "1080", "Frame height.");
+  mvx_argp_add_opt(&argp, 'n', "frames", true, 1, "8",
+                   "Frames per synthetic input.");
+  mvx_argp_add_opt(&argp, 's', "frame_size", true, 1, "32768",
+                   "Bytes per compressed frame.");
+  mvx_argp_add_opt(&argp, 'f', "filter", true, 1, NULL,
+                   "Only run benchmarks whose name contains this string.");
+  mvx_argp_add_opt(&argp, 0, "report", true, 1, "bench.json",
+                   "Write a machine readable report. A .csv path selects "
+                   "CSV, anything else JSON.");
+
+  ret = mvx_argp_parse(&argp, argc - 1, &argv[1]);
+  if (ret != 0) {
+    mvx_argp_help(&argp, argv[0]);
+    return 1;
+  }
+
+  size_t width = mvx_argp_get_int(&argp, "width", 0);
+  size_t height = mvx_argp_get_int(&argp, "height", 0);
+  size_t frames = mvx_argp_get_int(&argp, "frames", 0);
+  size_t frameSize = mvx_argp_get_int(&argp, "frame_size", 0);
+  uint64_t budget = mvx_argp_get_int(&argp, "time", 0) * 1000000ull;
+  Report report;
+  bool hasReport = mvx_argp_is_set(&argp, "report");
+  Runner runner(budget,
+                mvx_argp_is_set(&argp, "filter")
+                    ? mvx_argp_get(&argp, "filter", 0)
+                    : NULL,
+                hasReport ? &report : NULL);
+
+  try {
+    benchBitstream(runner, width, height, frames * 16, frameSize);
+    benchFrames(runner, width, height, frames);
+    benchBuffer(runner, width, height);
+    benchMD5(runner);
+    benchIVF(runner, width, height, frameSize);
+    benchConfig(runner, width, height, frames * 4);
+  } catch (Exception &e) {
+    cerr << "Error: " << e.what() << endl;
+    return 1;
+  }
+
+  if (hasReport) {
+    report.write(mvx_argp_get(&argp, "report", 0));
+  }
+
+  return 0;
+}
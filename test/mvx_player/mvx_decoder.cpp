@@ -30,6 +30,9 @@
  *
  */
 
+#include <sys/stat.h>
+
+#include <algorithm>
 #include <fstream>
 
 #include "mvx_argparse.h"
@@ -37,6 +40,119 @@
 
 using namespace std;
 
+static Input *createInput(const char *container, istream &is,
+                          uint32_t format, bool preload) {
+  if (string(container).compare("ivf") == 0) {
+    return new InputIVF(is, format, preload);
+  } else if (string(container).compare("rcv") == 0) {
+    return new InputRCV(is);
+  } else if (string(container).compare("raw") == 0) {
+    return new InputFile(is, format, preload);
+  }
+
+  return NULL;
+}
+
+/* Nearest rank of a sorted, non-empty list. */
+static uint64_t getPercentile(const vector<uint64_t> &sorted, int percentile) {
+  size_t rank = (sorted.size() * percentile + 99) / 100;
+
+  return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+/*
+ * Decode every input of the list in one warm session. The first input is
+ * already set up on the decoder, the others get their own IO in turn.
+ * The latency of every image, in us, is added to latencies and the images
+ * per second of the whole list go to rate.
+ */
+static int streamWarm(Decoder &decoder, const InputList &inputs,
+                      mvx_argparse &argp, Input &input, Output &output,
+                      vector<uint64_t> &latencies, double &rate) {
+  const char *container = mvx_argp_get(&argp, "format", 0);
+  uint32_t inputFormat = Codec::to4cc(mvx_argp_get(&argp, "inputformat", 0));
+  uint32_t outputFormat =
+      Codec::to4cc(mvx_argp_get(&argp, "outputformat", 0));
+  bool preload = mvx_argp_is_set(&argp, "preload");
+  bool interlaced = mvx_argp_is_set(&argp, "interlaced");
+  bool tiled = mvx_argp_is_set(&argp, "tiled");
+  uint64_t begin = Timer::now();
+  int ret = 0;
+
+  for (size_t i = 0; i < inputs.size() && ret == 0; ++i) {
+    uint64_t start = Timer::now();
+
+    if (i == 0) {
+      ret = decoder.stream();
+    } else {
+      ifstream is(inputs[i].c_str());
+      if (!is) {
+        cerr << "Error: Failed to open input. path=" << inputs[i] << "."
+             << endl;
+        ret = 1;
+        break;
+      }
+
+      ofstream os(inputs
+                      .getOutput(i, mvx_argp_get(&argp, "output", 0),
+                                 mvx_argp_get(&argp, "outputformat", 0))
+                      .c_str(),
+                  ios::binary);
+      Input *in = createInput(container, is, inputFormat, preload);
+      Output *out;
+
+      if (Codec::isAFBC(outputFormat)) {
+        out = interlaced ? new OutputAFBCInterlaced(os, outputFormat, tiled)
+                         : new OutputAFBC(os, outputFormat, tiled);
+      } else {
+        out = new OutputFile(os, outputFormat);
+      }
+
+      ret = decoder.stream(*in, *out);
+
+      /* The report only needs the formats, which the first IO shares. */
+      decoder.setIO(input, output);
+      delete in;
+      delete out;
+    }
+
+    latencies.push_back((Timer::now() - start) / 1000);
+    printf("-----[Image] index=%zu, latency=%lu us, input=%s.\n", i,
+           latencies.back(), inputs[i].c_str());
+  }
+
+  rate = latencies.size() * 1e9 / std::max<uint64_t>(Timer::now() - begin, 1);
+
+  vector<uint64_t> sorted = latencies;
+  sort(sorted.begin(), sorted.end());
+  printf(
+      "-----[Test Result] MVX Warm Decode. images: %zu, images/s: %.2f, "
+      "p50: %lu us, p95: %lu us, max: %lu us.\n",
+      latencies.size(), rate, getPercentile(sorted, 50),
+      getPercentile(sorted, 95), sorted.back());
+
+  return ret;
+}
+
+/* Images/s of a batch, printed with the latency from queue to output. */
+static double streamBatch(Decoder &decoder, const OutputStills &output,
+                          uint64_t time) {
+  LatencyTracker *latency = decoder.getLatencyTracker();
+  double rate = output.getImages() * 1e9 / std::max<uint64_t>(time, 1);
+
+  if (latency == NULL || latency->getFrames() == 0) {
+    return rate;
+  }
+
+  printf(
+      "-----[Test Result] MVX Batch Decode. images: %zu, images/s: %.2f, "
+      "p50: %lu us, p95: %lu us, max: %lu us.\n",
+      output.getImages(), rate, latency->getPercentile(50),
+      latency->getPercentile(95), latency->getPercentile(100));
+
+  return rate;
+}
+
 int main(int argc, const char *argv[]) {
   int ret;
   mvx_argparse argp;
@@ -48,7 +164,8 @@ int main(int argc, const char *argv[]) {
   ifstream *md5ref_is = NULL;
 
   mvx_argp_construct(&argp);
-  mvx_argp_add_opt(&argp, '\0', "dev", true, 1, "/dev/video0", "Device.");
+  mvx_argp_add_opt(&argp, '\0', "dev", true, 1, "/dev/video0",
+                   "Device, or fake[:options] for the in-process fake.");
   mvx_argp_add_opt(&argp, 'i', "inputformat", true, 1, "h264", "Pixel format.");
   mvx_argp_add_opt(&argp, 'o', "outputformat", true, 1, "yuv420",
                    "Output pixel format.");
@@ -97,11 +214,58 @@ int main(int argc, const char *argv[]) {
                    "Frames are interlaced");
   mvx_argp_add_opt(&argp, '\0', "tiled", true, 0, "disabled",
                    "Use tiles for AFBC formats.");
+  mvx_argp_add_opt(&argp, 0, "warm", true, 0, "0",
+                   "Decode many inputs in one warm session, which keeps the "
+                   "device set up between them. input is a directory or a "
+                   "file listing one input per line, output a directory "
+                   "the images are written to under their own name, with "
+                   "the output format as extension. Reports the latency of "
+                   "every image.");
+  mvx_argp_add_opt(&argp, 0, "batch", true, 0, "0",
+                   "Decode many stills, one per input buffer, in one "
+                   "session without stopping between them. input and output "
+                   "are as for --warm. Reports images/s and the latency of "
+                   "every image.");
   mvx_argp_add_opt(&argp, 0, "preload", true, 0, "0",
                    "preload the input stream to memory. the size for input "
                    "file should be less than 15MBytes.");
   mvx_argp_add_opt(&argp, 0, "fw_timeout", true, 1, "5",
                    "timeout value[secs] for watchdog timeout. range: 5~60.");
+  mvx_argp_add_opt(&argp, 0, "memory", true, 1, "dmabuf",
+                   "Buffer memory type. [mmap, dmabuf, userptr]");
+  mvx_argp_add_opt(&argp, 0, "prefault", true, 1, "0",
+                   "Pre-fault buffer mappings at allocation. 0:lazy; "
+                   "1:MAP_POPULATE; 2:touch every page once.");
+  mvx_argp_add_opt(&argp, 0, "hugepages", true, 0, "0",
+                   "Back userptr buffers with huge pages.");
+  mvx_argp_add_opt(&argp, 0, "plane_align", true, 1, "64",
+                   "Alignment in bytes of planes packed in one dmabuf. 64 is "
+                   "a cache line, 4096 a page.");
+  mvx_argp_add_opt(&argp, 0, "plane_fds", true, 0, "0",
+                   "Allocate a separate dmabuf for every plane.");
+  mvx_argp_add_opt(&argp, 0, "input_buffers", true, 1, "0",
+                   "Buffers on the input port. 0 keeps the default.");
+  mvx_argp_add_opt(&argp, 0, "output_buffers", true, 1, "0",
+                   "Buffers on the output port. 0 keeps the default.");
+  mvx_argp_add_opt(&argp, 0, "auto_buffers", true, 1, "30",
+                   "Start from the driver's minimum buffer counts and add a "
+                   "buffer to each port that stalled in the last this many "
+                   "frames, until neither port stalls.");
+  mvx_argp_add_opt(&argp, 0, "watchdog", true, 1, "1200000",
+                   "Give up after this many ms without any progress. 0 waits "
+                   "forever.");
+  mvx_argp_add_opt(&argp, 0, "trace", true, 1, "trace.json",
+                   "Write a per buffer timeline in Chrome trace format.");
+  mvx_argp_add_opt(&argp, 0, "report", true, 1, "report.json",
+                   "Write a machine readable report. A .csv path selects "
+                   "CSV, anything else JSON.");
+  mvx_argp_add_opt(&argp, 0, "fw_profile", true, 1, "profile.csv",
+                   "Turn on firmware profiling and write the firmware time "
+                   "of every frame, split from host and driver time, to "
+                   "this CSV file. Needs the driver's firmware interface "
+                   "log and one session per device.");
+  mvx_argp_add_opt(&argp, 0, "fw_log", true, 1, FIRMWARE_LOG_DEFAULT,
+                   "Firmware interface log to read for --fw_profile.");
   mvx_argp_add_opt(
       &argp, 0, "profiling", true, 1, "0",
       "enable profiling for bandwidth statistics . 0:disable; 1:enable.");
@@ -123,15 +287,44 @@ int main(int argc, const char *argv[]) {
 
   bool isPreload = mvx_argp_is_set(&argp, "preload");
 
-  ifstream is(mvx_argp_get(&argp, "input", 0));
+  string inputPath = mvx_argp_get(&argp, "input", 0);
+  string outputPath = mvx_argp_get(&argp, "output", 0);
+  bool warm = mvx_argp_is_set(&argp, "warm");
+  bool batch = mvx_argp_is_set(&argp, "batch");
+  InputList *inputs = NULL;
+  if (warm || batch) {
+    if (warm && batch) {
+      cerr << "Error: --warm and --batch are exclusive." << endl;
+      return 1;
+    }
+    if (mvx_argp_is_set(&argp, "md5")) {
+      cerr << "Error: md5 is not supported for many inputs." << endl;
+      return 1;
+    }
+
+    try {
+      inputs = new InputList(inputPath.c_str());
+    } catch (Exception &e) {
+      cerr << "Error: " << e.what() << endl;
+      return 1;
+    }
+
+    mkdir(outputPath.c_str(), 0755);
+    inputPath = (*inputs)[0];
+    outputPath = inputs->getOutput(0, mvx_argp_get(&argp, "output", 0),
+                                   mvx_argp_get(&argp, "outputformat", 0));
+  }
+
+  ifstream is;
   Input *inputFile;
-  if (string(mvx_argp_get(&argp, "format", 0)).compare("ivf") == 0) {
-    inputFile = new InputIVF(is, inputFormat, isPreload);
-  } else if (string(mvx_argp_get(&argp, "format", 0)).compare("rcv") == 0) {
-    inputFile = new InputRCV(is);
-  } else if (string(mvx_argp_get(&argp, "format", 0)).compare("raw") == 0) {
-    inputFile = new InputFile(is, inputFormat, isPreload);
+  if (batch) {
+    inputFile = new InputStills(*inputs, inputFormat);
   } else {
+    is.open(inputPath.c_str());
+    inputFile = createInput(mvx_argp_get(&argp, "format", 0), is,
+                            inputFormat, isPreload);
+  }
+  if (inputFile == NULL) {
     cerr << "Error: Unsupported container format. format="
          << mvx_argp_get(&argp, "format", 0) << "." << endl;
     return 1;
@@ -154,13 +347,20 @@ int main(int argc, const char *argv[]) {
   bool interlaced = mvx_argp_is_set(&argp, "interlaced");
   bool tiled = mvx_argp_is_set(&argp, "tiled");
 
-  ofstream os(mvx_argp_get(&argp, "output", 0), ios::binary);
+  ofstream os;
   Output *output;
 
-  if (Codec::isAFBC(outputFormat)) {
+  if (batch) {
+    output = new OutputStills(outputFormat,
+                              static_cast<InputStills &>(*inputFile),
+                              mvx_argp_get(&argp, "output", 0),
+                              mvx_argp_get(&argp, "outputformat", 0));
+  } else if (Codec::isAFBC(outputFormat)) {
+    os.open(outputPath.c_str(), ios::binary);
     output = (interlaced) ? new OutputAFBCInterlaced(os, outputFormat, tiled)
                           : new OutputAFBC(os, outputFormat, tiled);
   } else {
+    os.open(outputPath.c_str(), ios::binary);
     md5_filename = mvx_argp_get(&argp, "md5", 0);
     if (md5_filename) {
       printf("md5_filename is < %s >.\n", md5_filename);
@@ -216,6 +416,39 @@ int main(int argc, const char *argv[]) {
   if (mvx_argp_is_set(&argp, "profiling")) {
     decoder.setProfiling(mvx_argp_get_int(&argp, "profiling", 0));
   }
+  if (mvx_argp_is_set(&argp, "memory")) {
+    decoder.setMemoryType(
+        Codec::toMemoryType(mvx_argp_get(&argp, "memory", 0)));
+  }
+  if (mvx_argp_is_set(&argp, "prefault")) {
+    try {
+      decoder.setPrefault(
+          Codec::toPrefault(mvx_argp_get_int(&argp, "prefault", 0)));
+    } catch (Exception &e) {
+      cerr << "Error: " << e.what();
+      return 1;
+    }
+  }
+  if (mvx_argp_is_set(&argp, "hugepages")) {
+    decoder.setHugePages(true);
+  }
+  if (mvx_argp_is_set(&argp, "plane_align")) {
+    decoder.setPlaneAlignment(mvx_argp_get_int(&argp, "plane_align", 0));
+  }
+  if (mvx_argp_is_set(&argp, "plane_fds")) {
+    decoder.setSeparatePlanes(true);
+  }
+  if (mvx_argp_is_set(&argp, "watchdog")) {
+    decoder.setWatchdog(mvx_argp_get_int(&argp, "watchdog", 0));
+  }
+  if (mvx_argp_is_set(&argp, "input_buffers") ||
+      mvx_argp_is_set(&argp, "output_buffers")) {
+    decoder.setBufferCounts(mvx_argp_get_int(&argp, "input_buffers", 0),
+                            mvx_argp_get_int(&argp, "output_buffers", 0));
+  }
+  if (mvx_argp_is_set(&argp, "auto_buffers")) {
+    decoder.setAutoBuffers(mvx_argp_get_int(&argp, "auto_buffers", 0));
+  }
   if (mvx_argp_is_set(&argp, "dsl_frame_width") &&
       mvx_argp_is_set(&argp, "dsl_frame_height")) {
     assert(!mvx_argp_is_set(&argp, "dsl_ratio_hor") &&
@@ -259,13 +492,44 @@ int main(int argc, const char *argv[]) {
   decoder.setDownScale(scale);
   decoder.setFrameCount(frames);
 
-  ret = decoder.stream();
+  FirmwareProfiler *profiler = NULL;
+  if (mvx_argp_is_set(&argp, "fw_profile")) {
+    profiler = new FirmwareProfiler(mvx_argp_get(&argp, "fw_log", 0));
+    decoder.setProfiling(1);
+    decoder.setFirmwareProfiler(profiler);
+  }
+
+  if (mvx_argp_is_set(&argp, "trace")) {
+    Trace::enable();
+  }
+
+  vector<uint64_t> latencies;
+  double rate = 0;
+  if (warm) {
+    ret = streamWarm(decoder, *inputs, argp, *inputFile, *output, latencies,
+                     rate);
+  } else if (batch) {
+    uint64_t start = Timer::now();
+
+    decoder.setTrackLatency(true);
+    ret = decoder.stream();
+    rate = streamBatch(decoder, static_cast<OutputStills &>(*output),
+                       Timer::now() - start);
+  } else {
+    ret = decoder.stream();
+  }
+
+  if (mvx_argp_is_set(&argp, "trace")) {
+    Trace::write(mvx_argp_get(&argp, "trace", 0));
+  }
 
   float fps = decoder.getAverageFramerate();
+  const char *md5 = "none";
 
   if (ret == 0) {
     if (md5_filename != NULL && md5ref_filename != NULL) {
       bool is_md5_ok = output->getMd5CheckResult();
+      md5 = is_md5_ok ? "pass" : "fail";
       if (is_md5_ok) {
         printf(
             "-----[Test Result] MVX Decode MD5 Check PASS. Average Framerate: "
@@ -287,6 +551,35 @@ int main(int argc, const char *argv[]) {
            fps);
   }
 
+  if (profiler != NULL) {
+    profiler->writeSummary(cout);
+    profiler->write(mvx_argp_get(&argp, "fw_profile", 0));
+  }
+
+  if (mvx_argp_is_set(&argp, "report")) {
+    Report report;
+    ReportRecord &record = report.add();
+
+    record.set("tool", "mvx_decoder");
+    record.set("device", mvx_argp_get(&argp, "dev", 0));
+    record.set("input", mvx_argp_get(&argp, "input", 0));
+    record.set("output", mvx_argp_get(&argp, "output", 0));
+    decoder.fillReport(record);
+    if (warm) {
+      record.set("images", static_cast<uint64_t>(latencies.size()));
+      record.set("images_per_sec", rate);
+      record.set("image_latency_us", latencies);
+    } else if (batch) {
+      record.set("images", static_cast<uint64_t>(
+                               static_cast<OutputStills *>(output)
+                                   ->getImages()));
+      record.set("images_per_sec", rate);
+    }
+    record.set("md5", md5);
+    record.set("result", ret == 0 ? "pass" : "fail");
+    report.write(mvx_argp_get(&argp, "report", 0));
+  }
+
   if (md5_os) {
     md5_os->close();
     delete md5_os;
@@ -299,6 +592,8 @@ int main(int argc, const char *argv[]) {
   is.close();
   os.close();
 
+  delete profiler;
+  delete inputs;
   delete inputFile;
   delete output;
 
@@ -32,6 +32,7 @@
 
 #include <pthread.h>
 
+#include <cstdio>
 #include <fstream>
 #include <sstream>
 
@@ -51,6 +52,15 @@ struct job {
         outputFormat(outputFormat),
         outputStride(outputStride),
         inputFileFormat(inputFileFormat),
+        nonblock(true),
+        memoryType(V4L2_MEMORY_DMABUF),
+        scheduler(NULL),
+        is(NULL),
+        os(NULL),
+        log(NULL),
+        input(NULL),
+        output(NULL),
+        decoder(NULL),
         ret(0) {}
 
   const char *dev;
@@ -60,43 +70,205 @@ struct job {
   uint32_t outputFormat;
   size_t outputStride;
   string inputFileFormat;
+  string segment;  // Bitstream fed from memory instead of inputFile.
+  bool nonblock;
+  uint32_t memoryType;
+  StageScheduler *scheduler;
+  istream *is;
+  ofstream *os;
+  ofstream *log;
+  InputFile *input;
+  OutputFile *output;
+  Decoder *decoder;
+  ReportRecord record;
   int ret;
 };
 
-void *decodeThread(void *arg) {
-  job *j = static_cast<job *>(arg);
-
-  ifstream is(j->inputFile.c_str());
-  ofstream os(j->outputFile.c_str());
+static void openJob(job *j) {
   string logf = j->outputFile + ".log";
-  ofstream log(logf.c_str());
 
-  InputFile *inputFile;
-  OutputFile outputFile = OutputFile(os, j->outputFormat);
+  if (j->segment.empty()) {
+    j->is = new ifstream(j->inputFile.c_str());
+  } else {
+    j->is = new istringstream(j->segment);
+  }
+
+  j->os = new ofstream(j->outputFile.c_str());
+  j->log = new ofstream(logf.c_str());
+  j->output = new OutputFile(*j->os, j->outputFormat);
 
   if ((j->inputFileFormat).compare("ivf") == 0) {
-    inputFile = new InputIVF(is, j->inputFormat);
+    j->input = new InputIVF(*j->is, j->inputFormat);
   } else if ((j->inputFileFormat).compare("rcv") == 0) {
-    inputFile = new InputRCV(is);
+    j->input = new InputRCV(*j->is);
   } else if ((j->inputFileFormat).compare("raw") == 0) {
-    inputFile = new InputFile(is, j->inputFormat);
+    j->input = new InputFile(*j->is, j->inputFormat);
   }
 
-  Decoder decoder(j->dev, *inputFile, outputFile, true, log);
-  j->ret = decoder.stream();
+  j->decoder =
+      new Decoder(j->dev, *j->input, *j->output, j->nonblock, *j->log);
+  j->decoder->setStageScheduler(j->scheduler);
+  j->decoder->setMemoryType(j->memoryType);
+}
+
+static void closeJob(job *j) {
+  j->decoder->fillReport(j->record);
+  j->record.set("result", j->ret == 0 ? "pass" : "fail");
+
+  delete j->decoder;
+  delete j->input;
+  delete j->output;
+  delete j->log;
+  delete j->os;
+  delete j->is;
+}
+
+void *decodeThread(void *arg) {
+  job *j = static_cast<job *>(arg);
+
+  openJob(j);
+  j->ret = j->decoder->stream();
+  closeJob(j);
 
   return j;
 }
 
+/* Drive every session from a few threads instead of one thread each. */
+static int runEventLoop(job *jobs[], int nsessions, int threads) {
+  EventLoop loop(threads);
+  int ret;
+
+  for (int i = 0; i < nsessions; ++i) {
+    openJob(jobs[i]);
+    loop.add(*jobs[i]->decoder);
+  }
+
+  ret = loop.run();
+
+  for (int i = 0; i < nsessions; ++i) {
+    jobs[i]->ret = loop.getResult(i);
+    closeJob(jobs[i]);
+  }
+
+  return ret;
+}
+
+/*
+ * Split a closed GOP H.264 or HEVC stream into at most count segments of
+ * about equal size. Each segment after the first starts at an IDR access unit,
+ * with the parameter sets and SEI in front of it, so it decodes on its own.
+ * Segments without parameter sets of their own get the stream header.
+ */
+static void splitStream(string &stream, uint32_t format, size_t count,
+                        vector<string> &segments) {
+  start_code_reader reader(format);
+  uint8_t *base = reinterpret_cast<uint8_t *>(&stream[0]);
+  vector<size_t> idrs;
+  vector<bool> configs;
+  vector<size_t> cuts;
+  string header;
+  size_t unit = string::npos;
+  bool config = false;
+  bool frames = false;
+
+  if (!reader.is_parser_valid()) {
+    throw Exception("Segmented decode needs H.264 or HEVC. format=%08x.",
+                    format);
+  }
+
+  reader.reset_bitstream_data(base, stream.size());
+  reader.set_eos(true);
+
+  while (true) {
+    uint8_t *data;
+    uint32_t remaining;
+    uint32_t slices;
+    uint32_t start;
+    uint32_t size;
+
+    reader.get_remaining_bitstream_data(data, remaining);
+    reader::result rtn = reader.find_one_frame(slices, start, size);
+    if (size == 0) {
+      break;
+    }
+
+    start += data - base;
+    if (rtn == reader::RR_EOP_CODEC_CONFIG || rtn == reader::RR_OK) {
+      unit = unit == string::npos ? start : unit;
+      config = config || rtn == reader::RR_EOP_CODEC_CONFIG;
+      if (!frames && rtn == reader::RR_EOP_CODEC_CONFIG) {
+        header.append(stream, start, size);
+      }
+
+      continue;
+    }
+
+    /* Access units open with the config and SEI in front of the slices. */
+    if (reader.is_idr_frame()) {
+      idrs.push_back(unit == string::npos ? start : unit);
+      configs.push_back(config);
+    }
+
+    unit = string::npos;
+    config = false;
+    frames = true;
+  }
+
+  /* Cut at the first IDR at or past each equal share of the stream. */
+  for (size_t i = 0, k = 1; i < idrs.size() && k < count; ++i) {
+    if (idrs[i] == 0 || idrs[i] < stream.size() * k / count) {
+      continue;
+    }
+
+    cuts.push_back(i);
+    while (k < count && stream.size() * k / count <= idrs[i]) {
+      k++;
+    }
+  }
+
+  for (size_t i = 0, begin = 0; i <= cuts.size(); ++i) {
+    size_t end = i < cuts.size() ? idrs[cuts[i]] : stream.size();
+
+    segments.push_back(i == 0 || configs[cuts[i - 1]] ? string() : header);
+    segments.back().append(stream, begin, end - begin);
+    begin = end;
+  }
+}
+
+/* Append the segment outputs in order to path and remove them. */
+static void joinSegments(job *jobs[], int nsessions, const char *path) {
+  ofstream os(path);
+
+  for (int i = 0; i < nsessions; ++i) {
+    {
+      ifstream is(jobs[i]->outputFile.c_str());
+
+      if (is.peek() != EOF) {
+        os << is.rdbuf();
+      }
+    }
+
+    remove(jobs[i]->outputFile.c_str());
+  }
+}
+
 int main(int argc, const char *argv[]) {
   int ret;
   mvx_argparse argp;
   uint32_t inputFormat;
   uint32_t outputFormat;
   int nsessions;
+  int threads;
+  int stageThreads;
+  uint32_t memoryType = V4L2_MEMORY_DMABUF;
+  StageScheduler *scheduler = NULL;
+  bool segmented;
+  vector<string> segments;
+  uint64_t begin = Timer::now();
 
   mvx_argp_construct(&argp);
-  mvx_argp_add_opt(&argp, '\0', "dev", true, 1, "/dev/video0", "Device.");
+  mvx_argp_add_opt(&argp, '\0', "dev", true, 1, "/dev/video0",
+                   "Device, or fake[:options] for the in-process fake.");
   mvx_argp_add_opt(&argp, 'i', "inputformat", true, 1, "h264", "Pixel format.");
   mvx_argp_add_opt(&argp, 'o', "outputformat", true, 1, "yuv420",
                    "Output pixel format.");
@@ -106,6 +278,24 @@ int main(int argc, const char *argv[]) {
   mvx_argp_add_opt(&argp, 's', "stride", true, 1, "1", "Stride alignment.");
   mvx_argp_add_opt(&argp, 'n', "nsessions", true, 1, "1",
                    "Number of sessions.");
+  mvx_argp_add_opt(&argp, 'z', "block", true, 0, "0",
+                   "Use video device in blocking mode");
+  mvx_argp_add_opt(&argp, '\0', "event_loop", true, 1, "0",
+                   "Drive all sessions from this many event loop threads. 0 "
+                   "uses one thread per session.");
+  mvx_argp_add_opt(&argp, '\0', "stage_threads", true, 1, "0",
+                   "Run the CPU side of all sessions on a shared pool of this "
+                   "many threads. 0 keeps it on the polling thread.");
+  mvx_argp_add_opt(&argp, 0, "memory", true, 1, "dmabuf",
+                   "Buffer memory type of every session. [mmap, dmabuf, "
+                   "userptr]");
+  mvx_argp_add_opt(&argp, 0, "report", true, 1, "report.json",
+                   "Write a machine readable report with one record per "
+                   "session. A .csv path selects CSV, anything else JSON.");
+  mvx_argp_add_opt(&argp, 0, "segmented", true, 0, "0",
+                   "Split one closed GOP raw H.264 or HEVC stream at IDR "
+                   "pictures, decode the segments in parallel, one per "
+                   "session, and join the output in order.");
   mvx_argp_add_pos(&argp, "input", false, 1, "", "Input file.");
   mvx_argp_add_pos(&argp, "output", false, 1, "", "Output file.");
 
@@ -129,8 +319,39 @@ int main(int argc, const char *argv[]) {
     return 1;
   }
 
+  if (mvx_argp_is_set(&argp, "memory")) {
+    try {
+      memoryType = Codec::toMemoryType(mvx_argp_get(&argp, "memory", 0));
+    } catch (Exception &e) {
+      fprintf(stderr, "Error: %s\n", e.what());
+      return 1;
+    }
+  }
+
   nsessions = mvx_argp_get_int(&argp, "nsessions", 0);
+  threads = mvx_argp_get_int(&argp, "event_loop", 0);
+  stageThreads = mvx_argp_get_int(&argp, "stage_threads", 0);
+  if (stageThreads > 0) {
+    scheduler = new StageScheduler(stageThreads);
+  }
 
+  segmented = mvx_argp_is_set(&argp, "segmented");
+  if (segmented) {
+    ifstream is(mvx_argp_get(&argp, "input", 0));
+    stringstream ss;
+
+    if (string(mvx_argp_get(&argp, "format", 0)).compare("raw") != 0) {
+      fprintf(stderr, "Error: Segmented decode needs raw input.\n");
+      return 1;
+    }
+
+    ss << is.rdbuf();
+    string stream = ss.str();
+    splitStream(stream, inputFormat, nsessions, segments);
+    nsessions = segments.size();
+  }
+
+  job *jobs[nsessions];
   pthread_t tid[nsessions];
   for (int i = 0; i < nsessions; ++i) {
     stringstream ss;
@@ -143,20 +364,66 @@ int main(int argc, const char *argv[]) {
                 outputFormat, mvx_argp_get_int(&argp, "stride", 0),
                 string(mvx_argp_get(&argp, "format", 0)));
 
+    if (segmented) {
+      j->segment.swap(segments[i]);
+      j->record.set("segment_bytes", static_cast<uint64_t>(j->segment.size()));
+    }
+
+    j->nonblock = !mvx_argp_is_set(&argp, "block");
+    j->memoryType = memoryType;
+    j->scheduler = scheduler;
+    j->record.set("tool", "mvx_decoder_multi");
+    j->record.set("session", i);
+    j->record.set("device", j->dev);
+    j->record.set("input", mvx_argp_get(&argp, "input", 0));
+    j->record.set("output", j->outputFile);
+    jobs[i] = j;
+
+    if (threads > 0) {
+      continue;
+    }
+
     ret = pthread_create(&tid[i], NULL, decodeThread, j);
     if (ret != 0) {
       throw Exception("Failed to create input thread.");
     }
   }
 
-  ret = 0;
-  for (int i = 0; i < nsessions; ++i) {
-    job *j;
+  if (threads > 0) {
+    ret = runEventLoop(jobs, nsessions, threads);
+  } else {
+    ret = 0;
+    for (int i = 0; i < nsessions; ++i) {
+      job *j;
 
-    pthread_join(tid[i], reinterpret_cast<void **>(&j));
-    ret += j->ret;
-    delete (j);
+      pthread_join(tid[i], reinterpret_cast<void **>(&j));
+      ret += j->ret;
+    }
   }
 
+  if (segmented) {
+    joinSegments(jobs, nsessions, mvx_argp_get(&argp, "output", 0));
+    printf(
+        "-----[Test Result] MVX Segmented Decode %s. segments: %d, time: "
+        "%.3f s.\n",
+        ret == 0 ? "PASS" : "FAIL", nsessions, (Timer::now() - begin) / 1e9);
+  }
+
+  if (mvx_argp_is_set(&argp, "report")) {
+    Report report;
+
+    for (int i = 0; i < nsessions; ++i) {
+      report.add() = jobs[i]->record;
+    }
+
+    report.write(mvx_argp_get(&argp, "report", 0));
+  }
+
+  for (int i = 0; i < nsessions; ++i) {
+    delete jobs[i];
+  }
+
+  delete scheduler;
+
   return ret;
 }
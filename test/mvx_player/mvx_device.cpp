@@ -0,0 +1,1162 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include "mvx_device.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "mvx-v4l2-controls.h"
+#include "mvx_player.hpp"
+
+using namespace std;
+
+/****************************************************************************
+ * Fake device
+ ****************************************************************************/
+
+/* Bitstream buffer size when the player leaves it to the device. */
+#define FAKE_BITSTREAM_SIZE (1024 * 1024)
+
+namespace {
+
+class FakeDevice : public Device {
+ public:
+  FakeDevice(const char *options);
+  virtual ~FakeDevice();
+
+ protected:
+  virtual int getFd() const { return ready.getFd(); }
+  virtual int handleIoctl(unsigned long request, void *arg);
+  virtual void *mapMemory(size_t length, int prot, int flags, off_t offset);
+  virtual short pollEvents(short events);
+  virtual short pollRevents(short revents);
+
+ private:
+  struct Buffer {
+    uint32_t flags;
+    timeval timestamp;
+    uint32_t sequence;
+    uint32_t nplanes;
+    v4l2_plane planes[VIDEO_MAX_PLANES];
+    uint8_t *data[VIDEO_MAX_PLANES];   /* Where the codec reads or writes. */
+    uint8_t *view[VIDEO_MAX_PLANES];   /* MMAP memory or mapped dmabuf. */
+    size_t viewLength[VIDEO_MAX_PLANES];
+    int dmabuf[VIDEO_MAX_PLANES];
+  };
+
+  /*
+   * Buffer indices in the order they were added. A buffer is on one list at
+   * a time, so VIDEO_MAX_FRAME entries are enough and streaming does not
+   * allocate.
+   */
+  class Indices {
+   public:
+    Indices() : first(0), count(0) {}
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    uint32_t front() const { return entries[first]; }
+    void clear() { first = count = 0; }
+
+    void push_back(uint32_t index) {
+      entries[(first + count++) % VIDEO_MAX_FRAME] = index;
+    }
+
+    void pop_front() {
+      first = (first + 1) % VIDEO_MAX_FRAME;
+      count--;
+    }
+
+   private:
+    uint32_t entries[VIDEO_MAX_FRAME];
+    size_t first;
+    size_t count;
+  };
+
+  struct Queue {
+    Queue();
+
+    v4l2_format format;
+    uint32_t memory;
+    vector<Buffer> buffers;
+    Indices queued;
+    Indices held;
+    Indices done;
+    size_t hold;
+    uint32_t sequence;
+    bool streaming;
+  };
+
+  void parse(const char *options);
+  Queue &getQueue(uint32_t type);
+  static uint32_t getPixelFormat(const v4l2_format &format);
+  bool isRaw(uint32_t format);
+  void adjustFormat(v4l2_format &format);
+
+  int requestBuffers(v4l2_requestbuffers &reqbuf);
+  int createBuffers(v4l2_create_buffers &create);
+  void addBuffer(Queue &queue, const v4l2_format &format);
+  void freeBuffers(Queue &queue);
+  int queueBuffer(v4l2_buffer &buf);
+  int dequeueBuffer(v4l2_buffer &buf);
+  int queryBuffer(v4l2_buffer &buf);
+  void copyOut(Queue &queue, uint32_t index, v4l2_buffer &buf);
+  uint8_t *mapDmabuf(Buffer &buffer, uint32_t plane, int dmabuf);
+  int streamon(uint32_t type);
+  int streamoff(uint32_t type);
+  void pushEvent(uint32_t type, uint32_t changes = 0);
+
+  static void *run(void *arg);
+  void process();
+  bool canProcess();
+  void complete(Queue &queue, uint32_t index);
+  void release(Queue &queue);
+  void changeSource();
+  void drain();
+  short getState();
+  void updateReady();
+
+  /* Options. */
+  unsigned int latency;
+  size_t width;
+  size_t height;
+  unsigned int minBuffers;
+  uint64_t change;
+  uint64_t skew;
+
+  EventNotifier ready; /* Set while an event the codec polls for is ready. */
+  int memfd;
+  off_t memSize;
+  Queue input;
+  Queue output;
+  map<uint32_t, int32_t> controls;
+  set<uint32_t> subscribed;
+  deque<v4l2_event> events;
+  uint32_t eventSequence;
+  short wanted;
+  bool signalled;
+  uint64_t frames;
+  bool processing;
+  bool changing;
+  bool draining;
+  bool drained;
+  bool stopping;
+  mutex lock;
+  condition_variable changed;
+  pthread_t thread;
+};
+
+FakeDevice::Queue::Queue()
+    : memory(V4L2_MEMORY_MMAP), hold(0), sequence(0), streaming(false) {
+  memset(&format, 0, sizeof(format));
+}
+
+FakeDevice::FakeDevice(const char *options)
+    : latency(0),
+      width(1920),
+      height(1080),
+      minBuffers(0),
+      change(0),
+      skew(0),
+      ready(true),
+      memfd(-1),
+      memSize(0),
+      eventSequence(0),
+      wanted(0),
+      signalled(false),
+      frames(0),
+      processing(false),
+      changing(false),
+      draining(false),
+      drained(false),
+      stopping(false) {
+  parse(options);
+  if (minBuffers == 0) {
+    minBuffers = output.hold + 2;
+  }
+
+  memfd = memfd_create("mvx_fake", MFD_CLOEXEC);
+  if (memfd < 0) {
+    throw Exception("Failed to create fake device memory. errno=%d.", errno);
+  }
+
+  if (pthread_create(&thread, NULL, run, this) != 0) {
+    ::close(memfd);
+    throw Exception("Failed to create fake device thread.");
+  }
+}
+
+FakeDevice::~FakeDevice() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+    changed.notify_all();
+  }
+
+  pthread_join(thread, NULL);
+  freeBuffers(input);
+  freeBuffers(output);
+  ::close(memfd);
+}
+
+void FakeDevice::parse(const char *options) {
+  stringstream ss(options);
+  string option;
+
+  while (getline(ss, option, ',')) {
+    size_t eq = option.find('=');
+    string key = option.substr(0, eq);
+    char *end = NULL;
+    unsigned long value = 0;
+
+    if (eq != string::npos) {
+      value = strtoul(option.c_str() + eq + 1, &end, 0);
+    }
+    if (eq == string::npos || end == NULL || *end != '\0') {
+      throw Exception("Bad fake device option. option=%s.", option.c_str());
+    }
+
+    if (key == "latency") {
+      latency = value;
+    } else if (key == "hold") {
+      output.hold = value;
+    } else if (key == "input_hold") {
+      input.hold = value;
+    } else if (key == "change") {
+      change = value;
+    } else if (key == "width") {
+      width = value;
+    } else if (key == "height") {
+      height = value;
+    } else if (key == "min_buffers") {
+      minBuffers = value;
+    } else if (key == "skew") {
+      skew = value;
+    } else {
+      throw Exception("Unknown fake device option. option=%s.", key.c_str());
+    }
+  }
+}
+
+FakeDevice::Queue &FakeDevice::getQueue(uint32_t type) {
+  return V4L2_TYPE_IS_OUTPUT(type) ? input : output;
+}
+
+uint32_t FakeDevice::getPixelFormat(const v4l2_format &format) {
+  return V4L2_TYPE_IS_MULTIPLANAR(format.type) ? format.fmt.pix_mp.pixelformat
+                                               : format.fmt.pix.pixelformat;
+}
+
+bool FakeDevice::isRaw(uint32_t format) {
+  size_t nplanes;
+  size_t stride[3][2];
+
+  try {
+    Codec::getStride(format, nplanes, stride);
+  } catch (Exception &e) {
+    return false;
+  }
+
+  return true;
+}
+
+/* Raw frames get the planes Codec::getSize() gives, bitstream one plane. */
+void FakeDevice::adjustFormat(v4l2_format &format) {
+  if (V4L2_TYPE_IS_MULTIPLANAR(format.type)) {
+    v4l2_pix_format_mplane &f = format.fmt.pix_mp;
+
+    if (f.width == 0 || f.height == 0) {
+      f.width = width;
+      f.height = height;
+    }
+
+    if (isRaw(f.pixelformat)) {
+      size_t nplanes;
+      size_t stride[3];
+      size_t size[3];
+
+      Codec::getSize(f.pixelformat, f.width, f.height, 1, nplanes, stride,
+                     size);
+      f.num_planes = nplanes;
+      for (size_t i = 0; i < nplanes; ++i) {
+        f.plane_fmt[i].bytesperline = stride[i];
+        f.plane_fmt[i].sizeimage =
+            std::max<size_t>(f.plane_fmt[i].sizeimage, size[i]);
+      }
+    } else {
+      f.num_planes = 1;
+      f.plane_fmt[0].bytesperline = 0;
+      f.plane_fmt[0].sizeimage = std::max<size_t>(f.plane_fmt[0].sizeimage,
+                                                  FAKE_BITSTREAM_SIZE);
+    }
+  } else {
+    v4l2_pix_format &f = format.fmt.pix;
+
+    if (f.width == 0 || f.height == 0) {
+      f.width = width;
+      f.height = height;
+    }
+
+    f.bytesperline = 0;
+    f.sizeimage = std::max<size_t>(f.sizeimage, FAKE_BITSTREAM_SIZE);
+  }
+}
+
+int FakeDevice::handleIoctl(unsigned long request, void *arg) {
+  unique_lock<mutex> guard(lock);
+  int ret = 0;
+
+  switch (request) {
+    case VIDIOC_QUERYCAP: {
+      v4l2_capability &cap = *static_cast<v4l2_capability *>(arg);
+
+      memset(&cap, 0, sizeof(cap));
+      strncpy(reinterpret_cast<char *>(cap.driver), "mvx_fake",
+              sizeof(cap.driver) - 1);
+      strncpy(reinterpret_cast<char *>(cap.card), "Fake VPU",
+              sizeof(cap.card) - 1);
+      cap.capabilities = V4L2_CAP_VIDEO_M2M | V4L2_CAP_VIDEO_M2M_MPLANE |
+                         V4L2_CAP_STREAMING | V4L2_CAP_DEVICE_CAPS;
+      cap.device_caps = V4L2_CAP_VIDEO_M2M | V4L2_CAP_VIDEO_M2M_MPLANE |
+                        V4L2_CAP_STREAMING;
+      break;
+    }
+    case VIDIOC_ENUM_FRAMESIZES: {
+      v4l2_frmsizeenum &frmsize = *static_cast<v4l2_frmsizeenum *>(arg);
+
+      if (frmsize.index != 0) {
+        errno = EINVAL;
+        return -1;
+      }
+      frmsize.type = V4L2_FRMSIZE_TYPE_STEPWISE;
+      frmsize.stepwise.min_width = 2;
+      frmsize.stepwise.max_width = 8192;
+      frmsize.stepwise.step_width = 2;
+      frmsize.stepwise.min_height = 2;
+      frmsize.stepwise.max_height = 8192;
+      frmsize.stepwise.step_height = 2;
+      break;
+    }
+    case VIDIOC_G_FMT: {
+      v4l2_format &format = *static_cast<v4l2_format *>(arg);
+      uint32_t type = format.type;
+
+      format = getQueue(type).format;
+      format.type = type;
+      break;
+    }
+    case VIDIOC_TRY_FMT:
+      adjustFormat(*static_cast<v4l2_format *>(arg));
+      break;
+    case VIDIOC_S_FMT: {
+      v4l2_format &format = *static_cast<v4l2_format *>(arg);
+      Queue &queue = getQueue(format.type);
+
+      if (!queue.buffers.empty()) {
+        errno = EBUSY;
+        return -1;
+      }
+      adjustFormat(format);
+      queue.format = format;
+      break;
+    }
+    case VIDIOC_G_CROP: {
+      v4l2_crop &crop = *static_cast<v4l2_crop *>(arg);
+      const v4l2_format &format = getQueue(crop.type).format;
+
+      crop.c.left = 0;
+      crop.c.top = 0;
+      if (V4L2_TYPE_IS_MULTIPLANAR(format.type)) {
+        crop.c.width = format.fmt.pix_mp.width;
+        crop.c.height = format.fmt.pix_mp.height;
+      } else {
+        crop.c.width = format.fmt.pix.width;
+        crop.c.height = format.fmt.pix.height;
+      }
+      break;
+    }
+    case VIDIOC_G_CTRL: {
+      v4l2_control &control = *static_cast<v4l2_control *>(arg);
+
+      if (control.id == V4L2_CID_MIN_BUFFERS_FOR_CAPTURE) {
+        control.value = minBuffers;
+      } else if (control.id == V4L2_CID_MIN_BUFFERS_FOR_OUTPUT) {
+        control.value = input.hold + 1;
+      } else {
+        control.value = controls[control.id];
+      }
+      break;
+    }
+    case VIDIOC_S_CTRL: {
+      v4l2_control &control = *static_cast<v4l2_control *>(arg);
+
+      controls[control.id] = control.value;
+      break;
+    }
+    case VIDIOC_G_EXT_CTRLS:
+    case VIDIOC_S_EXT_CTRLS:
+    case VIDIOC_TRY_EXT_CTRLS: {
+      v4l2_ext_controls &ext = *static_cast<v4l2_ext_controls *>(arg);
+
+      for (uint32_t i = 0; i < ext.count; ++i) {
+        if (request == VIDIOC_G_EXT_CTRLS) {
+          ext.controls[i].value = controls[ext.controls[i].id];
+        } else if (request == VIDIOC_S_EXT_CTRLS) {
+          controls[ext.controls[i].id] = ext.controls[i].value;
+        }
+      }
+      break;
+    }
+    case VIDIOC_G_MVX_COLORDESC:
+      memset(arg, 0, sizeof(v4l2_mvx_color_desc));
+      break;
+    case VIDIOC_SUBSCRIBE_EVENT:
+      subscribed.insert(static_cast<v4l2_event_subscription *>(arg)->type);
+      break;
+    case VIDIOC_UNSUBSCRIBE_EVENT: {
+      uint32_t type = static_cast<v4l2_event_subscription *>(arg)->type;
+
+      if (type == V4L2_EVENT_ALL) {
+        subscribed.clear();
+      } else {
+        subscribed.erase(type);
+      }
+      break;
+    }
+    case VIDIOC_DQEVENT: {
+      v4l2_event &event = *static_cast<v4l2_event *>(arg);
+
+      if (events.empty()) {
+        errno = ENOENT;
+        return -1;
+      }
+      event = events.front();
+      events.pop_front();
+      event.pending = events.size();
+      updateReady();
+      break;
+    }
+    case VIDIOC_REQBUFS:
+      ret = requestBuffers(*static_cast<v4l2_requestbuffers *>(arg));
+      break;
+    case VIDIOC_CREATE_BUFS:
+      ret = createBuffers(*static_cast<v4l2_create_buffers *>(arg));
+      break;
+    case VIDIOC_QUERYBUF:
+      ret = queryBuffer(*static_cast<v4l2_buffer *>(arg));
+      break;
+    case VIDIOC_QBUF:
+      ret = queueBuffer(*static_cast<v4l2_buffer *>(arg));
+      break;
+    case VIDIOC_DQBUF:
+      ret = dequeueBuffer(*static_cast<v4l2_buffer *>(arg));
+      break;
+    case VIDIOC_STREAMON:
+      ret = streamon(*static_cast<uint32_t *>(arg));
+      break;
+    case VIDIOC_STREAMOFF:
+      /* Wait for the codec to let go of the buffers. */
+      while (processing) {
+        changed.wait(guard);
+      }
+      ret = streamoff(*static_cast<uint32_t *>(arg));
+      break;
+    case VIDIOC_ENCODER_CMD:
+    case VIDIOC_DECODER_CMD:
+      draining = true;
+      changed.notify_all();
+      break;
+    case VIDIOC_TRY_ENCODER_CMD:
+    case VIDIOC_TRY_DECODER_CMD:
+      break;
+    default:
+      /* Other vendor ioctls only pass settings to the firmware. */
+      if (_IOC_TYPE(request) == 'V' &&
+          _IOC_NR(request) >= _IOC_NR(BASE_VIDIOC_PRIVATE)) {
+        break;
+      }
+
+      errno = ENOTTY;
+      return -1;
+  }
+
+  return ret;
+}
+
+void *FakeDevice::mapMemory(size_t length, int prot, int flags,
+                             off_t offset) {
+  return ::mmap(NULL, length, prot, flags, memfd, offset);
+}
+
+int FakeDevice::requestBuffers(v4l2_requestbuffers &reqbuf) {
+  Queue &queue = getQueue(reqbuf.type);
+
+  if (queue.streaming) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  if (reqbuf.memory != V4L2_MEMORY_MMAP &&
+      reqbuf.memory != V4L2_MEMORY_USERPTR &&
+      reqbuf.memory != V4L2_MEMORY_DMABUF) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  freeBuffers(queue);
+  queue.memory = reqbuf.memory;
+  reqbuf.count = std::min<uint32_t>(reqbuf.count, VIDEO_MAX_FRAME);
+  for (uint32_t i = 0; i < reqbuf.count; ++i) {
+    addBuffer(queue, queue.format);
+  }
+
+  return 0;
+}
+
+int FakeDevice::createBuffers(v4l2_create_buffers &create) {
+  Queue &queue = getQueue(create.format.type);
+
+  if (create.memory != queue.memory) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  create.index = queue.buffers.size();
+  create.count = std::min<uint32_t>(create.count,
+                                    VIDEO_MAX_FRAME - queue.buffers.size());
+  for (uint32_t i = 0; i < create.count; ++i) {
+    addBuffer(queue, create.format);
+  }
+
+  return 0;
+}
+
+/* MMAP planes live in the memfd, page aligned, at their mmap offset. */
+void FakeDevice::addBuffer(Queue &queue, const v4l2_format &format) {
+  Buffer buffer;
+  long pageSize = sysconf(_SC_PAGESIZE);
+
+  memset(&buffer, 0, sizeof(buffer));
+  if (V4L2_TYPE_IS_MULTIPLANAR(format.type)) {
+    buffer.nplanes = std::max<uint32_t>(format.fmt.pix_mp.num_planes, 1);
+    for (uint32_t i = 0; i < buffer.nplanes; ++i) {
+      buffer.planes[i].length = format.fmt.pix_mp.plane_fmt[i].sizeimage;
+    }
+  } else {
+    buffer.nplanes = 1;
+    buffer.planes[0].length = format.fmt.pix.sizeimage;
+  }
+
+  for (uint32_t i = 0; i < buffer.nplanes; ++i) {
+    buffer.dmabuf[i] = -1;
+
+    if (queue.memory != V4L2_MEMORY_MMAP) {
+      continue;
+    }
+
+    size_t length = (buffer.planes[i].length + pageSize - 1) &
+                    ~static_cast<size_t>(pageSize - 1);
+    if (ftruncate(memfd, memSize + length) != 0) {
+      throw Exception("Failed to grow fake device memory. size=%zu.",
+                      static_cast<size_t>(memSize + length));
+    }
+
+    void *p = ::mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, memfd,
+                     memSize);
+    if (p == MAP_FAILED) {
+      throw Exception("Failed to map fake device memory.");
+    }
+
+    buffer.planes[i].m.mem_offset = memSize;
+    buffer.view[i] = static_cast<uint8_t *>(p);
+    buffer.viewLength[i] = length;
+    buffer.data[i] = buffer.view[i];
+    memSize += length;
+  }
+
+  queue.buffers.push_back(buffer);
+}
+
+void FakeDevice::freeBuffers(Queue &queue) {
+  for (size_t i = 0; i < queue.buffers.size(); ++i) {
+    Buffer &buffer = queue.buffers[i];
+
+    for (uint32_t j = 0; j < buffer.nplanes; ++j) {
+      if (buffer.view[j] == NULL) {
+        continue;
+      }
+
+      munmap(buffer.view[j], buffer.viewLength[j]);
+      if (queue.memory == V4L2_MEMORY_MMAP) {
+        fallocate(memfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  buffer.planes[j].m.mem_offset, buffer.viewLength[j]);
+      }
+    }
+  }
+
+  queue.buffers.clear();
+  queue.queued.clear();
+  queue.held.clear();
+  queue.done.clear();
+}
+
+uint8_t *FakeDevice::mapDmabuf(Buffer &buffer, uint32_t plane, int dmabuf) {
+  if (buffer.dmabuf[plane] == dmabuf && buffer.view[plane] != NULL) {
+    return buffer.view[plane];
+  }
+
+  if (buffer.view[plane] != NULL) {
+    munmap(buffer.view[plane], buffer.viewLength[plane]);
+    buffer.view[plane] = NULL;
+  }
+
+  off_t size = lseek(dmabuf, 0, SEEK_END);
+  void *p = size > 0 ? ::mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, dmabuf, 0)
+                     : MAP_FAILED;
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+
+  buffer.dmabuf[plane] = dmabuf;
+  buffer.view[plane] = static_cast<uint8_t *>(p);
+  buffer.viewLength[plane] = size;
+
+  return buffer.view[plane];
+}
+
+int FakeDevice::queueBuffer(v4l2_buffer &buf) {
+  Queue &queue = getQueue(buf.type);
+
+  if (buf.index >= queue.buffers.size() || buf.memory != queue.memory) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  Buffer &buffer = queue.buffers[buf.index];
+  buffer.flags = buf.flags & ~(V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE);
+  buffer.timestamp = buf.timestamp;
+
+  for (uint32_t i = 0; i < buffer.nplanes; ++i) {
+    v4l2_plane &p = buffer.planes[i];
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
+      p.bytesused = buf.m.planes[i].bytesused;
+      p.data_offset = buf.m.planes[i].data_offset;
+      if (queue.memory == V4L2_MEMORY_USERPTR) {
+        p.m.userptr = buf.m.planes[i].m.userptr;
+        p.length = buf.m.planes[i].length;
+      } else if (queue.memory == V4L2_MEMORY_DMABUF) {
+        p.m.fd = buf.m.planes[i].m.fd;
+      }
+    } else {
+      p.bytesused = buf.bytesused;
+      p.data_offset = 0;
+      if (queue.memory == V4L2_MEMORY_USERPTR) {
+        p.m.userptr = buf.m.userptr;
+        p.length = buf.length;
+      } else if (queue.memory == V4L2_MEMORY_DMABUF) {
+        p.m.fd = buf.m.fd;
+      } else if (queue.memory == V4L2_MEMORY_MMAP) {
+        /* The low bits carry the offset of the data. */
+        p.data_offset = buf.m.offset & ((1 << 12) - 1);
+      }
+    }
+
+    if (queue.memory == V4L2_MEMORY_USERPTR) {
+      buffer.data[i] = reinterpret_cast<uint8_t *>(p.m.userptr);
+    } else if (queue.memory == V4L2_MEMORY_DMABUF) {
+      buffer.data[i] = mapDmabuf(buffer, i, p.m.fd);
+      if (buffer.data[i] == NULL) {
+        errno = EINVAL;
+        return -1;
+      }
+      p.length = std::min<size_t>(p.length, buffer.viewLength[i]);
+    }
+  }
+
+  /* Capture buffers are handed straight back until the source change is
+   * acknowledged. */
+  if (&queue == &output && changing) {
+    for (uint32_t i = 0; i < buffer.nplanes; ++i) {
+      buffer.planes[i].bytesused = 0;
+    }
+    buffer.flags = 0;
+    queue.done.push_back(buf.index);
+  } else {
+    queue.queued.push_back(buf.index);
+  }
+
+  updateReady();
+  changed.notify_all();
+
+  return 0;
+}
+
+int FakeDevice::dequeueBuffer(v4l2_buffer &buf) {
+  Queue &queue = getQueue(buf.type);
+
+  if (queue.done.empty()) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  uint32_t index = queue.done.front();
+  queue.done.pop_front();
+  copyOut(queue, index, buf);
+  updateReady();
+
+  return 0;
+}
+
+int FakeDevice::queryBuffer(v4l2_buffer &buf) {
+  Queue &queue = getQueue(buf.type);
+
+  if (buf.index >= queue.buffers.size()) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  copyOut(queue, buf.index, buf);
+
+  return 0;
+}
+
+void FakeDevice::copyOut(Queue &queue, uint32_t index, v4l2_buffer &buf) {
+  const Buffer &buffer = queue.buffers[index];
+
+  buf.index = index;
+  buf.memory = queue.memory;
+  buf.flags = buffer.flags;
+  buf.field = V4L2_FIELD_NONE;
+  buf.timestamp = buffer.timestamp;
+  buf.sequence = buffer.sequence;
+
+  if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
+    uint32_t n = std::min(buf.length, buffer.nplanes);
+
+    for (uint32_t i = 0; i < n; ++i) {
+      buf.m.planes[i] = buffer.planes[i];
+    }
+    buf.length = buffer.nplanes;
+  } else {
+    const v4l2_plane &p = buffer.planes[0];
+
+    buf.bytesused = p.bytesused;
+    buf.length = p.length;
+    if (queue.memory == V4L2_MEMORY_MMAP) {
+      buf.m.offset = p.m.mem_offset;
+    } else if (queue.memory == V4L2_MEMORY_USERPTR) {
+      buf.m.userptr = p.m.userptr;
+    } else {
+      buf.m.fd = p.m.fd;
+    }
+  }
+}
+
+int FakeDevice::streamon(uint32_t type) {
+  Queue &queue = getQueue(type);
+
+  queue.streaming = true;
+  if (&queue == &output) {
+    changing = false;
+  }
+  changed.notify_all();
+
+  return 0;
+}
+
+/* Every buffer goes back to the player, without being dequeued. */
+int FakeDevice::streamoff(uint32_t type) {
+  Queue &queue = getQueue(type);
+
+  queue.streaming = false;
+  queue.queued.clear();
+  queue.held.clear();
+  queue.done.clear();
+
+  if (&queue == &input) {
+    draining = false;
+    drained = false;
+  } else {
+    changing = false;
+  }
+
+  updateReady();
+
+  return 0;
+}
+
+void FakeDevice::pushEvent(uint32_t type, uint32_t changes) {
+  v4l2_event event;
+
+  if (subscribed.count(type) == 0) {
+    return;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.type = type;
+  event.u.src_change.changes = changes;
+  event.sequence = eventSequence++;
+  clock_gettime(CLOCK_MONOTONIC, &event.timestamp);
+  events.push_back(event);
+}
+
+void *FakeDevice::run(void *arg) {
+  static_cast<FakeDevice *>(arg)->process();
+
+  return NULL;
+}
+
+bool FakeDevice::canProcess() {
+  if (!input.streaming || !output.streaming || changing ||
+      output.queued.empty()) {
+    return false;
+  }
+
+  return !input.queued.empty() || (draining && !drained);
+}
+
+/*
+ * The pass-through codec. One output port buffer at a time is copied into
+ * a capture buffer, outside the lock so the player can keep queueing.
+ */
+void FakeDevice::process() {
+  unique_lock<mutex> guard(lock);
+
+  while (!stopping) {
+    if (!canProcess()) {
+      changed.wait(guard);
+      continue;
+    }
+
+    if (input.queued.empty()) {
+      drain();
+      continue;
+    }
+
+    uint32_t in = input.queued.front();
+    input.queued.pop_front();
+    Buffer &src = input.buffers[in];
+    bool last = (src.flags & V4L2_BUF_FLAG_LAST) != 0;
+    iovec from[VIDEO_MAX_PLANES];
+    size_t nfrom = src.nplanes;
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < nfrom; ++i) {
+      v4l2_plane &p = src.planes[i];
+      size_t used = p.bytesused > p.data_offset ? p.bytesused - p.data_offset
+                                                : 0;
+
+      from[i].iov_base = src.data[i] + p.data_offset;
+      from[i].iov_len = src.data[i] != NULL ? used : 0;
+      bytes += from[i].iov_len;
+    }
+
+    if (bytes > 0) {
+      uint32_t out = output.queued.front();
+      output.queued.pop_front();
+      uint8_t *to = output.buffers[out].data[0];
+      size_t room = output.buffers[out].planes[0].length;
+      size_t copied = 0;
+
+      processing = true;
+      guard.unlock();
+
+      if (latency > 0) {
+        usleep(latency);
+      }
+
+      for (size_t i = 0; i < nfrom && to != NULL; ++i) {
+        size_t n = std::min(from[i].iov_len, room - copied);
+        memcpy(to + copied, from[i].iov_base, n);
+        copied += n;
+      }
+
+      guard.lock();
+      processing = false;
+
+      Buffer &dst = output.buffers[out];
+      Buffer &done = input.buffers[in];
+      for (uint32_t i = 0; i < dst.nplanes; ++i) {
+        dst.planes[i].bytesused = 0;
+        dst.planes[i].data_offset = 0;
+      }
+      dst.planes[0].bytesused = copied;
+      dst.timestamp = done.timestamp;
+      dst.timestamp.tv_sec += (dst.timestamp.tv_usec + skew) / 1000000;
+      dst.timestamp.tv_usec = (dst.timestamp.tv_usec + skew) % 1000000;
+      dst.flags = isRaw(getPixelFormat(output.format))
+                      ? V4L2_BUF_FLAG_MVX_BUFFER_FRAME_PRESENT
+                      : V4L2_BUF_FLAG_KEYFRAME;
+      complete(output, out);
+      frames++;
+    }
+
+    complete(input, in);
+    if (last) {
+      draining = true;
+    }
+
+    if (change != 0 && frames == change && bytes > 0) {
+      changeSource();
+    }
+
+    updateReady();
+    changed.notify_all();
+  }
+}
+
+/* Held buffers go back once more than the hold count are waiting. */
+void FakeDevice::complete(Queue &queue, uint32_t index) {
+  Buffer &buffer = queue.buffers[index];
+
+  buffer.sequence = queue.sequence++;
+  buffer.flags &= ~V4L2_BUF_FLAG_QUEUED;
+  buffer.flags |= V4L2_BUF_FLAG_DONE;
+  queue.held.push_back(index);
+
+  while (queue.held.size() > queue.hold) {
+    queue.done.push_back(queue.held.front());
+    queue.held.pop_front();
+  }
+}
+
+void FakeDevice::release(Queue &queue) {
+  while (!queue.held.empty()) {
+    queue.done.push_back(queue.held.front());
+    queue.held.pop_front();
+  }
+}
+
+/* Decoded frames come out, then every capture buffer returns empty. */
+void FakeDevice::changeSource() {
+  pushEvent(V4L2_EVENT_SOURCE_CHANGE, V4L2_EVENT_SRC_CH_RESOLUTION);
+  release(output);
+  changing = true;
+
+  while (!output.queued.empty()) {
+    Buffer &buffer = output.buffers[output.queued.front()];
+
+    for (uint32_t i = 0; i < buffer.nplanes; ++i) {
+      buffer.planes[i].bytesused = 0;
+    }
+    buffer.flags = 0;
+    output.done.push_back(output.queued.front());
+    output.queued.pop_front();
+  }
+}
+
+/* End of stream: everything held goes back, then an empty LAST buffer. */
+void FakeDevice::drain() {
+  uint32_t out = output.queued.front();
+  Buffer &buffer = output.buffers[out];
+
+  release(input);
+  release(output);
+
+  output.queued.pop_front();
+  for (uint32_t i = 0; i < buffer.nplanes; ++i) {
+    buffer.planes[i].bytesused = 0;
+  }
+  buffer.flags = V4L2_BUF_FLAG_LAST;
+  buffer.sequence = output.sequence++;
+  output.done.push_back(out);
+
+  pushEvent(V4L2_EVENT_EOS);
+  drained = true;
+  updateReady();
+}
+
+short FakeDevice::getState() {
+  short state = 0;
+
+  state |= output.done.empty() ? 0 : POLLIN;
+  state |= input.done.empty() ? 0 : POLLOUT;
+  state |= events.empty() ? 0 : POLLPRI;
+
+  return state;
+}
+
+/* Keep the notifier set exactly while a wanted event is ready. */
+void FakeDevice::updateReady() {
+  bool set = (getState() & wanted) != 0;
+
+  if (set == signalled) {
+    return;
+  }
+
+  if (set) {
+    ready.notify();
+  } else {
+    ready.clear();
+  }
+  signalled = set;
+}
+
+short FakeDevice::pollEvents(short events) {
+  lock_guard<mutex> guard(lock);
+
+  wanted = events;
+  updateReady();
+
+  return POLLIN;
+}
+
+short FakeDevice::pollRevents(short revents) {
+  lock_guard<mutex> guard(lock);
+
+  if (revents == 0) {
+    return 0;
+  }
+
+  return getState() & wanted;
+}
+
+}  // namespace
+
+/****************************************************************************
+ * Device backend
+ ****************************************************************************/
+
+static mutex devicesLock;
+static map<int, Device *> devices;
+
+/*
+ * Open fakes. Descriptors of the kernel driver skip the lock and the lookup
+ * while there are none, which is always the case on a board.
+ */
+static atomic<int> fakes(0);
+
+Device *Device::find(int fd) {
+  if (fakes.load(memory_order_acquire) == 0) {
+    return NULL;
+  }
+
+  lock_guard<mutex> guard(devicesLock);
+  map<int, Device *>::iterator it = devices.find(fd);
+
+  return it != devices.end() ? it->second : NULL;
+}
+
+int Device::open(const char *path, int flags) {
+  size_t n = strlen(FAKE_DEVICE_PREFIX);
+
+  if (strncmp(path, FAKE_DEVICE_PREFIX, n) != 0 ||
+      (path[n] != '\0' && path[n] != ':')) {
+    return ::open(path, flags);
+  }
+
+  Device *device = new FakeDevice(path[n] == ':' ? path + n + 1 : "");
+  lock_guard<mutex> guard(devicesLock);
+  devices[device->getFd()] = device;
+  fakes.fetch_add(1, memory_order_release);
+
+  return device->getFd();
+}
+
+int Device::close(int fd) {
+  Device *device = find(fd);
+
+  if (device == NULL) {
+    return ::close(fd);
+  }
+
+  {
+    lock_guard<mutex> guard(devicesLock);
+    devices.erase(fd);
+    fakes.fetch_sub(1, memory_order_release);
+  }
+  delete device;
+
+  return 0;
+}
+
+int Device::ioctl(int fd, unsigned long request, void *arg) {
+  Device *device = find(fd);
+
+  if (device == NULL) {
+    return ::ioctl(fd, request, arg);
+  }
+
+  return device->handleIoctl(request, arg);
+}
+
+void *Device::mmap(size_t length, int prot, int flags, int fd,
+                   off_t offset) {
+  Device *device = find(fd);
+
+  if (device == NULL) {
+    return ::mmap(NULL, length, prot, flags, fd, offset);
+  }
+
+  return device->mapMemory(length, prot, flags, offset);
+}
+
+short Device::getPollEvents(int fd, short events) {
+  Device *device = find(fd);
+
+  return device != NULL ? device->pollEvents(events) : events;
+}
+
+short Device::getRevents(int fd, short revents) {
+  Device *device = find(fd);
+
+  return device != NULL ? device->pollRevents(revents) : revents;
+}
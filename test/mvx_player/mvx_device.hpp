@@ -0,0 +1,101 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+
+#ifndef __MVX_DEVICE_H__
+#define __MVX_DEVICE_H__
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/****************************************************************************
+ * Device backend
+ ****************************************************************************/
+
+#define FAKE_DEVICE_PREFIX "fake"
+
+/*
+ * Where the player's device calls go. The descriptor open() returns is the
+ * key for every other call, so the codec keeps passing plain fds around and
+ * descriptors of the kernel driver go straight to the system calls.
+ *
+ * A path of "fake" or "fake:<options>" opens an in-process fake of the VPU
+ * driver instead, for running the player without a board. It implements
+ * the memory to memory queues for MMAP, USERPTR and DMABUF memory, events
+ * and poll, with a pass-through codec: the bytes of each buffer queued on
+ * the output port are copied, planes back to back, into the first plane of
+ * the next capture buffer, cut to fit. Options are comma separated:
+ *
+ *   latency=<us>      Time the codec takes per frame.
+ *   hold=<n>          Capture buffers kept back before they are returned,
+ *                     like the reference frames of a decoder.
+ *   input_hold=<n>    Output port buffers kept back the same way.
+ *   change=<n>        Signal a source change after n frames.
+ *   width=<pixels>    Frame size when the player leaves it to the device.
+ *   height=<pixels>
+ *   min_buffers=<n>   V4L2_CID_MIN_BUFFERS_FOR_CAPTURE, hold + 2 by default.
+ *   skew=<us>         Added to the timestamp of every capture buffer, so
+ *                     no output matches its input.
+ */
+class Device {
+ public:
+  virtual ~Device() {}
+
+  static int open(const char *path, int flags);
+  static int close(int fd);
+  static int ioctl(int fd, unsigned long request, void *arg);
+  static void *mmap(size_t length, int prot, int flags, int fd, off_t offset);
+
+  /*
+   * Events to poll fd for to wait for the given device events, and the
+   * device events behind what poll returned.
+   */
+  static short getPollEvents(int fd, short events);
+  static short getRevents(int fd, short revents);
+
+ protected:
+  virtual int getFd() const = 0;
+  virtual int handleIoctl(unsigned long request, void *arg) = 0;
+  virtual void *mapMemory(size_t length, int prot, int flags, off_t offset) = 0;
+  virtual short pollEvents(short events) = 0;
+  virtual short pollRevents(short revents) = 0;
+
+ private:
+  static Device *find(int fd);
+};
+
+#endif /* __MVX_DEVICE_H__ */
@@ -30,6 +30,9 @@
  *
  */
 
+#include <sys/stat.h>
+
+#include <algorithm>
 #include <fstream>
 
 #include "mvx_argparse.h"
@@ -37,6 +40,25 @@
 
 using namespace std;
 
+/* Images/s of a batch, printed with the latency from queue to output. */
+static double streamBatch(Encoder &encoder, const OutputStills &output,
+                          uint64_t time) {
+  LatencyTracker *latency = encoder.getLatencyTracker();
+  double rate = output.getImages() * 1e9 / std::max<uint64_t>(time, 1);
+
+  if (latency == NULL || latency->getFrames() == 0) {
+    return rate;
+  }
+
+  printf(
+      "-----[Test Result] MVX Batch Encode. images: %zu, images/s: %.2f, "
+      "p50: %lu us, p95: %lu us, max: %lu us.\n",
+      output.getImages(), rate, latency->getPercentile(50),
+      latency->getPercentile(95), latency->getPercentile(100));
+
+  return rate;
+}
+
 int main(int argc, const char *argv[]) {
   int ret;
   mvx_argparse argp;
@@ -46,7 +68,8 @@ int main(int argc, const char *argv[]) {
   const char *epr_file = NULL;
 
   mvx_argp_construct(&argp);
-  mvx_argp_add_opt(&argp, '\0', "dev", true, 1, "/dev/video0", "Device.");
+  mvx_argp_add_opt(&argp, '\0', "dev", true, 1, "/dev/video0",
+                   "Device, or fake[:options] for the in-process fake.");
   mvx_argp_add_opt(&argp, 'i', "inputformat", true, 1, "yuv420",
                    "Pixel format.");
   mvx_argp_add_opt(&argp, 'o', "outputformat", true, 1, "h264",
@@ -58,7 +81,8 @@ int main(int argc, const char *argv[]) {
   mvx_argp_add_opt(&argp, 's', "stride", true, 1, "1", "Stride alignment.");
   mvx_argp_add_opt(&argp, 0, "mirror", true, 1, "0",
                    "mirror, 1 : horizontal; 2 : vertical.");
-  mvx_argp_add_opt(&argp, 0, "roi_cfg", true, 1, NULL, "ROI config file.");
+  mvx_argp_add_opt(&argp, 0, "roi_cfg", true, 1, NULL,
+                   "ROI config file, text or compiled with mvx_roi_compile.");
   mvx_argp_add_opt(&argp, 0, "frames", true, 1, "0", "nr of frames to process");
   mvx_argp_add_opt(&argp, 0, "epr_cfg", true, 1, NULL,
                    "Encode Parameter Records config file name");
@@ -161,10 +185,62 @@ int main(int argc, const char *argv[]) {
                    "JPEG restart interval.");
   mvx_argp_add_opt(&argp, 0, "quality", true, 1, "0",
                    "JPEG compression quality. [1-100, 0 - default]");
+  mvx_argp_add_opt(&argp, 0, "batch", true, 0, "0",
+                   "Encode many stills, one raw frame per file, in one "
+                   "session without stopping between them. input is a "
+                   "directory or a file listing one still per line, output "
+                   "a directory the images are written to under their own "
+                   "name, with the output format as extension. Reports "
+                   "images/s and the latency of every image.");
   mvx_argp_add_opt(&argp, 0, "preload", true, 0, "0",
                    "preload the first 5 yuv frames to memory.");
   mvx_argp_add_opt(&argp, 0, "fw_timeout", true, 1, "5",
                    "timeout value[secs] for watchdog timeout. range: 5~60.");
+  mvx_argp_add_opt(&argp, 0, "memory", true, 1, "dmabuf",
+                   "Buffer memory type. [mmap, dmabuf, userptr]");
+  mvx_argp_add_opt(&argp, 0, "prefault", true, 1, "0",
+                   "Pre-fault buffer mappings at allocation. 0:lazy; "
+                   "1:MAP_POPULATE; 2:touch every page once.");
+  mvx_argp_add_opt(&argp, 0, "hugepages", true, 0, "0",
+                   "Back userptr buffers with huge pages.");
+  mvx_argp_add_opt(&argp, 0, "plane_align", true, 1, "64",
+                   "Alignment in bytes of planes packed in one dmabuf. 64 is "
+                   "a cache line, 4096 a page.");
+  mvx_argp_add_opt(&argp, 0, "plane_fds", true, 0, "0",
+                   "Allocate a separate dmabuf for every plane.");
+  mvx_argp_add_opt(&argp, 0, "input_buffers", true, 1, "0",
+                   "Buffers on the input port. 0 keeps the default.");
+  mvx_argp_add_opt(&argp, 0, "output_buffers", true, 1, "0",
+                   "Buffers on the output port. 0 keeps the default.");
+  mvx_argp_add_opt(&argp, 0, "auto_buffers", true, 1, "30",
+                   "Start from the driver's minimum buffer counts and add a "
+                   "buffer to each port that stalled in the last this many "
+                   "frames, until neither port stalls.");
+  mvx_argp_add_opt(&argp, 0, "watchdog", true, 1, "1200000",
+                   "Give up after this many ms without any progress. 0 waits "
+                   "forever.");
+  mvx_argp_add_opt(&argp, 0, "trace", true, 1, "trace.json",
+                   "Write a per buffer timeline in Chrome trace format.");
+  mvx_argp_add_opt(&argp, 0, "report", true, 1, "report.json",
+                   "Write a machine readable report. A .csv path selects "
+                   "CSV, anything else JSON.");
+  mvx_argp_add_opt(&argp, 0, "analyze", true, 1, "frames.csv",
+                   "Parse the H.264/HEVC output and write frame type, size, "
+                   "slice QP and bitrate per frame to this CSV file. A rate "
+                   "control summary is printed at the end.");
+  mvx_argp_add_opt(&argp, 0, "schedule", true, 1, NULL,
+                   "Per frame bitrate, fps, QP range, IDR and ROI changes. "
+                   "See EncoderSchedule for the file format.");
+  mvx_argp_add_opt(&argp, 0, "live", true, 0, "0",
+                   "Act as a live camera at --fps: stamp frames when queued, "
+                   "drop them under back-pressure and report latency.");
+  mvx_argp_add_opt(&argp, 0, "fw_profile", true, 1, "profile.csv",
+                   "Turn on firmware profiling and write the firmware time "
+                   "of every frame, split from host and driver time, to "
+                   "this CSV file. Needs the driver's firmware interface "
+                   "log and one session per device.");
+  mvx_argp_add_opt(&argp, 0, "fw_log", true, 1, FIRMWARE_LOG_DEFAULT,
+                   "Firmware interface log to read for --fw_profile.");
   mvx_argp_add_opt(
       &argp, 0, "profiling", true, 1, "0",
       "enable profiling for bandwidth statistics . 0:disable; 1:enable.");
@@ -190,12 +266,34 @@ int main(int argc, const char *argv[]) {
   }
 
   bool preload = mvx_argp_is_set(&argp, "preload");
+  bool batch = mvx_argp_is_set(&argp, "batch");
 
-  ifstream is(mvx_argp_get(&argp, "input", 0));
+  InputList *inputs = NULL;
+  if (batch) {
+    try {
+      inputs = new InputList(mvx_argp_get(&argp, "input", 0));
+    } catch (Exception &e) {
+      cerr << "Error: " << e.what() << endl;
+      return 1;
+    }
+
+    mkdir(mvx_argp_get(&argp, "output", 0), 0755);
+  }
+
+  ifstream is;
   Input *inputFile;
-  ifstream *roi_stream = NULL;
   ifstream *epr_stream = NULL;
-  if (Codec::isAFBC(inputFormat)) {
+  if (batch) {
+    if (Codec::isAFBC(inputFormat)) {
+      fprintf(stderr, "Error: AFBC stills are not supported.\n");
+      return 1;
+    }
+    inputFile = new InputStills(*inputs, inputFormat,
+                                mvx_argp_get_int(&argp, "width", 0),
+                                mvx_argp_get_int(&argp, "height", 0),
+                                mvx_argp_get_int(&argp, "stride", 0));
+  } else if (Codec::isAFBC(inputFormat)) {
+    is.open(mvx_argp_get(&argp, "input", 0));
     inputFile =
         new InputAFBC(is, inputFormat, mvx_argp_get_int(&argp, "width", 0),
                       mvx_argp_get_int(&argp, "height", 0), preload);
@@ -204,18 +302,14 @@ int main(int argc, const char *argv[]) {
       fprintf(stderr, "Error: Illegal stride 0.\n");
       return 1;
     }
+    is.open(mvx_argp_get(&argp, "input", 0));
     roi_file = mvx_argp_get(&argp, "roi_cfg", 0);
     if (roi_file) {
       printf("roi config filename is < %s >.\n", roi_file);
-      roi_stream = new ifstream(roi_file, ios::binary);
-      if (NULL == roi_stream) {
-        fprintf(stderr, "Error: (NULL == roi_stream).\n");
-        return 1;
-      }
       inputFile = new InputFileFrameWithROI(
           is, inputFormat, mvx_argp_get_int(&argp, "width", 0),
           mvx_argp_get_int(&argp, "height", 0),
-          mvx_argp_get_int(&argp, "stride", 0), *roi_stream);
+          mvx_argp_get_int(&argp, "stride", 0), roi_file);
     } else {
       epr_file = mvx_argp_get(&argp, "epr_cfg", 0);
       if (epr_file) {
@@ -240,14 +334,21 @@ int main(int argc, const char *argv[]) {
 
   int mirror = mvx_argp_get_int(&argp, "mirror", 0);
   int frames = mvx_argp_get_int(&argp, "frames", 0);
-  ofstream os(mvx_argp_get(&argp, "output", 0));
+  ofstream os;
   Output *outputFile;
 
-  if (string(mvx_argp_get(&argp, "format", 0)).compare("ivf") == 0) {
+  if (batch) {
+    outputFile = new OutputStills(outputFormat,
+                                  static_cast<InputStills &>(*inputFile),
+                                  mvx_argp_get(&argp, "output", 0),
+                                  mvx_argp_get(&argp, "outputformat", 0));
+  } else if (string(mvx_argp_get(&argp, "format", 0)).compare("ivf") == 0) {
+    os.open(mvx_argp_get(&argp, "output", 0));
     outputFile =
         new OutputIVF(os, outputFormat, mvx_argp_get_int(&argp, "width", 0),
                       mvx_argp_get_int(&argp, "height", 0));
   } else if (string(mvx_argp_get(&argp, "format", 0)).compare("raw") == 0) {
+    os.open(mvx_argp_get(&argp, "output", 0));
     outputFile = new OutputFile(os, outputFormat);
   } else {
     cerr << "Error: Unsupported container format. format="
@@ -328,6 +429,42 @@ int main(int argc, const char *argv[]) {
   if (mvx_argp_is_set(&argp, "profiling")) {
     encoder.setProfiling(mvx_argp_get_int(&argp, "profiling", 0));
   }
+  if (mvx_argp_is_set(&argp, "memory")) {
+    encoder.setMemoryType(
+        Codec::toMemoryType(mvx_argp_get(&argp, "memory", 0)));
+  }
+  if (mvx_argp_is_set(&argp, "prefault")) {
+    try {
+      encoder.setPrefault(
+          Codec::toPrefault(mvx_argp_get_int(&argp, "prefault", 0)));
+    } catch (Exception &e) {
+      cerr << "Error: " << e.what();
+      return 1;
+    }
+  }
+  if (mvx_argp_is_set(&argp, "hugepages")) {
+    encoder.setHugePages(true);
+  }
+  if (mvx_argp_is_set(&argp, "plane_align")) {
+    encoder.setPlaneAlignment(mvx_argp_get_int(&argp, "plane_align", 0));
+  }
+  if (mvx_argp_is_set(&argp, "plane_fds")) {
+    encoder.setSeparatePlanes(true);
+  }
+  if (mvx_argp_is_set(&argp, "watchdog")) {
+    encoder.setWatchdog(mvx_argp_get_int(&argp, "watchdog", 0));
+  }
+  if (mvx_argp_is_set(&argp, "input_buffers") ||
+      mvx_argp_is_set(&argp, "output_buffers")) {
+    encoder.setBufferCounts(mvx_argp_get_int(&argp, "input_buffers", 0),
+                            mvx_argp_get_int(&argp, "output_buffers", 0));
+  }
+  if (mvx_argp_is_set(&argp, "auto_buffers")) {
+    encoder.setAutoBuffers(mvx_argp_get_int(&argp, "auto_buffers", 0));
+  }
+  if (mvx_argp_is_set(&argp, "live")) {
+    encoder.setLive(true);
+  }
   if (mvx_argp_is_set(&argp, "colour_description_range") ||
       mvx_argp_is_set(&argp, "colour_primaries") ||
       mvx_argp_is_set(&argp, "transfer_characteristics") ||
@@ -558,7 +695,62 @@ int main(int argc, const char *argv[]) {
     encoder.setH264GOPType(mvx_argp_get_int(&argp, "gop", 0));
   }
 
-  int result = encoder.stream();
+  BitstreamAnalyzer *analyzer = NULL;
+  if (mvx_argp_is_set(&argp, "analyze")) {
+    if (outputFormat != V4L2_PIX_FMT_H264 &&
+        outputFormat != V4L2_PIX_FMT_HEVC) {
+      fprintf(stderr, "Error: Analysis needs h264 or hevc output.\n");
+      return 1;
+    }
+
+    analyzer = new BitstreamAnalyzer(outputFormat,
+                                     mvx_argp_get_int(&argp, "fps", 0));
+    if (mvx_argp_is_set(&argp, "hrd_buffer_size") &&
+        mvx_argp_get_int(&argp, "target_bitrate", 0) > 0) {
+      analyzer->setHrd(mvx_argp_get_int(&argp, "target_bitrate", 0),
+                       mvx_argp_get_int(&argp, "hrd_buffer_size", 0));
+    }
+    encoder.setAnalyzer(analyzer);
+  }
+
+  EncoderSchedule schedule;
+  if (mvx_argp_is_set(&argp, "schedule")) {
+    try {
+      schedule.load(mvx_argp_get(&argp, "schedule", 0));
+    } catch (Exception &e) {
+      cerr << "Error: " << e.what() << endl;
+      return 1;
+    }
+    encoder.setSchedule(&schedule);
+  }
+
+  FirmwareProfiler *profiler = NULL;
+  if (mvx_argp_is_set(&argp, "fw_profile")) {
+    profiler = new FirmwareProfiler(mvx_argp_get(&argp, "fw_log", 0));
+    encoder.setProfiling(1);
+    encoder.setFirmwareProfiler(profiler);
+  }
+
+  if (mvx_argp_is_set(&argp, "trace")) {
+    Trace::enable();
+  }
+
+  double rate = 0;
+  int result;
+  if (batch) {
+    uint64_t start = Timer::now();
+
+    encoder.setTrackLatency(true);
+    result = encoder.stream();
+    rate = streamBatch(encoder, static_cast<OutputStills &>(*outputFile),
+                       Timer::now() - start);
+  } else {
+    result = encoder.stream();
+  }
+
+  if (mvx_argp_is_set(&argp, "trace")) {
+    Trace::write(mvx_argp_get(&argp, "trace", 0));
+  }
 
   float fps = encoder.getAverageFramerate();
   if (result == 0) {
@@ -569,19 +761,48 @@ int main(int argc, const char *argv[]) {
            fps);
   }
 
+  if (analyzer != NULL) {
+    analyzer->writeSummary(cout);
+    analyzer->write(mvx_argp_get(&argp, "analyze", 0));
+  }
+
+  if (profiler != NULL) {
+    profiler->writeSummary(cout);
+    profiler->write(mvx_argp_get(&argp, "fw_profile", 0));
+  }
+
+  if (mvx_argp_is_set(&argp, "report")) {
+    Report report;
+    ReportRecord &record = report.add();
+
+    record.set("tool", "mvx_encoder");
+    record.set("device", mvx_argp_get(&argp, "dev", 0));
+    record.set("input", mvx_argp_get(&argp, "input", 0));
+    record.set("output", mvx_argp_get(&argp, "output", 0));
+    encoder.fillReport(record);
+    if (batch) {
+      record.set("images", static_cast<uint64_t>(
+                               static_cast<OutputStills *>(outputFile)
+                                   ->getImages()));
+      record.set("images_per_sec", rate);
+    }
+    record.set("md5", "none");
+    record.set("result", result == 0 ? "pass" : "fail");
+    report.write(mvx_argp_get(&argp, "report", 0));
+  }
+
   is.close();
   os.close();
-  if (roi_stream != NULL) {
-    roi_stream->close();
-    delete roi_stream;
-  }
   if (epr_stream != NULL) {
     epr_stream->close();
     delete epr_stream;
   }
 
+  delete analyzer;
+  delete profiler;
   delete inputFile;
   delete outputFile;
+  delete inputs;
 
   return result;
 }
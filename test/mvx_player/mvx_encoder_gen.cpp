@@ -45,7 +45,8 @@ int main(int argc, const char *argv[]) {
   uint32_t outputFormat;
 
   mvx_argp_construct(&argp);
-  mvx_argp_add_opt(&argp, '\0', "dev", true, 1, "/dev/video0", "Device.");
+  mvx_argp_add_opt(&argp, '\0', "dev", true, 1, "/dev/video0",
+                   "Device, or fake[:options] for the in-process fake.");
   mvx_argp_add_opt(&argp, 'i', "inputformat", true, 1, "yuv420",
                    "Pixel format.");
   mvx_argp_add_opt(&argp, 'o', "outputformat", true, 1, "h264",
@@ -101,6 +102,9 @@ int main(int argc, const char *argv[]) {
                    "JPEG restart interval.");
   mvx_argp_add_opt(&argp, 0, "quality", true, 1, "0",
                    "JPEG compression quality. [1-100, 0 - default]");
+  mvx_argp_add_opt(&argp, 0, "report", true, 1, "report.json",
+                   "Write a machine readable report. A .csv path selects "
+                   "CSV, anything else JSON.");
   mvx_argp_add_pos(&argp, "output", false, 1, "", "Output file.");
 
   ret = mvx_argp_parse(&argp, argc - 1, &argv[1]);
@@ -234,6 +238,19 @@ int main(int argc, const char *argv[]) {
 
   ret = encoder.stream();
 
+  if (mvx_argp_is_set(&argp, "report")) {
+    Report report;
+    ReportRecord &record = report.add();
+
+    record.set("tool", "mvx_encoder_gen");
+    record.set("device", mvx_argp_get(&argp, "dev", 0));
+    record.set("output", mvx_argp_get(&argp, "output", 0));
+    encoder.fillReport(record);
+    record.set("md5", "none");
+    record.set("result", ret == 0 ? "pass" : "fail");
+    report.write(mvx_argp_get(&argp, "report", 0));
+  }
+
   delete outputFile;
 
   return ret;
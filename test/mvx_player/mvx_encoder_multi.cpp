@@ -55,6 +55,15 @@ struct job {
         height(h),
         frames(f),
         inputFileFormat(inputFileFormat),
+        nonblock(true),
+        memoryType(V4L2_MEMORY_DMABUF),
+        scheduler(NULL),
+        is(NULL),
+        os(NULL),
+        log(NULL),
+        input(NULL),
+        output(NULL),
+        encoder(NULL),
         ret(0) {}
 
   const char *dev;
@@ -67,46 +76,100 @@ struct job {
   uint32_t height;
   uint32_t frames;
   string inputFileFormat;
+  bool nonblock;
+  uint32_t memoryType;
+  StageScheduler *scheduler;
+  ifstream *is;
+  ofstream *os;
+  ofstream *log;
+  InputFileFrame *input;
+  OutputFile *output;
+  Encoder *encoder;
+  ReportRecord record;
   int ret;
 };
 
-void *encodeThread(void *arg) {
-  job *j = static_cast<job *>(arg);
-
-  ifstream is(j->inputFile.c_str());
-  ofstream os(j->outputFile.c_str());
+static void openJob(job *j) {
   string logf = j->outputFile + ".log";
-  ofstream log(logf.c_str());
 
-  InputFileFrame inputFile =
-      InputFileFrame(is, j->inputFormat, j->width, j->height, j->outputStride);
-  OutputFile *outputFile;
+  j->is = new ifstream(j->inputFile.c_str());
+  j->os = new ofstream(j->outputFile.c_str());
+  j->log = new ofstream(logf.c_str());
+  j->input = new InputFileFrame(*j->is, j->inputFormat, j->width, j->height,
+                                j->outputStride);
 
   if ((j->inputFileFormat).compare("ivf") == 0) {
-    outputFile = new OutputIVF(os, j->outputFormat, j->width, j->height);
+    j->output = new OutputIVF(*j->os, j->outputFormat, j->width, j->height);
   } else if ((j->inputFileFormat).compare("raw") == 0) {
-    outputFile = new OutputFile(os, j->outputFormat);
+    j->output = new OutputFile(*j->os, j->outputFormat);
   }
 
-  Encoder encoder(j->dev, inputFile, *outputFile, true, log);
+  j->encoder =
+      new Encoder(j->dev, *j->input, *j->output, j->nonblock, *j->log);
   if (j->frames > 0) {
-    encoder.setFrameCount(j->frames);
+    j->encoder->setFrameCount(j->frames);
   }
-  encoder.setRateControl("off", 0, 0);
-  j->ret = encoder.stream();
+  j->encoder->setRateControl("off", 0, 0);
+  j->encoder->setStageScheduler(j->scheduler);
+  j->encoder->setMemoryType(j->memoryType);
+}
+
+static void closeJob(job *j) {
+  j->encoder->fillReport(j->record);
+  j->record.set("result", j->ret == 0 ? "pass" : "fail");
+
+  delete j->encoder;
+  delete j->input;
+  delete j->output;
+  delete j->log;
+  delete j->os;
+  delete j->is;
+}
+
+void *encodeThread(void *arg) {
+  job *j = static_cast<job *>(arg);
+
+  openJob(j);
+  j->ret = j->encoder->stream();
+  closeJob(j);
 
   return j;
 }
 
+/* Drive every session from a few threads instead of one thread each. */
+static int runEventLoop(job *jobs[], int nsessions, int threads) {
+  EventLoop loop(threads);
+  int ret;
+
+  for (int i = 0; i < nsessions; ++i) {
+    openJob(jobs[i]);
+    loop.add(*jobs[i]->encoder);
+  }
+
+  ret = loop.run();
+
+  for (int i = 0; i < nsessions; ++i) {
+    jobs[i]->ret = loop.getResult(i);
+    closeJob(jobs[i]);
+  }
+
+  return ret;
+}
+
 int main(int argc, const char *argv[]) {
   int ret;
   mvx_argparse argp;
   uint32_t inputFormat;
   uint32_t outputFormat;
   int nsessions;
+  int threads;
+  int stageThreads;
+  uint32_t memoryType = V4L2_MEMORY_DMABUF;
+  StageScheduler *scheduler = NULL;
 
   mvx_argp_construct(&argp);
-  mvx_argp_add_opt(&argp, '\0', "dev", true, 1, "/dev/video0", "Device.");
+  mvx_argp_add_opt(&argp, '\0', "dev", true, 1, "/dev/video0",
+                   "Device, or fake[:options] for the in-process fake.");
   mvx_argp_add_opt(&argp, 'i', "inputformat", true, 1, "yuv420",
                    "Pixel format.");
   mvx_argp_add_opt(&argp, 'o', "outputformat", true, 1, "h264",
@@ -121,6 +184,20 @@ int main(int argc, const char *argv[]) {
                    "Specfied frame count to be processed.");
   mvx_argp_add_opt(&argp, 'n', "nsessions", true, 1, "1",
                    "Number of sessions.");
+  mvx_argp_add_opt(&argp, 'z', "block", true, 0, "0",
+                   "Use video device in blocking mode");
+  mvx_argp_add_opt(&argp, '\0', "event_loop", true, 1, "0",
+                   "Drive all sessions from this many event loop threads. 0 "
+                   "uses one thread per session.");
+  mvx_argp_add_opt(&argp, '\0', "stage_threads", true, 1, "0",
+                   "Run the CPU side of all sessions on a shared pool of this "
+                   "many threads. 0 keeps it on the polling thread.");
+  mvx_argp_add_opt(&argp, 0, "memory", true, 1, "dmabuf",
+                   "Buffer memory type of every session. [mmap, dmabuf, "
+                   "userptr]");
+  mvx_argp_add_opt(&argp, 0, "report", true, 1, "report.json",
+                   "Write a machine readable report with one record per "
+                   "session. A .csv path selects CSV, anything else JSON.");
   mvx_argp_add_pos(&argp, "input", false, 1, "", "Input file.");
   mvx_argp_add_pos(&argp, "output", false, 1, "", "Output file.");
 
@@ -144,8 +221,23 @@ int main(int argc, const char *argv[]) {
     return 1;
   }
 
+  if (mvx_argp_is_set(&argp, "memory")) {
+    try {
+      memoryType = Codec::toMemoryType(mvx_argp_get(&argp, "memory", 0));
+    } catch (Exception &e) {
+      fprintf(stderr, "Error: %s\n", e.what());
+      return 1;
+    }
+  }
+
   nsessions = mvx_argp_get_int(&argp, "nsessions", 0);
+  threads = mvx_argp_get_int(&argp, "event_loop", 0);
+  stageThreads = mvx_argp_get_int(&argp, "stage_threads", 0);
+  if (stageThreads > 0) {
+    scheduler = new StageScheduler(stageThreads);
+  }
 
+  job *jobs[nsessions];
   pthread_t tid[nsessions];
   for (int i = 0; i < nsessions; ++i) {
     stringstream ss;
@@ -161,20 +253,53 @@ int main(int argc, const char *argv[]) {
                 mvx_argp_get_int(&argp, "frames", 0),
                 string(mvx_argp_get(&argp, "format", 0)));
 
+    j->nonblock = !mvx_argp_is_set(&argp, "block");
+    j->memoryType = memoryType;
+    j->scheduler = scheduler;
+    j->record.set("tool", "mvx_encoder_multi");
+    j->record.set("session", i);
+    j->record.set("device", j->dev);
+    j->record.set("input", mvx_argp_get(&argp, "input", 0));
+    j->record.set("output", j->outputFile);
+    jobs[i] = j;
+
+    if (threads > 0) {
+      continue;
+    }
+
     ret = pthread_create(&tid[i], NULL, encodeThread, j);
     if (ret != 0) {
       throw Exception("Failed to create input thread.");
     }
   }
 
-  ret = 0;
-  for (int i = 0; i < nsessions; ++i) {
-    job *j;
+  if (threads > 0) {
+    ret = runEventLoop(jobs, nsessions, threads);
+  } else {
+    ret = 0;
+    for (int i = 0; i < nsessions; ++i) {
+      job *j;
 
-    pthread_join(tid[i], reinterpret_cast<void **>(&j));
-    ret += j->ret;
-    delete (j);
+      pthread_join(tid[i], reinterpret_cast<void **>(&j));
+      ret += j->ret;
+    }
+  }
+
+  if (mvx_argp_is_set(&argp, "report")) {
+    Report report;
+
+    for (int i = 0; i < nsessions; ++i) {
+      report.add() = jobs[i]->record;
+    }
+
+    report.write(mvx_argp_get(&argp, "report", 0));
   }
 
+  for (int i = 0; i < nsessions; ++i) {
+    delete jobs[i];
+  }
+
+  delete scheduler;
+
   return ret;
 }
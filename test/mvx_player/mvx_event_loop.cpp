@@ -0,0 +1,337 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include "mvx_event_loop.hpp"
+
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include <iostream>
+
+#include "mvx_player.hpp"
+
+using namespace std;
+
+/****************************************************************************
+ * Event loop
+ ****************************************************************************/
+
+/* epoll data of the wake up notifier, sessions use their index. */
+#define EVENT_LOOP_WAKE UINT64_MAX
+
+/*
+ * Every session owns an inner epoll set holding the descriptors it currently
+ * polls. The inner set is registered one shot in the outer set, so a session
+ * is dispatched by one thread at a time and rearmed once it has been handled.
+ * The owned flag carries the hand over between threads.
+ */
+EventLoop::Session::Session(EventSource &source, size_t index)
+    : source(&source),
+      index(index),
+      state(STATE_IDLE),
+      epfd(-1),
+      nfds(0),
+      narmed(0),
+      owned(true) {}
+
+EventLoop::EventLoop(size_t threads, int timeout)
+    : threads(threads > 0 ? threads : 1),
+      timeout(timeout),
+      epfd(-1),
+      wake(NULL),
+      nextStart(0),
+      remaining(0),
+      progress(0),
+      stopped(false) {
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    throw Exception("Failed to create epoll set. errno=%d.", errno);
+  }
+
+  wake = new EventNotifier();
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.u64 = EVENT_LOOP_WAKE;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, wake->getFd(), &ev) != 0) {
+    delete wake;
+    close(epfd);
+    throw Exception("Failed to add wake up notifier. errno=%d.", errno);
+  }
+}
+
+EventLoop::~EventLoop() {
+  for (size_t i = 0; i < sessions.size(); ++i) {
+    if (sessions[i]->epfd >= 0) {
+      close(sessions[i]->epfd);
+    }
+    delete sessions[i];
+  }
+
+  delete wake;
+  close(epfd);
+}
+
+void EventLoop::add(EventSource &source) {
+  sessions.push_back(new Session(source, sessions.size()));
+}
+
+int EventLoop::run() {
+  vector<pthread_t> tids;
+  int failed = 0;
+
+  nextStart = 0;
+  remaining = sessions.size();
+  stopped = sessions.empty();
+
+  for (size_t i = 1; i < threads; ++i) {
+    pthread_t tid;
+
+    /* Carry on with the threads there are. */
+    if (pthread_create(&tid, NULL, runThread, this) != 0) {
+      break;
+    }
+
+    tids.push_back(tid);
+  }
+
+  loop();
+
+  for (size_t i = 0; i < tids.size(); ++i) {
+    pthread_join(tids[i], NULL);
+  }
+
+  for (size_t i = 0; i < sessions.size(); ++i) {
+    failed += getResult(i);
+  }
+
+  return failed;
+}
+
+int EventLoop::getResult(size_t index) const {
+  if (index >= sessions.size()) {
+    throw Exception("No such session. index=%zu.", index);
+  }
+
+  return sessions[index]->state == STATE_DONE ? 0 : 1;
+}
+
+void *EventLoop::runThread(void *arg) {
+  EventLoop *loop = static_cast<EventLoop *>(arg);
+
+  loop->loop();
+
+  return NULL;
+}
+
+void EventLoop::loop() {
+  uint64_t lastProgress = progress;
+  size_t index;
+
+  /* Sessions are started by whichever thread gets to them first. */
+  while ((index = nextStart++) < sessions.size()) {
+    startSession(*sessions[index]);
+  }
+
+  while (!stopped) {
+    struct epoll_event ev;
+
+    int ret = epoll_wait(epfd, &ev, 1, timeout);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      cerr << "Error: epoll returned error code. errno=" << errno << endl;
+      stopped = true;
+      break;
+    }
+
+    /* Only give up when no session has moved for a whole timeout. */
+    if (ret == 0) {
+      if (progress != lastProgress) {
+        lastProgress = progress;
+        continue;
+      }
+
+      cerr << "Error: Poll timed out." << endl;
+      stopped = true;
+      wake->notify();
+      break;
+    }
+
+    /* The notifier is never cleared, so it wakes every thread. */
+    if (ev.data.u64 == EVENT_LOOP_WAKE) {
+      break;
+    }
+
+    dispatch(*sessions[ev.data.u64]);
+  }
+}
+
+void EventLoop::startSession(Session &session) {
+  try {
+    session.source->start();
+
+    session.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (session.epfd < 0) {
+      throw Exception("Failed to create epoll set. errno=%d.", errno);
+    }
+
+    session.state = STATE_STREAMING;
+    arm(session, true);
+  } catch (exception &e) {
+    fail(session, e);
+  }
+}
+
+void EventLoop::dispatch(Session &session) {
+  /* One shot arming hands out an event once, so this never fails. */
+  if (session.owned.exchange(true, memory_order_acquire)) {
+    cerr << "Error: Session dispatched twice. index=" << session.index
+         << "." << endl;
+    return;
+  }
+
+  try {
+    struct epoll_event events[EVENT_SOURCE_MAX_FDS];
+
+    int ret = epoll_wait(session.epfd, events, EVENT_SOURCE_MAX_FDS, 0);
+    if (ret < 0) {
+      throw Exception("Poll returned error code.");
+    }
+
+    for (size_t i = 0; i < session.nfds; ++i) {
+      session.fds[i].revents = 0;
+    }
+
+    /* Poll and epoll share event bit values on Linux. */
+    for (int i = 0; i < ret; ++i) {
+      session.fds[events[i].data.u32].revents = events[i].events;
+    }
+
+    if (ret > 0) {
+      progress++;
+
+      if (session.source->handlePollFds(session.fds, session.nfds)) {
+        session.source->finish();
+        complete(session, STATE_DONE);
+        return;
+      }
+    }
+
+    arm(session, false);
+  } catch (exception &e) {
+    fail(session, e);
+  }
+}
+
+/*
+ * Bring the inner set in line with what the source wants to poll next, then
+ * hand the session back to the outer set.
+ */
+void EventLoop::arm(Session &session, bool first) {
+  session.nfds =
+      session.source->getPollFds(session.fds, EVENT_SOURCE_MAX_FDS);
+
+  for (size_t i = 0; i < session.narmed; ++i) {
+    bool keep = false;
+
+    for (size_t j = 0; j < session.nfds; ++j) {
+      keep = keep || session.fds[j].fd == session.armed[i].fd;
+    }
+
+    if (!keep) {
+      epoll_ctl(session.epfd, EPOLL_CTL_DEL, session.armed[i].fd, NULL);
+    }
+  }
+
+  for (size_t i = 0; i < session.nfds; ++i) {
+    struct epoll_event ev = {};
+    int op = EPOLL_CTL_ADD;
+
+    ev.events = session.fds[i].events;
+    ev.data.u32 = i;
+
+    for (size_t j = 0; j < session.narmed; ++j) {
+      if (session.armed[j].fd == session.fds[i].fd) {
+        op = EPOLL_CTL_MOD;
+      }
+    }
+
+    if (epoll_ctl(session.epfd, op, session.fds[i].fd, &ev) != 0) {
+      throw Exception("Failed to watch fd %d. errno=%d.", session.fds[i].fd,
+                      errno);
+    }
+
+    session.armed[i] = session.fds[i];
+  }
+  session.narmed = session.nfds;
+
+  /* Any thread may take the session as soon as it is armed. */
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.u64 = session.index;
+  session.owned.store(false, memory_order_release);
+  if (epoll_ctl(epfd, first ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, session.epfd,
+                &ev) != 0) {
+    session.owned.store(true, memory_order_relaxed);
+    throw Exception("Failed to arm session. errno=%d.", errno);
+  }
+}
+
+/*
+ * The inner set stays open until the loop is destroyed. The thread that last
+ * rearmed the session may still be in epoll_ctl() on it.
+ */
+void EventLoop::complete(Session &session, State state) {
+  if (session.epfd >= 0) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, session.epfd, NULL);
+  }
+
+  session.state = state;
+
+  if (--remaining == 0) {
+    stopped = true;
+    wake->notify();
+  }
+}
+
+void EventLoop::fail(Session &session, const exception &e) {
+  cerr << "Error: " << e.what() << endl;
+  complete(session, STATE_FAILED);
+}
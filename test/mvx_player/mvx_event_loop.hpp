@@ -0,0 +1,143 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+#ifndef __MVX_EVENT_LOOP_H__
+#define __MVX_EVENT_LOOP_H__
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <exception>
+#include <vector>
+
+/****************************************************************************
+ * Event source
+ ****************************************************************************/
+
+/* Most file descriptors a single event source may ask to be watched. */
+#define EVENT_SOURCE_MAX_FDS 8
+
+/*
+ * Something that can be driven by an EventLoop, typically one codec session.
+ * All methods of one source are called from one thread at a time, but not
+ * necessarily from the same thread.
+ */
+class EventSource {
+ public:
+  virtual ~EventSource() {}
+
+  /* Prepare for streaming. Called once before the first poll. */
+  virtual void start() = 0;
+
+  /* Fill in the descriptors and poll events currently wanted. */
+  virtual size_t getPollFds(struct pollfd fds[], size_t max) = 0;
+
+  /*
+   * Handle the events reported for the descriptors returned by the last
+   * call to getPollFds(). Returns true once the source is done.
+   */
+  virtual bool handlePollFds(const struct pollfd fds[], size_t nfds) = 0;
+
+  /* Tear down after handlePollFds() returned true. */
+  virtual void finish() = 0;
+};
+
+/****************************************************************************
+ * Event loop
+ ****************************************************************************/
+
+class EventNotifier;
+
+/*
+ * Drives many event sources from one thread or a small pool of threads with
+ * epoll, instead of one thread per session. Every source is a state machine
+ * going from idle to streaming to done or failed.
+ */
+class EventLoop {
+ public:
+  EventLoop(size_t threads = 1, int timeout = 1200000);
+  ~EventLoop();
+
+  void add(EventSource &source);
+  int run();
+  int getResult(size_t index) const;
+
+ private:
+  enum State { STATE_IDLE, STATE_STREAMING, STATE_DONE, STATE_FAILED };
+
+  struct Session {
+    Session(EventSource &source, size_t index);
+
+    EventSource *source;
+    size_t index;
+    State state;
+    int epfd;
+    struct pollfd fds[EVENT_SOURCE_MAX_FDS];
+    size_t nfds;
+    struct pollfd armed[EVENT_SOURCE_MAX_FDS];
+    size_t narmed;
+
+    /*
+     * Whether a thread handles the session. Taken with acquire when an
+     * event is dispatched and given back with release before the session is
+     * rearmed, so the next thread sees everything the last one did.
+     */
+    std::atomic<bool> owned;
+  };
+
+  static void *runThread(void *arg);
+  void loop();
+  void startSession(Session &session);
+  void dispatch(Session &session);
+  void arm(Session &session, bool first);
+  void complete(Session &session, State state);
+  void fail(Session &session, const std::exception &e);
+
+  std::vector<Session *> sessions;
+  size_t threads;
+  int timeout;
+  int epfd;
+  EventNotifier *wake;
+  std::atomic<size_t> nextStart;
+  std::atomic<size_t> remaining;
+  std::atomic<uint64_t> progress;
+  std::atomic<bool> stopped;
+};
+
+#endif /* __MVX_EVENT_LOOP_H__ */
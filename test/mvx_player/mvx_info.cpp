@@ -42,7 +42,8 @@ int main(int argc, const char *argv[]) {
   mvx_argparse argp;
 
   mvx_argp_construct(&argp);
-  mvx_argp_add_opt(&argp, '\0', "dev", true, 1, "/dev/video0", "Device.");
+  mvx_argp_add_opt(&argp, '\0', "dev", true, 1, "/dev/video0",
+                   "Device, or fake[:options] for the in-process fake.");
   mvx_argp_add_opt(&argp, 'f', "formats", true, 0, "0",
                    "List supported formats.");
 
@@ -37,6 +37,7 @@
 #include "mvx_player.hpp"
 
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <linux/videodev2.h>
 #include <pthread.h>
@@ -44,6 +45,8 @@
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -57,6 +60,7 @@
 #include <sstream>
 
 #include "md5.h"
+#include "mvx_device.hpp"
 
 using namespace std;
 
@@ -85,6 +89,9 @@ using namespace std;
 #define INPUT_NUM_BUFFERS 3
 #define OUTPUT_EXTRA_NUM_BUFFERS 3
 
+/* Huge page size when the kernel does not report one. */
+#define HUGE_PAGE_SIZE_DEFAULT (2 * 1048576)
+
 #ifndef V4L2_EVENT_SOURCE_CHANGE
 #define V4L2_EVENT_SOURCE_CHANGE 5
 #endif
@@ -104,6 +111,27 @@ static T roundUp(T value, U round) {
   return divRoundUp(value, round) * round;
 }
 
+/* The default huge page size, which MAP_HUGETLB mappings come in. */
+static size_t readHugePageSize() {
+  ifstream meminfo("/proc/meminfo");
+  string line;
+  size_t kb = 0;
+
+  while (getline(meminfo, line)) {
+    if (sscanf(line.c_str(), "Hugepagesize: %zu kB", &kb) == 1) {
+      return kb * 1024;
+    }
+  }
+
+  return HUGE_PAGE_SIZE_DEFAULT;
+}
+
+static size_t getHugePageSize() {
+  static const size_t size = readHugePageSize();
+
+  return size;
+}
+
 /****************************************************************************
  * Exception
  ****************************************************************************/
@@ -125,6 +153,422 @@ Exception::~Exception() throw() {}
 
 const char *Exception::what() const throw() { return msg; }
 
+/****************************************************************************
+ * Queues
+ ****************************************************************************/
+
+EventNotifier::EventNotifier(bool nonblock) {
+  fd = eventfd(0, EFD_CLOEXEC | (nonblock ? EFD_NONBLOCK : 0));
+  if (fd < 0) {
+    throw Exception("Failed to create eventfd. errno=%d.", errno);
+  }
+}
+
+EventNotifier::~EventNotifier() { close(fd); }
+
+void EventNotifier::notify() {
+  uint64_t value = 1;
+  ssize_t ret = write(fd, &value, sizeof(value));
+  (void)ret;
+}
+
+void EventNotifier::wait() {
+  uint64_t value;
+  ssize_t ret = read(fd, &value, sizeof(value));
+  (void)ret;
+}
+
+void EventNotifier::clear() {
+  uint64_t value;
+  ssize_t ret = read(fd, &value, sizeof(value));
+  (void)ret;
+}
+
+/****************************************************************************
+ * Stage scheduler
+ ****************************************************************************/
+
+StageScheduler::StageScheduler(size_t threads)
+    : nextWorker(0), nready(0), stop(false) {
+  for (size_t i = 0; i < (threads > 0 ? threads : 1); ++i) {
+    Worker *worker = new Worker();
+
+    worker->scheduler = this;
+    worker->index = i;
+    workers.push_back(worker);
+  }
+
+  for (size_t i = 0; i < workers.size(); ++i) {
+    int ret = pthread_create(&workers[i]->tid, NULL, runWorker, workers[i]);
+    if (ret != 0) {
+      stopWorkers(i);
+      throw Exception("Failed to create stage worker. index=%zu.", i);
+    }
+  }
+}
+
+StageScheduler::~StageScheduler() { stopWorkers(workers.size()); }
+
+void StageScheduler::stopWorkers(size_t running) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  wakeup.notify_all();
+
+  for (size_t i = 0; i < workers.size(); ++i) {
+    if (i < running) {
+      pthread_join(workers[i]->tid, NULL);
+    }
+    delete workers[i];
+  }
+  workers.clear();
+}
+
+/*
+ * Queue a strand that has new work. A strand that is already queued or
+ * running is left alone; the worker running it checks for more work before
+ * letting go of it.
+ */
+void StageScheduler::submit(StageStrand &strand) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (strand.queued.exchange(true)) {
+    return;
+  }
+
+  push(nextWorker++ % workers.size(), &strand);
+}
+
+/* Wait until a strand is neither queued nor running. */
+void StageScheduler::wait(StageStrand &strand) {
+  std::unique_lock<std::mutex> lock(mutex);
+  idle.wait(lock, [&strand] { return !strand.queued; });
+}
+
+void *StageScheduler::runWorker(void *arg) {
+  Worker *worker = static_cast<Worker *>(arg);
+
+  worker->scheduler->loop(worker->index);
+
+  return NULL;
+}
+
+void StageScheduler::loop(size_t index) {
+  while (true) {
+    StageStrand *strand = take(index);
+
+    if (strand == NULL) {
+      std::unique_lock<std::mutex> lock(mutex);
+      wakeup.wait(lock, [this] { return stop || nready > 0; });
+      if (stop && nready == 0) {
+        break;
+      }
+      continue;
+    }
+
+    strand->runStrand();
+
+    /*
+     * Release the strand under the lock, so that wait() only returns once
+     * this worker is done with it.
+     */
+    bool again;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      strand->queued = false;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      again = strand->hasWork() && !strand->queued.exchange(true);
+      if (!again) {
+        idle.notify_all();
+      }
+    }
+
+    if (again) {
+      push(index, strand);
+    }
+  }
+}
+
+void StageScheduler::push(size_t index, StageStrand *strand) {
+  {
+    std::lock_guard<std::mutex> lock(workers[index]->mutex);
+    workers[index]->ready.push_back(strand);
+  }
+
+  nready++;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+  }
+  wakeup.notify_one();
+}
+
+/* Own deque first, oldest strand first; otherwise steal the newest. */
+StageStrand *StageScheduler::take(size_t index) {
+  for (size_t i = 0; i < workers.size(); ++i) {
+    Worker *worker = workers[(index + i) % workers.size()];
+    std::lock_guard<std::mutex> lock(worker->mutex);
+
+    if (worker->ready.empty()) {
+      continue;
+    }
+
+    StageStrand *strand;
+    if (i == 0) {
+      strand = worker->ready.front();
+      worker->ready.pop_front();
+    } else {
+      strand = worker->ready.back();
+      worker->ready.pop_back();
+    }
+
+    nready--;
+    return strand;
+  }
+
+  return NULL;
+}
+
+/****************************************************************************
+ * Timers
+ ****************************************************************************/
+
+#define NSEC_PER_SEC 1000000000ull
+#define NSEC_PER_MSEC 1000000ull
+
+/* Releases further off their slot than this count as outliers. */
+#define PACING_JITTER_LIMIT NSEC_PER_MSEC
+
+Timer::Timer() {
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    throw Exception("Failed to create timerfd. errno=%d.", errno);
+  }
+}
+
+Timer::~Timer() { close(fd); }
+
+void Timer::setAbsolute(uint64_t time) {
+  struct itimerspec spec = {};
+
+  spec.it_value.tv_sec = time / NSEC_PER_SEC;
+  spec.it_value.tv_nsec = time % NSEC_PER_SEC;
+  if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0) {
+    throw Exception("Failed to arm timer. errno=%d.", errno);
+  }
+}
+
+void Timer::setRelative(uint64_t delay) {
+  struct itimerspec spec = {};
+
+  /* A zero expiry would disarm the timer. */
+  delay = delay > 0 ? delay : 1;
+  spec.it_value.tv_sec = delay / NSEC_PER_SEC;
+  spec.it_value.tv_nsec = delay % NSEC_PER_SEC;
+  if (timerfd_settime(fd, 0, &spec, NULL) != 0) {
+    throw Exception("Failed to arm timer. errno=%d.", errno);
+  }
+}
+
+void Timer::disarm() {
+  struct itimerspec spec = {};
+
+  timerfd_settime(fd, 0, &spec, NULL);
+}
+
+uint64_t Timer::clear() {
+  uint64_t expirations = 0;
+  ssize_t ret = read(fd, &expirations, sizeof(expirations));
+  (void)ret;
+
+  return expirations;
+}
+
+uint64_t Timer::now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+FramePacer::FramePacer(uint64_t interval)
+    : interval(interval),
+      next(0),
+      last(0),
+      frames(0),
+      jitterSum(0),
+      jitterMax(0),
+      outliers(0) {}
+
+bool FramePacer::isDue() { return next == 0 || Timer::now() >= next; }
+
+uint64_t FramePacer::release() {
+  uint64_t now = Timer::now();
+
+  if (last != 0) {
+    uint64_t delta = now - last;
+    uint64_t jitter = delta > interval ? delta - interval : interval - delta;
+
+    jitterSum += jitter;
+    jitterMax = std::max(jitterMax, jitter);
+    if (jitter > PACING_JITTER_LIMIT) {
+      outliers++;
+    }
+  }
+
+  /*
+   * Stay on the absolute schedule, but when more than a frame behind start
+   * over from now rather than bursting to catch up. The slots skipped are
+   * returned, a live source drops those frames.
+   */
+  uint64_t missed = 0;
+  if (next == 0) {
+    next = now;
+  } else if (now > next + interval) {
+    missed = (now - next) / interval;
+    next = now;
+  }
+  next += interval;
+  last = now;
+  frames++;
+
+  return missed;
+}
+
+void FramePacer::arm() { timer.setAbsolute(next); }
+
+uint64_t FramePacer::getJitterAverage() const {
+  return frames > 1 ? jitterSum / (frames - 1) : 0;
+}
+
+LatencyTracker::LatencyTracker() : start(Timer::now()), drops(0), lost(0) {
+  latencies.reserve(1024);
+}
+
+/* Never zero, a zero timestamp means none. */
+uint64_t LatencyTracker::capture() {
+  uint64_t timestamp = (Timer::now() - start) / 1000 + 1;
+
+  timestampList.insert(timestamp);
+  if (timestampList.size() > LATENCY_MAX_PENDING) {
+    timestampList.erase(timestampList.begin());
+    lost++;
+  }
+
+  return timestamp;
+}
+
+void LatencyTracker::complete(const v4l2_buffer &buf) {
+  uint64_t timestamp =
+      buf.timestamp.tv_sec * 1000000ull + buf.timestamp.tv_usec;
+  std::set<uint64_t>::iterator it = timestampList.find(timestamp);
+
+  if (it == timestampList.end()) {
+    return;
+  }
+
+  timestampList.erase(it);
+  latencies.push_back((Timer::now() - start) / 1000 - (timestamp - 1));
+  histogram.add(latencies.back());
+}
+
+uint64_t LatencyTracker::getPercentile(unsigned int percent) {
+  if (latencies.empty()) {
+    return 0;
+  }
+
+  /* Nearest rank. */
+  size_t rank = (latencies.size() * percent + 99) / 100;
+  std::vector<uint64_t>::iterator nth =
+      latencies.begin() + std::max<size_t>(rank, 1) - 1;
+  std::nth_element(latencies.begin(), nth, latencies.end());
+
+  return *nth;
+}
+
+OccupancyTracker::OccupancyTracker()
+    : running(false),
+      level(0),
+      since(0),
+      stalls(0),
+      stallTime(0),
+      longestStall(0) {
+  memset(time, 0, sizeof(time));
+}
+
+void OccupancyTracker::update(size_t level) {
+  uint64_t now = Timer::now();
+
+  if (!running) {
+    if (level == 0) {
+      return;
+    }
+
+    running = true;
+    this->level = level;
+    since = now;
+    return;
+  }
+
+  if (level == this->level) {
+    return;
+  }
+
+  uint64_t elapsed = now - since;
+  time[std::min<size_t>(this->level, OCCUPANCY_LEVELS - 1)] += elapsed;
+
+  if (this->level == 0) {
+    stalls++;
+    stallTime += elapsed;
+    longestStall = std::max(longestStall, elapsed);
+  }
+
+  this->level = level;
+  since = now;
+}
+
+/* A stall still open when the port is done is draining, not starving. */
+void OccupancyTracker::stop() {
+  if (!running) {
+    return;
+  }
+
+  if (level != 0) {
+    uint64_t elapsed = Timer::now() - since;
+    time[std::min<size_t>(level, OCCUPANCY_LEVELS - 1)] += elapsed;
+  }
+
+  running = false;
+}
+
+/* Time in us spent at each level, up to the highest one seen. */
+std::vector<uint64_t> OccupancyTracker::getTimes() const {
+  size_t levels = OCCUPANCY_LEVELS;
+
+  while (levels > 0 && time[levels - 1] == 0) {
+    levels--;
+  }
+
+  std::vector<uint64_t> times(levels);
+  for (size_t i = 0; i < levels; ++i) {
+    times[i] = time[i] / 1000;
+  }
+
+  return times;
+}
+
+double OccupancyTracker::getAverage() const {
+  uint64_t total = 0;
+  double sum = 0;
+
+  for (size_t i = 0; i < OCCUPANCY_LEVELS; ++i) {
+    total += time[i];
+    sum += static_cast<double>(i) * time[i];
+  }
+
+  return total > 0 ? sum / total : 0;
+}
+
 /****************************************************************************
  * Input and output
  ****************************************************************************/
@@ -132,13 +576,12 @@ const char *Exception::what() const throw() { return msg; }
 const uint32_t IVFHeader::signatureDKIF = v4l2_fourcc('D', 'K', 'I', 'F');
 static const uint8_t startCode[4] = {0x00, 0x00, 0x00, 0x01};
 static const uint8_t subStartCode[3] = {0x00, 0x00, 0x01};
-static std::mutex m_Mutex;
 
 // COnfiguration file maximum line lengths, for use by fgets()
 // ROI requires 512
 // ERP requires 10+1 + 7+1 + 11+1 + (22+1)*256 = 5919 (8k width)
 #define CFG_FILE_LINE_SIZE (6144)
-static char cfg_file_line_buf[CFG_FILE_LINE_SIZE];
+static thread_local char cfg_file_line_buf[CFG_FILE_LINE_SIZE];
 
 static int startcode_find_candidate(char *buf, int size);
 
@@ -278,6 +721,16 @@ IO::IO(uint32_t format, bool preload, size_t width, size_t height,
       isPreload(preload),
       timestamp(0) {}
 
+void IO::addTimestamp(uint64_t ts) {
+  std::lock_guard<std::mutex> guard(timestampLock);
+  timestampList.insert(ts);
+}
+
+bool IO::hasTimestamp(uint64_t ts) {
+  std::lock_guard<std::mutex> guard(timestampLock);
+  return timestampList.count(ts) != 0;
+}
+
 Input::Input(uint32_t format, bool preload, size_t width, size_t height,
              size_t strideAlign)
     : IO(format, preload, width, height, strideAlign) {
@@ -331,19 +784,18 @@ InputFile::~InputFile() {
 }
 
 void InputFile::prepare(Buffer &buf) {
-  vector<iovec> iov = buf.getImageSize();
+  PlaneView iov = buf.getImageSize();
   if (getNaluFormat() == V4L2_OPT_NALU_FORMAT_ONE_NALU_PER_BUFFER) {
     int buflen = V4L2_ALLOCATE_BUFFER_ROI;
     int readlen = V4L2_READ_LEN_BUFFER_ROI;
     int iovoff = 0;
     {
-      m_Mutex.lock();
+      std::lock_guard<std::mutex> lock(mutex);
       if (!inputBuf) {
         inputBuf = static_cast<char *>(malloc(buflen));  // ToDo
         input.read(static_cast<char *>(inputBuf), readlen);
         curlen = readlen;
       }
-      m_Mutex.unlock();
     }
     if (offset == 0 && (0 == memcmp(inputBuf + offset, startCode, 4))) {
       offset += 4;
@@ -409,7 +861,7 @@ void InputFile::prepare(Buffer &buf) {
     int buflen = V4L2_READ_LEN_BUFFER_ROI;
     bool found_frame = false;
     {
-      m_Mutex.lock();
+      std::lock_guard<std::mutex> lock(mutex);
       if (!inputBuf) {
         inputBuf = static_cast<char *>(malloc(buflen));  // ToDo
         // input.read(static_cast<char *>(inputBuf), readlen);
@@ -418,7 +870,6 @@ void InputFile::prepare(Buffer &buf) {
       if (!reader) {
         reader = new start_code_reader(getFormat());
       }
-      m_Mutex.unlock();
     }
     uint32_t frame_start_pos = 0;
     uint32_t frame_size = 0;
@@ -629,7 +1080,7 @@ void InputIVF::prepare(Buffer &buf) {
     cal_size = left_bytes;
   }
 
-  vector<iovec> iov = buf.getImageSize();
+  PlaneView iov = buf.getImageSize();
   uint32_t read_bytes = cal_size > iov[0].iov_len ? iov[0].iov_len : cal_size;
   int read_len = 0;
   if (!getPreload()) {
@@ -646,7 +1097,7 @@ void InputIVF::prepare(Buffer &buf) {
   left_bytes = cal_size - iov[0].iov_len;
   buf.setBytesUsed(iov);
   buf.setTimeStamp(timestamp);
-  timestampList.insert(timestamp);
+  addTimestamp(timestamp);
 }
 
 InputRCV::InputRCV(istream &input, bool preload)
@@ -681,7 +1132,7 @@ InputRCV::InputRCV(istream &input, bool preload)
 bool InputRCV::eof() { return input.peek() == EOF; }
 
 void InputRCV::prepare(Buffer &buf) {
-  vector<iovec> iov = buf.getImageSize();
+  PlaneView iov = buf.getImageSize();
   if (!isRcv) {
     InputFile::prepare(buf);
     return;
@@ -733,7 +1184,7 @@ void InputAFBC::prepare(Buffer &buf) {
   if (eof()) {
     return;
   }
-  vector<iovec> iov = buf.getImageSize();
+  PlaneView iov = buf.getImageSize();
   AFBCHeader header;
 
   if (!getPreload()) {
@@ -817,7 +1268,7 @@ InputFileFrame::InputFileFrame(istream &input, uint32_t format, size_t width,
 }
 
 void InputFileFrame::prepare(Buffer &buf) {
-  vector<iovec> iov = buf.getImageSize();
+  PlaneView iov = buf.getImageSize();
 
   if (nplanes != iov.size()) {
     throw Exception(
@@ -852,32 +1303,48 @@ void InputFileFrame::prepare(Buffer &buf) {
   buf.setBytesUsed(iov);
 }
 
+void InputFileFrame::skipFrame() {
+  size_t total = 0;
+
+  for (size_t i = 0; i < nplanes; ++i) {
+    total += size[i];
+  }
+
+  if (!getPreload()) {
+    input.ignore(total);
+    if ((size_t)input.gcount() < total) {
+      iseof = true;
+    }
+  } else {
+    ignoreBuffer(total);
+  }
+}
+
 InputFileFrameWithROI::InputFileFrameWithROI(std ::istream &input,
                                              uint32_t format, size_t width,
                                              size_t height, size_t strideAlign,
                                              std ::istream &roi)
-    : InputFileFrame(input, format, width, height, strideAlign), roi_is(roi) {
-  roi_list = NULL;
-  load_roi_cfg();
+    : InputFileFrame(input, format, width, height, strideAlign) {
+  config.load(roi);
   prepared_frames = 0;
 }
 
-InputFileFrameWithROI::~InputFileFrameWithROI() {
-  if (roi_list) {
-    delete roi_list;
-  }
+InputFileFrameWithROI::InputFileFrameWithROI(std ::istream &input,
+                                             uint32_t format, size_t width,
+                                             size_t height, size_t strideAlign,
+                                             const char *roi)
+    : InputFileFrame(input, format, width, height, strideAlign) {
+  config.load(roi);
+  prepared_frames = 0;
 }
 
+InputFileFrameWithROI::~InputFileFrameWithROI() {}
+
 void InputFileFrameWithROI::prepare(Buffer &buf) {
-  v4l2_roi_list_t::iterator iter = roi_list->begin();
-  v4l2_roi_list_t::iterator end = roi_list->end();
-  for (; iter != end; iter++) {
-    if (iter->pic_index == prepared_frames) {
-      break;
-    }
-  }
-  if (iter != end) {
-    buf.setRoiCfg(*iter);
+  const v4l2_mvx_roi_regions *roi = config.find(prepared_frames);
+
+  if (roi != NULL) {
+    buf.setRoiCfg(*roi);
   } else {
     printf("no roiCfg value for pic_index %d.\n", prepared_frames);
   }
@@ -886,73 +1353,6 @@ void InputFileFrameWithROI::prepare(Buffer &buf) {
   prepared_frames++;
 }
 
-void InputFileFrameWithROI::load_roi_cfg() {
-  int pic_index, qp, num_roi;
-  struct v4l2_mvx_roi_regions roi;
-  if (!roi_list) {
-    roi_list = new v4l2_roi_list_t;
-  }
-  while (roi_is.getline(cfg_file_line_buf, CFG_FILE_LINE_SIZE)) {
-    memset(&roi, 0, sizeof(struct v4l2_mvx_roi_regions));
-    if (3 == sscanf(cfg_file_line_buf, "pic=%d qp=%d num_roi=%d", &pic_index,
-                    &qp, &num_roi)) {
-      roi.pic_index = pic_index;
-      roi.qp = qp;
-      roi.num_roi = num_roi;
-      roi.roi_present = true;
-      roi.qp_present = true;
-    } else if (3 == sscanf(cfg_file_line_buf, "pic=%d num_roi=%d qp=%d",
-                           &pic_index, &num_roi, &qp)) {
-      roi.pic_index = pic_index;
-      roi.qp = qp;
-      roi.num_roi = num_roi;
-      roi.roi_present = true;
-      roi.qp_present = true;
-    } else if (2 == sscanf(cfg_file_line_buf, "pic=%d num_roi=%d qp=%d",
-                           &pic_index, &num_roi, &qp)) {
-      roi.pic_index = pic_index;
-      roi.qp = 0;
-      roi.num_roi = num_roi;
-      roi.roi_present = true;
-      roi.qp_present = false;
-    } else if (2 == sscanf(cfg_file_line_buf, "pic=%d qp=%d num_roi=%d",
-                           &pic_index, &qp, &num_roi)) {
-      roi.pic_index = pic_index;
-      roi.qp = qp;
-      roi.num_roi = 0;
-      roi.roi_present = false;
-      roi.qp_present = true;
-    } else {
-      cout << "parse ROI config file ERROR!" << endl;
-    }
-    if (roi.num_roi > V4L2_MVX_MAX_FRAME_REGIONS) {
-      cout << "invalid n_regions value:" << roi.num_roi << endl;
-    }
-    if (roi.num_roi > 0) {
-      char *sub_buf1 = cfg_file_line_buf;
-      char *sub_buf2;
-      int match = 0;
-      for (int i = 0; i < roi.num_roi; i++) {
-        sub_buf2 = strstr(sub_buf1, " roi=");
-        if (sub_buf2 != NULL) {
-          match = sscanf(sub_buf2, " roi={%hu,%hu,%hu,%hu,%hu}",
-                         &roi.roi[i].mbx_left, &roi.roi[i].mbx_right,
-                         &roi.roi[i].mby_top, &roi.roi[i].mby_bottom,
-                         &roi.roi[i].qp_delta);
-        }
-        if (match != 5) {
-          cout << "Error while parsing the ROI regions:" << match << endl;
-        }
-        cout << roi.roi[i].mbx_left << "," << roi.roi[i].mbx_right << ","
-             << roi.roi[i].mby_top << "," << roi.roi[i].mby_bottom << ","
-             << roi.roi[i].qp_delta << endl;
-        sub_buf1 = sub_buf2 + 5;
-      }
-    }
-    roi_list->push_back(roi);
-  }
-}
-
 InputFileFrameWithEPR::InputFileFrameWithEPR(std ::istream &input,
                                              uint32_t format, size_t width,
                                              size_t height, size_t strideAlign,
@@ -960,18 +1360,16 @@ InputFileFrameWithEPR::InputFileFrameWithEPR(std ::istream &input,
                                              uint32_t oformat)
     : InputFileFrame(input, format, width, height, strideAlign),
       epr_is(epr),
+      epr_eof(false),
+      last_row(0),
       outformat(oformat) {
   prepared_frames = 0;
-  epr_list = NULL;
-  load_epr_cfg();
-  cur = epr_list->begin();
+  max_bprf_body_size = ((getWidth() + 31) >> 5) * ((getHeight() + 31) >> 5) *
+                       sizeof(struct v4l2_block_param_record);
+  fill_epr_window();
 }
 
-InputFileFrameWithEPR::~InputFileFrameWithEPR() {
-  if (epr_list) {
-    delete epr_list;
-  }
-}
+InputFileFrameWithEPR::~InputFileFrameWithEPR() {}
 
 void InputFileFrameWithEPR::erp_adjust_bpr_to_64_64(
     struct v4l2_buffer_general_rows_uncomp_body *uncomp_body, int qp_delta,
@@ -1002,9 +1400,11 @@ void InputFileFrameWithEPR::prepare(Buffer &buf) {
       InputFileFrame::prepare(buf);
   }
   prepared_frames++;*/
-  if (epr_list->end() != cur && cur->pic_index == prepared_frames) {
+  fill_epr_window();
+  if (!window.empty() && window.front().pic_index == prepared_frames) {
     prepareEPR(buf);
-    cur++;
+    pool.push_back(std::move(window.front()));
+    window.pop_front();
   } else {
     InputFileFrame::prepare(buf);
     prepared_frames++;
@@ -1012,15 +1412,15 @@ void InputFileFrameWithEPR::prepare(Buffer &buf) {
 }
 
 void InputFileFrameWithEPR::prepareEPR(Buffer &buf) {
-  vector<iovec> iov = buf.getImageSize();
-  v4l2_epr_list_t::iterator iter = cur;
-  v4l2_epr_list_t::iterator end = epr_list->end();
+  PlaneView iov = buf.getImageSize();
+  std::deque<epr_config>::iterator iter = window.begin();
+  std::deque<epr_config>::iterator end = window.end();
   /*for (; iter != end; iter++) {
       if (iter->pic_index == prepared_frames / 2) {
           break;
       }
   }*/
-  if (cur != end) {
+  if (iter != end) {
     if (iter->qp_present) {
       cout << "qp:" << iter->qp.qp << endl;
       buf.setQPofEPR(iter->qp.qp);
@@ -1241,37 +1641,54 @@ void InputFileFrameWithEPR::read_efp_cfg(char *buf, int num_epr,
     cout << "Error not parsed enough EPRs" << endl;
   }
 }
-void InputFileFrameWithEPR::load_epr_cfg() {
+void InputFileFrameWithEPR::fill_epr_window() {
+  while (window.size() < EPR_WINDOW && !epr_eof) {
+    if (pool.empty()) {
+      pool.push_back(epr_config(max_bprf_body_size));
+    }
+
+    epr_config config(std::move(pool.back()));
+    pool.pop_back();
+
+    if (load_epr_cfg(config)) {
+      window.push_back(std::move(config));
+    } else {
+      pool.push_back(std::move(config));
+      epr_eof = true;
+    }
+  }
+}
+
+bool InputFileFrameWithEPR::load_epr_cfg(epr_config &config) {
   unsigned int num;
   unsigned int num2;
   int pic_num;
   int last_pic_num = -1;  // -1 to handle first time
   int epr_num_row = 0;
   int epr_real_row = 0;
-  if (!epr_list) {
-    epr_list = new v4l2_epr_list_t;
-  }
-  const size_t max_bprf_body_size = ((getWidth() + 31) >> 5) *
-                                    ((getHeight() + 31) >> 5) *
-                                    sizeof(struct v4l2_block_param_record);
-  epr_config config(max_bprf_body_size);
-  while (epr_is.getline(cfg_file_line_buf, CFG_FILE_LINE_SIZE)) {
+
+  config.clear();
+  last_row = 0;
+  while (true) {
+    if (!pending.empty()) {
+      strcpy(cfg_file_line_buf, pending.c_str());
+      pending.clear();
+    } else if (!epr_is.getline(cfg_file_line_buf, CFG_FILE_LINE_SIZE)) {
+      break;
+    }
+
     if (1 != sscanf(cfg_file_line_buf, "pic=%d", &pic_num)) {
       cout << "Line:" << cfg_file_line_buf << endl;
-      return;
+      return false;
     }
     if (pic_num < 0) {
       cout << "pic index must not be less than zero!" << endl;
-      return;
+      return false;
     }
-    if (last_pic_num != pic_num) {
-      // not the first time
-      if (last_pic_num != -1) {
-        epr_list->push_back(config);
-      }
-      config.clear();
-      epr_num_row = 0;
-      epr_real_row = 0;
+    if (last_pic_num != -1 && last_pic_num != pic_num) {
+      /* First line of the next picture, keep it for the next call. */
+      pending = cfg_file_line_buf;
+      break;
     }
     if (2 == sscanf(cfg_file_line_buf, "pic=%d num_efp=%d", &config.pic_index,
                     &num)) {
@@ -1280,7 +1697,7 @@ void InputFileFrameWithEPR::load_epr_cfg() {
                            &config.pic_index, &num, &num2)) {
       if (num == 0) {
         cout << "num_row must be greater than 0" << endl;
-        return;
+        return false;
       }
       if (config.block_configs_present) {
         cout << " block_configs_present flag already set to region for picture!"
@@ -1293,7 +1710,7 @@ void InputFileFrameWithEPR::load_epr_cfg() {
         config.block_configs.blk_cfgs.rows_uncomp.n_rows_minus1 = num - 1;
       } else {
         cout << "Error - Unsupported block_param_rows_format" << endl;
-        return;
+        return false;
       }
       epr_num_row = num;
     } else if (3 == sscanf(cfg_file_line_buf, "pic=%d row=%u num_bpr=%u",
@@ -1303,7 +1720,6 @@ void InputFileFrameWithEPR::load_epr_cfg() {
       }
       if (config.block_configs.blk_cfg_type ==
           V4L2_BLOCK_CONFIGS_TYPE_ROW_UNCOMP) {
-        static unsigned int last_row = 0;
         if (num <= last_row && num != 0) {
           cout << "Error : current row number is less than last_row for picture"
                << endl;
@@ -1331,12 +1747,17 @@ void InputFileFrameWithEPR::load_epr_cfg() {
     last_pic_num = pic_num;
   }
 
+  if (last_pic_num == -1) {
+    return false;
+  }
+
   if (epr_real_row != epr_num_row) {
     cout << "Error: num_row [%d] in epr-cfg-file is not equal to the "
             "real-line-number"
          << endl;
   }
-  epr_list->push_back(config);
+
+  return true;
 }
 
 InputFrame::InputFrame(uint32_t format, size_t width, size_t height,
@@ -1346,7 +1767,7 @@ InputFrame::InputFrame(uint32_t format, size_t width, size_t height,
 }
 
 void InputFrame::prepare(Buffer &buf) {
-  vector<iovec> iov = buf.getImageSize();
+  PlaneView iov = buf.getImageSize();
 
   unsigned int color = (0xff << 24) | (count * 10);
   unsigned int rgba[4];
@@ -1731,11 +2152,262 @@ void InputFrame::rgb2yuv(unsigned int yuv[3], const unsigned int rgb[3]) {
   yuv[2] = v * 112 + 128;
 }
 
-Output::Output(uint32_t format) : IO(format), totalSize(0) { dir = 1; }
+InputCallback::InputCallback(uint32_t format, const Source &source,
+                             const Release &release)
+    : Input(format),
+      source(source),
+      releaseUnit(release),
+      iseof(false),
+      naluFmt(V4L2_OPT_NALU_FORMAT_ONE_FRAME_PER_BUFFER),
+      nplanes(0) {}
+
+InputCallback::InputCallback(uint32_t format, size_t width, size_t height,
+                             size_t strideAlign, const Source &source,
+                             const Release &release)
+    : Input(format, false, width, height, strideAlign),
+      source(source),
+      releaseUnit(release),
+      iseof(false),
+      naluFmt(0),
+      nplanes(0) {
+  Codec::getSize(format, width, height, strideAlign, nplanes, stride, size);
+}
 
-Output::~Output() { cout << "Total size " << totalSize << endl; }
+bool InputCallback::next(MemoryUnit &unit) { return source && source(unit); }
 
-void Output::prepare(Buffer &buf) { buf.clearBytesUsed(); }
+void InputCallback::release(const MemoryUnit &unit) {
+  if (releaseUnit) {
+    releaseUnit(unit);
+  }
+}
+
+/*
+ * Bitstream is gathered into the first plane. Frames given as one span are
+ * split at the plane sizes, frames given per plane are copied plane by
+ * plane. Without a unit the buffer goes out empty and marks the end.
+ */
+void InputCallback::prepare(Buffer &buf) {
+  PlaneView iov = buf.getImageSize();
+  MemoryUnit unit;
+
+  if (iseof || !next(unit)) {
+    iseof = true;
+    buf.clearBytesUsed();
+    return;
+  }
+
+  if (nplanes == 0) {
+    size_t offset = 0;
+
+    for (size_t i = 0; i < unit.count; ++i) {
+      if (unit.spans[i].iov_len > iov[0].iov_len - offset) {
+        release(unit);
+        throw Exception("Unit is larger than buffer. buffer=%zu.",
+                        iov[0].iov_len);
+      }
+
+      memcpy(static_cast<char *>(iov[0].iov_base) + offset,
+             unit.spans[i].iov_base, unit.spans[i].iov_len);
+      offset += unit.spans[i].iov_len;
+    }
+
+    iov[0].iov_len = offset;
+    buf.setEndOfFrame(true);
+  } else {
+    const char *data = static_cast<const char *>(unit.spans[0].iov_base);
+    size_t left = unit.count > 0 ? unit.spans[0].iov_len : 0;
+
+    if (nplanes != iov.size() || (unit.count != 1 && unit.count != nplanes)) {
+      release(unit);
+      throw Exception("Unit, frame and buffer planes differ. unit=%zu.",
+                      unit.count);
+    }
+
+    for (size_t i = 0; i < nplanes; ++i) {
+      size_t len;
+
+      if (unit.count == nplanes) {
+        data = static_cast<const char *>(unit.spans[i].iov_base);
+        len = std::min(unit.spans[i].iov_len, size[i]);
+      } else {
+        len = std::min(left, size[i]);
+        left -= len;
+      }
+
+      if (size[i] > iov[i].iov_len) {
+        release(unit);
+        throw Exception("Frame plane is larger than buffer. plane=%zu.", i);
+      }
+
+      memcpy(iov[i].iov_base, data, len);
+      iov[i].iov_len = len;
+      data += len;
+    }
+  }
+
+  buf.setBytesUsed(iov);
+  buf.setTimeStamp(unit.timestamp);
+  release(unit);
+}
+
+InputMemory::InputMemory(uint32_t format, const vector<MemoryUnit> &units)
+    : InputCallback(format), units(units), index(0) {}
+
+InputMemory::InputMemory(uint32_t format, size_t width, size_t height,
+                         size_t strideAlign, const vector<MemoryUnit> &units)
+    : InputCallback(format, width, height, strideAlign),
+      units(units),
+      index(0) {}
+
+bool InputMemory::next(MemoryUnit &unit) {
+  if (index >= units.size()) {
+    return false;
+  }
+
+  unit = units[index++];
+  return true;
+}
+
+InputList::InputList(const char *path) {
+  struct stat st;
+
+  if (stat(path, &st) != 0) {
+    throw Exception("Failed to open input list. path=%s.", path);
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+
+    if (dir == NULL) {
+      throw Exception("Failed to open input directory. path=%s.", path);
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+      string file = string(path) + "/" + entry->d_name;
+
+      if (stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        paths.push_back(file);
+      }
+    }
+
+    closedir(dir);
+    sort(paths.begin(), paths.end());
+  } else {
+    ifstream is(path);
+    string line;
+
+    while (getline(is, line)) {
+      if (!line.empty() && line[0] != '#') {
+        paths.push_back(line);
+      }
+    }
+  }
+
+  if (paths.empty()) {
+    throw Exception("No inputs in list. path=%s.", path);
+  }
+}
+
+string InputList::getOutput(size_t i, const char *dir,
+                            const char *extension) const {
+  size_t slash = paths[i].rfind('/');
+  string name = slash == string::npos ? paths[i] : paths[i].substr(slash + 1);
+
+  return string(dir) + "/" + name + "." + extension;
+}
+
+InputStills::InputStills(const InputList &list, uint32_t format,
+                         size_t width, size_t height, size_t strideAlign)
+    : Input(format, false, width, height, strideAlign),
+      list(list),
+      index(0),
+      raw(width != 0 && height != 0),
+      nplanes(0) {
+  if (raw) {
+    Codec::getSize(format, width, height, strideAlign, nplanes, stride, size);
+  }
+}
+
+void InputStills::prepare(Buffer &buf) {
+  PlaneView iov = buf.getImageSize();
+  size_t still = index++;
+  const string &path = list[still];
+  ifstream is(path.c_str(), ios::binary);
+
+  if (!is) {
+    throw Exception("Failed to open still. path=%s.", path.c_str());
+  }
+
+  if (raw) {
+    if (nplanes != iov.size()) {
+      throw Exception("Still and buffer have different number of planes.");
+    }
+
+    for (size_t i = 0; i < nplanes; ++i) {
+      if (size[i] > iov[i].iov_len) {
+        throw Exception("Still plane is larger than buffer plane. plane=%zu.",
+                        i);
+      }
+
+      is.read(static_cast<char *>(iov[i].iov_base), size[i]);
+      iov[i].iov_len = is.gcount();
+    }
+  } else {
+    is.seekg(0, ios::end);
+    size_t length = is.tellg();
+    is.seekg(0, ios::beg);
+
+    if (length > iov[0].iov_len) {
+      throw Exception("Still is larger than buffer. size=%zu, buffer=%zu.",
+                      length, iov[0].iov_len);
+    }
+
+    is.read(static_cast<char *>(iov[0].iov_base), length);
+    iov[0].iov_len = is.gcount();
+    buf.setEndOfFrame(true);
+  }
+
+  buf.setBytesUsed(iov);
+
+  /* Never zero, a zero timestamp means none. */
+  buf.setTimeStamp(still + 1);
+
+  lock_guard<mutex> guard(lock);
+  prepared[buf.getBuffer().index] = still;
+}
+
+void InputStills::queued(Buffer &buf) {
+  const v4l2_buffer &b = buf.getBuffer();
+  lock_guard<mutex> guard(lock);
+  map<uint32_t, size_t>::iterator it = prepared.find(b.index);
+
+  if (it == prepared.end()) {
+    return;
+  }
+
+  stills[b.timestamp.tv_sec * 1000000ull + b.timestamp.tv_usec] = it->second;
+  prepared.erase(it);
+}
+
+bool InputStills::takeStill(uint64_t timestamp, size_t &still) {
+  lock_guard<mutex> guard(lock);
+  map<uint64_t, size_t>::iterator it = stills.find(timestamp);
+
+  if (it == stills.end()) {
+    return false;
+  }
+
+  still = it->second;
+  stills.erase(it);
+  return true;
+}
+
+Output::Output(uint32_t format) : IO(format), totalSize(0) { dir = 1; }
+
+Output::~Output() { cout << "Total size " << totalSize << endl; }
+
+void Output::prepare(Buffer &buf) { buf.clearBytesUsed(); }
 
 void Output::finalize(Buffer &buf) {
   v4l2_buffer &b = buf.getBuffer();
@@ -1749,7 +2421,7 @@ void Output::finalize(Buffer &buf) {
 
   timestamp = b.timestamp.tv_usec;
 
-  vector<iovec> iov = buf.getBytesUsed();
+  const PlaneView &iov = buf.getBytesUsed();
 
   for (size_t i = 0; i < iov.size(); ++i) {
     write(iov[i].iov_base, iov[i].iov_len);
@@ -1775,7 +2447,7 @@ OutputIVF::OutputIVF(ofstream &output, uint32_t format, uint16_t width,
 }
 
 void OutputIVF::finalize(Buffer &buf) {
-  vector<iovec> iov = buf.getBytesUsed();
+  const PlaneView &iov = buf.getBytesUsed();
   v4l2_buffer &b = buf.getBuffer();
   if (V4L2_TYPE_IS_MULTIPLANAR(b.type) && (b.length > 1) &&
       (b.flags & V4L2_BUF_FLAG_MVX_BUFFER_FRAME_PRESENT) !=
@@ -1811,7 +2483,7 @@ void OutputAFBC::prepare(Buffer &buf) {
 }
 
 void OutputAFBC::finalize(Buffer &buf) {
-  vector<iovec> iov = buf.getBytesUsed();
+  const PlaneView &iov = buf.getBytesUsed();
   v4l2_buffer &b = buf.getBuffer();
   if (V4L2_TYPE_IS_MULTIPLANAR(b.type) &&
       (b.flags & V4L2_BUF_FLAG_MVX_BUFFER_FRAME_PRESENT) !=
@@ -1831,7 +2503,7 @@ OutputAFBCInterlaced::OutputAFBCInterlaced(std::ofstream &output,
     : OutputAFBC(output, format, tiled) {}
 
 void OutputAFBCInterlaced::finalize(Buffer &buf) {
-  vector<iovec> iov = buf.getBytesUsed();
+  const PlaneView &iov = buf.getBytesUsed();
   v4l2_buffer &b = buf.getBuffer();
   if (V4L2_TYPE_IS_MULTIPLANAR(b.type) &&
       (b.flags & V4L2_BUF_FLAG_MVX_BUFFER_FRAME_PRESENT) == 0) {
@@ -1877,7 +2549,7 @@ void OutputFileWithMD5::finalize(Buffer &buf) {
   static char const slookup[] = {'0', '1', '2', '3', '4', '5', '6', '7',
                                  '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
   int i;
-  vector<iovec> iov;
+  PlaneView iov;
   v4l2_buffer &b = buf.getBuffer();
   if (V4L2_TYPE_IS_MULTIPLANAR(b.type) && (b.length > 1) &&
       ((b.flags & V4L2_BUF_FLAG_MVX_BUFFER_FRAME_PRESENT) !=
@@ -1947,18 +2619,153 @@ bool OutputFileWithMD5::checkMd5(char *cur_str_hash) {
 
 bool OutputFileWithMD5::getMd5CheckResult() { return md5_check_result; }
 
+OutputCallback::OutputCallback(uint32_t format, const Sink &sink)
+    : Output(format), sink(sink) {}
+
+void OutputCallback::finalize(Buffer &buf) {
+  v4l2_buffer &b = buf.getBuffer();
+  MemoryUnit unit;
+
+  if (V4L2_TYPE_IS_MULTIPLANAR(b.type) && (b.length > 1) &&
+      ((b.flags & V4L2_BUF_FLAG_MVX_BUFFER_FRAME_PRESENT) !=
+           V4L2_BUF_FLAG_MVX_BUFFER_FRAME_PRESENT ||
+       (b.flags & V4L2_BUF_FLAG_MVX_DECODE_ONLY) ==
+           V4L2_BUF_FLAG_MVX_DECODE_ONLY)) {
+    return;
+  }
+
+  const PlaneView &iov = buf.getBytesUsed();
+  size_t total = 0;
+  for (size_t i = 0; i < iov.size(); ++i) {
+    unit.spans[unit.count++] = iov[i];
+    total += iov[i].iov_len;
+  }
+
+  if (total == 0 && (b.flags & V4L2_BUF_FLAG_LAST) == 0) {
+    return;
+  }
+
+  unit.timestamp = b.timestamp.tv_sec * 1000000ull + b.timestamp.tv_usec;
+  unit.flags = b.flags;
+  totalSize += total;
+  deliver(unit);
+}
+
+void OutputCallback::deliver(const MemoryUnit &unit) {
+  if (sink) {
+    sink(unit);
+  }
+}
+
+OutputStills::OutputStills(uint32_t format, InputStills &input,
+                           const char *dir, const char *extension)
+    : OutputCallback(format),
+      input(input),
+      dir(dir),
+      extension(extension),
+      images(0) {}
+
+void OutputStills::deliver(const MemoryUnit &unit) {
+  if (unit.count == 0) {
+    return;
+  }
+
+  size_t total = 0;
+  for (size_t i = 0; i < unit.count; ++i) {
+    total += unit.spans[i].iov_len;
+  }
+  size_t still;
+  if (total == 0 || !input.takeStill(unit.timestamp, still)) {
+    return;
+  }
+
+  images++;
+  string path =
+      input.getList().getOutput(still, dir.c_str(), extension.c_str());
+  ofstream os(path.c_str(), ios::binary);
+  for (size_t i = 0; i < unit.count; ++i) {
+    os.write(static_cast<const char *>(unit.spans[i].iov_base),
+             unit.spans[i].iov_len);
+  }
+
+  if (!os) {
+    throw Exception("Failed to write still. path=%s.", path.c_str());
+  }
+}
+
+OutputMemory::OutputMemory(uint32_t format) : OutputCallback(format) {}
+
+void OutputMemory::deliver(const MemoryUnit &unit) {
+  Unit u = {data.size(), 0, unit.timestamp, unit.flags};
+
+  for (size_t i = 0; i < unit.count; ++i) {
+    const uint8_t *span = static_cast<const uint8_t *>(unit.spans[i].iov_base);
+    data.insert(data.end(), span, span + unit.spans[i].iov_len);
+  }
+
+  u.size = data.size() - u.offset;
+  units.push_back(u);
+}
+
+/****************************************************************************
+ * Plane layout
+ ****************************************************************************/
+
+PlaneLayout::PlaneLayout()
+    : nplanes(0), totalSize(0), alignment(1), separate(false) {
+  memset(offset, 0, sizeof(offset));
+  memset(length, 0, sizeof(length));
+}
+
+void PlaneLayout::compute(const size_t length[], size_t nplanes,
+                          size_t alignment, bool separate) {
+  if (nplanes > VIDEO_MAX_PLANES) {
+    throw Exception("Too many planes for layout. planes=%zu.", nplanes);
+  }
+
+  this->nplanes = nplanes;
+  this->alignment = alignment > 0 ? alignment : 1;
+  this->separate = separate;
+  totalSize = 0;
+
+  for (size_t i = 0; i < nplanes; ++i) {
+    this->length[i] = length[i];
+    if (separate) {
+      offset[i] = 0;
+      totalSize += length[i];
+    } else {
+      offset[i] = roundUp(totalSize, this->alignment);
+      totalSize = offset[i] + length[i];
+    }
+  }
+}
+
 /****************************************************************************
  * Buffer
  ****************************************************************************/
 
-Buffer::Buffer(const v4l2_format &format) : format(format) {
+Buffer::Buffer(const v4l2_format &format)
+    : format(format), bytesUsedValid(false) {
   isRoiCfg = false;
   qp = 0;
 }
 
-Buffer::Buffer(v4l2_buffer &buf, int fd, const v4l2_format &format)
-    : buf(buf), format(format) {
+Buffer::Buffer(v4l2_buffer &buf, int fd, const v4l2_format &format,
+               Prefault prefault, bool hugePages, size_t planeAlignment,
+               bool separatePlanes)
+    : buf(buf),
+      format(format),
+      prefault(prefault),
+      hugePages(hugePages),
+      planeAlignment(planeAlignment),
+      separatePlanes(separatePlanes),
+      mapFaults(0),
+      touchFaults(0),
+      touched(false),
+      bytesUsedValid(false) {
   memset(ptr, 0, sizeof(ptr));
+  memset(map_length, 0, sizeof(map_length));
+  memset(dma_fd, -1, sizeof(dma_fd));
   if (buf.memory == V4L2_MEMORY_DMABUF) {
     bufferAllocator = CreateDmabufHeapBufferAllocator();
   }
@@ -1969,17 +2776,40 @@ Buffer::Buffer(v4l2_buffer &buf, int fd, const v4l2_format &format)
   }
   isRoiCfg = false;
   qp = 0;
+
+  long faults = getPageFaults();
   memoryMap(fd);
+  mapFaults = getPageFaults() - faults;
+  updateImageSize();
 }
 
 Buffer::~Buffer() {
   memoryUnmap();
   if (buf.memory == V4L2_MEMORY_DMABUF && bufferAllocator != NULL) {
-    close(dma_fd);
+    for (int i = 0; i < VIDEO_MAX_PLANES; ++i) {
+      if (dma_fd[i] >= 0) {
+        close(dma_fd[i]);
+      }
+    }
     FreeDmabufHeapBufferAllocator(bufferAllocator);
   }
 }
 
+long Buffer::getPageFaults() {
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_THREAD, &usage) != 0) {
+    return 0;
+  }
+
+  return usage.ru_minflt + usage.ru_majflt;
+}
+
+void Buffer::setTouchFaults(long faults) {
+  touchFaults = faults;
+  touched = true;
+}
+
 v4l2_buffer &Buffer::getBuffer() { return buf; }
 
 const v4l2_format &Buffer::getFormat() const { return format; }
@@ -1988,29 +2818,36 @@ void Buffer::setCrop(const v4l2_crop &crop) { this->crop = crop; }
 
 const v4l2_crop &Buffer::getCrop() const { return crop; }
 
-vector<iovec> Buffer::getImageSize() const {
-  vector<iovec> iova;
+void Buffer::updateImageSize() {
+  imageSize.clear();
 
   if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
     for (unsigned int i = 0; i < buf.length; ++i) {
-      buf.m.planes[i].length = plane_length[i];
-      buf.m.planes[i].data_offset = 0;
-      iovec iov = {.iov_base = ptr[i], .iov_len = buf.m.planes[i].length};
-      iova.push_back(iov);
+      iovec iov = {.iov_base = ptr[i], .iov_len = layout.getLength(i)};
+      imageSize.push_back(iov);
     }
   } else {
     iovec iov = {.iov_base = ptr[0], .iov_len = buf.length};
-    iova.push_back(iov);
+    imageSize.push_back(iov);
+  }
+}
+
+const PlaneView &Buffer::getImageSize() const {
+  if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
+    for (unsigned int i = 0; i < buf.length; ++i) {
+      buf.m.planes[i].length = layout.getLength(i);
+      buf.m.planes[i].data_offset = 0;
+    }
+    bytesUsedValid = false;
   }
 
-  return iova;
+  return imageSize;
 }
 
-vector<iovec> Buffer::convert10Bit() {
+const PlaneView &Buffer::convert10Bit() {
   unsigned int i = 0;
   unsigned short *y, *tmp_uv, *u, *v;
   size_t y_size, uv_size;
-  vector<iovec> iova;
   v4l2_plane &y_p = buf.m.planes[0];
   y = static_cast<unsigned short *>(ptr[0]) + y_p.data_offset;
   y_size = y_p.bytesused - y_p.data_offset;
@@ -2023,34 +2860,52 @@ vector<iovec> Buffer::convert10Bit() {
   // buf.length = 3;
   iovec iov;
 
-  tmp_uv = static_cast<unsigned short *>(
-      calloc(uv_size / sizeof(short), sizeof(short)));
-  if (NULL == tmp_uv) {
+  converted.clear();
+
+  /* The scratch buffer only grows, steady state frames reuse it. */
+  if (scratch.size() < uv_size / sizeof(short)) {
+    try {
+      scratch.resize(uv_size / sizeof(short));
+    } catch (std::bad_alloc &) {
+      scratch.clear();
+    }
+  }
+
+  if (scratch.size() < uv_size / sizeof(short)) {
     memset(y, 0xcc, y_size);
     iov = {.iov_base = y, .iov_len = y_p.bytesused - y_p.data_offset};
-    iova.push_back(iov);
+    converted.push_back(iov);
   } else {
+    tmp_uv = &scratch[0];
     memcpy(tmp_uv, u, uv_size);
     memset(u, 0, uv_size);
     for (i = 0; i < y_size / sizeof(short); i++) {
       y[i] = y[i] >> 6;
     }
     iov = {.iov_base = y, .iov_len = y_p.bytesused - y_p.data_offset};
-    iova.push_back(iov);
+    converted.push_back(iov);
     for (i = 0; i < uv_size / (2 * sizeof(short)); i++) {
       u[i] = tmp_uv[2 * i] >> 6;
       v[i] = tmp_uv[2 * i + 1] >> 6;
     }
     iov = {.iov_base = u, .iov_len = (u_p.bytesused - u_p.data_offset) / 2};
-    iova.push_back(iov);
+    converted.push_back(iov);
     iov = {.iov_base = v, .iov_len = (u_p.bytesused - u_p.data_offset) / 2};
-    iova.push_back(iov);
-    free(tmp_uv);
+    converted.push_back(iov);
+  }
+  return converted;
+}
+
+const PlaneView &Buffer::getBytesUsed() const {
+  if (!bytesUsedValid) {
+    updateBytesUsed();
   }
-  return iova;
+
+  return bytesUsed;
 }
-vector<iovec> Buffer::getBytesUsed() const {
-  vector<iovec> iova;
+
+void Buffer::updateBytesUsed() const {
+  bytesUsed.clear();
 
   if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
     for (unsigned int i = 0; i < buf.length; ++i) {
@@ -2061,7 +2916,8 @@ vector<iovec> Buffer::getBytesUsed() const {
         iov = {.iov_base = static_cast<char *>(ptr[i]) + p.data_offset,
                .iov_len = p.bytesused - p.data_offset};
       } else if (buf.memory == V4L2_MEMORY_DMABUF) {
-        iov = {.iov_base = static_cast<char *>(ptr[0]) + p.data_offset,
+        void *base = layout.isSeparate() ? ptr[i] : ptr[0];
+        iov = {.iov_base = static_cast<char *>(base) + p.data_offset,
                .iov_len = p.bytesused - p.data_offset};
       }
 
@@ -2069,7 +2925,7 @@ vector<iovec> Buffer::getBytesUsed() const {
         iov.iov_len = 0;
       }
 
-      iova.push_back(iov);
+      bytesUsed.push_back(iov);
     }
   } else {
     iovec iov = {.iov_base = ptr[0], .iov_len = buf.bytesused};
@@ -2099,13 +2955,15 @@ vector<iovec> Buffer::getBytesUsed() const {
         break;
     }
 
-    iova.push_back(iov);
+    bytesUsed.push_back(iov);
   }
 
-  return iova;
+  bytesUsedValid = true;
 }
 
-void Buffer::setBytesUsed(vector<iovec> &iov) {
+void Buffer::setBytesUsed(const PlaneView &iov) {
+  bytesUsedValid = false;
+
   if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
     if (iov.size() > buf.length) {
       throw Exception(
@@ -2118,11 +2976,11 @@ void Buffer::setBytesUsed(vector<iovec> &iov) {
     for (i = 0; i < iov.size(); ++i) {
       buf.m.planes[i].bytesused = iov[i].iov_len;
       if (buf.memory == V4L2_MEMORY_DMABUF) {
-        buf.m.planes[i].m.fd = dma_fd;
+        buf.m.planes[i].m.fd = getDmabufFd(i);
         if (buf.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE &&
             iov[i].iov_len != 0) {
-          buf.m.planes[i].data_offset = plane_offset[i];
-          buf.m.planes[i].bytesused += plane_offset[i];
+          buf.m.planes[i].data_offset = layout.getOffset(i);
+          buf.m.planes[i].bytesused += layout.getOffset(i);
           buf.m.planes[i].length = buf.m.planes[i].bytesused;
         }
       } else if (buf.memory == V4L2_MEMORY_USERPTR) {
@@ -2144,7 +3002,7 @@ void Buffer::setBytesUsed(vector<iovec> &iov) {
       }
 
       if (buf.memory == V4L2_MEMORY_DMABUF) {
-        buf.m.fd = dma_fd;
+        buf.m.fd = getDmabufFd(0);
       } else if (buf.memory == V4L2_MEMORY_USERPTR) {
         buf.m.userptr = (unsigned long)(iov[i].iov_base);
       }
@@ -2153,11 +3011,13 @@ void Buffer::setBytesUsed(vector<iovec> &iov) {
 }
 
 void Buffer::clearBytesUsed() {
+  bytesUsedValid = false;
+
   if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
     for (size_t i = 0; i < buf.length; ++i) {
       buf.m.planes[i].bytesused = 0;
       if (buf.memory == V4L2_MEMORY_DMABUF) {
-        buf.m.planes[i].m.fd = dma_fd;
+        buf.m.planes[i].m.fd = getDmabufFd(i);
         buf.m.planes[i].data_offset = 0;
       } else if (buf.memory == V4L2_MEMORY_USERPTR) {
         buf.m.planes[i].m.userptr = (unsigned long)ptr[i];
@@ -2167,7 +3027,7 @@ void Buffer::clearBytesUsed() {
   } else {
     buf.bytesused = 0;
     if (buf.memory == V4L2_MEMORY_DMABUF) {
-      buf.m.fd = dma_fd;
+      buf.m.fd = getDmabufFd(0);
     } else if (buf.memory == V4L2_MEMORY_USERPTR) {
       buf.m.userptr = (unsigned long)ptr[0];
     }
@@ -2181,7 +3041,7 @@ void Buffer::setCodecConfig(bool codecConfig) {
   buf.flags |= codecConfig ? V4L2_BUF_FLAG_MVX_CODEC_CONFIG : 0;
 }
 
-void Buffer::setTimeStamp(unsigned int timeUs) {
+void Buffer::setTimeStamp(uint64_t timeUs) {
   buf.flags |= V4L2_BUF_FLAG_TIMESTAMP_COPY;
   buf.timestamp.tv_sec = timeUs / 1000000;
   buf.timestamp.tv_usec = timeUs % 1000000;
@@ -2273,6 +3133,7 @@ void Buffer::setEPRflag() {
 
 void Buffer::update(v4l2_buffer &b) {
   buf = b;
+  bytesUsedValid = false;
 
   if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
     buf.m.planes = planes;
@@ -2282,85 +3143,163 @@ void Buffer::update(v4l2_buffer &b) {
   }
 }
 
+void *Buffer::mapAnonymous(size_t length, size_t &mapped) {
+  void *p = MAP_FAILED;
+
+  if (hugePages) {
+    /*
+     * Explicit huge pages need a reserved pool, fall back to THP if empty.
+     * The mappings stay MAP_SHARED like the small page ones.
+     */
+    mapped = roundUp(length, getHugePageSize());
+    p = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB |
+                 (prefault == PREFAULT_POPULATE ? MAP_POPULATE : 0),
+             -1, 0);
+    if (p != MAP_FAILED) {
+      return p;
+    }
+
+    p = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      return p;
+    }
+
+    madvise(p, mapped, MADV_HUGEPAGE);
+    if (prefault == PREFAULT_POPULATE) {
+      touchPages(p, mapped);
+    }
+    return p;
+  }
+
+  mapped = length;
+  return mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS |
+                  (prefault == PREFAULT_POPULATE ? MAP_POPULATE : 0),
+              -1, 0);
+}
+
+void Buffer::touchPages(void *p, size_t length) {
+  volatile char *c = static_cast<volatile char *>(p);
+  long pageSize = sysconf(_SC_PAGESIZE);
+
+  for (size_t i = 0; i < length; i += pageSize) {
+    c[i] = 0;
+  }
+}
+
+void Buffer::mapDmabuf(unsigned int plane, size_t length) {
+  bool cpu_access_need = true;
+
+  dma_fd[plane] =
+      DmabufHeapAllocSystem(bufferAllocator, cpu_access_need, length, 0, 0);
+  if (dma_fd[plane] < 0) {
+    throw Exception("Failed to allocate dmabuf. size=%zu.", length);
+  }
+
+  ptr[plane] = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | (prefault == PREFAULT_POPULATE ? MAP_POPULATE
+                                                                : 0),
+                    dma_fd[plane], 0);
+  if (ptr[plane] == MAP_FAILED) {
+    ptr[plane] = 0;
+    throw Exception("Failed to mmap dmabuf. size=%zu.", length);
+  }
+  map_length[plane] = length;
+}
+
+int Buffer::getDmabufFd(unsigned int plane) const {
+  return dma_fd[layout.isSeparate() ? plane : 0];
+}
+
 void Buffer::memoryMap(int fd) {
+  int populate = prefault == PREFAULT_POPULATE ? MAP_POPULATE : 0;
+
   if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
+    size_t length[VIDEO_MAX_PLANES];
+
+    for (uint32_t i = 0; i < buf.length; ++i) {
+      length[i] = buf.m.planes[i].length;
+    }
+
+    /* Only dmabuf planes can share one allocation. */
+    if (buf.memory == V4L2_MEMORY_DMABUF && !separatePlanes) {
+      layout.compute(length, buf.length, planeAlignment, false);
+    } else {
+      layout.compute(length, buf.length, 1, true);
+    }
+
+    if (buf.memory == V4L2_MEMORY_DMABUF && !layout.isSeparate()) {
+      mapDmabuf(0, layout.getTotalSize());
+      if (prefault == PREFAULT_TOUCH) {
+        touchPages(ptr[0], map_length[0]);
+      }
+
+      for (uint32_t j = 1; j < buf.length; ++j) {
+        if (layout.getLength(j) > 0) {
+          ptr[j] = static_cast<char *>(ptr[0]) + layout.getOffset(j);
+        }
+      }
+
+      return;
+    }
+
     for (uint32_t i = 0; i < buf.length; ++i) {
       v4l2_plane &p = buf.m.planes[i];
 
       if (p.length > 0) {
         if (buf.memory == V4L2_MEMORY_MMAP) {
-          ptr[i] = mmap(NULL, p.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
-                        p.m.mem_offset);
+          map_length[i] = p.length;
+          ptr[i] = Device::mmap(p.length, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | populate, fd, p.m.mem_offset);
         } else if (buf.memory == V4L2_MEMORY_USERPTR) {
-          ptr[i] = mmap(NULL, p.length, PROT_READ | PROT_WRITE,
-                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+          ptr[i] = mapAnonymous(p.length, map_length[i]);
+        } else if (buf.memory == V4L2_MEMORY_DMABUF) {
+          mapDmabuf(i, p.length);
         }
         if (ptr[i] == MAP_FAILED) {
+          ptr[i] = 0;
           throw Exception("Failed to mmap multi memory.");
         }
-        plane_length[i] = p.length;
-        total_length += p.length;
-      }
-    }
-
-    if (buf.memory == V4L2_MEMORY_DMABUF) {
-      bool cpu_access_need = true;
-      dma_fd = DmabufHeapAllocSystem(bufferAllocator, cpu_access_need,
-                                     total_length, 0, 0);
-      ptr[0] = mmap(NULL, total_length, PROT_READ | PROT_WRITE, MAP_SHARED,
-                    dma_fd, 0);
-      plane_offset[0] = 0;
-
-      for (uint32_t j = 1; j < buf.length; ++j) {
-        v4l2_plane &p = buf.m.planes[j];
-        int k;
-        int offset = 0;
-        for (k = j; k > 0; k--) {
-          offset += plane_length[j - k];
-        }
-        plane_offset[j] = offset;
-        if (p.length > 0) {
-          ptr[j] = static_cast<char *>(ptr[0]) + offset;
+        if (prefault == PREFAULT_TOUCH && ptr[i] != 0) {
+          touchPages(ptr[i], map_length[i]);
         }
       }
     }
   } else {
+    size_t length = buf.length;
+
+    layout.compute(&length, 1, 1, true);
+
     if (buf.length > 0) {
       if (buf.memory == V4L2_MEMORY_MMAP) {
-        ptr[0] = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
-                      buf.m.offset);
-        if (ptr[0] == MAP_FAILED) {
-          throw Exception("Failed to mmap memory.");
-        }
+        map_length[0] = buf.length;
+        ptr[0] = Device::mmap(buf.length, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | populate, fd, buf.m.offset);
       } else if (buf.memory == V4L2_MEMORY_DMABUF) {
-        total_length = buf.length;
-        bool cpu_access_need = true;
-        dma_fd = DmabufHeapAllocSystem(bufferAllocator, cpu_access_need,
-                                       total_length, 0, 0);
-        ptr[0] = mmap(NULL, total_length, PROT_READ | PROT_WRITE, MAP_SHARED,
-                      dma_fd, 0);
+        mapDmabuf(0, buf.length);
       } else if (buf.memory == V4L2_MEMORY_USERPTR) {
-        ptr[0] = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
-                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        ptr[0] = mapAnonymous(buf.length, map_length[0]);
+      }
+
+      if (ptr[0] == MAP_FAILED) {
+        ptr[0] = 0;
+        throw Exception("Failed to mmap memory.");
+      }
+
+      if (prefault == PREFAULT_TOUCH) {
+        touchPages(ptr[0], buf.length);
       }
     }
   }
 }
 
 void Buffer::memoryUnmap() {
-  if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
-    if (buf.memory == V4L2_MEMORY_MMAP || buf.memory == V4L2_MEMORY_USERPTR) {
-      for (uint32_t i = 0; i < buf.length; ++i) {
-        if (ptr[i] != 0) {
-          munmap(ptr[i], buf.m.planes[i].length);
-        }
-      }
-    } else {
-      munmap(ptr[0], total_length);
-    }
-  } else {
-    if (ptr[0]) {
-      munmap(ptr[0], buf.length);
+  /* Planes packed into one allocation only record a length for plane 0. */
+  for (uint32_t i = 0; i < VIDEO_MAX_PLANES; ++i) {
+    if (ptr[i] != 0 && map_length[i] > 0) {
+      munmap(ptr[i], map_length[i]);
     }
   }
 }
@@ -2414,32 +3353,131 @@ void Buffer::setSuperblock(bool superblock) {
 }
 
 /****************************************************************************
- * Transcoder, decoder, encoder
+ * ControlSet
  ****************************************************************************/
 
-Codec::Codec(const char *dev, enum v4l2_buf_type inputType,
-             enum v4l2_buf_type outputType, ostream &log, bool nonblock)
-    : input(fd, inputType, log),
-      output(fd, outputType, log),
-      log(log),
-      csweo(false),
-      fps(0),
-      bps(0),
-      minqp(0),
-      maxqp(0),
-      fixedqp(0),
-      nonblock(nonblock) {
-  openDev(dev);
-  timestart_us = 0;
-  timeend_us = 0;
-  avgfps = 0;
+void ControlSet::add(uint32_t id, int32_t value, const Exception &error) {
+  v4l2_ext_control control;
+
+  /* A later write of the same control wins, in its later position. */
+  for (size_t i = 0; i < controls.size(); ++i) {
+    if (controls[i].id == id) {
+      controls.erase(controls.begin() + i);
+      errors.erase(errors.begin() + i);
+      break;
+    }
+  }
+
+  memset(&control, 0, sizeof(control));
+  control.id = id;
+  control.value = value;
+  controls.push_back(control);
+  errors.push_back(error);
+}
+
+void ControlSet::apply(int fd, ostream &log) {
+  v4l2_ext_controls ext;
+
+  if (controls.empty()) {
+    return;
+  }
+
+  memset(&ext, 0, sizeof(ext));
+  ext.which = V4L2_CTRL_WHICH_CUR_VAL;
+  ext.count = controls.size();
+  ext.controls = &controls[0];
+
+  /*
+   * TRY validates every value without touching the device. An error_idx
+   * inside the array names the control that was rejected, anything else
+   * means the driver could not say, so find out one control at a time.
+   */
+  if (-1 == Device::ioctl(fd, VIDIOC_TRY_EXT_CTRLS, &ext)) {
+    if (ext.error_idx < ext.count) {
+      Exception error = errors[ext.error_idx];
+
+      controls.clear();
+      errors.clear();
+      throw error;
+    }
+
+    applyEach(fd);
+  } else if (-1 == Device::ioctl(fd, VIDIOC_S_EXT_CTRLS, &ext)) {
+    applyEach(fd);
+  }
+
+  log << "Set controls. count=" << controls.size() << "." << endl;
+
+  controls.clear();
+  errors.clear();
+}
+
+void ControlSet::end(int fd, ostream &log) {
+  apply(fd, log);
+  open = false;
+}
+
+void ControlSet::applyEach(int fd) {
+  for (size_t i = 0; i < controls.size(); ++i) {
+    v4l2_control control;
+
+    memset(&control, 0, sizeof(control));
+    control.id = controls[i].id;
+    control.value = controls[i].value;
+
+    if (-1 == Device::ioctl(fd, VIDIOC_S_CTRL, &control)) {
+      Exception error = errors[i];
+
+      controls.clear();
+      errors.clear();
+      throw error;
+    }
+  }
+}
+
+/****************************************************************************
+ * Transcoder, decoder, encoder
+ ****************************************************************************/
+
+Codec::Codec(const char *dev, enum v4l2_buf_type inputType,
+             enum v4l2_buf_type outputType, ostream &log, bool nonblock)
+    : input(fd, inputType, log, controls),
+      output(fd, outputType, log, controls),
+      log(log),
+      csweo(false),
+      fps(0),
+      bps(0),
+      minqp(0),
+      maxqp(0),
+      fixedqp(0),
+      nonblock(nonblock),
+      configured(false),
+      stageDone(NULL),
+      scheduler(NULL),
+      watchdog(NULL),
+      watchdogTimeout(1200000),
+      lastProgress(0),
+      live(false),
+      trackLatency(false),
+      latency(NULL),
+      profiler(NULL),
+      tuneWindow(0),
+      tuneStart(0),
+      tuneInput(Port::GROWTH_DEFERRED),
+      tuneOutput(Port::GROWTH_DEFERRED),
+      tuneGrew(false) {
+  openDev(dev);
+  controls.begin();
+  timestart_us = 0;
+  timeend_us = 0;
+  avgfps = 0;
 }
 
 Codec::Codec(const char *dev, Input &input, enum v4l2_buf_type inputType,
              Output &output, enum v4l2_buf_type outputType, ostream &log,
              bool nonblock)
-    : input(fd, input, inputType, log),
-      output(fd, output, outputType, log),
+    : input(fd, input, inputType, log, controls),
+      output(fd, output, outputType, log, controls),
       log(log),
       csweo(false),
       fps(0),
@@ -2447,19 +3485,209 @@ Codec::Codec(const char *dev, Input &input, enum v4l2_buf_type inputType,
       minqp(0),
       maxqp(0),
       fixedqp(0),
-      nonblock(nonblock) {
+      nonblock(nonblock),
+      configured(false),
+      stageDone(NULL),
+      scheduler(NULL),
+      watchdog(NULL),
+      watchdogTimeout(1200000),
+      lastProgress(0),
+      live(false),
+      trackLatency(false),
+      latency(NULL),
+      profiler(NULL),
+      tuneWindow(0),
+      tuneStart(0),
+      tuneInput(Port::GROWTH_DEFERRED),
+      tuneOutput(Port::GROWTH_DEFERRED),
+      tuneGrew(false) {
   openDev(dev);
+  controls.begin();
   timestart_us = 0;
   timeend_us = 0;
   avgfps = 0;
 }
 
 Codec::~Codec() {
+  stopStages();
+  stopTimers();
+  delete latency;
   freeBuffers();
   closeDev();
 }
 
+void Codec::setMemoryType(uint32_t memory) {
+  input.setMemoryType(memory);
+  output.setMemoryType(memory);
+}
+
+void Codec::setPrefault(Buffer::Prefault prefault) {
+  input.setPrefault(prefault);
+  output.setPrefault(prefault);
+}
+
+void Codec::setHugePages(bool hugePages) {
+  input.setHugePages(hugePages);
+  output.setHugePages(hugePages);
+}
+
+void Codec::setPlaneAlignment(size_t alignment) {
+  input.setPlaneAlignment(alignment);
+  output.setPlaneAlignment(alignment);
+}
+
+void Codec::setSeparatePlanes(bool separate) {
+  input.setSeparatePlanes(separate);
+  output.setSeparatePlanes(separate);
+}
+
+void Codec::setStageScheduler(StageScheduler *scheduler) {
+  this->scheduler = scheduler;
+}
+
+void Codec::setWatchdog(int timeout) {
+  log << "setWatchdog( " << timeout << " )" << endl;
+  watchdogTimeout = timeout;
+}
+
+void Codec::setLive(bool live) {
+  log << "setLive( " << live << " )" << endl;
+  this->live = live;
+}
+
+/* Stamp frames as they are queued and measure the time to their output. */
+void Codec::setTrackLatency(bool track) {
+  log << "setTrackLatency( " << track << " )" << endl;
+  trackLatency = track;
+}
+
+void Codec::setBufferCounts(unsigned int input, unsigned int output) {
+  log << "setBufferCounts( " << input << ", " << output << " )" << endl;
+  this->input.setBufferCount(input);
+  this->output.setBufferCount(output);
+}
+
+void Codec::setAutoBuffers(unsigned int window) {
+  log << "setAutoBuffers( " << window << " )" << endl;
+  tuneWindow = window;
+  input.setAutoBuffers(window != 0);
+  output.setAutoBuffers(window != 0);
+}
+
+void Codec::setFirmwareProfiler(FirmwareProfiler *profiler) {
+  this->profiler = profiler;
+  input.setFirmwareProfiler(profiler);
+  output.setFirmwareProfiler(profiler);
+}
+
 int Codec::stream() {
+  try {
+    start();
+    runPoll();
+    finish();
+  } catch (Exception &e) {
+    cerr << "Error: " << e.what() << endl;
+    stopStages();
+    stopTimers();
+    return 1;
+  }
+
+  return 0;
+}
+
+int Codec::stream(Input &input, Output &output) {
+  if (configured && !isCompatible(input, output)) {
+    cerr << "Error: Input or output does not match the warm session."
+         << endl;
+    return 1;
+  }
+
+  setIO(input, output);
+
+  return stream();
+}
+
+void Codec::setIO(Input &input, Output &output) {
+  this->input.setIO(input);
+  this->output.setIO(output);
+}
+
+/*
+ * A warm session keeps the formats negotiated with the device, so the new IO
+ * must ask for the same. An IO without a size, like a bitstream, takes the
+ * size of the stream.
+ */
+bool Codec::isCompatible(const Input &input, const Output &output) {
+  Port *port[2] = {&this->input, &this->output};
+  const IO *io[2] = {&input, &output};
+
+  for (size_t i = 0; i < 2; ++i) {
+    const v4l2_format &format = port[i]->getFormat();
+    uint32_t pixelformat;
+    uint32_t width;
+    uint32_t height;
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(format.type)) {
+      pixelformat = format.fmt.pix_mp.pixelformat;
+      width = format.fmt.pix_mp.width;
+      height = format.fmt.pix_mp.height;
+    } else {
+      pixelformat = format.fmt.pix.pixelformat;
+      width = format.fmt.pix.width;
+      height = format.fmt.pix.height;
+    }
+
+    if (io[i]->getFormat() != pixelformat ||
+        (io[i]->getWidth() != 0 &&
+         (io[i]->getWidth() != width || io[i]->getHeight() != height)) ||
+        io[i]->getStrideAlign() != port[i]->io->getStrideAlign()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void Codec::start() {
+  /* Events already in the log belong to earlier sessions. */
+  if (profiler != NULL) {
+    profiler->open();
+  }
+
+  if (input.io->getPreload()) {
+    input.io->preloadBuffer(input.type);
+  }
+
+  if (!configured) {
+    configure();
+    configured = true;
+  } else {
+    log << "Warm start." << endl;
+    input.reset();
+    output.reset();
+    timestart_us = 0;
+    timeend_us = 0;
+    avgfps = 0;
+  }
+
+  /* Frames are stamped from the first one queued. */
+  if (live || trackLatency) {
+    delete latency;
+    latency = new LatencyTracker();
+    input.setLatencyTracker(latency);
+    output.setLatencyTracker(latency);
+  }
+
+  queueBuffers();
+  streamon();
+
+  if (!nonblock || scheduler != NULL) {
+    startStages();
+  }
+  startTimers();
+}
+
+void Codec::configure() {
   /* Set NALU. */
   if (isVPx(input.io->getFormat())) {
     input.setNALU(NALU_FORMAT_ONE_NALU_PER_BUFFER);
@@ -2476,7 +3704,6 @@ int Codec::stream() {
   }
   if ((input.io->getFormat() == V4L2_PIX_FMT_VC1_ANNEX_L) ||
       (input.io->getFormat() == V4L2_PIX_FMT_VC1_ANNEX_G)) {
-    struct v4l2_control control;
     int profile = 0xff;
 
     switch (input.io->getProfile()) {
@@ -2499,15 +3726,9 @@ int Codec::stream() {
 
     log << "VC1 decoding profile( " << profile << " )" << endl;
 
-    memset(&control, 0, sizeof(control));
-
-    control.id = V4L2_CID_MVE_VIDEO_VC1_PROFILE;
-    control.value = profile;
-
-    if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-      throw Exception("Failed to set profile=%u for fmt: %u .", profile,
-                      input.io->getFormat());
-    }
+    input.setControl(V4L2_CID_MVE_VIDEO_VC1_PROFILE, profile,
+                     Exception("Failed to set profile=%u for fmt: %u .",
+                               profile, input.io->getFormat()));
   }
 
   /* Add VPx file header. */
@@ -2515,32 +3736,113 @@ int Codec::stream() {
     output.setNALU(NALU_FORMAT_ONE_NALU_PER_BUFFER);
   }
 
-  try {
-    if (input.io->getPreload()) {
-      input.io->preloadBuffer(input.type);
-    }
+  /* Everything set up to here goes to the device in one call. */
+  controls.end(fd, log);
+
+  queryCapabilities();
+  /* enumerateFormats(); */
+  enumerateFramesizes(output.io->getFormat());
+  setFormats();
+  subscribeEvents();
+  allocateBuffers();
+}
 
-    queryCapabilities();
-    /* enumerateFormats(); */
-    enumerateFramesizes(output.io->getFormat());
-    setFormats();
-    subscribeEvents();
-    allocateBuffers();
-    queueBuffers();
-    streamon();
+static string from4cc(uint32_t format) {
+  char str[5] = {(char)(format & 0xff), (char)((format >> 8) & 0xff),
+                 (char)((format >> 16) & 0xff), (char)((format >> 24) & 0xff),
+                 '\0'};
 
-    if (nonblock) {
-      runPoll();
-    } else {
-      runThreads();
+  return str;
+}
+
+/*
+ * Results of the last stream() for a machine readable report. CPU time and
+ * peak RSS are for the whole process.
+ */
+void Codec::fillReport(ReportRecord &record) {
+  bool decode = input.type == V4L2_BUF_TYPE_VIDEO_OUTPUT;
+  const v4l2_format &raw = decode ? output.format : input.format;
+  uint64_t frames =
+      decode ? getOutputFramesProcessed() : getInputFramesProcessed();
+  struct rusage usage;
+
+  record.set("mode", decode ? "decode" : "encode");
+  record.set("input_format", from4cc(input.io->getFormat()));
+  record.set("output_format", from4cc(output.io->getFormat()));
+  if (V4L2_TYPE_IS_MULTIPLANAR(raw.type)) {
+    record.set("width", (uint64_t)raw.fmt.pix_mp.width);
+    record.set("height", (uint64_t)raw.fmt.pix_mp.height);
+  } else {
+    record.set("width", (uint64_t)raw.fmt.pix.width);
+    record.set("height", (uint64_t)raw.fmt.pix.height);
+  }
+  record.set("frames", frames);
+  record.set("wall_time_us",
+             timeend_us > timestart_us ? timeend_us - timestart_us : 0);
+  record.set("fps", (double)avgfps);
+
+  memset(&usage, 0, sizeof(usage));
+  getrusage(RUSAGE_SELF, &usage);
+  record.set("cpu_user_us", (uint64_t)usage.ru_utime.tv_sec * 1000000 +
+                                usage.ru_utime.tv_usec);
+  record.set("cpu_sys_us", (uint64_t)usage.ru_stime.tv_sec * 1000000 +
+                               usage.ru_stime.tv_usec);
+  record.set("peak_rss_kb", (uint64_t)usage.ru_maxrss);
+
+  record.set("bytes_in", input.getBytes());
+  record.set("bytes_out", output.getBytes());
+  record.set("frame_time_us", output.getFrameTimes());
+  record.set("input_buffers", (uint64_t)input.buffers.size());
+  record.set("output_buffers", (uint64_t)output.buffers.size());
+
+  const OccupancyTracker &in = input.getOccupancy();
+  const OccupancyTracker &out = output.getOccupancy();
+  record.set("input_queued_avg", in.getAverage());
+  record.set("input_queued_us", in.getTimes());
+  record.set("input_starved", in.getStalls());
+  record.set("input_starved_us", in.getStallTime());
+  record.set("input_starved_max_us", in.getLongestStall());
+  record.set("output_queued_avg", out.getAverage());
+  record.set("output_queued_us", out.getTimes());
+  record.set("output_stalled", out.getStalls());
+  record.set("output_stalled_us", out.getStallTime());
+  record.set("output_stalled_max_us", out.getLongestStall());
+
+  if (latency != NULL) {
+    record.set("dropped", latency->getDrops());
+    record.set("latency_lost", latency->getLost());
+    record.set("latency_p50_us", latency->getPercentile(50));
+    record.set("latency_p95_us", latency->getPercentile(95));
+    record.set("latency_p99_us", latency->getPercentile(99));
+    record.set("latency_max_us", latency->getPercentile(100));
+    record.set("latency_us", latency->getHistogram());
+  }
+
+  BitstreamAnalyzer *analyzer = output.getAnalyzer();
+  if (analyzer != NULL) {
+    record.set("frames_i", (uint64_t)analyzer->getFrames('I'));
+    record.set("frames_p", (uint64_t)analyzer->getFrames('P'));
+    record.set("frames_b", (uint64_t)analyzer->getFrames('B'));
+    record.set("bitrate_kbps", analyzer->getBitrate() / 1000);
+    record.set("bitrate_peak_kbps", analyzer->getPeakBitrate() / 1000);
+    record.set("qp_avg", analyzer->getAverageQp());
+    record.set("qp_min", analyzer->getMinQp());
+    record.set("qp_max", analyzer->getMaxQp());
+    if (analyzer->hasHrd()) {
+      record.set("hrd_underflows", analyzer->getUnderflows());
     }
-    streamoff();
-  } catch (Exception &e) {
-    cerr << "Error: " << e.what() << endl;
-    return 1;
   }
 
-  return 0;
+  if (profiler != NULL) {
+    FirmwareProfiler::Split avg = profiler->getAverage();
+
+    record.set("fw_events", (uint64_t)profiler->getEvents());
+    record.set("fw_ticks_per_us", profiler->getTicksPerUs());
+    record.set("fw_total_us", avg.total);
+    record.set("fw_vpu_us", avg.vpu);
+    record.set("fw_to_vpu_us", avg.toVpu);
+    record.set("fw_from_vpu_us", avg.fromVpu);
+  }
 }
 
 uint32_t Codec::to4cc(const string &str) {
@@ -2615,6 +3917,31 @@ uint32_t Codec::to4cc(const string &str) {
   return 0;
 }
 
+uint32_t Codec::toMemoryType(const string &str) {
+  if (str.compare("mmap") == 0) {
+    return V4L2_MEMORY_MMAP;
+  } else if (str.compare("userptr") == 0) {
+    return V4L2_MEMORY_USERPTR;
+  } else if (str.compare("dmabuf") == 0) {
+    return V4L2_MEMORY_DMABUF;
+  } else {
+    throw Exception("Not a valid memory type '%s'.\n", str.c_str());
+  }
+
+  return 0;
+}
+
+Buffer::Prefault Codec::toPrefault(int value) {
+  switch (value) {
+    case Buffer::PREFAULT_NONE:
+    case Buffer::PREFAULT_POPULATE:
+    case Buffer::PREFAULT_TOUCH:
+      return static_cast<Buffer::Prefault>(value);
+    default:
+      throw Exception("Not a valid prefault mode '%d'.\n", value);
+  }
+}
+
 bool Codec::isVPx(uint32_t format) {
   return format == V4L2_PIX_FMT_VP8 || format == V4L2_PIX_FMT_VP9;
 }
@@ -2631,12 +3958,17 @@ bool Codec::isAFBC(uint32_t format) {
   }
 }
 
+/* Payload bytes, bytesused of a plane includes its data_offset. */
 size_t Codec::getBytesUsed(v4l2_buffer &buf) {
   size_t size = 0;
 
   if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
     for (uint32_t i = 0; i < buf.length; ++i) {
-      size += buf.m.planes[i].bytesused;
+      v4l2_plane &p = buf.m.planes[i];
+
+      if (p.bytesused > p.data_offset) {
+        size += p.bytesused - p.data_offset;
+      }
     }
   } else {
     size = buf.bytesused;
@@ -2655,7 +3987,7 @@ void Codec::openDev(const char *dev) {
   }
 
   /* Open the video device in read/write mode. */
-  fd = open(dev, flags);
+  fd = Device::open(dev, flags);
   if (fd < 0) {
     throw Exception("Failed to open device.");
   }
@@ -2663,7 +3995,7 @@ void Codec::openDev(const char *dev) {
 
 void Codec::closeDev() {
   log << "Closing fd " << fd << "." << endl;
-  close(fd);
+  Device::close(fd);
   fd = -1;
 }
 
@@ -2672,7 +4004,7 @@ void Codec::queryCapabilities() {
   int ret;
 
   /* Query capabilities. */
-  ret = ioctl(fd, VIDIOC_QUERYCAP, &cap);
+  ret = Device::ioctl(fd, VIDIOC_QUERYCAP, &cap);
   if (ret != 0) {
     throw Exception("Failed to query for capabilities");
   }
@@ -2696,7 +4028,7 @@ void Codec::Port::enumerateFormats() {
   fmtdesc.type = type;
 
   while (1) {
-    ret = ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc);
+    ret = Device::ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc);
     if (ret != 0) {
       break;
     }
@@ -2718,7 +4050,7 @@ void Codec::enumerateFramesizes(uint32_t format) {
   frmsize.index = 0;
   frmsize.pixel_format = format;
 
-  int ret = ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize);
+  int ret = Device::ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize);
   if (ret != 0) {
     throw Exception("Failed to enumerate frame sizes. ret=%d.\n", ret);
   }
@@ -2750,7 +4082,7 @@ void Codec::enumerateFramesizes(uint32_t format) {
 const v4l2_format &Codec::Port::getFormat() {
   /* Get and print format. */
   format.type = type;
-  int ret = ioctl(fd, VIDIOC_G_FMT, &format);
+  int ret = Device::ioctl(fd, VIDIOC_G_FMT, &format);
   if (ret != 0) {
     throw Exception("Failed to get format.");
   }
@@ -2759,14 +4091,14 @@ const v4l2_format &Codec::Port::getFormat() {
 }
 
 void Codec::Port::tryFormat(v4l2_format &format) {
-  int ret = ioctl(fd, VIDIOC_TRY_FMT, &format);
+  int ret = Device::ioctl(fd, VIDIOC_TRY_FMT, &format);
   if (ret != 0) {
     throw Exception("Failed to try format.");
   }
 }
 
 void Codec::Port::setFormat(v4l2_format &format) {
-  int ret = ioctl(fd, VIDIOC_S_FMT, &format);
+  int ret = Device::ioctl(fd, VIDIOC_S_FMT, &format);
   if (ret != 0) {
     throw Exception("Failed to set format.");
   }
@@ -2867,7 +4199,7 @@ void Codec::Port::printFormat(const struct v4l2_format &format) {
 const v4l2_crop Codec::Port::getCrop() {
   v4l2_crop crop = {.type = type};
 
-  int ret = ioctl(fd, VIDIOC_G_CROP, &crop);
+  int ret = Device::ioctl(fd, VIDIOC_G_CROP, &crop);
   if (ret != 0) {
     throw Exception("Failed to get crop.");
   }
@@ -2886,7 +4218,7 @@ void Codec::Port::tryDecStopCmd(bool tryStop) { this->tryDecStop = tryStop; }
 v4l2_mvx_color_desc Codec::getColorDesc() {
   v4l2_mvx_color_desc color;
 
-  int ret = ioctl(fd, VIDIOC_G_MVX_COLORDESC, &color);
+  int ret = Device::ioctl(fd, VIDIOC_G_MVX_COLORDESC, &color);
   if (ret != 0) {
     throw Exception("Failed to get color description.");
   }
@@ -2929,7 +4261,7 @@ void Codec::subscribeEvents(uint32_t event) {
   struct v4l2_event_subscription sub = {.type = event, .id = 0};
   int ret;
 
-  ret = ioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
+  ret = Device::ioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
   if (ret != 0) {
     throw Exception("Failed to subscribe for event.");
   }
@@ -2942,7 +4274,7 @@ void Codec::unsubscribeEvents(uint32_t event) {
   int ret;
 
   sub.type = event;
-  ret = ioctl(fd, VIDIOC_UNSUBSCRIBE_EVENT, &sub);
+  ret = Device::ioctl(fd, VIDIOC_UNSUBSCRIBE_EVENT, &sub);
   if (ret != 0) {
     throw Exception("Failed to unsubscribe for event.");
   }
@@ -2957,6 +4289,32 @@ void Codec::allocateBuffers() {
   output.allocateBuffers(6);
 }
 
+/*
+ * Forget the counters and statistics of the last job of a warm session.
+ * Stream off handed every buffer back, so none are pending.
+ */
+void Codec::Port::reset() {
+  Completion completion;
+
+  while (done.pop(completion)) {
+  }
+  while (paced.pop(completion)) {
+  }
+
+  pending = 0;
+  inFlight = 0;
+  frames_processed = 0;
+  isSourceChange = false;
+  resolutionChangePending = false;
+  scheduleFrame = 0;
+  bytes = 0;
+  lastDequeue = 0;
+  tuneStalls = 0;
+  frameTimes = Histogram();
+  occupancy = OccupancyTracker();
+  occupancy.update(pending);
+}
+
 void Codec::Port::allocateBuffers(size_t count) {
   struct v4l2_requestbuffers reqbuf;
   uint32_t i;
@@ -2965,8 +4323,19 @@ void Codec::Port::allocateBuffers(size_t count) {
   /* Free existing meta buffer. */
   freeBuffers();
 
-  /* Request new buffer to be allocated. */
-  reqbuf.count = io->needDoubleCount() ? count * 2 : count;
+  /* Request new buffer to be allocated. Counts set by the user or by
+   * tuning replace the defaults, extra buffers included. */
+  size_t frames = count;
+  bool defaults = false;
+  if (count != 0 && bufferCount != 0) {
+    frames = bufferCount;
+  } else if (count != 0 && autoBuffers) {
+    frames = std::max(getBufferCount(), 1u);
+  } else {
+    defaults = true;
+  }
+
+  reqbuf.count = io->needDoubleCount() ? frames * 2 : frames;
   reqbuf.type = type;
   if (memory_type == V4L2_MEMORY_MMAP) {
     reqbuf.memory = V4L2_MEMORY_MMAP;
@@ -2975,11 +4344,11 @@ void Codec::Port::allocateBuffers(size_t count) {
   } else if (memory_type == V4L2_MEMORY_USERPTR) {
     reqbuf.memory = V4L2_MEMORY_USERPTR;
   }
-  if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE && count != 0) {
+  if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE && count != 0 && defaults) {
     reqbuf.count = reqbuf.count + OUTPUT_EXTRA_NUM_BUFFERS;
   }
 
-  ret = ioctl(fd, VIDIOC_REQBUFS, &reqbuf);
+  ret = Device::ioctl(fd, VIDIOC_REQBUFS, &reqbuf);
   if (ret != 0) {
     throw Exception("Failed to request buffers.");
   }
@@ -2990,33 +4359,50 @@ void Codec::Port::allocateBuffers(size_t count) {
 
   /* Reset number of buffers queued to driver. */
   pending = 0;
+  occupancy.update(pending);
 
   /* Query each buffer and create a new meta buffer. */
   for (i = 0; i < reqbuf.count; ++i) {
-    v4l2_buffer buf;
-    struct v4l2_plane planes[VIDEO_MAX_PLANES];
-
-    buf.type = type;
-    if (memory_type == V4L2_MEMORY_MMAP) {
-      buf.memory = V4L2_MEMORY_MMAP;
-    } else if (memory_type == V4L2_MEMORY_DMABUF) {
-      buf.memory = V4L2_MEMORY_DMABUF;
-    } else if (memory_type == V4L2_MEMORY_USERPTR) {
-      buf.memory = V4L2_MEMORY_USERPTR;
-    }
-    buf.index = i;
-    buf.length = 3;
-    buf.m.planes = planes;
+    createBuffer(i);
+  }
+}
 
-    ret = ioctl(fd, VIDIOC_QUERYBUF, &buf);
-    if (ret != 0) {
-      throw Exception("Failed to query buffer. ret=%d, errno=%d", ret, errno);
-    }
+void Codec::Port::createBuffer(uint32_t index) {
+  v4l2_buffer buf;
+  struct v4l2_plane planes[VIDEO_MAX_PLANES];
+  int ret;
+
+  buf.type = type;
+  if (memory_type == V4L2_MEMORY_MMAP) {
+    buf.memory = V4L2_MEMORY_MMAP;
+  } else if (memory_type == V4L2_MEMORY_DMABUF) {
+    buf.memory = V4L2_MEMORY_DMABUF;
+  } else if (memory_type == V4L2_MEMORY_USERPTR) {
+    buf.memory = V4L2_MEMORY_USERPTR;
+  }
+  buf.index = index;
+  buf.length = 3;
+  buf.m.planes = planes;
+
+  ret = Device::ioctl(fd, VIDIOC_QUERYBUF, &buf);
+  if (ret != 0) {
+    throw Exception("Failed to query buffer. ret=%d, errno=%d", ret, errno);
+  }
+
+  printBuffer(buf, "Query");
 
-    printBuffer(buf, "Query");
+  Buffer *buffer = new Buffer(buf, fd, format, prefault, hugePages,
+                              planeAlignment, separatePlanes);
+  buffers[buf.index] = buffer;
 
-    buffers[buf.index] = new Buffer(buf, fd, format);
+  const PlaneLayout &layout = buffer->getLayout();
+  log << "Map buffer. type=" << type << ", index=" << buf.index
+      << ", layout=" << (layout.isSeparate() ? "separate" : "packed")
+      << ", offset=[";
+  for (size_t j = 0; j < layout.getPlanes(); ++j) {
+    log << (j > 0 ? ", " : "") << layout.getOffset(j);
   }
+  log << "], faults=" << buffer->getMapFaults() << endl;
 }
 
 void Codec::freeBuffers() {
@@ -3025,6 +4411,22 @@ void Codec::freeBuffers() {
 }
 
 void Codec::Port::freeBuffers() {
+  if (!buffers.empty()) {
+    long mapFaults = 0;
+    long touchFaults = 0;
+
+    for (BufferMap::iterator it = buffers.begin(); it != buffers.end(); ++it) {
+      log << "Buffer page faults. type=" << type << ", index=" << it->first
+          << ", map=" << it->second->getMapFaults()
+          << ", first_touch=" << it->second->getTouchFaults() << endl;
+      mapFaults += it->second->getMapFaults();
+      touchFaults += it->second->getTouchFaults();
+    }
+
+    log << "Page faults. type=" << type << ", buffers=" << buffers.size()
+        << ", map=" << mapFaults << ", first_touch=" << touchFaults << endl;
+  }
+
   while (!buffers.empty()) {
     BufferMap::iterator it = buffers.begin();
     delete (it->second);
@@ -3037,7 +4439,7 @@ unsigned int Codec::Port::getBufferCount() {
 
   control.id = V4L2_TYPE_IS_OUTPUT(type) ? V4L2_CID_MIN_BUFFERS_FOR_OUTPUT
                                          : V4L2_CID_MIN_BUFFERS_FOR_CAPTURE;
-  if (-1 == ioctl(fd, VIDIOC_G_CTRL, &control)) {
+  if (-1 == Device::ioctl(fd, VIDIOC_G_CTRL, &control)) {
     throw Exception("Failed to get minimum buffers.");
   }
 
@@ -3051,41 +4453,73 @@ void Codec::queueBuffers() {
 
 void Codec::Port::queueBuffers() {
   for (BufferMap::iterator it = buffers.begin(); it != buffers.end(); ++it) {
-    Buffer &buffer = *(it->second);
-    if (!io->eof()) {
-      /* Remove vendor custom flags. */
-      buffer.resetVendorFlags();
-      io->prepare(buffer);
-      buffer.setEndOfStream(io->eof());
-      queueBuffer(buffer);
-    }
+    primeBuffer(*(it->second));
   }
 }
 
-void Codec::Port::controlFramerate() {
-  struct timeval curtime;
-  gettimeofday(&curtime, NULL);
-  uint64_t curTimestamp = curtime.tv_sec * 1000000ll + curtime.tv_usec;
-  if (lastTimestamp == 0) {
-    lastTimestamp = curTimestamp;
+/* Fill a buffer that is not queued yet and queue it. */
+void Codec::Port::primeBuffer(Buffer &buffer) {
+  if (io->eof()) {
+    return;
+  }
+
+  /* Remove vendor custom flags. */
+  buffer.resetVendorFlags();
+  TraceScope trace("prepare", getTraceCategory(), fd,
+                   buffer.getBuffer().index);
+  if (V4L2_TYPE_IS_OUTPUT(type) && !buffer.isTouched()) {
+    long faults = Buffer::getPageFaults();
+    io->prepare(buffer);
+    touchBuffer(buffer, faults);
   } else {
-    uint64_t diffTime = curTimestamp - lastTimestamp;
-    if (diffTime >= intervalTime) {
-      remainTime += diffTime - intervalTime;
-    } else if (diffTime + remainTime >= intervalTime) {
-      remainTime = diffTime + remainTime - intervalTime;
-    } else {
-      usleep(intervalTime - (diffTime + remainTime));
-      remainTime = 0;
-    }
-    gettimeofday(&curtime, NULL);
-    uint64_t sentTimestamp = curtime.tv_sec * 1000000ll + curtime.tv_usec;
-    // printf("---------queue buffer[%d]. last time: %lu us, cur time: %lu us,
-    // diffTime: %lu us, remainTime: %lu us, intervalTime: %lu
-    // us--------------\n", frames_processed, lastTimestamp/1000l,
-    // curTimestamp/1000l, diffTime, remainTime, intervalTime);
-    lastTimestamp = sentTimestamp;
+    io->prepare(buffer);
+  }
+  buffer.setEndOfStream(io->eof());
+  queueBuffer(buffer);
+}
+
+/*
+ * Add one frame's worth of buffers, with VIDIOC_CREATE_BUFS so the port
+ * keeps streaming, if the port stalled since the last call.
+ */
+Codec::Port::Growth Codec::Port::growBuffers() {
+  uint64_t stalls = occupancy.getStalls();
+  struct v4l2_create_buffers create;
+
+  /* The IO belongs to the CPU stage while it holds buffers, keep the
+   * stalls until it lets go. */
+  if ((stageDone != NULL && inFlight > 0) || resolutionChangePending) {
+    return GROWTH_DEFERRED;
+  }
+
+  bool stalled = stalls > tuneStalls;
+  tuneStalls = stalls;
+  if (!autoBuffers || !stalled || buffers.size() >= VIDEO_MAX_FRAME) {
+    return GROWTH_STABLE;
+  }
+
+  memset(&create, 0, sizeof(create));
+  create.count = io->needDoubleCount() ? 2 : 1;
+  create.memory = memory_type;
+  create.format = format;
+  if (Device::ioctl(fd, VIDIOC_CREATE_BUFS, &create) != 0 ||
+      create.count == 0) {
+    log << "Failed to create buffers. type=" << type << ", errno=" << errno
+        << "." << endl;
+    return GROWTH_STABLE;
+  }
+
+  for (uint32_t i = create.index; i < create.index + create.count; ++i) {
+    createBuffer(i);
+    primeBuffer(*buffers.at(i));
   }
+
+  /* Keep the count if the port is reallocated. */
+  bufferCount = buffers.size() / (io->needDoubleCount() ? 2 : 1);
+  log << "Grow buffers. type=" << type << ", count=" << buffers.size()
+      << ", stalls=" << stalls << "." << endl;
+
+  return GROWTH_GREW;
 }
 
 void Codec::Port::queueBuffer(Buffer &buf) {
@@ -3096,9 +4530,13 @@ void Codec::Port::queueBuffer(Buffer &buf) {
   buf.setMirror(mirror);
   buf.setDownScale(scale);
 
+  if (schedule != NULL && !buf.isGeneralBuffer() && getBytesUsed(b) != 0) {
+    applySchedule(buf);
+  }
+
   if (buf.getRoiCfgflag() && getBytesUsed(b) != 0) {
     struct v4l2_mvx_roi_regions roi = buf.getRoiCfg();
-    ret = ioctl(fd, VIDIOC_S_MVX_ROI_REGIONS, &roi);
+    ret = Device::ioctl(fd, VIDIOC_S_MVX_ROI_REGIONS, &roi);
     if (ret != 0) {
       throw Exception("Failed to queue roi param.");
     }
@@ -3106,7 +4544,7 @@ void Codec::Port::queueBuffer(Buffer &buf) {
 
   if (buf.getQPofEPR() > 0) {
     int qp = buf.getQPofEPR();
-    ret = ioctl(fd, VIDIOC_S_MVX_QP_EPR, &qp);
+    ret = Device::ioctl(fd, VIDIOC_S_MVX_QP_EPR, &qp);
     if (ret != 0) {
       throw Exception("Failed to queue roi param.");
     }
@@ -3133,12 +4571,25 @@ void Codec::Port::queueBuffer(Buffer &buf) {
     buf.setEndOfStream(true);
   }
 
+  /* Live capture time, the frame is "taken" as it is queued. */
+  if (latency != NULL && V4L2_TYPE_IS_OUTPUT(type) && getBytesUsed(b) != 0) {
+    buf.setTimeStamp(latency->capture());
+  }
+  io->queued(buf);
+
   // printBuffer(b, "->");
 
-  ret = ioctl(fd, VIDIOC_QBUF, &b);
+  ret = Device::ioctl(fd, VIDIOC_QBUF, &b);
   if (ret != 0) {
     throw Exception("Failed to queue buffer.");
   }
+  Trace::instant("QBUF", getTraceCategory(), fd, b.index);
+  if (V4L2_TYPE_IS_OUTPUT(type)) {
+    bytes += getBytesUsed(b);
+  }
+  if (profiler != NULL && V4L2_TYPE_IS_OUTPUT(type) && getBytesUsed(b) != 0) {
+    profiler->queued(b);
+  }
   if (io->getDir() == 0 && V4L2_TYPE_IS_MULTIPLANAR(b.type) &&
       !buf.isGeneralBuffer()) {
     frames_processed++;
@@ -3147,6 +4598,7 @@ void Codec::Port::queueBuffer(Buffer &buf) {
   }
 
   ++pending;
+  occupancy.update(pending);
 }
 
 Buffer &Codec::Port::dequeueBuffer() {
@@ -3165,18 +4617,39 @@ Buffer &Codec::Port::dequeueBuffer() {
   }
   buf.length = 3;
 
-  ret = ioctl(fd, VIDIOC_DQBUF, &buf);
+  ret = Device::ioctl(fd, VIDIOC_DQBUF, &buf);
   if (ret != 0) {
     throw Exception("Failed to dequeue buffer. type=%u, memory=%u", buf.type,
                     buf.memory);
   }
 
   --pending;
+  occupancy.update(pending);
+  Trace::instant("DQBUF", getTraceCategory(), fd, buf.index);
   // printBuffer(buf, "<-");
 
   Buffer &buffer = *(buffers.at(buf.index));
   buffer.update(buf);
 
+  if (latency != NULL && !V4L2_TYPE_IS_OUTPUT(type) && getBytesUsed(buf) != 0) {
+    latency->complete(buf);
+  }
+
+  if (profiler != NULL && !V4L2_TYPE_IS_OUTPUT(type) &&
+      getBytesUsed(buf) != 0) {
+    profiler->dequeued(buf);
+  }
+
+  if (!V4L2_TYPE_IS_OUTPUT(type) && getBytesUsed(buf) != 0) {
+    uint64_t now = Timer::now();
+
+    bytes += getBytesUsed(buf);
+    if (lastDequeue != 0) {
+      frameTimes.add((now - lastDequeue) / 1000);
+    }
+    lastDequeue = now;
+  }
+
   buffer.setCrop(getCrop());
 
   return buffer;
@@ -3232,7 +4705,7 @@ void Codec::streamon() {
 void Codec::Port::streamon() {
   log << "Stream on " << dec << type << endl;
 
-  int ret = ioctl(fd, VIDIOC_STREAMON, &type);
+  int ret = Device::ioctl(fd, VIDIOC_STREAMON, &type);
   if (ret != 0) {
     throw Exception("Failed to stream on.");
   }
@@ -3246,7 +4719,7 @@ void Codec::streamoff() {
 void Codec::Port::streamoff() {
   log << "Stream off " << dec << type << endl;
 
-  int ret = ioctl(fd, VIDIOC_STREAMOFF, &type);
+  int ret = Device::ioctl(fd, VIDIOC_STREAMOFF, &type);
   if (ret != 0) {
     throw Exception("Failed to stream off.");
   }
@@ -3256,12 +4729,12 @@ void Codec::Port::sendEncStopCommand() {
   v4l2_encoder_cmd cmd = {.cmd = V4L2_ENC_CMD_STOP};
 
   if (tryEncStop) {
-    if (0 != ioctl(fd, VIDIOC_TRY_ENCODER_CMD, &cmd)) {
+    if (0 != Device::ioctl(fd, VIDIOC_TRY_ENCODER_CMD, &cmd)) {
       throw Exception("Failed to send try encoder stop command.");
     }
   }
 
-  if (0 != ioctl(fd, VIDIOC_ENCODER_CMD, &cmd)) {
+  if (0 != Device::ioctl(fd, VIDIOC_ENCODER_CMD, &cmd)) {
     throw Exception("Failed to send encoding stop command.");
   }
 }
@@ -3270,12 +4743,12 @@ void Codec::Port::sendDecStopCommand() {
   v4l2_decoder_cmd cmd = {.cmd = V4L2_DEC_CMD_STOP};
 
   if (tryDecStop) {
-    if (0 != ioctl(fd, VIDIOC_TRY_DECODER_CMD, &cmd)) {
+    if (0 != Device::ioctl(fd, VIDIOC_TRY_DECODER_CMD, &cmd)) {
       throw Exception("Failed to send try decoder stop command.");
     }
   }
 
-  if (0 != ioctl(fd, VIDIOC_DECODER_CMD, &cmd)) {
+  if (0 != Device::ioctl(fd, VIDIOC_DECODER_CMD, &cmd)) {
     throw Exception("Failed to send decoding stop command.");
   }
 }
@@ -3283,71 +4756,36 @@ void Codec::Port::sendDecStopCommand() {
 void Codec::Port::setH264DecIntBufSize(uint32_t ibs) {
   log << "setH264DecIntBufSize( " << ibs << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_INTBUF_SIZE;
-  control.value = ibs;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 ibs=%u.", ibs);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_INTBUF_SIZE, ibs,
+             Exception("Failed to set H264 ibs=%u.", ibs));
 }
 
 void Codec::Port::setDecFrameReOrdering(uint32_t fro) {
   log << "setDecFrameReOrdering( " << fro << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_FRAME_REORDERING;
-  control.value = fro;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set decoding fro=%u.", fro);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_FRAME_REORDERING, fro,
+             Exception("Failed to set decoding fro=%u.", fro));
 }
 
 void Codec::Port::setDecIgnoreStreamHeaders(uint32_t ish) {
   log << "setDecIgnoreStreamHeaders( " << ish << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_IGNORE_STREAM_HEADERS;
-  control.value = ish;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set decoding ish=%u.", ish);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_IGNORE_STREAM_HEADERS, ish,
+             Exception("Failed to set decoding ish=%u.", ish));
 }
 
 void Codec::Port::setNALU(NaluFormat nalu) {
   log << "Set NALU " << nalu << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_NALU_FORMAT;
-  control.value = nalu;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set NALU. nalu=%u.", nalu);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_NALU_FORMAT, nalu,
+             Exception("Failed to set NALU. nalu=%u.", nalu));
 }
 
 void Codec::Port::setEncFramerate(uint32_t frame_rate) {
   log << "setEncFramerate( " << frame_rate << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_FRAME_RATE;
-  control.value = frame_rate;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set frame_rate=%u.", frame_rate);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_FRAME_RATE, frame_rate,
+             Exception("Failed to set frame_rate=%u.", frame_rate));
 }
 
 void Codec::Port::setEncBitrate(uint32_t bit_rate) {
@@ -3356,22 +4794,18 @@ void Codec::Port::setEncBitrate(uint32_t bit_rate) {
   if (bit_rate == 0 && rc_type == 0) {
     return;
   }
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_BITRATE;
-  control.value = bit_rate;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set bit_rate=%u.", bit_rate);
-  }
-}
+  setControl(V4L2_CID_MPEG_VIDEO_BITRATE, bit_rate,
+             Exception("Failed to set bit_rate=%u.", bit_rate));
+}
 
 void Codec::Port::setRateControl(struct v4l2_rate_control *rc) {
   log << "setRateControl( " << rc->rc_type << ",";
   log << rc->target_bitrate << "," << rc->maximum_bitrate << ")" << endl;
 
-  int ret = ioctl(fd, VIDIOC_S_MVX_RATE_CONTROL, rc);
+  /* Keep the order relative to the controls set before. */
+  controls.apply(fd, log);
+
+  int ret = Device::ioctl(fd, VIDIOC_S_MVX_RATE_CONTROL, rc);
   if (ret != 0) {
     throw Exception("Failed to set rate control.");
   }
@@ -3382,101 +4816,49 @@ void Codec::Port::setRateControl(struct v4l2_rate_control *rc) {
 void Codec::Port::setEncPFrames(uint32_t pframes) {
   log << "setEncPFrames( " << pframes << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_P_FRAMES;
-  control.value = pframes;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set pframes=%u.", pframes);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_P_FRAMES, pframes,
+             Exception("Failed to set pframes=%u.", pframes));
 }
 
 void Codec::Port::setEncBFrames(uint32_t bframes) {
   log << "setEncBFrames( " << bframes << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_B_FRAMES;
-  control.value = bframes;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set bframes=%u.", bframes);
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_B_FRAMES, bframes,
+             Exception("Failed to set bframes=%u.", bframes));
 }
 
 void Codec::Port::setEncSliceSpacing(uint32_t spacing) {
   log << "setEncSliceSpacing( " << spacing << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB;
-  control.value = spacing;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set slice spacing=%u.", spacing);
-  }
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE;
-  control.value = spacing != 0;
+  setControl(V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB, spacing,
+             Exception("Failed to set slice spacing=%u.", spacing));
 
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set slice mode.");
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE, spacing != 0,
+             Exception("Failed to set slice mode."));
 }
 
 void Codec::Port::setH264EncForceChroma(uint32_t fmt) {
   log << "setH264EncForceChroma( " << fmt << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_FORCE_CHROMA_FORMAT;
-  control.value = fmt;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 chroma fmt=%u.", fmt);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_FORCE_CHROMA_FORMAT, fmt,
+             Exception("Failed to set H264 chroma fmt=%u.", fmt));
 }
 
 void Codec::Port::setH264EncBitdepth(uint32_t bd) {
   log << "setH264EncBitdepth( " << bd << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_BITDEPTH_LUMA;
-  control.value = bd;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 luma bd=%u.", bd);
-  }
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_BITDEPTH_CHROMA;
-  control.value = bd;
+  setControl(V4L2_CID_MVE_VIDEO_BITDEPTH_LUMA, bd,
+             Exception("Failed to set H264 luma bd=%u.", bd));
 
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 chroma bd=%u.", bd);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_BITDEPTH_CHROMA, bd,
+             Exception("Failed to set H264 chroma bd=%u.", bd));
 }
 
 void Codec::Port::setH264EncIntraMBRefresh(uint32_t period) {
   log << "setH264EncIntraMBRefresh( " << period << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB;
-  control.value = period;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 period=%u.", period);
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB, period,
+             Exception("Failed to set H264 period=%u.", period));
 }
 
 void Codec::Port::setEncProfile(uint32_t profile) {
@@ -3498,10 +4880,9 @@ void Codec::Port::setEncProfile(uint32_t profile) {
   }
 
   if (setProfile) {
-    if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-      throw Exception("Failed to set profile=%u for fmt: %u .", profile,
-                      io->getFormat());
-    }
+    setControl(control.id, control.value,
+               Exception("Failed to set profile=%u for fmt: %u .", profile,
+                         io->getFormat()));
   } else {
     log << "Profile cannot be set for this codec" << endl;
   }
@@ -3526,10 +4907,9 @@ void Codec::Port::setEncLevel(uint32_t level) {
   }
 
   if (setLevel) {
-    if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-      throw Exception("Failed to set level=%u for fmt: %u .", level,
-                      io->getFormat());
-    }
+    setControl(control.id, control.value,
+               Exception("Failed to set level=%u for fmt: %u .", level,
+                         io->getFormat()));
   } else {
     log << "Level cannot be set for this codec" << endl;
   }
@@ -3538,293 +4918,142 @@ void Codec::Port::setEncLevel(uint32_t level) {
 void Codec::Port::setEncConstrainedIntraPred(uint32_t cip) {
   log << "setEncConstrainedIntraPred( " << cip << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_CONSTR_IPRED;
-  control.value = cip;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set encoding cip=%u.", cip);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_CONSTR_IPRED, cip,
+             Exception("Failed to set encoding cip=%u.", cip));
 }
 
 void Codec::Port::setH264EncEntropyMode(uint32_t ecm) {
   log << "setH264EncEntropyMode( " << ecm << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE;
-  control.value = ecm;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 ecm=%u.", ecm);
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE, ecm,
+             Exception("Failed to set H264 ecm=%u.", ecm));
 }
 
 void Codec::Port::setH264EncGOPType(uint32_t gop) {
   log << "setH264EncGOPType( " << gop << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_GOP_TYPE;
-  control.value = gop;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 gop=%u.", gop);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_GOP_TYPE, gop,
+             Exception("Failed to set H264 gop=%u.", gop));
 }
 
 void Codec::Port::setH264EncMinQP(uint32_t minqp) {
   log << "setH264EncMinQP( " << minqp << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_H264_MIN_QP;
-  control.value = minqp;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 minqp=%u.", minqp);
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_H264_MIN_QP, minqp,
+             Exception("Failed to set H264 minqp=%u.", minqp));
 }
 
 void Codec::Port::setH264EncMaxQP(uint32_t maxqp) {
   log << "setH264EncMaxQP( " << maxqp << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_FRAME_RC_ENABLE;
-  control.value = 1;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to enable/disable rate control.");
-  }
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_H264_MAX_QP;
-  control.value = maxqp;
+  setControl(V4L2_CID_MPEG_VIDEO_FRAME_RC_ENABLE, 1,
+             Exception("Failed to enable/disable rate control."));
 
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 maxqp=%u.", maxqp);
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_H264_MAX_QP, maxqp,
+             Exception("Failed to set H264 maxqp=%u.", maxqp));
 }
 
 void Codec::Port::setH264EncFixedQP(uint32_t fqp) {
   log << "setH264EncFixedQP( " << fqp << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP;
-  control.value = fqp;
+  setControl(V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP, fqp,
+             Exception("Failed to set H264 I frame fqp=%u.", fqp));
 
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 I frame fqp=%u.", fqp);
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP, fqp,
+             Exception("Failed to set H264 P frame fqp=%u.", fqp));
 
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP;
-  control.value = fqp;
+  setControl(V4L2_CID_MPEG_VIDEO_H264_B_FRAME_QP, fqp,
+             Exception("Failed to set H264 B frame fqp=%u.", fqp));
 
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 P frame fqp=%u.", fqp);
-  }
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_H264_B_FRAME_QP;
-  control.value = fqp;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 B frame fqp=%u.", fqp);
-  }
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_FRAME_RC_ENABLE;
-  control.value = 0;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to enable/disable rate control.");
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_FRAME_RC_ENABLE, 0,
+             Exception("Failed to enable/disable rate control."));
 }
 
 void Codec::Port::setH264EncFixedQPI(uint32_t fqp) {
   log << "setH264EncFixedQPI( " << fqp << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP;
-  control.value = fqp;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 I frame fqp=%u.", fqp);
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP, fqp,
+             Exception("Failed to set H264 I frame fqp=%u.", fqp));
 }
 
 void Codec::Port::setH264EncFixedQPP(uint32_t fqp) {
   log << "setH264EncFixedQPP( " << fqp << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP;
-  control.value = fqp;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 P frame fqp=%u.", fqp);
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP, fqp,
+             Exception("Failed to set H264 P frame fqp=%u.", fqp));
 }
 
 void Codec::Port::setH264EncFixedQPB(uint32_t fqp) {
   log << "setH264EncFixedQPB( " << fqp << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_H264_B_FRAME_QP;
-  control.value = fqp;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 B frame fqp=%u.", fqp);
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_H264_B_FRAME_QP, fqp,
+             Exception("Failed to set H264 B frame fqp=%u.", fqp));
 }
 
 void Codec::Port::setH264EncBandwidth(uint32_t bw) {
   log << "setH264EncBandwidth( " << bw << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_BANDWIDTH_LIMIT;
-  control.value = bw;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set H264 bw=%u.", bw);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_BANDWIDTH_LIMIT, bw,
+             Exception("Failed to set H264 bw=%u.", bw));
 }
 
 void Codec::Port::setHEVCEncEntropySync(uint32_t es) {
   log << "setHEVCEncEntropySync( " << es << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_ENTROPY_SYNC;
-  control.value = es;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set HEVC es=%u.", es);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_ENTROPY_SYNC, es,
+             Exception("Failed to set HEVC es=%u.", es));
 }
 
 void Codec::Port::setHEVCEncTemporalMVP(uint32_t tmvp) {
   log << "setHEVCEncTemporalMVP( " << tmvp << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_TEMPORAL_MVP;
-  control.value = tmvp;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set HEVC tmvp=%u.", tmvp);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_TEMPORAL_MVP, tmvp,
+             Exception("Failed to set HEVC tmvp=%u.", tmvp));
 }
 
 void Codec::Port::setEncStreamEscaping(uint32_t sesc) {
   log << "setEncStreamEscaping( " << sesc << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_STREAM_ESCAPING;
-  control.value = sesc;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set encoding sesc=%u.", sesc);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_STREAM_ESCAPING, sesc,
+             Exception("Failed to set encoding sesc=%u.", sesc));
 }
 
 void Codec::Port::setEncHorizontalMVSearchRange(uint32_t hmvsr) {
   log << "setEncHorizontalMVSearchRange( " << hmvsr << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_MV_H_SEARCH_RANGE;
-  control.value = hmvsr;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set encoding hmvsr=%u.", hmvsr);
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_MV_H_SEARCH_RANGE, hmvsr,
+             Exception("Failed to set encoding hmvsr=%u.", hmvsr));
 }
 
 void Codec::Port::setEncVerticalMVSearchRange(uint32_t vmvsr) {
   log << "setEncVerticalMVSearchRange( " << vmvsr << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MPEG_VIDEO_MV_V_SEARCH_RANGE;
-  control.value = vmvsr;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set encoding vmvsr=%u.", vmvsr);
-  }
+  setControl(V4L2_CID_MPEG_VIDEO_MV_V_SEARCH_RANGE, vmvsr,
+             Exception("Failed to set encoding vmvsr=%u.", vmvsr));
 }
 
 void Codec::Port::setVP9EncTileCR(uint32_t tcr) {
   log << "setVP9EncTileCR( " << tcr << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_TILE_COLS;
-  control.value = tcr;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set VP9 tile cols=%u.", tcr);
-  }
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_TILE_ROWS;
-  control.value = tcr;
+  setControl(V4L2_CID_MVE_VIDEO_TILE_COLS, tcr,
+             Exception("Failed to set VP9 tile cols=%u.", tcr));
 
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set VP9 tile rows=%u.", tcr);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_TILE_ROWS, tcr,
+             Exception("Failed to set VP9 tile rows=%u.", tcr));
 }
 
 void Codec::Port::setJPEGEncRefreshInterval(uint32_t r) {
   log << "setJPEGEncRefreshInterval( " << r << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_JPEG_RESTART_INTERVAL;
-  control.value = r;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set JPEG refresh interval=%u.", r);
-  }
+  setControl(V4L2_CID_JPEG_RESTART_INTERVAL, r,
+             Exception("Failed to set JPEG refresh interval=%u.", r));
 }
 
 void Codec::Port::setJPEGEncQuality(uint32_t q) {
   log << "setJPEGEncQuality( " << q << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_JPEG_COMPRESSION_QUALITY;
-  control.value = q;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set JPEG compression quality=%u.", q);
-  }
+  setControl(V4L2_CID_JPEG_COMPRESSION_QUALITY, q,
+             Exception("Failed to set JPEG compression quality=%u.", q));
 }
 
 void Codec::Port::setRotation(int rotation) { this->rotation = rotation; }
@@ -3840,7 +5069,9 @@ void Codec::Port::setDSLFrame(int width, int height) {
   memset(&dsl_frame, 0, sizeof(dsl_frame));
   dsl_frame.width = width;
   dsl_frame.height = height;
-  int ret = ioctl(fd, VIDIOC_S_MVX_DSL_FRAME, &dsl_frame);
+  controls.apply(fd, log);
+
+  int ret = Device::ioctl(fd, VIDIOC_S_MVX_DSL_FRAME, &dsl_frame);
   if (ret != 0) {
     throw Exception("Failed to set DSL frame width/height.");
   }
@@ -3855,7 +5086,9 @@ void Codec::Port::setDSLRatio(int hor, int ver) {
   memset(&dsl_ratio, 0, sizeof(dsl_ratio));
   dsl_ratio.hor = hor;
   dsl_ratio.ver = ver;
-  int ret = ioctl(fd, VIDIOC_S_MVX_DSL_RATIO, &dsl_ratio);
+  controls.apply(fd, log);
+
+  int ret = Device::ioctl(fd, VIDIOC_S_MVX_DSL_RATIO, &dsl_ratio);
   if (ret != 0) {
     throw Exception("Failed to set DSL frame hor/ver.");
   }
@@ -3866,7 +5099,9 @@ void Codec::Port::setDSLRatio(int hor, int ver) {
 void Codec::Port::setDSLMode(int mode) {
   log << "setDSLMode(" << mode << ")" << endl;
   int dsl_pos_mode = mode;
-  int ret = ioctl(fd, VIDIOC_S_MVX_DSL_MODE, &dsl_pos_mode);
+  controls.apply(fd, log);
+
+  int ret = Device::ioctl(fd, VIDIOC_S_MVX_DSL_MODE, &dsl_pos_mode);
   if (ret != 0) {
     throw Exception("Failed to set dsl mode.");
   }
@@ -3878,7 +5113,9 @@ void Codec::Port::setLongTermRef(uint32_t mode, uint32_t period) {
   memset(&ltr, 0, sizeof(ltr));
   ltr.mode = mode;
   ltr.period = period;
-  int ret = ioctl(fd, VIDIOC_S_MVX_LONG_TERM_REF, &ltr);
+  controls.apply(fd, log);
+
+  int ret = Device::ioctl(fd, VIDIOC_S_MVX_LONG_TERM_REF, &ltr);
   if (ret != 0) {
     throw Exception("Failed to set long term mode/period.");
   }
@@ -3887,29 +5124,15 @@ void Codec::Port::setLongTermRef(uint32_t mode, uint32_t period) {
 void Codec::Port::setFWTimeout(int timeout) {
   log << "setFWTimeout( " << timeout << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_WATCHDOG_TIMEOUT;
-  control.value = timeout;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set firmware timeout=%u.", timeout);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_WATCHDOG_TIMEOUT, timeout,
+             Exception("Failed to set firmware timeout=%u.", timeout));
 }
 
 void Codec::Port::setProfiling(int enable) {
   log << "setProfiling( " << enable << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_PROFILING;
-  control.value = enable;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set profiling=%u.", enable);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_PROFILING, enable,
+             Exception("Failed to set profiling=%u.", enable));
 }
 
 void Codec::Port::setFrameCount(int frames) { this->frames_count = frames; }
@@ -3926,64 +5149,38 @@ void Codec::Port::setFramerate(int framerate) {
 void Codec::Port::setCropLeft(int left) {
   log << "setCropLeft( " << left << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_CROP_LEFT;
-  control.value = left;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set crop left=%u.", left);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_CROP_LEFT, left,
+             Exception("Failed to set crop left=%u.", left));
 }
 
 void Codec::Port::setCropRight(int right) {
   log << "setCropRight( " << right << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_CROP_RIGHT;
-  control.value = right;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set crop right=%u.", right);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_CROP_RIGHT, right,
+             Exception("Failed to set crop right=%u.", right));
 }
 
 void Codec::Port::setCropTop(int top) {
   log << "setCropTop( " << top << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_CROP_TOP;
-  control.value = top;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set crop top=%u.", top);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_CROP_TOP, top,
+             Exception("Failed to set crop top=%u.", top));
 }
 
 void Codec::Port::setCropBottom(int bottom) {
   log << "setCropBottom( " << bottom << " )" << endl;
 
-  struct v4l2_control control;
-
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_CROP_BOTTOM;
-  control.value = bottom;
-
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set crop bottom=%u.", bottom);
-  }
+  setControl(V4L2_CID_MVE_VIDEO_CROP_BOTTOM, bottom,
+             Exception("Failed to set crop bottom=%u.", bottom));
 }
 
 void Codec::Port::setVuiColourDesc(struct v4l2_mvx_color_desc *color) {
   log << "setVuiColourDesc( " << color->content.luminance_average << ",";
   log << color->content.luminance_max << ")" << endl;
 
-  int ret = ioctl(fd, VIDIOC_S_MVX_COLORDESC, color);
+  controls.apply(fd, log);
+
+  int ret = Device::ioctl(fd, VIDIOC_S_MVX_COLORDESC, color);
   if (ret != 0) {
     throw Exception("Failed to set color description.");
   }
@@ -3994,7 +5191,9 @@ void Codec::Port::setVuiColourDesc(struct v4l2_mvx_color_desc *color) {
 void Codec::Port::setSeiUserData(struct v4l2_sei_user_data *sei_user_data) {
   log << "setSeiUserData( " << sei_user_data->user_data << ")" << endl;
 
-  int ret = ioctl(fd, VIDIOC_S_MVX_SEI_USERDATA, sei_user_data);
+  controls.apply(fd, log);
+
+  int ret = Device::ioctl(fd, VIDIOC_S_MVX_SEI_USERDATA, sei_user_data);
   if (ret != 0) {
     throw Exception("Failed to set color description.");
   }
@@ -4005,105 +5204,241 @@ void Codec::Port::setSeiUserData(struct v4l2_sei_user_data *sei_user_data) {
 void Codec::Port::setHRDBufferSize(int size) {
   log << "setHRDBufferSize( " << size << " )" << endl;
 
-  struct v4l2_control control;
+  setControl(V4L2_CID_MVE_VIDEO_HRD_BUFFER_SIZE, size,
+             Exception("Failed to set crop bottom=%u.", size));
+}
 
-  memset(&control, 0, sizeof(control));
-  control.id = V4L2_CID_MVE_VIDEO_HRD_BUFFER_SIZE;
-  control.value = size;
+void Codec::Port::setMemoryType(uint32_t memory) {
+  log << "setMemoryType( " << memory << " )" << endl;
+
+  memory_type = memory;
+}
+
+void Codec::Port::setPrefault(Buffer::Prefault prefault) {
+  log << "setPrefault( " << prefault << " )" << endl;
+
+  this->prefault = prefault;
+}
+
+void Codec::Port::setHugePages(bool hugePages) {
+  log << "setHugePages( " << hugePages << " )" << endl;
+
+  this->hugePages = hugePages;
+}
 
-  if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-    throw Exception("Failed to set crop bottom=%u.", size);
+void Codec::Port::setPlaneAlignment(size_t alignment) {
+  log << "setPlaneAlignment( " << alignment << " )" << endl;
+
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    throw Exception("Plane alignment must be a power of two. alignment=%zu.",
+                    alignment);
   }
+
+  planeAlignment = alignment;
+}
+
+void Codec::Port::setSeparatePlanes(bool separate) {
+  log << "setSeparatePlanes( " << separate << " )" << endl;
+
+  separatePlanes = separate;
 }
 
 void Codec::Port::notifySourceChange() { isSourceChange = true; }
 
 void Codec::runPoll() {
   bool eos = false;
-  struct timeval timestart, timeend;
-  uint64_t frames_processed = 0;
 
   while (!eos) {
-    struct pollfd p = {.fd = fd, .events = POLLPRI};
+    struct pollfd p[CODEC_POLL_FDS];
+    size_t nfds = getPollFds(p, CODEC_POLL_FDS);
 
-    if (input.pending > 0) {
-      p.events |= POLLOUT;
+    /* The watchdog in the poll set bounds the wait. */
+    int ret = poll(p, nfds, -1);
+
+    if (ret < 0) {
+      throw Exception("Poll returned error code.");
     }
 
-    if (output.pending > 0) {
-      p.events |= POLLIN;
+    if (ret == 0) {
+      throw Exception("Poll timed out.");
     }
 
-    int ret = poll(&p, 1, 1200000);
+    eos = handlePollFds(p, nfds);
+  }
+}
 
-    if (ret < 0) {
-      throw Exception("Poll returned error code.");
-    }
+size_t Codec::getPollFds(struct pollfd fds[], size_t max) {
+  size_t nfds = 0;
+
+  if (max < CODEC_POLL_FDS) {
+    throw Exception("Poll set too small. max=%zu.", max);
+  }
+
+  short events = POLLPRI;
 
-    if (p.revents & POLLERR) {
-      throw Exception("Poll returned error event.");
+  if (input.pending > 0) {
+    events |= POLLOUT;
+  }
+
+  /* Capture buffers stay in the driver until a reallocation completes. */
+  if (output.pending > 0 && !output.isResolutionChangePending()) {
+    events |= POLLIN;
+  }
+
+  fds[nfds].fd = fd;
+  fds[nfds].events = Device::getPollEvents(fd, events);
+  fds[nfds].revents = 0;
+  nfds++;
+
+  if (stageDone != NULL) {
+    fds[nfds].fd = stageDone->getFd();
+    fds[nfds].events = POLLIN;
+    fds[nfds].revents = 0;
+    nfds++;
+  }
+
+  int timers[3] = {input.getPacingFd(), output.getPacingFd(),
+                   watchdog != NULL ? watchdog->getFd() : -1};
+  for (size_t i = 0; i < 3; ++i) {
+    if (timers[i] >= 0) {
+      fds[nfds].fd = timers[i];
+      fds[nfds].events = POLLIN;
+      fds[nfds].revents = 0;
+      nfds++;
     }
+  }
 
-    if (ret == 0) {
-      throw Exception("Poll timed out.");
+  if (profiler != NULL && profiler->getFd() >= 0) {
+    fds[nfds].fd = profiler->getFd();
+    fds[nfds].events = POLLIN | POLLPRI;
+    fds[nfds].revents = 0;
+    nfds++;
+  }
+
+  return nfds;
+}
+
+bool Codec::handlePollFds(const struct pollfd fds[], size_t nfds) {
+  short revents = 0;
+  short stageEvents = 0;
+  short inputPacing = 0;
+  short outputPacing = 0;
+  short watchdogEvents = 0;
+  short logEvents = 0;
+  bool eos = false;
+
+  /* Match by descriptor, the caller may have reordered the set. */
+  for (size_t i = 0; i < nfds; ++i) {
+    if (fds[i].fd == fd) {
+      revents |= Device::getRevents(fd, fds[i].revents);
+    } else if (stageDone != NULL && fds[i].fd == stageDone->getFd()) {
+      stageEvents |= fds[i].revents;
+    } else if (fds[i].fd == input.getPacingFd()) {
+      inputPacing |= fds[i].revents;
+    } else if (fds[i].fd == output.getPacingFd()) {
+      outputPacing |= fds[i].revents;
+    } else if (watchdog != NULL && fds[i].fd == watchdog->getFd()) {
+      watchdogEvents |= fds[i].revents;
+    } else if (profiler != NULL && fds[i].fd == profiler->getFd()) {
+      logEvents |= fds[i].revents;
     }
+  }
+
+  if (revents & POLLERR) {
+    throw Exception("Poll returned error event.");
+  }
+
+  if (revents || stageEvents || inputPacing || outputPacing) {
+    lastProgress = Timer::now();
+  }
+  if (watchdogEvents & POLLIN) {
+    checkWatchdog();
+  }
+
+  /* Log traffic is not progress of the session. */
+  if (logEvents & (POLLIN | POLLPRI)) {
+    profiler->readLog();
+  }
+
+  if (inputPacing & POLLIN) {
+    input.handlePacing();
+  }
+  if (outputPacing & POLLIN) {
+    eos = output.handlePacing() || eos;
+  }
+
+  if (stageEvents & POLLIN) {
+    stageDone->clear();
+    input.drainStage();
+    eos = output.drainStage([this](uint64_t timestamp) {
+      if (latency == NULL) {
+        checkOutputTimestamp(timestamp);
+      }
+    }) || eos;
+    markTimeStart();
+  }
 
-    if (p.revents & POLLOUT) {
+  if (revents & POLLOUT) {
+    if (stageDone != NULL) {
+      input.submitBuffer(input.dequeueBuffer());
+    } else {
       input.handleBuffer();
     }
-    if (p.revents & POLLIN) {
-      if (csweo) {
-        log << "Changing settings while encoding." << endl;
-        if (fps != 0) {
-          output.setEncFramerate(fps);
-          fps = 0;
-        }
-        if (bps != 0) {
-          /* output.setEncBitrate(bps); */
-          output.setEncBitrate(0); /* only for coverage */
-          bps = 0;
-        }
-        /* Set maxQP before minQP, otherwise FW rejects */
-        if (maxqp != 0) {
-          output.setH264EncMaxQP(maxqp);
-          maxqp = 0;
-        }
-        if (minqp != 0) {
-          output.setH264EncMinQP(minqp);
-          minqp = 0;
-        }
-        if (fixedqp != 0) {
-          output.setH264EncFixedQP(fixedqp);
-          fixedqp = 0;
-        }
-
-        csweo = false;
+  }
+  if (revents & POLLIN) {
+    if (csweo) {
+      log << "Changing settings while encoding." << endl;
+      if (fps != 0) {
+        output.setEncFramerate(fps);
+        fps = 0;
+      }
+      if (bps != 0) {
+        /* output.setEncBitrate(bps); */
+        output.setEncBitrate(0); /* only for coverage */
+        bps = 0;
+      }
+      /* Set maxQP before minQP, otherwise FW rejects */
+      if (maxqp != 0) {
+        output.setH264EncMaxQP(maxqp);
+        maxqp = 0;
+      }
+      if (minqp != 0) {
+        output.setH264EncMinQP(minqp);
+        minqp = 0;
+      }
+      if (fixedqp != 0) {
+        output.setH264EncFixedQP(fixedqp);
+        fixedqp = 0;
       }
 
-      eos = output.handleBuffer();
-      checkOutputTimestamp(output.io->getCurTimestamp());
-      output.io->resetCurTimestamp();
+      csweo = false;
+    }
 
-      if (timestart_us == 0) {
-        if (input.type == V4L2_BUF_TYPE_VIDEO_OUTPUT &&
-            getOutputFramesProcessed() >= 1) {
-          gettimeofday(&timestart, NULL);
-          timestart_us = timestart.tv_sec * 1000000ll + timestart.tv_usec;
-          printf("-----Decoder. set timestart_us: %lu us---------\n",
-                 timestart_us);
-        } else if (input.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE &&
-                   getInputFramesProcessed() >= 1) {
-          gettimeofday(&timestart, NULL);
-          timestart_us = timestart.tv_sec * 1000000ll + timestart.tv_usec;
-          printf("-----Encoder. set timestart_us: %lu us---------\n",
-                 timestart_us);
-        }
+    if (stageDone != NULL) {
+      output.submitBuffer(output.dequeueBuffer());
+    } else {
+      eos = output.handleBuffer() || eos;
+      if (latency == NULL) {
+        checkOutputTimestamp(output.io->getCurTimestamp());
       }
+      output.io->resetCurTimestamp();
+      markTimeStart();
     }
-    if (p.revents & POLLPRI) {
-      handleEvent();
-    }
   }
+  if (revents & POLLPRI) {
+    handleEvent();
+  }
+
+  if (tuneWindow != 0 && !eos) {
+    tuneBuffers();
+  }
+
+  return eos;
+}
+
+void Codec::finish() {
+  struct timeval timeend;
+  uint64_t frames_processed = 0;
 
   gettimeofday(&timeend, NULL);
   timeend_us = timeend.tv_sec * 1000000ll + timeend.tv_usec;
@@ -4125,66 +5460,364 @@ void Codec::runPoll() {
         "%lu us.\n",
         frames_processed, timeend_us - timestart_us);
   }
+
+  stopStages();
+  stopTimers();
+
+  input.stopOccupancy();
+  output.stopOccupancy();
+  printOccupancy("input", "starved", input.getOccupancy());
+  printOccupancy("output", "stalled", output.getOccupancy());
+  /* A stream may end inside a window, only growth means it was unsettled. */
+  if (tuneWindow != 0 && tuneGrew) {
+    log << "Buffer tuning did not settle. input=" << input.buffers.size()
+        << ", output=" << output.buffers.size() << "." << endl;
+  } else if (tuneWindow != 0) {
+    log << "Buffer counts at end of stream. input=" << input.buffers.size()
+        << ", output=" << output.buffers.size() << "." << endl;
+  }
+
+  streamoff();
+
+  if (profiler != NULL) {
+    profiler->readLog();
+    profiler->close();
+  }
+}
+
+/*
+ * Every tuneWindow frames, each port that stalled during the window gets
+ * more buffers. A port that defers is asked again on the following frames
+ * until it answers, the window closes once both did. Tuning ends after a
+ * window in which neither port grew.
+ */
+void Codec::tuneBuffers() {
+  uint64_t frames = std::max(getInputFramesProcessed(),
+                             getOutputFramesProcessed());
+
+  if (frames < tuneStart + tuneWindow) {
+    return;
+  }
+
+  if (tuneInput == Port::GROWTH_DEFERRED) {
+    tuneInput = input.growBuffers();
+  }
+  if (tuneOutput == Port::GROWTH_DEFERRED) {
+    tuneOutput = output.growBuffers();
+  }
+  if (tuneInput == Port::GROWTH_DEFERRED ||
+      tuneOutput == Port::GROWTH_DEFERRED) {
+    return;
+  }
+
+  tuneStart = frames;
+  tuneGrew = tuneInput == Port::GROWTH_GREW || tuneOutput == Port::GROWTH_GREW;
+  if (!tuneGrew) {
+    log << "Buffer counts tuned. input=" << input.buffers.size()
+        << ", output=" << output.buffers.size() << ", frames=" << frames
+        << "." << endl;
+    tuneWindow = 0;
+  }
+  tuneInput = Port::GROWTH_DEFERRED;
+  tuneOutput = Port::GROWTH_DEFERRED;
+}
+
+void Codec::printOccupancy(const char *name, const char *stall,
+                           const OccupancyTracker &occupancy) {
+  std::vector<uint64_t> times = occupancy.getTimes();
+
+  log << "Occupancy. port=" << name << ", average=" << fixed
+      << setprecision(2) << occupancy.getAverage() << ", " << stall << "="
+      << occupancy.getStalls() << ", " << stall
+      << "_time=" << occupancy.getStallTime()
+      << " us, longest=" << occupancy.getLongestStall() << " us." << endl;
+  log.unsetf(ios::floatfield);
+
+  log << "  Time queued (us):";
+  for (size_t i = 0; i < times.size(); ++i) {
+    log << " " << i << (i == OCCUPANCY_LEVELS - 1 ? "+" : "") << ":"
+        << times[i];
+  }
+  log << endl;
+}
+
+void Codec::startTimers() {
+  input.startPacing();
+  output.startPacing();
+
+  /* A live source is a camera: frames come at the input port's frame rate. */
+  if (live && !input.isPaced()) {
+    throw Exception("Live mode needs a frame rate on the input port.");
+  }
+
+  if (watchdogTimeout > 0) {
+    watchdog = new Timer();
+    lastProgress = Timer::now();
+    watchdog->setRelative(watchdogTimeout * NSEC_PER_MSEC);
+  }
+}
+
+void Codec::stopTimers() {
+  input.stopPacing();
+  output.stopPacing();
+
+  if (latency != NULL && input.getLatencyTracker() != NULL) {
+    log << "Latency. frames=" << latency->getFrames()
+        << ", dropped=" << latency->getDrops()
+        << ", lost=" << latency->getLost()
+        << ", p50=" << latency->getPercentile(50)
+        << " us, p95=" << latency->getPercentile(95)
+        << " us, p99=" << latency->getPercentile(99)
+        << " us, max=" << latency->getPercentile(100) << " us." << endl;
+
+    /* Kept for fillReport(). */
+    input.setLatencyTracker(NULL);
+    output.setLatencyTracker(NULL);
+  }
+
+  delete watchdog;
+  watchdog = NULL;
+}
+
+/*
+ * The watchdog is only rearmed when it fires, for whatever is left of the
+ * timeout since the last event, so progress costs no timer updates.
+ */
+void Codec::checkWatchdog() {
+  uint64_t timeout = watchdogTimeout * NSEC_PER_MSEC;
+  uint64_t elapsed = Timer::now() - lastProgress;
+
+  watchdog->clear();
+  if (elapsed >= timeout) {
+    throw Exception("Poll timed out.");
+  }
+
+  watchdog->setRelative(timeout - elapsed);
+}
+
+void Codec::markTimeStart() {
+  struct timeval timestart;
+
+  if (timestart_us != 0) {
+    return;
+  }
+
+  if (input.type == V4L2_BUF_TYPE_VIDEO_OUTPUT &&
+      getOutputFramesProcessed() >= 1) {
+    gettimeofday(&timestart, NULL);
+    timestart_us = timestart.tv_sec * 1000000ll + timestart.tv_usec;
+    printf("-----Decoder. set timestart_us: %lu us---------\n", timestart_us);
+  } else if (input.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE &&
+             getInputFramesProcessed() >= 1) {
+    gettimeofday(&timestart, NULL);
+    timestart_us = timestart.tv_sec * 1000000ll + timestart.tv_usec;
+    printf("-----Encoder. set timestart_us: %lu us---------\n", timestart_us);
+  }
 }
 
 void Codec::checkOutputTimestamp(uint64_t timestamp) {
   if (timestamp == 0) return;
 
-  std::set<uint64_t> timestampList = input.io->timestampList;
-  std::set<uint64_t>::iterator it = timestampList.find(timestamp);
-  if (it != timestampList.end()) {
-    timestampList.erase(it);
-  } else {
+  if (!input.io->hasTimestamp(timestamp)) {
     cerr << "Incorrect timestamp: " << timestamp
          << ", don't find it in input timestamp list." << endl;
   }
 }
 
-void Codec::runThreads() {
+/*
+ * Threaded mode. The polling thread owns the device: it polls, dequeues and
+ * queues buffers, and handles events. The CPU side of each port (reading
+ * input, writing output, hashing) runs either on a stage thread per port or,
+ * when a scheduler is set, on a pool shared with other sessions. Buffers
+ * are handed over through single producer, single consumer queues, so the
+ * only state shared between threads is the queues and atomic counters.
+ */
+void Codec::startStages() {
+  stageDone = new EventNotifier();
+  try {
+    input.startStage(*stageDone, scheduler);
+    output.startStage(*stageDone, scheduler);
+  } catch (...) {
+    stopStages();
+    throw;
+  }
+}
+
+void Codec::stopStages() {
+  if (stageDone == NULL) {
+    return;
+  }
+
+  input.stopStage();
+  output.stopStage();
+  delete stageDone;
+  stageDone = NULL;
+}
+
+void Codec::Port::startStage(EventNotifier &done, StageScheduler *scheduler) {
   int ret;
-  void *retval;
 
-  ret = pthread_create(&input.tid, NULL, runThreadInput, this);
-  if (ret != 0) {
-    throw Exception("Failed to create input thread.");
+  stageDone = &done;
+  stageStop = false;
+  this->scheduler = scheduler;
+
+  /* Pooled ports run as a strand of the scheduler, see runStrand(). */
+  if (scheduler != NULL) {
+    return;
   }
 
-  ret = pthread_create(&output.tid, NULL, runThreadOutput, this);
+  workReady = new EventNotifier(false);
+
+  ret = pthread_create(&tid, NULL, runStage, this);
   if (ret != 0) {
-    throw Exception("Failed to create output thread.");
+    delete workReady;
+    workReady = NULL;
+    stageDone = NULL;
+    throw Exception("Failed to create stage thread. type=%u.", type);
+  }
+}
+
+void Codec::Port::stopStage() {
+  if (stageDone == NULL) {
+    return;
   }
 
-  pthread_join(input.tid, &retval);
-  pthread_join(output.tid, &retval);
+  stageStop = true;
+  if (scheduler != NULL) {
+    scheduler->wait(*this);
+    scheduler = NULL;
+  } else {
+    workReady->notify();
+    pthread_join(tid, NULL);
+    delete workReady;
+    workReady = NULL;
+  }
+  stageDone = NULL;
+
+  /* Drop anything left over, the buffers are reclaimed by stream off. */
+  Buffer *buffer;
+  Completion completion;
+  while (work.pop(buffer)) {
+  }
+  while (done.pop(completion)) {
+  }
+  inFlight = 0;
 }
 
-void *Codec::runThreadInput(void *arg) {
-  Codec *_this = static_cast<Codec *>(arg);
-  bool eos = false;
+void *Codec::Port::runStage(void *arg) {
+  Port *port = static_cast<Port *>(arg);
+
+  while (!port->stageStop) {
+    Buffer *buffer;
+
+    if (!port->work.pop(buffer)) {
+      port->workReady->wait();
+      continue;
+    }
 
-  while (!eos) eos = _this->input.handleBuffer();
+    port->runStageBuffer(*buffer);
+  }
 
   return NULL;
 }
 
-void *Codec::runThreadOutput(void *arg) {
-  Codec *_this = static_cast<Codec *>(arg);
+void Codec::Port::runStrand() {
+  Buffer *buffer;
+
+  while (!stageStop && work.pop(buffer)) {
+    runStageBuffer(*buffer);
+  }
+}
+
+bool Codec::Port::hasWork() { return !stageStop && !work.empty(); }
+
+void Codec::Port::runStageBuffer(Buffer &buffer) {
+  Completion completion = {&buffer, ACTION_ERROR, 0};
+
+  /* Whatever the IO throws ends the session, not the process. */
+  try {
+    completion.action = processBuffer(buffer);
+
+    /* Only this thread touches the IO, the device thread checks the copy. */
+    if (!V4L2_TYPE_IS_OUTPUT(type)) {
+      completion.timestamp = io->getCurTimestamp();
+      io->resetCurTimestamp();
+    }
+  } catch (std::exception &e) {
+    stageError = e.what();
+  } catch (...) {
+    stageError = "Unknown exception in the CPU stage.";
+  }
+
+  /* Never full, a port has fewer buffers than the queue has slots. */
+  done.push(completion);
+  stageDone->notify();
+}
+
+void Codec::Port::submitBuffer(Buffer &buffer) {
+  if (!work.push(&buffer)) {
+    throw Exception("Stage queue full. type=%u.", type);
+  }
+
+  ++inFlight;
+  if (scheduler != NULL) {
+    scheduler->submit(*this);
+  } else {
+    workReady->notify();
+  }
+}
+
+bool Codec::Port::drainStage(const TimestampCheck &check) {
+  Completion completion;
   bool eos = false;
 
-  while (!eos) eos = _this->output.handleBuffer();
+  while (done.pop(completion)) {
+    --inFlight;
+    if (check) {
+      check(completion.timestamp);
+    }
+    eos = completeBuffer(*completion.buffer, completion.action) || eos;
+  }
+
+  return eos;
+}
 
-  return NULL;
+void Codec::Port::touchBuffer(Buffer &buffer, long faults) {
+  buffer.setTouchFaults(Buffer::getPageFaults() - faults);
 }
 
 bool Codec::Port::handleBuffer() {
   Buffer &buffer = dequeueBuffer();
-  io->finalize(buffer);
+
+  return completeBuffer(buffer, processBuffer(buffer));
+}
+
+/*
+ * CPU side of a dequeued buffer. Runs on a stage thread in threaded mode, so
+ * it must not issue ioctls or log; anything touching the device is left to
+ * completeBuffer().
+ */
+Codec::Port::Action Codec::Port::processBuffer(Buffer &buffer) {
   v4l2_buffer &b = buffer.getBuffer();
-  if (io->eof()) {
-    if (tryDecStop) {
-      sendDecStopCommand();
+
+  if (analyzer != NULL && !V4L2_TYPE_IS_OUTPUT(type)) {
+    TraceScope trace("analyze", getTraceCategory(), fd, b.index);
+    const PlaneView &iov = buffer.getBytesUsed();
+    analyzer->add(&iov[0], iov.size(), b.flags);
+  }
+
+  {
+    TraceScope trace("finalize", getTraceCategory(), fd, b.index);
+    if (!V4L2_TYPE_IS_OUTPUT(type) && !buffer.isTouched()) {
+      long faults = Buffer::getPageFaults();
+      io->finalize(buffer);
+      touchBuffer(buffer, faults);
+    } else {
+      io->finalize(buffer);
     }
-    return true;
+  }
+  if (io->eof()) {
+    return ACTION_STOP;
   }
 
   /* EOS on capture port. */
@@ -4196,8 +5829,7 @@ bool Codec::Port::handleBuffer() {
       // printf("-------------dequeueBuffer yuv frames: %d-------------\n",
       // frames_processed);
     }
-    log << "Capture EOS." << endl;
-    return true;
+    return ACTION_EOS;
   }
 
   /* input source change. we should only handle this on decode
@@ -4208,10 +5840,7 @@ bool Codec::Port::handleBuffer() {
            V4L2_BUF_FLAG_MVX_BUFFER_FRAME_PRESENT) &&
       (b.flags & V4L2_BUF_FLAG_ERROR) == 0) {
     if (isSourceChange) {
-      log << "source changed. should reset output stream." << endl;
-      handleResolutionChange();
-      isSourceChange = false;
-      return false;
+      return ACTION_RESOLUTION_CHANGE;
     }
   }
 
@@ -4230,24 +5859,223 @@ bool Codec::Port::handleBuffer() {
       frames_processed >= frames_count) {
     buffer.clearBytesUsed();
     buffer.setEndOfStream(true);
-    queueBuffer(buffer);
-    return true;
+    return ACTION_QUEUE_EOS;
   } else {
+    TraceScope trace("prepare", getTraceCategory(), fd, b.index);
     io->prepare(buffer);
     buffer.setEndOfStream(io->eof());
   }
 
-  if (fps > 0 && V4L2_TYPE_IS_MULTIPLANAR(b.type)) {
-    controlFramerate();
+  return io->eof() ? ACTION_QUEUE_LAST : ACTION_QUEUE;
+}
+
+/* Device side of a dequeued buffer. Returns true when the port is done. */
+bool Codec::Port::completeBuffer(Buffer &buffer, Action action) {
+  bool frame = action == ACTION_QUEUE || action == ACTION_QUEUE_LAST;
+
+  /* Paced ports hold frames, and whatever follows them, until their slot. */
+  if (pacer != NULL && (frame || (!paced.empty() && action != ACTION_ERROR &&
+                                  action != ACTION_RESOLUTION_CHANGE))) {
+    Completion completion = {&buffer, action, 0};
+    if (!paced.push(completion)) {
+      throw Exception("Pacing queue full. type=%u.", type);
+    }
+
+    return releasePaced();
   }
 
-  queueBuffer(buffer);
+  /* Held buffers are reclaimed by the reallocation. */
+  if (action == ACTION_RESOLUTION_CHANGE) {
+    Completion completion;
+    while (paced.pop(completion)) {
+    }
+  }
 
-  if (io->eof()) {
-    sendEncStopCommand();
+  return finishBuffer(buffer, action);
+}
+
+bool Codec::Port::finishBuffer(Buffer &buffer, Action action) {
+  bool eos = false;
+
+  switch (action) {
+    case ACTION_QUEUE:
+      queueBuffer(buffer);
+      break;
+    case ACTION_QUEUE_LAST:
+      queueBuffer(buffer);
+      sendEncStopCommand();
+      break;
+    case ACTION_QUEUE_EOS:
+      queueBuffer(buffer);
+      eos = true;
+      break;
+    case ACTION_STOP:
+      if (tryDecStop) {
+        sendDecStopCommand();
+      }
+      eos = true;
+      break;
+    case ACTION_EOS:
+      log << "Capture EOS." << endl;
+      eos = true;
+      break;
+    case ACTION_RESOLUTION_CHANGE:
+      resolutionChangePending = true;
+      break;
+    case ACTION_ERROR:
+      throw Exception(stageError);
   }
 
-  return false;
+  if (eos || action == ACTION_QUEUE_LAST) {
+    occupancy.stop();
+  }
+
+  /* Wait until the stage thread has handed back every capture buffer. */
+  if (resolutionChangePending && inFlight == 0) {
+    log << "source changed. should reset output stream." << endl;
+    handleResolutionChange();
+    isSourceChange = false;
+    resolutionChangePending = false;
+  }
+
+  return eos;
+}
+
+void Codec::Port::startPacing() {
+  if (fps <= 0 || intervalTime == 0 || !V4L2_TYPE_IS_MULTIPLANAR(type)) {
+    return;
+  }
+
+  pacer = new FramePacer(intervalTime * 1000);
+}
+
+void Codec::Port::stopPacing() {
+  if (pacer == NULL) {
+    return;
+  }
+
+  log << "Pacing. type=" << type << ", frames=" << pacer->getFrames()
+      << ", interval=" << pacer->getInterval() / 1000
+      << " us, jitter avg=" << pacer->getJitterAverage() / 1000
+      << " us, max=" << pacer->getJitterMax() / 1000
+      << " us, outliers=" << pacer->getOutliers() << "." << endl;
+
+  delete pacer;
+  pacer = NULL;
+
+  Completion completion;
+  while (paced.pop(completion)) {
+  }
+}
+
+void Codec::Port::setLatencyTracker(LatencyTracker *latency) {
+  this->latency = latency;
+}
+
+void Codec::Port::setAnalyzer(BitstreamAnalyzer *analyzer) {
+  this->analyzer = analyzer;
+}
+
+void Codec::Port::setFirmwareProfiler(FirmwareProfiler *profiler) {
+  this->profiler = profiler;
+}
+
+void Codec::Port::setControl(uint32_t id, int32_t value,
+                             const Exception &error) {
+  if (controls.isOpen()) {
+    controls.add(id, value, error);
+    return;
+  }
+
+  v4l2_control control;
+
+  memset(&control, 0, sizeof(control));
+  control.id = id;
+  control.value = value;
+
+  if (-1 == Device::ioctl(fd, VIDIOC_S_CTRL, &control)) {
+    throw error;
+  }
+}
+
+void Codec::Port::setSchedule(const EncoderSchedule *schedule) {
+  this->schedule = schedule;
+  scheduleFrame = 0;
+}
+
+void Codec::Port::applySchedule(Buffer &buf) {
+  const ScheduleEntry *entry = schedule->find(scheduleFrame++);
+  v4l2_ext_control controls[SCHEDULE_MAX_CONTROLS];
+  v4l2_ext_controls ext;
+
+  if (entry == NULL) {
+    return;
+  }
+
+  memset(&ext, 0, sizeof(ext));
+  ext.which = V4L2_CTRL_WHICH_CUR_VAL;
+  ext.count = EncoderSchedule::getControls(*entry, controls);
+  ext.controls = controls;
+
+  log << "Apply schedule. frame=" << entry->frame
+      << ", controls=" << ext.count << "." << endl;
+
+  if (ext.count > 0 && -1 == Device::ioctl(fd, VIDIOC_S_EXT_CTRLS, &ext)) {
+    throw Exception("Failed to apply schedule. frame=%u, control=0x%x.",
+                    entry->frame,
+                    ext.error_idx < ext.count ? controls[ext.error_idx].id : 0);
+  }
+
+  /* ROI regions are not a control, they go with the buffer. */
+  if (entry->set & ScheduleEntry::SET_ROI) {
+    v4l2_mvx_roi_regions roi = entry->roi;
+
+    if (-1 == Device::ioctl(fd, VIDIOC_S_MVX_ROI_REGIONS, &roi)) {
+      throw Exception("Failed to apply schedule ROI. frame=%u.", entry->frame);
+    }
+    buf.setROIflag();
+  }
+}
+
+bool Codec::Port::handlePacing() {
+  pacer->clear();
+
+  return releasePaced();
+}
+
+/*
+ * Queue held buffers whose slot has come. Frames wait for the timer; EOS
+ * and stop actions follow the frame before them straight away.
+ */
+bool Codec::Port::releasePaced() {
+  Completion completion;
+  bool eos = false;
+
+  while (paced.peek(completion)) {
+    bool frame = completion.action == ACTION_QUEUE ||
+                 completion.action == ACTION_QUEUE_LAST;
+
+    if (frame && !pacer->isDue()) {
+      pacer->arm();
+      break;
+    }
+
+    paced.pop(completion);
+    if (frame) {
+      uint64_t missed = pacer->release();
+
+      /* No buffer was free for those slots, the camera dropped them. */
+      if (latency != NULL && missed > 0) {
+        for (uint64_t i = 0; i < missed; ++i) {
+          io->skipFrame();
+        }
+        latency->drop(missed);
+      }
+    }
+    eos = finishBuffer(*completion.buffer, completion.action) || eos;
+  }
+
+  return eos;
 }
 
 void Codec::Port::handleResolutionChange() {
@@ -4264,12 +6092,13 @@ bool Codec::handleEvent() {
   struct v4l2_event event;
   int ret;
 
-  ret = ioctl(fd, VIDIOC_DQEVENT, &event);
+  ret = Device::ioctl(fd, VIDIOC_DQEVENT, &event);
   if (ret != 0) {
     throw Exception("Failed to dequeue event.");
   }
 
   log << "Event. type=" << event.type << "." << endl;
+  Trace::instant("event", "device", fd, event.type);
 
   if (event.type == V4L2_EVENT_MVX_COLOR_DESC) {
     v4l2_mvx_color_desc color = getColorDesc();
@@ -4604,6 +6433,14 @@ void Encoder::setFWTimeout(int timeout) { input.setFWTimeout(timeout); }
 
 void Encoder::setProfiling(int enable) { input.setProfiling(enable); }
 
+void Encoder::setAnalyzer(BitstreamAnalyzer *analyzer) {
+  output.setAnalyzer(analyzer);
+}
+
+void Encoder::setSchedule(const EncoderSchedule *schedule) {
+  input.setSchedule(schedule);
+}
+
 Info::Info(const char *dev, ostream &log)
     : Codec(dev, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_BUF_TYPE_VIDEO_CAPTURE,
             log, true) {}
@@ -43,24 +43,38 @@
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <list>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <set>
+#include <string>
 #include <vector>
 
 #include "dmabufheap/BufferAllocatorWrapper.h"
 #include "mvx-v4l2-controls.h"
+#include "mvx_analyzer.hpp"
+#include "mvx_event_loop.hpp"
+#include "mvx_profile.hpp"
+#include "mvx_report.hpp"
+#include "mvx_roi.hpp"
+#include "mvx_schedule.hpp"
+#include "mvx_trace.hpp"
 #include "reader/parser.h"
 #include "reader/read_util.h"
 /****************************************************************************
@@ -78,27 +92,364 @@ class Exception : public std::exception {
   char msg[100];
 };
 
+/****************************************************************************
+ * Queues
+ ****************************************************************************/
+
+/*
+ * Lock-free ring buffer with exactly one producer thread and one consumer
+ * thread. The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(size_t capacity) : head(0), tail(0) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    slots.resize(size);
+    mask = size - 1;
+  }
+
+  bool push(const T &value) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask) {
+      return false;
+    }
+    slots[t & mask] = value;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &value) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = slots[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool peek(T &value) const {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = slots[h & mask];
+    return true;
+  }
+
+  bool empty() const {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
+  }
+
+ private:
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+  std::vector<T> slots;
+  size_t mask;
+};
+
+/*
+ * Counting wake-up primitive backed by an eventfd, so that it can be waited
+ * on directly or together with the device fd in poll.
+ */
+class EventNotifier {
+ public:
+  EventNotifier(bool nonblock = true);
+  ~EventNotifier();
+
+  int getFd() const { return fd; }
+  void notify();
+  void wait();
+  void clear();
+
+ private:
+  int fd;
+};
+
+/****************************************************************************
+ * Stage scheduler
+ ****************************************************************************/
+
+/*
+ * A serial stream of CPU work, for example one port of one session. The
+ * scheduler never runs a strand on two threads at once, so work queued on
+ * one strand completes in order.
+ */
+class StageStrand {
+ public:
+  StageStrand() : queued(false) {}
+  virtual ~StageStrand() {}
+
+  /* Run the work queued so far. */
+  virtual void runStrand() = 0;
+  virtual bool hasWork() = 0;
+
+ private:
+  friend class StageScheduler;
+
+  std::atomic<bool> queued;
+};
+
+/*
+ * Work-stealing pool shared by many sessions. Every worker has its own deque
+ * of ready strands; a worker that runs dry steals from the back of the
+ * others, so an idle core picks up hashing or conversion from a busy session.
+ */
+class StageScheduler {
+ public:
+  StageScheduler(size_t threads);
+  ~StageScheduler();
+
+  void submit(StageStrand &strand);
+  void wait(StageStrand &strand);
+
+ private:
+  struct Worker {
+    StageScheduler *scheduler;
+    size_t index;
+    pthread_t tid;
+    std::mutex mutex;
+    std::deque<StageStrand *> ready;
+  };
+
+  static void *runWorker(void *arg);
+  void stopWorkers(size_t running);
+  void loop(size_t index);
+  void push(size_t index, StageStrand *strand);
+  StageStrand *take(size_t index);
+
+  std::vector<Worker *> workers;
+  std::atomic<size_t> nextWorker;
+  std::atomic<size_t> nready;
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  std::condition_variable idle;
+  bool stop;
+};
+
+/****************************************************************************
+ * Timers
+ ****************************************************************************/
+
+/*
+ * One-shot CLOCK_MONOTONIC timer backed by a timerfd, so that it can be
+ * polled together with the device. Times are in nanoseconds.
+ */
+class Timer {
+ public:
+  Timer();
+  ~Timer();
+
+  int getFd() const { return fd; }
+  void setAbsolute(uint64_t time);
+  void setRelative(uint64_t delay);
+  void disarm();
+  uint64_t clear();
+
+  static uint64_t now();
+
+ private:
+  int fd;
+};
+
+/*
+ * Releases one frame per interval on an absolute schedule, so rounding does
+ * not accumulate into drift. Keeps jitter statistics of the release times.
+ */
+class FramePacer {
+ public:
+  FramePacer(uint64_t interval);
+
+  int getFd() const { return timer.getFd(); }
+  bool isDue();
+  uint64_t release();
+  void arm();
+  void clear() { timer.clear(); }
+
+  uint64_t getInterval() const { return interval; }
+  uint64_t getFrames() const { return frames; }
+  uint64_t getJitterAverage() const;
+  uint64_t getJitterMax() const { return jitterMax; }
+  uint64_t getOutliers() const { return outliers; }
+
+ private:
+  Timer timer;
+  uint64_t interval;
+  uint64_t next;
+  uint64_t last;
+  uint64_t frames;
+  uint64_t jitterSum;
+  uint64_t jitterMax;
+  uint64_t outliers;
+};
+
+/*
+ * Capture times a latency tracker keeps for frames in flight. Beyond that
+ * the oldest belong to frames that were dropped or never came back, and are
+ * forgotten.
+ */
+#define LATENCY_MAX_PENDING 256
+
+/*
+ * Glass-to-glass latency of a live session. Frames are stamped with their
+ * capture time, in microseconds since the session started, when they are
+ * queued, and matched by timestamp when they come out of the capture port.
+ */
+class LatencyTracker {
+ public:
+  LatencyTracker();
+
+  uint64_t capture();
+  void complete(const v4l2_buffer &buf);
+  void drop(uint64_t frames) { drops += frames; }
+
+  size_t getFrames() const { return latencies.size(); }
+  uint64_t getDrops() const { return drops; }
+  uint64_t getLost() const { return lost; }
+  uint64_t getPercentile(unsigned int percent);
+  const Histogram &getHistogram() const { return histogram; }
+
+ private:
+  uint64_t start;
+  std::set<uint64_t> timestampList;
+  std::vector<uint64_t> latencies;
+  Histogram histogram;
+  uint64_t drops;
+  uint64_t lost;
+};
+
+#define OCCUPANCY_LEVELS 32
+
+/*
+ * Time weighted number of buffers a port has queued to the driver. Tracking
+ * starts with the first queued buffer and stops when the port is done, so
+ * priming and draining are not counted. Time with nothing queued is a stall:
+ * on the input port the VPU has nothing left to consume, on the capture
+ * port nowhere to write to.
+ */
+class OccupancyTracker {
+ public:
+  OccupancyTracker();
+
+  void update(size_t level);
+  void stop();
+
+  std::vector<uint64_t> getTimes() const;
+  double getAverage() const;
+  uint64_t getStalls() const { return stalls; }
+  uint64_t getStallTime() const { return stallTime / 1000; }
+  uint64_t getLongestStall() const { return longestStall / 1000; }
+
+ private:
+  bool running;
+  size_t level;
+  uint64_t since;
+  uint64_t time[OCCUPANCY_LEVELS];
+  uint64_t stalls;
+  uint64_t stallTime;
+  uint64_t longestStall;
+};
+
+/****************************************************************************
+ * Plane view
+ ****************************************************************************/
+
+/*
+ * Fixed capacity list of iovecs, one per plane. Used instead of
+ * std::vector<iovec> so that the per frame path does not touch the heap.
+ */
+class PlaneView {
+ public:
+  PlaneView() : count(0) {}
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  void clear() { count = 0; }
+  void push_back(const iovec &iov) {
+    if (count >= VIDEO_MAX_PLANES) {
+      throw Exception("Plane view is full. planes=%zu.", count);
+    }
+    iova[count++] = iov;
+  }
+  iovec &operator[](size_t i) { return iova[i]; }
+  const iovec &operator[](size_t i) const { return iova[i]; }
+
+ private:
+  iovec iova[VIDEO_MAX_PLANES];
+  size_t count;
+};
+
+/****************************************************************************
+ * Plane layout
+ ****************************************************************************/
+
+#define PLANE_ALIGNMENT_CACHE_LINE 64
+#define PLANE_ALIGNMENT_PAGE 4096
+
+/*
+ * Placement of the planes of a frame buffer in memory. Planes are either
+ * packed into one allocation with the start of each plane aligned, or given
+ * one allocation each.
+ */
+class PlaneLayout {
+ public:
+  PlaneLayout();
+
+  void compute(const size_t length[], size_t nplanes, size_t alignment,
+               bool separate);
+
+  size_t getPlanes() const { return nplanes; }
+  size_t getOffset(size_t plane) const { return offset[plane]; }
+  size_t getLength(size_t plane) const { return length[plane]; }
+  size_t getTotalSize() const { return totalSize; }
+  size_t getAlignment() const { return alignment; }
+  bool isSeparate() const { return separate; }
+
+ private:
+  size_t nplanes;
+  size_t offset[VIDEO_MAX_PLANES];
+  size_t length[VIDEO_MAX_PLANES];
+  size_t totalSize;
+  size_t alignment;
+  bool separate;
+};
+
 /****************************************************************************
  * Buffer
  ****************************************************************************/
 
 class Buffer {
  public:
+  /* How mappings are faulted in when a buffer is allocated. */
+  enum Prefault {
+    PREFAULT_NONE,     /* Fault lazily on first access. */
+    PREFAULT_POPULATE, /* Map with MAP_POPULATE. */
+    PREFAULT_TOUCH     /* Write once to every page after mapping. */
+  };
+
   Buffer(const v4l2_format &format);
-  Buffer(v4l2_buffer &buf, int fd, const v4l2_format &format);
+  Buffer(v4l2_buffer &buf, int fd, const v4l2_format &format,
+         Prefault prefault = PREFAULT_NONE, bool hugePages = false,
+         size_t planeAlignment = PLANE_ALIGNMENT_CACHE_LINE,
+         bool separatePlanes = false);
   virtual ~Buffer();
 
   v4l2_buffer &getBuffer();
   const v4l2_format &getFormat() const;
   void setCrop(const v4l2_crop &crop);
   const v4l2_crop &getCrop() const;
-  std::vector<iovec> getImageSize() const;
-  std::vector<iovec> getBytesUsed() const;
-  void setBytesUsed(std::vector<iovec> &iov);
+  const PlaneView &getImageSize() const;
+  const PlaneView &getBytesUsed() const;
+  void setBytesUsed(const PlaneView &iov);
   void clearBytesUsed();
   void resetVendorFlags();
   void setCodecConfig(bool codecConfig);
-  void setTimeStamp(unsigned int timeUs);
+  void setTimeStamp(uint64_t timeUs);
   void setEndOfFrame(bool eof);
   void setEndOfStream(bool eos);
   void update(v4l2_buffer &buf);
@@ -109,7 +460,7 @@ class Buffer {
   void setMirror(int mirror);
   void setDownScale(int scale);
   void setEndOfSubFrame(bool eos);
-  std::vector<iovec> convert10Bit();
+  const PlaneView &convert10Bit();
   void setRoiCfg(struct v4l2_mvx_roi_regions roi);
   bool getRoiCfgflag() { return isRoiCfg; }
   struct v4l2_mvx_roi_regions getRoiCfg() {
@@ -124,10 +475,23 @@ class Buffer {
     return (buf.flags & V4L2_BUF_FLAG_MVX_BUFFER_EPR) ==
            V4L2_BUF_FLAG_MVX_BUFFER_EPR;
   };
+  const PlaneLayout &getLayout() const { return layout; }
+  long getMapFaults() const { return mapFaults; }
+  long getTouchFaults() const { return touchFaults; }
+  bool isTouched() const { return touched; }
+  void setTouchFaults(long faults);
+
+  static long getPageFaults();
 
  private:
   void memoryMap(int fd);
   void memoryUnmap();
+  void *mapAnonymous(size_t length, size_t &mapped);
+  void mapDmabuf(unsigned int plane, size_t length);
+  int getDmabufFd(unsigned int plane) const;
+  void touchPages(void *p, size_t length);
+  void updateImageSize();
+  void updateBytesUsed() const;
   size_t getLength(unsigned int plane);
 
   void *ptr[VIDEO_MAX_PLANES];
@@ -138,11 +502,22 @@ class Buffer {
   bool isRoiCfg;
   struct v4l2_mvx_roi_regions roi_cfg;
   int qp;
-  int dma_fd;
+  int dma_fd[VIDEO_MAX_PLANES];
   BufferAllocator *bufferAllocator;
-  int total_length;
-  int plane_offset[VIDEO_MAX_PLANES];
-  int plane_length[VIDEO_MAX_PLANES];
+  PlaneLayout layout;
+  size_t map_length[VIDEO_MAX_PLANES];
+  Prefault prefault;
+  bool hugePages;
+  size_t planeAlignment;
+  bool separatePlanes;
+  long mapFaults;
+  long touchFaults;
+  bool touched;
+  PlaneView imageSize;
+  mutable PlaneView bytesUsed;
+  mutable bool bytesUsedValid;
+  PlaneView converted;
+  std::vector<unsigned short> scratch;
 };
 
 /****************************************************************************
@@ -257,6 +632,8 @@ class IO {
 
   virtual void preloadBuffer(v4l2_buf_type type) {}
   virtual void prepare(Buffer &buf) {}
+  /* Right before the buffer is queued, with its final timestamp. */
+  virtual void queued(Buffer &buf) {}
   virtual void finalize(Buffer &buf) {}
   virtual bool eof() { return false; }
   virtual void setNaluFormat(int nalu) {}
@@ -264,6 +641,7 @@ class IO {
   virtual bool needDoubleCount() { return false; };
   virtual uint64_t getCurTimestamp() { return timestamp; }
   virtual void resetCurTimestamp() { timestamp = 0; }
+  virtual void skipFrame() {}
 
   uint32_t getFormat() const { return format; }
   uint8_t getProfile() const { return profile; }
@@ -274,6 +652,13 @@ class IO {
   bool getPreload() { return isPreload; }
   uint32_t getFrameSize() const { return frameSize; }
 
+  /*
+   * Input timestamps, looked up when the output is checked. Staged sessions
+   * add them on the input stage thread and look them up on the device thread.
+   */
+  void addTimestamp(uint64_t ts);
+  bool hasTimestamp(uint64_t ts);
+
  protected:
   uint32_t format;
   uint8_t profile;
@@ -285,6 +670,7 @@ class IO {
 
  public:
   std::set<uint64_t> timestampList;
+  std::mutex timestampLock;
   unsigned int timestamp;
   uint32_t frameSize;
 };
@@ -327,6 +713,7 @@ class InputFile : public Input {
   int naluFmt;
   uint32_t remaining_bytes;
   start_code_reader *reader;
+  std::mutex mutex;
 
  public:
   int read_pos;
@@ -374,6 +761,7 @@ class InputFileFrame : public InputFile {
                  size_t height, size_t strideAlign, bool preload = 0);
 
   virtual void prepare(Buffer &buf);
+  virtual void skipFrame();
 
  protected:
   size_t nplanes;
@@ -398,10 +786,12 @@ struct epr_config {
 
   epr_config(const size_t size = 0) {
     pic_index = 0;
+    memset(&block_configs, 0, sizeof(block_configs));
     qp.qp = 0;
     clear();
     allocate_bprf(size);
   };
+  epr_config(epr_config &&other) : epr_config() { swap(*this, other); }
   epr_config(const epr_config &other)
       : pic_index(other.pic_index),
         block_configs(other.block_configs),
@@ -446,30 +836,36 @@ struct epr_config {
   void allocate_bprf(size_t size) {
     bc_row_body_size = size;
     if (size > 0) {
-      bc_row_body._bc_row_body_data = new char[size];
+      bc_row_body._bc_row_body_data = new char[size]();
     } else {
       bc_row_body._bc_row_body_data = NULL;
     }
   };
 };
 
-typedef std::list<epr_config> v4l2_epr_list_t;
-typedef std::list<v4l2_mvx_roi_regions> v4l2_roi_list_t;
-
+/* Raw frames with per picture ROI regions, see RoiConfig for the formats. */
 class InputFileFrameWithROI : public InputFileFrame {
  public:
   InputFileFrameWithROI(std::istream &input, uint32_t format, size_t width,
                         size_t height, size_t strideAlign, std::istream &roi);
+  InputFileFrameWithROI(std::istream &input, uint32_t format, size_t width,
+                        size_t height, size_t strideAlign, const char *roi);
   virtual void prepare(Buffer &buf);
   virtual ~InputFileFrameWithROI();
 
  private:
-  void load_roi_cfg();
-  std::istream &roi_is;
-  v4l2_roi_list_t *roi_list;
+  RoiConfig config;
   unsigned int prepared_frames;
 };
 
+/* Pictures of the EPR config parsed ahead of the one being encoded. */
+#define EPR_WINDOW 2
+
+/*
+ * Raw frames with EPR buffers in between. The EPR config is read one
+ * picture at a time as the encode reaches it, and the row bodies of used
+ * pictures are recycled, so memory does not grow with the stream length.
+ */
 class InputFileFrameWithEPR : public InputFileFrame {
  public:
   InputFileFrameWithEPR(std::istream &input, uint32_t format, size_t width,
@@ -482,11 +878,16 @@ class InputFileFrameWithEPR : public InputFileFrame {
 
  private:
   std::istream &epr_is;
-  v4l2_epr_list_t *epr_list;
+  std::deque<epr_config> window;
+  std::vector<epr_config> pool;
+  std::string pending;
+  bool epr_eof;
+  unsigned int last_row;
+  size_t max_bprf_body_size;
   unsigned int prepared_frames;
-  v4l2_epr_list_t::iterator cur;
   uint32_t outformat;
-  void load_epr_cfg();
+  void fill_epr_window();
+  bool load_epr_cfg(epr_config &config);
   void read_efp_cfg(char *buf, int num_epr, struct epr_config *config);
   void read_row_cfg(char *buf, int row, int len, struct epr_config &config);
   void erp_adjust_bpr_to_64_64(
@@ -512,6 +913,125 @@ class InputFrame : public Input {
   size_t count;
 };
 
+/*
+ * An access unit or frame in application memory, as one span per plane or
+ * as a single span with the planes one after the other at the sizes
+ * Codec::getSize() gives.
+ */
+struct MemoryUnit {
+  MemoryUnit() : count(0), timestamp(0), flags(0), opaque(NULL) {}
+
+  iovec spans[VIDEO_MAX_PLANES];
+  size_t count;
+  uint64_t timestamp; /* us */
+  uint32_t flags;     /* V4L2_BUF_FLAG_*, set on output. */
+  void *opaque;       /* For the application, handed back on release. */
+};
+
+/*
+ * Input pulled from the application one unit per buffer. Bitstream units
+ * must be whole access units. The source may block; it runs on the input
+ * stage thread when stages are used. Each unit is copied straight into a
+ * device buffer and then released, so the application can reuse it.
+ */
+class InputCallback : public Input {
+ public:
+  /* Fill in the next unit. Returns false at the end of the stream. */
+  typedef std::function<bool(MemoryUnit &unit)> Source;
+  typedef std::function<void(const MemoryUnit &unit)> Release;
+
+  InputCallback(uint32_t format, const Source &source = Source(),
+                const Release &release = Release());
+  InputCallback(uint32_t format, size_t width, size_t height,
+                size_t strideAlign, const Source &source = Source(),
+                const Release &release = Release());
+
+  virtual void prepare(Buffer &buf);
+  virtual bool eof() { return iseof; }
+  virtual void setNaluFormat(int nalu) { naluFmt = nalu; }
+  virtual int getNaluFormat() { return naluFmt; }
+
+ protected:
+  virtual bool next(MemoryUnit &unit);
+  virtual void release(const MemoryUnit &unit);
+
+ private:
+  Source source;
+  Release releaseUnit;
+  bool iseof;
+  int naluFmt;
+  size_t nplanes;
+  size_t stride[3];
+  size_t size[3];
+};
+
+/* Input from units already in memory, for example a whole clip. */
+class InputMemory : public InputCallback {
+ public:
+  InputMemory(uint32_t format, const std::vector<MemoryUnit> &units);
+  InputMemory(uint32_t format, size_t width, size_t height,
+              size_t strideAlign, const std::vector<MemoryUnit> &units);
+
+ protected:
+  virtual bool next(MemoryUnit &unit);
+  virtual void release(const MemoryUnit &) {}
+
+ private:
+  std::vector<MemoryUnit> units;
+  size_t index;
+};
+
+/*
+ * Paths of many inputs for one session: the regular files of a directory,
+ * sorted by name, or the lines of a list file. Empty lines and lines
+ * starting with '#' in a list file are skipped.
+ */
+class InputList {
+ public:
+  explicit InputList(const char *path);
+
+  size_t size() const { return paths.size(); }
+  const std::string &operator[](size_t i) const { return paths[i]; }
+
+  /* The file name of input i in dir, with extension added. */
+  std::string getOutput(size_t i, const char *dir,
+                        const char *extension) const;
+
+ private:
+  std::vector<std::string> paths;
+};
+
+/*
+ * Many stills through one session, one file of an InputList per buffer, so
+ * the port stays full across image boundaries. Raw frames are read plane by
+ * plane like InputFileFrame, anything else is one image per buffer.
+ */
+class InputStills : public Input {
+ public:
+  InputStills(const InputList &list, uint32_t format, size_t width = 0,
+              size_t height = 0, size_t strideAlign = 0);
+
+  virtual void prepare(Buffer &buf);
+  virtual void queued(Buffer &buf);
+  virtual bool eof() { return index >= list.size(); }
+
+  const InputList &getList() const { return list; }
+
+  /* The entry of the buffer queued with timestamp, forgotten once found. */
+  bool takeStill(uint64_t timestamp, size_t &still);
+
+ private:
+  const InputList &list;
+  size_t index;
+  bool raw;
+  size_t nplanes;
+  size_t stride[3];
+  size_t size[3];
+  std::mutex lock;
+  std::map<uint32_t, size_t> prepared; /* Buffer index to entry. */
+  std::map<uint64_t, size_t> stills;   /* Queued timestamp to entry. */
+};
+
 class Output : public IO {
  public:
   Output(uint32_t format);
@@ -580,11 +1100,110 @@ class OutputFileWithMD5 : public OutputFile {
   std::ifstream *input_ref_md5;
   bool md5_check_result;
 };
+
+/*
+ * Output handed to the application in place. The spans point into the
+ * mapped device buffer and are only valid until the sink returns, which
+ * is on the output stage thread when stages are used. An empty unit with
+ * V4L2_BUF_FLAG_LAST marks the end of the stream.
+ */
+class OutputCallback : public Output {
+ public:
+  typedef std::function<void(const MemoryUnit &unit)> Sink;
+
+  OutputCallback(uint32_t format, const Sink &sink = Sink());
+
+  virtual void finalize(Buffer &buf);
+
+ protected:
+  virtual void deliver(const MemoryUnit &unit);
+
+ private:
+  Sink sink;
+};
+
+/*
+ * One file per image, named after the InputList entry it came from. The
+ * entry is found through the timestamp its input buffer was queued with, so
+ * images may come out in any order.
+ */
+class OutputStills : public OutputCallback {
+ public:
+  OutputStills(uint32_t format, InputStills &input, const char *dir,
+               const char *extension);
+
+  size_t getImages() const { return images; }
+
+ protected:
+  virtual void deliver(const MemoryUnit &unit);
+
+ private:
+  InputStills &input;
+  std::string dir;
+  std::string extension;
+  size_t images;
+};
+
+/* Output collected in memory, one unit after the other. */
+class OutputMemory : public OutputCallback {
+ public:
+  struct Unit {
+    size_t offset;
+    size_t size;
+    uint64_t timestamp;
+    uint32_t flags;
+  };
+
+  OutputMemory(uint32_t format);
+
+  const std::vector<uint8_t> &getData() const { return data; }
+  const std::vector<Unit> &getUnits() const { return units; }
+
+ protected:
+  virtual void deliver(const MemoryUnit &unit);
+
+ private:
+  std::vector<uint8_t> data;
+  std::vector<Unit> units;
+};
 /****************************************************************************
  * Codec, Decoder, Encoder
  ****************************************************************************/
 
-class Codec {
+/* Buffers in flight between the device thread and a CPU stage thread. */
+#define STAGE_QUEUE_SIZE 64
+
+/*
+ * Descriptors a codec polls: the device, the stage notifier, a pacing timer
+ * per port, the watchdog and the firmware log.
+ */
+#define CODEC_POLL_FDS EVENT_SOURCE_MAX_FDS
+
+/*
+ * Controls collected while a codec is being configured. They are validated
+ * with one VIDIOC_TRY_EXT_CTRLS and applied with one VIDIOC_S_EXT_CTRLS
+ * instead of a VIDIOC_S_CTRL round trip each. A failing control is reported
+ * with the error it was added with.
+ */
+class ControlSet {
+ public:
+  ControlSet() : open(false) {}
+
+  void begin() { open = true; }
+  bool isOpen() const { return open; }
+  void add(uint32_t id, int32_t value, const Exception &error);
+  void apply(int fd, std::ostream &log);
+  void end(int fd, std::ostream &log);
+
+ private:
+  void applyEach(int fd);
+
+  std::vector<v4l2_ext_control> controls;
+  std::vector<Exception> errors;
+  bool open;
+};
+
+class Codec : public EventSource {
  public:
   typedef std::map<uint32_t, Buffer *> BufferMap;
 
@@ -597,7 +1216,40 @@ class Codec {
 
   int stream();
 
+  /*
+   * Warm session reuse. The first start() sets up the device; later ones
+   * keep the formats, event subscriptions and buffers, and only restart
+   * streaming. stream(input, output) runs the next job of a warm session on
+   * new IO of the same formats.
+   */
+  int stream(Input &input, Output &output);
+  void setIO(Input &input, Output &output);
+  bool isCompatible(const Input &input, const Output &output);
+
+  /* EventSource, lets an EventLoop drive the session. */
+  void start();
+  size_t getPollFds(struct pollfd fds[], size_t max);
+  bool handlePollFds(const struct pollfd fds[], size_t nfds);
+  void finish();
+
+  void setMemoryType(uint32_t memory);
+  void setPrefault(Buffer::Prefault prefault);
+  void setHugePages(bool hugePages);
+  void setPlaneAlignment(size_t alignment);
+  void setSeparatePlanes(bool separate);
+  void setStageScheduler(StageScheduler *scheduler);
+  void setWatchdog(int timeout);
+  void setLive(bool live);
+  void setTrackLatency(bool track);
+  LatencyTracker *getLatencyTracker() { return latency; }
+  void setFirmwareProfiler(FirmwareProfiler *profiler);
+  void setBufferCounts(unsigned int input, unsigned int output);
+  void setAutoBuffers(unsigned int window);
+  void fillReport(ReportRecord &record);
+
   static uint32_t to4cc(const std::string &str);
+  static uint32_t toMemoryType(const std::string &str);
+  static Buffer::Prefault toPrefault(int value);
   static bool isVPx(uint32_t format);
   static bool isAFBC(uint32_t format);
   static void getStride(uint32_t format, size_t &nplanes, size_t stride[3][2]);
@@ -614,12 +1266,44 @@ class Codec {
     NALU_FORMAT_FOUR_BYTE_LENGTH_FIELD
   };
 
-  class Port {
+  class Port : public StageStrand {
    public:
-    Port(int &fd, enum v4l2_buf_type type, std::ostream &log)
+    /* What to do with a buffer once its CPU stage has run. */
+    enum Action {
+      ACTION_QUEUE,             /* Queue the buffer back. */
+      ACTION_QUEUE_LAST,        /* Queue and send the stop command. */
+      ACTION_QUEUE_EOS,         /* Queue, the port is done. */
+      ACTION_STOP,              /* Input exhausted, the port is done. */
+      ACTION_EOS,               /* Capture EOS, the port is done. */
+      ACTION_RESOLUTION_CHANGE, /* Reallocate the port. */
+      ACTION_ERROR              /* The stage threw, see stageError. */
+    };
+
+    struct Completion {
+      Buffer *buffer;
+      Action action;
+      uint64_t timestamp; /* Of the output IO after finalize, or 0. */
+    };
+
+    /* Checks the timestamp of every drained output buffer. */
+    typedef std::function<void(uint64_t timestamp)> TimestampCheck;
+
+    /* What growBuffers() made of a tuning window. */
+    enum Growth {
+      GROWTH_GREW,    /* Buffers were added. */
+      GROWTH_STABLE,  /* Nothing to add. */
+      GROWTH_DEFERRED /* The CPU stage held buffers, look again later. */
+    };
+
+    Port(int &fd, enum v4l2_buf_type type, std::ostream &log,
+         ControlSet &controls)
         : fd(fd),
+          io(NULL),
           type(type),
           log(log),
+          pending(0),
+          tid(0),
+          controls(controls),
           interlaced(false),
           tryEncStop(false),
           tryDecStop(false),
@@ -628,17 +1312,41 @@ class Codec {
           frames_processed(0),
           frames_count(0),
           isSourceChange(false),
-          lastTimestamp(0),
           intervalTime(0),
-          remainTime(0),
-          memory_type(V4L2_MEMORY_DMABUF) {}
-    Port(int &fd, IO &io, v4l2_buf_type type, std::ostream &log)
+          memory_type(V4L2_MEMORY_DMABUF),
+          prefault(Buffer::PREFAULT_NONE),
+          hugePages(false),
+          planeAlignment(PLANE_ALIGNMENT_CACHE_LINE),
+          separatePlanes(false),
+          work(STAGE_QUEUE_SIZE),
+          done(STAGE_QUEUE_SIZE),
+          workReady(NULL),
+          stageDone(NULL),
+          stageStop(false),
+          scheduler(NULL),
+          pacer(NULL),
+          paced(STAGE_QUEUE_SIZE),
+          latency(NULL),
+          analyzer(NULL),
+          profiler(NULL),
+          bufferCount(0),
+          autoBuffers(false),
+          tuneStalls(0),
+          bytes(0),
+          lastDequeue(0),
+          inFlight(0),
+          resolutionChangePending(false),
+          schedule(NULL),
+          scheduleFrame(0) {}
+    Port(int &fd, IO &io, v4l2_buf_type type, std::ostream &log,
+         ControlSet &controls)
         : fd(fd),
           io(&io),
           type(type),
           log(log),
           pending(0),
           tid(0),
+          controls(controls),
           interlaced(false),
           tryEncStop(false),
           tryDecStop(false),
@@ -647,10 +1355,32 @@ class Codec {
           frames_processed(0),
           frames_count(0),
           isSourceChange(false),
-          lastTimestamp(0),
           intervalTime(0),
-          remainTime(0),
-          memory_type(V4L2_MEMORY_DMABUF) {}
+          memory_type(V4L2_MEMORY_DMABUF),
+          prefault(Buffer::PREFAULT_NONE),
+          hugePages(false),
+          planeAlignment(PLANE_ALIGNMENT_CACHE_LINE),
+          separatePlanes(false),
+          work(STAGE_QUEUE_SIZE),
+          done(STAGE_QUEUE_SIZE),
+          workReady(NULL),
+          stageDone(NULL),
+          stageStop(false),
+          scheduler(NULL),
+          pacer(NULL),
+          paced(STAGE_QUEUE_SIZE),
+          latency(NULL),
+          analyzer(NULL),
+          profiler(NULL),
+          bufferCount(0),
+          autoBuffers(false),
+          tuneStalls(0),
+          bytes(0),
+          lastDequeue(0),
+          inFlight(0),
+          resolutionChangePending(false),
+          schedule(NULL),
+          scheduleFrame(0) {}
 
     void enumerateFormats();
     const v4l2_format &getFormat();
@@ -660,16 +1390,54 @@ class Codec {
     void printFormat(const struct v4l2_format &format);
     const v4l2_crop getCrop();
 
+    void setIO(IO &io) { this->io = &io; }
+    void reset();
+
     void allocateBuffers(size_t count);
     void freeBuffers();
     unsigned int getBufferCount();
+    void setBufferCount(unsigned int count) { bufferCount = count; }
+    void setAutoBuffers(bool enable) { autoBuffers = enable; }
+    Growth growBuffers();
     void queueBuffers();
     void queueBuffer(Buffer &buf);
     Buffer &dequeueBuffer();
     void printBuffer(const v4l2_buffer &buf, const char *prefix);
 
     bool handleBuffer();
+    Action processBuffer(Buffer &buffer);
+    bool completeBuffer(Buffer &buffer, Action action);
+    bool finishBuffer(Buffer &buffer, Action action);
     void handleResolutionChange();
+    bool isResolutionChangePending() const { return resolutionChangePending; }
+    void touchBuffer(Buffer &buffer, long faults);
+
+    void startStage(EventNotifier &done, StageScheduler *scheduler);
+    void stopStage();
+    void submitBuffer(Buffer &buffer);
+    bool drainStage(const TimestampCheck &check = TimestampCheck());
+    void runStrand();
+    bool hasWork();
+
+    void startPacing();
+    void stopPacing();
+    int getPacingFd() const { return pacer != NULL ? pacer->getFd() : -1; }
+    bool isPaced() const { return pacer != NULL; }
+    uint64_t getBytes() const { return bytes; }
+    const Histogram &getFrameTimes() const { return frameTimes; }
+    const OccupancyTracker &getOccupancy() const { return occupancy; }
+    void stopOccupancy() { occupancy.stop(); }
+    const char *getTraceCategory() const {
+      return V4L2_TYPE_IS_OUTPUT(type) ? "input" : "output";
+    }
+    void setLatencyTracker(LatencyTracker *latency);
+    LatencyTracker *getLatencyTracker() const { return latency; }
+    void setAnalyzer(BitstreamAnalyzer *analyzer);
+    BitstreamAnalyzer *getAnalyzer() const { return analyzer; }
+    void setFirmwareProfiler(FirmwareProfiler *profiler);
+    void setSchedule(const EncoderSchedule *schedule);
+    void setControl(uint32_t id, int32_t value, const Exception &error);
+    bool handlePacing();
 
     void streamon();
     void streamoff();
@@ -732,9 +1500,13 @@ class Codec {
     int getFramesProcessed() { return frames_processed; }
     void notifySourceChange();
     void setFramerate(int framerate);
-    void controlFramerate();
     void setFWTimeout(int timeout);
     void setProfiling(int enable);
+    void setMemoryType(uint32_t memory);
+    void setPrefault(Buffer::Prefault prefault);
+    void setHugePages(bool hugePages);
+    void setPlaneAlignment(size_t alignment);
+    void setSeparatePlanes(bool separate);
 
     int &fd;
     IO *io;
@@ -742,31 +1514,67 @@ class Codec {
     v4l2_format format;
     std::ostream &log;
     BufferMap buffers;
-    size_t pending;
+    std::atomic<size_t> pending;
     pthread_t tid;
     FILE *roi_cfg;
 
    private:
+    ControlSet &controls;
+    static void *runStage(void *arg);
+    void runStageBuffer(Buffer &buffer);
+    void createBuffer(uint32_t index);
+    void primeBuffer(Buffer &buffer);
+    bool releasePaced();
+    void applySchedule(Buffer &buf);
+
     int rotation;
     bool interlaced;
     bool tryEncStop;
     bool tryDecStop;
     int mirror;
     int scale;
-    int frames_processed;
+    std::atomic<int> frames_processed;
     int frames_count;
     int rc_type;
-    bool isSourceChange;
+    std::atomic<bool> isSourceChange;
     int fps;
-    uint64_t lastTimestamp;
     uint64_t intervalTime;
-    uint64_t remainTime;
     uint32_t memory_type;
+    Buffer::Prefault prefault;
+    bool hugePages;
+    size_t planeAlignment;
+    bool separatePlanes;
+
+    /* Hand-off to and from the CPU stage, see startStages(). */
+    SpscQueue<Buffer *> work;
+    SpscQueue<Completion> done;
+    EventNotifier *workReady;
+    EventNotifier *stageDone;
+    std::atomic<bool> stageStop;
+    StageScheduler *scheduler;
+    FramePacer *pacer;
+    SpscQueue<Completion> paced;
+    LatencyTracker *latency;
+    BitstreamAnalyzer *analyzer;
+    FirmwareProfiler *profiler;
+    unsigned int bufferCount; /* Frames to allocate for, 0 for default. */
+    bool autoBuffers;
+    uint64_t tuneStalls;
+    uint64_t bytes;
+    Histogram frameTimes;
+    OccupancyTracker occupancy;
+    uint64_t lastDequeue;
+    std::string stageError;
+    size_t inFlight;
+    bool resolutionChangePending;
+    const EncoderSchedule *schedule;
+    unsigned int scheduleFrame; /* Raw frames queued so far. */
   };
 
   static size_t getBytesUsed(v4l2_buffer &buf);
   void enumerateFormats();
 
+  ControlSet controls;
   Port input;
   Port output;
   int fd;
@@ -782,6 +1590,7 @@ class Codec {
  private:
   void openDev(const char *dev);
   void closeDev();
+  void configure();
 
   void queryCapabilities();
   void enumerateFramesizes(uint32_t format);
@@ -803,13 +1612,36 @@ class Codec {
   void streamoff();
 
   void runPoll();
-  void runThreads();
-  static void *runThreadInput(void *arg);
-  static void *runThreadOutput(void *arg);
+  void startStages();
+  void stopStages();
+  void startTimers();
+  void stopTimers();
+  void checkWatchdog();
+  void markTimeStart();
   bool handleEvent();
   void checkOutputTimestamp(uint64_t timestamp);
+  void printOccupancy(const char *name, const char *stall,
+                      const OccupancyTracker &occupancy);
+  void tuneBuffers();
 
   bool nonblock;
+  bool configured; /* The device is set up, start() runs warm. */
+  EventNotifier *stageDone;
+  StageScheduler *scheduler;
+  Timer *watchdog;
+  int watchdogTimeout;
+  uint64_t lastProgress;
+  bool live;
+  bool trackLatency;
+  LatencyTracker *latency;
+  FirmwareProfiler *profiler;
+  unsigned int tuneWindow;
+  uint64_t tuneStart;
+  /* Answers for the window, deferred until a port gives one. */
+  Port::Growth tuneInput;
+  Port::Growth tuneOutput;
+  /* A port grew in the last window that was closed. */
+  bool tuneGrew;
 
   uint64_t timestart_us;
   uint64_t timeend_us;
@@ -892,6 +1724,8 @@ class Encoder : public Codec {
   void setLongTermRef(uint32_t mode, uint32_t period);
   void setFWTimeout(int timeout);
   void setProfiling(int enable);
+  void setAnalyzer(BitstreamAnalyzer *analyzer);
+  void setSchedule(const EncoderSchedule *schedule);
 };
 
 class Info : public Codec {
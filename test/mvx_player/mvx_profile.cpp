@@ -0,0 +1,396 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include "mvx_profile.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iomanip>
+
+#include "fw_v2/mve_protocol_def.h"
+#include "mvx_log_ram.h"
+#include "mvx_player.hpp"
+
+using namespace std;
+
+/****************************************************************************
+ * Firmware profiler
+ ****************************************************************************/
+
+/* Unmatched QBUF times kept, older ones are dropped. */
+#define PROFILER_IN_FLIGHT_MAX 1024
+
+FirmwareProfiler::FirmwareProfiler(const string &path)
+    : path(path), fd(-1), realtimeOffset(0) {}
+
+FirmwareProfiler::~FirmwareProfiler() { close(); }
+
+void FirmwareProfiler::open() {
+  struct timespec ts;
+
+  close();
+
+  fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK);
+  if (fd < 0) {
+    throw Exception("Failed to open firmware log. path=%s.", path.c_str());
+  }
+
+  /* The driver stamps log records with the wall clock. */
+  clock_gettime(CLOCK_REALTIME, &ts);
+  realtimeOffset = static_cast<int64_t>(ts.tv_sec * 1000000000ull +
+                                        ts.tv_nsec) -
+                   static_cast<int64_t>(Timer::now());
+
+  /* Whatever is in the ring belongs to earlier sessions. */
+  readLog();
+  events.clear();
+  frames.clear();
+  inFlight.clear();
+}
+
+void FirmwareProfiler::close() {
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+void FirmwareProfiler::readLog() {
+  uint8_t buf[4096];
+  ssize_t n;
+
+  if (fd < 0) {
+    return;
+  }
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    pending.insert(pending.end(), buf, buf + n);
+  }
+
+  if (n < 0 && errno != EAGAIN && errno != EINTR) {
+    throw Exception("Failed to read firmware log. errno=%d.", errno);
+  }
+
+  parseLog();
+}
+
+/*
+ * Records are a mvx_log_header and a body padded to 32 bits. Like mvx_logd,
+ * resynchronise on the magic word one 32 bit word at a time.
+ */
+void FirmwareProfiler::parseLog() {
+  size_t pos = 0;
+
+  while (pending.size() - pos >= sizeof(mvx_log_header)) {
+    mvx_log_header header;
+
+    memcpy(&header, &pending[pos], sizeof(header));
+    if (header.magic != MVX_LOG_MAGIC ||
+        header.length > MVX_LOG_MESSAGE_LENGTH_MAX ||
+        header.type >= MVX_LOG_TYPE_MAX) {
+      pos += sizeof(header.magic);
+      continue;
+    }
+
+    size_t size = sizeof(header) + ((header.length + 3) & ~3);
+    if (pending.size() - pos < size) {
+      break;
+    }
+
+    if (header.type == MVX_LOG_TYPE_FWIF) {
+      int64_t logged = header.timestamp.sec * 1000000000ll +
+                       header.timestamp.nsec - realtimeOffset;
+      addRecord(&pending[pos + sizeof(header)], header.length,
+                logged > 0 ? logged : 0);
+    }
+
+    pos += size;
+  }
+
+  pending.erase(pending.begin(), pending.begin() + pos);
+}
+
+void FirmwareProfiler::addRecord(const uint8_t *record, size_t length,
+                                 uint64_t logged) {
+  mvx_log_fwif fwif;
+  mve_msg_header msg;
+  mve_response_event event;
+  size_t header = sizeof(fwif) + sizeof(msg);
+  size_t body = offsetof(mve_response_event, event_data) +
+                sizeof(mve_event_processed);
+
+  if (length < header + body) {
+    return;
+  }
+
+  memcpy(&fwif, record, sizeof(fwif));
+  if ((fwif.version_major != 2 && fwif.version_major != 3) ||
+      fwif.channel != MVX_LOG_FWIF_CHANNEL_MESSAGE ||
+      fwif.direction != MVX_LOG_FWIF_DIRECTION_FIRMWARE_TO_HOST) {
+    return;
+  }
+
+  memcpy(&msg, record + sizeof(fwif), sizeof(msg));
+  if (msg.code != MVE_RESPONSE_CODE_EVENT) {
+    return;
+  }
+
+  memcpy(&event, record + header, body);
+  if (event.event_code != MVE_EVENT_PROCESSED) {
+    return;
+  }
+
+  const mve_event_processed &p = event.event_data.event_processed;
+  Event e;
+
+  e.logged = logged;
+  e.parseStart = p.parse_start_time;
+  e.parseEnd = p.parse_end_time;
+  e.parseIdle = p.parse_idle_time;
+  e.pipeStart = p.pipe_start_time;
+  e.pipeEnd = p.pipe_end_time;
+  e.pipeIdle = p.pipe_idle_time;
+  e.parseCore = p.parser_coreid;
+  e.pipeCore = p.pipe_coreid;
+  e.bitstreamBits = p.bitstream_bits;
+  e.busReadBytes = p.bus_read_bytes;
+  e.busWriteBytes = p.bus_write_bytes;
+  e.qp = p.qp;
+  events.push_back(e);
+}
+
+static uint64_t getTimestampUs(const v4l2_buffer &buf) {
+  return buf.timestamp.tv_sec * 1000000ull + buf.timestamp.tv_usec;
+}
+
+void FirmwareProfiler::queued(const v4l2_buffer &buf) {
+  /* A frame split over several buffers is queued at its first one. */
+  inFlight.insert(make_pair(getTimestampUs(buf), Timer::now()));
+  if (inFlight.size() > PROFILER_IN_FLIGHT_MAX) {
+    inFlight.erase(inFlight.begin());
+  }
+}
+
+void FirmwareProfiler::dequeued(const v4l2_buffer &buf) {
+  /* Codec config and empty buffers have no firmware frame of their own. */
+  if ((buf.flags & (V4L2_BUF_FLAG_KEYFRAME | V4L2_BUF_FLAG_PFRAME |
+                    V4L2_BUF_FLAG_BFRAME)) == 0 &&
+      (buf.flags & V4L2_BUF_FLAG_MVX_BUFFER_FRAME_PRESENT) !=
+          V4L2_BUF_FLAG_MVX_BUFFER_FRAME_PRESENT) {
+    return;
+  }
+
+  Frame frame;
+  frame.timestamp = getTimestampUs(buf);
+  frame.queued = 0;
+  frame.dequeued = Timer::now();
+
+  map<uint64_t, uint64_t>::iterator it = inFlight.find(frame.timestamp);
+  if (it != inFlight.end()) {
+    frame.queued = it->second;
+    inFlight.erase(it);
+  }
+
+  frames.push_back(frame);
+}
+
+size_t FirmwareProfiler::getFrames() const { return frames.size(); }
+
+/*
+ * Firmware ticks elapsed between the first and last event against the host
+ * time between them. 32 bit tick counters are summed per event so a single
+ * wrap does not matter.
+ */
+double FirmwareProfiler::getTicksPerUs() const {
+  uint64_t ticks = 0;
+
+  if (events.size() < 2 || events.back().logged <= events.front().logged) {
+    return 0;
+  }
+
+  for (size_t i = 1; i < events.size(); ++i) {
+    ticks += static_cast<uint32_t>(events[i].pipeEnd - events[i - 1].pipeEnd);
+  }
+
+  double us = (events.back().logged - events.front().logged) / 1000.0;
+  return us >= 1 ? ticks / us : 0;
+}
+
+static double getBusyTicks(uint32_t start, uint32_t end, uint32_t idle) {
+  double busy = static_cast<double>(static_cast<uint32_t>(end - start)) - idle;
+
+  return busy > 0 ? busy : 0;
+}
+
+bool FirmwareProfiler::getSplit(size_t i, double ticksPerUs,
+                                Split &split) const {
+  if (i >= events.size() || i >= frames.size() || ticksPerUs <= 0 ||
+      frames[i].queued == 0) {
+    return false;
+  }
+
+  const Event &e = events[i];
+  const Frame &f = frames[i];
+
+  /* The event is logged as the frame completes, anchor the firmware
+   * timeline there. */
+  double span = static_cast<uint32_t>(e.pipeEnd - e.parseStart) / ticksPerUs;
+  double end = e.logged / 1000.0;
+
+  split.total = (f.dequeued - f.queued) / 1000.0;
+  split.parse = getBusyTicks(e.parseStart, e.parseEnd, e.parseIdle) /
+                ticksPerUs;
+  split.pipe = getBusyTicks(e.pipeStart, e.pipeEnd, e.pipeIdle) / ticksPerUs;
+  split.vpu = split.parse + split.pipe;
+  split.toVpu = end - span - f.queued / 1000.0;
+  split.fromVpu = f.dequeued / 1000.0 - end;
+
+  return true;
+}
+
+FirmwareProfiler::Split FirmwareProfiler::getAverage() const {
+  double ticksPerUs = getTicksPerUs();
+  Split sum = {0, 0, 0, 0, 0, 0};
+  size_t n = 0;
+
+  for (size_t i = 0; i < frames.size(); ++i) {
+    Split split;
+
+    if (!getSplit(i, ticksPerUs, split)) {
+      continue;
+    }
+
+    sum.total += split.total;
+    sum.vpu += split.vpu;
+    sum.parse += split.parse;
+    sum.pipe += split.pipe;
+    sum.toVpu += split.toVpu;
+    sum.fromVpu += split.fromVpu;
+    n++;
+  }
+
+  if (n > 0) {
+    sum.total /= n;
+    sum.vpu /= n;
+    sum.parse /= n;
+    sum.pipe /= n;
+    sum.toVpu /= n;
+    sum.fromVpu /= n;
+  }
+
+  return sum;
+}
+
+void FirmwareProfiler::writeSummary(ostream &os) const {
+  double ticksPerUs = getTicksPerUs();
+
+  os << fixed << setprecision(1);
+  os << "Firmware profile. frames=" << frames.size()
+     << ", events=" << events.size() << ", ticks_per_us=" << ticksPerUs
+     << "." << endl;
+
+  if (ticksPerUs > 0) {
+    Split avg = getAverage();
+
+    os << "  Per frame: total=" << avg.total << " us, vpu=" << avg.vpu
+       << " us (parse=" << avg.parse << ", pipe=" << avg.pipe
+       << "), to_vpu=" << avg.toVpu << " us, from_vpu=" << avg.fromVpu
+       << " us." << endl;
+  } else if (!events.empty()) {
+    os << "  Too few events to calibrate the firmware clock, see the CSV for "
+          "ticks."
+       << endl;
+  }
+
+  os.unsetf(ios::floatfield);
+}
+
+void FirmwareProfiler::write(ostream &os) const {
+  double ticksPerUs = getTicksPerUs();
+  size_t n = frames.size() > events.size() ? frames.size() : events.size();
+
+  os << "frame,timestamp_us,total_us,vpu_us,parse_us,pipe_us,to_vpu_us,"
+        "from_vpu_us,parse_ticks,pipe_ticks,parse_core,pipe_core,"
+        "bitstream_bits,bus_read_bytes,bus_write_bytes,qp"
+     << endl;
+
+  os << fixed << setprecision(1);
+  for (size_t i = 0; i < n; ++i) {
+    Split split;
+
+    os << i << ",";
+    if (i < frames.size()) {
+      os << frames[i].timestamp;
+    }
+
+    if (getSplit(i, ticksPerUs, split)) {
+      os << "," << split.total << "," << split.vpu << "," << split.parse
+         << "," << split.pipe << "," << split.toVpu << "," << split.fromVpu;
+    } else {
+      os << ",,,,,,";
+    }
+
+    if (i < events.size()) {
+      const Event &e = events[i];
+
+      os << "," << (uint64_t)getBusyTicks(e.parseStart, e.parseEnd, e.parseIdle)
+         << "," << (uint64_t)getBusyTicks(e.pipeStart, e.pipeEnd, e.pipeIdle)
+         << "," << e.parseCore << "," << e.pipeCore << "," << e.bitstreamBits
+         << "," << e.busReadBytes << "," << e.busWriteBytes << "," << e.qp;
+    } else {
+      os << ",,,,,,,,";
+    }
+
+    os << endl;
+  }
+  os.unsetf(ios::floatfield);
+}
+
+void FirmwareProfiler::write(const char *path) const {
+  ofstream os(path);
+
+  if (!os) {
+    throw Exception("Failed to open profile file. path=%s.", path);
+  }
+
+  write(os);
+}
@@ -0,0 +1,140 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+#ifndef __MVX_PROFILE_H__
+#define __MVX_PROFILE_H__
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include <stdint.h>
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct v4l2_buffer;
+
+/****************************************************************************
+ * Firmware profiler
+ ****************************************************************************/
+
+#define FIRMWARE_LOG_DEFAULT "/sys/kernel/debug/amvx/log/drain/ram0/msg"
+
+/*
+ * Per frame firmware timing. With V4L2_CID_MVE_VIDEO_PROFILING set the
+ * firmware sends an MVE_EVENT_PROCESSED for every frame, which the driver
+ * writes to its log ring. The profiler drains the ring while the session
+ * runs and pairs the nth event with the nth frame dequeued from the capture
+ * port, whose QBUF time is found through the buffer timestamp.
+ *
+ * Firmware timestamps are in ticks of an unspecified clock. Ticks per us are
+ * calibrated from the host time the driver logged each event at, which also
+ * places the firmware work on the host timeline so a frame's QBUF to DQBUF
+ * time can be split into VPU, before-VPU and after-VPU parts.
+ *
+ * The ring is shared by all sessions and events carry no host handle, so
+ * only one session per device should run while profiling.
+ */
+class FirmwareProfiler {
+ public:
+  FirmwareProfiler(const std::string &path = FIRMWARE_LOG_DEFAULT);
+  ~FirmwareProfiler();
+
+  void open();
+  void close();
+  int getFd() const { return fd; }
+  void readLog();
+
+  void queued(const v4l2_buffer &buf);
+  void dequeued(const v4l2_buffer &buf);
+
+  /* Where a frame's QBUF to DQBUF time went, in us. */
+  struct Split {
+    double total;
+    double vpu;
+    double parse;
+    double pipe;
+    double toVpu;
+    double fromVpu;
+  };
+
+  size_t getFrames() const;
+  size_t getEvents() const { return events.size(); }
+  double getTicksPerUs() const;
+  Split getAverage() const;
+
+  void writeSummary(std::ostream &os) const;
+  void write(std::ostream &os) const;
+  void write(const char *path) const;
+
+ private:
+  /* The fields of struct mve_event_processed that are used. */
+  struct Event {
+    uint64_t logged; /* ns, CLOCK_MONOTONIC */
+    uint32_t parseStart;
+    uint32_t parseEnd;
+    uint32_t parseIdle;
+    uint32_t pipeStart;
+    uint32_t pipeEnd;
+    uint32_t pipeIdle;
+    uint32_t parseCore;
+    uint32_t pipeCore;
+    uint32_t bitstreamBits;
+    uint32_t busReadBytes;
+    uint32_t busWriteBytes;
+    uint32_t qp;
+  };
+
+  struct Frame {
+    uint64_t timestamp; /* us, from the buffer */
+    uint64_t queued;    /* ns, CLOCK_MONOTONIC, 0 if not seen */
+    uint64_t dequeued;
+  };
+
+  void parseLog();
+  void addRecord(const uint8_t *record, size_t length, uint64_t logged);
+  bool getSplit(size_t i, double ticksPerUs, Split &split) const;
+
+  std::string path;
+  int fd;
+  int64_t realtimeOffset;
+  std::vector<uint8_t> pending;
+  std::vector<Event> events;
+  std::map<uint64_t, uint64_t> inFlight;
+  std::vector<Frame> frames;
+};
+
+#endif /* __MVX_PROFILE_H__ */
@@ -0,0 +1,275 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include "mvx_report.hpp"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fstream>
+
+#include "mvx_player.hpp"
+
+using namespace std;
+
+/****************************************************************************
+ * Histogram
+ ****************************************************************************/
+
+Histogram::Histogram() { memset(counts, 0, sizeof(counts)); }
+
+void Histogram::add(uint64_t value) {
+  size_t bucket = 0;
+
+  while (bucket < HISTOGRAM_BUCKETS - 1 && value >= getBound(bucket)) {
+    bucket++;
+  }
+
+  counts[bucket]++;
+}
+
+uint64_t Histogram::getBound(size_t bucket) {
+  return bucket < HISTOGRAM_BUCKETS - 1 ? 64ull << bucket : UINT64_MAX;
+}
+
+/****************************************************************************
+ * Report
+ ****************************************************************************/
+
+static string quoteJson(const string &str) {
+  string out = "\"";
+
+  for (size_t i = 0; i < str.size(); ++i) {
+    char c = str[i];
+
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      out += esc;
+    } else {
+      out += c;
+    }
+  }
+
+  return out + "\"";
+}
+
+static string quoteCsv(const string &str) {
+  if (str.find_first_of(",\"\n") == string::npos) {
+    return str;
+  }
+
+  string out = "\"";
+  for (size_t i = 0; i < str.size(); ++i) {
+    if (str[i] == '"') {
+      out += '"';
+    }
+    out += str[i];
+  }
+
+  return out + "\"";
+}
+
+void ReportRecord::setField(const string &key, const string &json,
+                            const string &csv) {
+  for (size_t i = 0; i < fields.size(); ++i) {
+    if (fields[i].key == key) {
+      fields[i].json = json;
+      fields[i].csv = csv;
+      return;
+    }
+  }
+
+  Field field = {key, json, csv};
+  fields.push_back(field);
+}
+
+void ReportRecord::set(const string &key, const string &value) {
+  setField(key, quoteJson(value), quoteCsv(value));
+}
+
+void ReportRecord::set(const string &key, const char *value) {
+  set(key, string(value != NULL ? value : ""));
+}
+
+void ReportRecord::set(const string &key, uint64_t value) {
+  char str[32];
+
+  snprintf(str, sizeof(str), "%" PRIu64, value);
+  setField(key, str, str);
+}
+
+void ReportRecord::set(const string &key, int value) {
+  char str[32];
+
+  snprintf(str, sizeof(str), "%d", value);
+  setField(key, str, str);
+}
+
+void ReportRecord::set(const string &key, double value) {
+  char str[32];
+
+  snprintf(str, sizeof(str), "%.3f", value);
+  setField(key, str, str);
+}
+
+/*
+ * JSON maps each bucket's upper bound in us to its count, "inf" for the
+ * last one. CSV packs the same into one "bound:count;..." cell.
+ */
+void ReportRecord::set(const string &key, const Histogram &value) {
+  string json = "{";
+  string csv;
+
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    char bound[32];
+    char entry[64];
+
+    if (i < HISTOGRAM_BUCKETS - 1) {
+      snprintf(bound, sizeof(bound), "%" PRIu64, Histogram::getBound(i));
+    } else {
+      snprintf(bound, sizeof(bound), "inf");
+    }
+
+    snprintf(entry, sizeof(entry), "%s\"%s\":%" PRIu64, i > 0 ? "," : "",
+             bound, value.getCount(i));
+    json += entry;
+
+    snprintf(entry, sizeof(entry), "%s%s:%" PRIu64, i > 0 ? ";" : "", bound,
+             value.getCount(i));
+    csv += entry;
+  }
+
+  setField(key, json + "}", csv);
+}
+
+/* A JSON array, or one "a;b;..." cell in CSV. */
+void ReportRecord::set(const string &key, const vector<uint64_t> &value) {
+  string json = "[";
+  string csv;
+
+  for (size_t i = 0; i < value.size(); ++i) {
+    char entry[32];
+
+    snprintf(entry, sizeof(entry), "%" PRIu64, value[i]);
+    json += i > 0 ? "," : "";
+    json += entry;
+    csv += i > 0 ? ";" : "";
+    csv += entry;
+  }
+
+  setField(key, json + "]", csv);
+}
+
+ReportRecord &Report::add() {
+  records.push_back(ReportRecord());
+
+  return records.back();
+}
+
+void Report::write(ostream &os, Format format) const {
+  if (format == FORMAT_JSON) {
+    os << "[";
+    for (size_t i = 0; i < records.size(); ++i) {
+      const vector<ReportRecord::Field> &fields = records[i].fields;
+
+      os << (i > 0 ? ",\n" : "\n") << "{";
+      for (size_t j = 0; j < fields.size(); ++j) {
+        os << (j > 0 ? ", " : "") << quoteJson(fields[j].key) << ": "
+           << fields[j].json;
+      }
+      os << "}";
+    }
+    os << "\n]\n";
+    return;
+  }
+
+  /* Columns are the union of all keys, in order of appearance. */
+  vector<string> keys;
+  for (size_t i = 0; i < records.size(); ++i) {
+    for (size_t j = 0; j < records[i].fields.size(); ++j) {
+      const string &key = records[i].fields[j].key;
+      bool found = false;
+
+      for (size_t k = 0; k < keys.size() && !found; ++k) {
+        found = keys[k] == key;
+      }
+      if (!found) {
+        keys.push_back(key);
+      }
+    }
+  }
+
+  for (size_t k = 0; k < keys.size(); ++k) {
+    os << (k > 0 ? "," : "") << quoteCsv(keys[k]);
+  }
+  os << "\n";
+
+  for (size_t i = 0; i < records.size(); ++i) {
+    for (size_t k = 0; k < keys.size(); ++k) {
+      os << (k > 0 ? "," : "");
+      for (size_t j = 0; j < records[i].fields.size(); ++j) {
+        if (records[i].fields[j].key == keys[k]) {
+          os << records[i].fields[j].csv;
+          break;
+        }
+      }
+    }
+    os << "\n";
+  }
+}
+
+/* A path ending in .csv selects CSV, anything else JSON. */
+void Report::write(const char *path) const {
+  size_t len = strlen(path);
+  Format format = FORMAT_JSON;
+  ofstream os(path);
+
+  if (!os) {
+    throw Exception("Failed to open report file. path=%s.", path);
+  }
+
+  if (len >= 4 && strcmp(path + len - 4, ".csv") == 0) {
+    format = FORMAT_CSV;
+  }
+
+  write(os, format);
+}
@@ -0,0 +1,116 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+#ifndef __MVX_REPORT_H__
+#define __MVX_REPORT_H__
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include <stdint.h>
+
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/****************************************************************************
+ * Histogram
+ ****************************************************************************/
+
+#define HISTOGRAM_BUCKETS 16
+
+/*
+ * Counts of microsecond samples in power of two buckets. Bucket i holds
+ * samples below 64 << i us; the last bucket is open ended.
+ */
+class Histogram {
+ public:
+  Histogram();
+
+  void add(uint64_t value);
+  uint64_t getCount(size_t bucket) const { return counts[bucket]; }
+  static uint64_t getBound(size_t bucket);
+
+ private:
+  uint64_t counts[HISTOGRAM_BUCKETS];
+};
+
+/****************************************************************************
+ * Report
+ ****************************************************************************/
+
+/* One row of a report, keys keep the order they were first set in. */
+class ReportRecord {
+ public:
+  void set(const std::string &key, const std::string &value);
+  void set(const std::string &key, const char *value);
+  void set(const std::string &key, uint64_t value);
+  void set(const std::string &key, int value);
+  void set(const std::string &key, double value);
+  void set(const std::string &key, const Histogram &value);
+  void set(const std::string &key, const std::vector<uint64_t> &value);
+
+ private:
+  friend class Report;
+
+  struct Field {
+    std::string key;
+    std::string json;
+    std::string csv;
+  };
+
+  void setField(const std::string &key, const std::string &json,
+                const std::string &csv);
+
+  std::vector<Field> fields;
+};
+
+/*
+ * Machine readable results of a run, one record per session. Written as a
+ * JSON array of objects or as CSV with a header row.
+ */
+class Report {
+ public:
+  enum Format { FORMAT_JSON, FORMAT_CSV };
+
+  ReportRecord &add();
+  void write(std::ostream &os, Format format) const;
+  void write(const char *path) const;
+
+ private:
+  std::vector<ReportRecord> records;
+};
+
+#endif /* __MVX_REPORT_H__ */
@@ -0,0 +1,262 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include "mvx_roi.hpp"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+
+#include "mvx_player.hpp"
+
+using namespace std;
+
+/****************************************************************************
+ * ROI config
+ ****************************************************************************/
+
+namespace {
+bool comparePicIndex(const v4l2_mvx_roi_regions &a,
+                     const v4l2_mvx_roi_regions &b) {
+  return a.pic_index < b.pic_index;
+}
+
+bool lessPicIndex(const v4l2_mvx_roi_regions &roi, unsigned int picIndex) {
+  return roi.pic_index < picIndex;
+}
+
+void checkHeader(const RoiFileHeader &header, size_t length) {
+  if (header.version != ROI_FILE_VERSION ||
+      header.recordSize != sizeof(v4l2_mvx_roi_regions)) {
+    throw Exception(
+        "Unsupported compiled ROI config. version=%u, record_size=%u.",
+        header.version, header.recordSize);
+  }
+
+  if (length < sizeof(header) + size_t(header.count) * header.recordSize) {
+    throw Exception("Truncated compiled ROI config. count=%u, size=%zu.",
+                    header.count, length);
+  }
+}
+}  // namespace
+
+RoiConfig::RoiConfig()
+    : mapping(MAP_FAILED), mappingLength(0), records(NULL), count(0) {}
+
+RoiConfig::~RoiConfig() { unmap(); }
+
+void RoiConfig::load(const char *path) {
+  RoiFileHeader header;
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw Exception("Failed to open ROI config. path=%s.", path);
+  }
+
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != ROI_FILE_MAGIC) {
+    close(fd);
+
+    ifstream is(path);
+    parse(is);
+    return;
+  }
+
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw Exception("Failed to stat ROI config. path=%s.", path);
+  }
+
+  checkHeader(header, st.st_size);
+
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    throw Exception("Failed to map ROI config. path=%s.", path);
+  }
+
+  unmap();
+  table.clear();
+  mapping = p;
+  mappingLength = st.st_size;
+  records = reinterpret_cast<const v4l2_mvx_roi_regions *>(
+      static_cast<const char *>(p) + sizeof(header));
+  count = header.count;
+}
+
+void RoiConfig::load(istream &is) {
+  RoiFileHeader header;
+  streampos start = is.tellg();
+
+  if (!is.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      header.magic != ROI_FILE_MAGIC) {
+    is.clear();
+    is.seekg(start);
+    parse(is);
+    return;
+  }
+
+  checkHeader(header, sizeof(header) + size_t(header.count) * sizeof(table[0]));
+
+  unmap();
+  table.resize(header.count);
+  is.read(reinterpret_cast<char *>(table.data()),
+          table.size() * sizeof(table[0]));
+  if (size_t(is.gcount()) != table.size() * sizeof(table[0])) {
+    table.clear();
+    throw Exception("Truncated compiled ROI config. count=%u.", header.count);
+  }
+
+  records = table.data();
+  count = table.size();
+}
+
+void RoiConfig::write(ostream &os) const {
+  RoiFileHeader header = {ROI_FILE_MAGIC, ROI_FILE_VERSION,
+                          sizeof(v4l2_mvx_roi_regions), uint32_t(count)};
+
+  os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  os.write(reinterpret_cast<const char *>(records), count * sizeof(*records));
+  if (!os) {
+    throw Exception("Failed to write compiled ROI config.");
+  }
+}
+
+const v4l2_mvx_roi_regions *RoiConfig::find(unsigned int picIndex) const {
+  const v4l2_mvx_roi_regions *end = records + count;
+  const v4l2_mvx_roi_regions *roi =
+      lower_bound(records, end, picIndex, lessPicIndex);
+
+  if (roi == end || roi->pic_index != picIndex) {
+    return NULL;
+  }
+
+  return roi;
+}
+
+void RoiConfig::parse(istream &is) {
+  string line;
+  size_t number = 0;
+
+  unmap();
+  table.clear();
+
+  while (getline(is, line)) {
+    v4l2_mvx_roi_regions roi;
+
+    number++;
+    if (line.find_first_not_of(" \t\r") == string::npos) {
+      continue;
+    }
+
+    parseLine(line.c_str(), number, roi);
+    table.push_back(roi);
+  }
+
+  /* Stable, so the first line of a repeated picture wins as before. */
+  stable_sort(table.begin(), table.end(), comparePicIndex);
+  records = table.data();
+  count = table.size();
+}
+
+void RoiConfig::parseLine(const char *line, size_t number,
+                          v4l2_mvx_roi_regions &roi) {
+  const char *p;
+  int value;
+
+  memset(&roi, 0, sizeof(roi));
+
+  if (sscanf(line, "pic=%d", &value) != 1 || value < 0) {
+    throw Exception("Bad ROI config, no picture index. line=%zu.", number);
+  }
+  roi.pic_index = value;
+
+  p = strstr(line, " qp=");
+  if (p != NULL) {
+    if (sscanf(p, " qp=%d", &value) != 1) {
+      throw Exception("Bad ROI config, qp does not parse. line=%zu.", number);
+    }
+    roi.qp = value;
+    roi.qp_present = true;
+  }
+
+  p = strstr(line, " num_roi=");
+  if (p != NULL) {
+    if (sscanf(p, " num_roi=%d", &value) != 1 || value < 0 ||
+        value > V4L2_MVX_MAX_FRAME_REGIONS) {
+      throw Exception("Bad ROI config, invalid num_roi. line=%zu.", number);
+    }
+    roi.num_roi = value;
+    roi.roi_present = true;
+  }
+
+  p = line;
+  for (int i = 0; i < roi.num_roi; ++i) {
+    v4l2_buffer_param_region &r = roi.roi[i];
+
+    p = strstr(p, " roi=");
+    if (p == NULL ||
+        sscanf(p, " roi={%hu,%hu,%hu,%hu,%hd}", &r.mbx_left, &r.mbx_right,
+               &r.mby_top, &r.mby_bottom, &r.qp_delta) != 5) {
+      throw Exception("Bad ROI config, region %d does not parse. line=%zu.",
+                      i, number);
+    }
+    p += 5;
+  }
+}
+
+void RoiConfig::unmap() {
+  if (mapping != MAP_FAILED) {
+    munmap(mapping, mappingLength);
+    mapping = MAP_FAILED;
+    mappingLength = 0;
+  }
+
+  records = NULL;
+  count = 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+
+
+#ifndef __MVX_ROI_H__
+#define __MVX_ROI_H__
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "mvx-v4l2-controls.h"
+
+/****************************************************************************
+ * ROI config
+ ****************************************************************************/
+
+#define ROI_FILE_MAGIC 0x5258564d /* "MVXR" in file byte order. */
+#define ROI_FILE_VERSION 1
+
+/*
+ * Header of a compiled ROI config. It is followed by count records of
+ * recordSize bytes, one v4l2_mvx_roi_regions per picture, sorted by
+ * pic_index.
+ */
+struct RoiFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t count;
+};
+
+/*
+ * Per picture ROI regions of an encode, looked up by picture index.
+ *
+ * A text config has one line per picture:
+ *
+ *   pic=<n> [qp=<qp>] [num_roi=<k> roi={left,right,top,bottom,qp_delta}...]
+ *
+ * It is parsed once into a table sorted by picture index. A compiled config
+ * is that table written out with a header, see write(). Loading one from a
+ * path maps it, so startup does no parsing and only the records of the
+ * pictures that are looked up are ever read.
+ */
+class RoiConfig {
+ public:
+  RoiConfig();
+  ~RoiConfig();
+
+  /* Load a text or compiled config, told apart by the magic. */
+  void load(const char *path);
+  void load(std::istream &is);
+
+  /* Write the config in the compiled format. */
+  void write(std::ostream &os) const;
+
+  /* Regions of a picture, NULL if the config has none for it. */
+  const v4l2_mvx_roi_regions *find(unsigned int picIndex) const;
+  size_t size() const { return count; }
+
+ private:
+  RoiConfig(const RoiConfig &);
+  RoiConfig &operator=(const RoiConfig &);
+
+  void parse(std::istream &is);
+  void parseLine(const char *line, size_t number, v4l2_mvx_roi_regions &roi);
+  void unmap();
+
+  std::vector<v4l2_mvx_roi_regions> table;
+  void *mapping;
+  size_t mappingLength;
+  const v4l2_mvx_roi_regions *records;
+  size_t count;
+};
+
+#endif /* __MVX_ROI_H__ */
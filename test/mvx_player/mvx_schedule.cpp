@@ -0,0 +1,206 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include "mvx_schedule.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "mvx_player.hpp"
+
+using namespace std;
+
+/****************************************************************************
+ * Encoder schedule
+ ****************************************************************************/
+
+namespace {
+bool lessFrame(const ScheduleEntry &entry, unsigned int frame) {
+  return entry.frame < frame;
+}
+}  // namespace
+
+void EncoderSchedule::load(const char *path) {
+  ifstream is(path);
+
+  if (!is) {
+    throw Exception("Failed to open schedule. path=%s.", path);
+  }
+
+  load(is);
+}
+
+void EncoderSchedule::load(istream &is) {
+  string line;
+  size_t number = 0;
+
+  entries.clear();
+  while (getline(is, line)) {
+    parseLine(line, ++number);
+  }
+}
+
+const ScheduleEntry *EncoderSchedule::find(unsigned int frame) const {
+  vector<ScheduleEntry>::const_iterator it =
+      lower_bound(entries.begin(), entries.end(), frame, lessFrame);
+
+  if (it == entries.end() || it->frame != frame) {
+    return NULL;
+  }
+
+  return &*it;
+}
+
+size_t EncoderSchedule::getControls(
+    const ScheduleEntry &entry,
+    v4l2_ext_control controls[SCHEDULE_MAX_CONTROLS]) {
+  size_t count = 0;
+
+  memset(controls, 0, sizeof(controls[0]) * SCHEDULE_MAX_CONTROLS);
+
+  if (entry.set & ScheduleEntry::SET_BITRATE) {
+    controls[count].id = V4L2_CID_MPEG_VIDEO_BITRATE;
+    controls[count++].value = entry.bitrate;
+  }
+
+  if (entry.set & ScheduleEntry::SET_FRAMERATE) {
+    controls[count].id = V4L2_CID_MVE_VIDEO_FRAME_RATE;
+    controls[count++].value = entry.framerate;
+  }
+
+  /* Set maxQP before minQP, otherwise FW rejects */
+  if (entry.set & ScheduleEntry::SET_MAX_QP) {
+    controls[count].id = V4L2_CID_MPEG_VIDEO_H264_MAX_QP;
+    controls[count++].value = entry.maxQP;
+  }
+
+  if (entry.set & ScheduleEntry::SET_MIN_QP) {
+    controls[count].id = V4L2_CID_MPEG_VIDEO_H264_MIN_QP;
+    controls[count++].value = entry.minQP;
+  }
+
+  if (entry.set & ScheduleEntry::SET_IDR) {
+    controls[count].id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+    controls[count++].value = 1;
+  }
+
+  return count;
+}
+
+void EncoderSchedule::parseLine(const string &line, size_t number) {
+  istringstream is(line);
+  string token;
+  unsigned int frame;
+
+  if (!(is >> token) || token[0] == '#') {
+    return;
+  }
+
+  if (sscanf(token.c_str(), "frame=%u", &frame) != 1) {
+    throw Exception("Bad schedule, line does not start with frame=. line=%zu.",
+                    number);
+  }
+
+  ScheduleEntry &entry = getEntry(frame);
+
+  while (is >> token) {
+    const char *s = token.c_str();
+    unsigned int value;
+    double fps;
+
+    if (sscanf(s, "bitrate=%u", &value) == 1) {
+      entry.bitrate = value;
+      entry.set |= ScheduleEntry::SET_BITRATE;
+    } else if (sscanf(s, "fps=%lf", &fps) == 1 && fps > 0) {
+      entry.framerate = uint32_t(fps * 65536 + 0.5);
+      entry.set |= ScheduleEntry::SET_FRAMERATE;
+    } else if (sscanf(s, "min_qp=%u", &value) == 1) {
+      entry.minQP = value;
+      entry.set |= ScheduleEntry::SET_MIN_QP;
+    } else if (sscanf(s, "max_qp=%u", &value) == 1) {
+      entry.maxQP = value;
+      entry.set |= ScheduleEntry::SET_MAX_QP;
+    } else if (token == "idr") {
+      entry.set |= ScheduleEntry::SET_IDR;
+    } else if (sscanf(s, "roi_qp=%u", &value) == 1) {
+      entry.roi.qp = value;
+      entry.roi.qp_present = true;
+      entry.set |= ScheduleEntry::SET_ROI;
+    } else if (strncmp(s, "roi=", 4) == 0) {
+      v4l2_mvx_roi_regions &roi = entry.roi;
+
+      if (roi.num_roi >= V4L2_MVX_MAX_FRAME_REGIONS) {
+        throw Exception("Bad schedule, too many regions. line=%zu.", number);
+      }
+
+      v4l2_buffer_param_region &r = roi.roi[roi.num_roi];
+      if (sscanf(s, "roi={%hu,%hu,%hu,%hu,%hd}", &r.mbx_left, &r.mbx_right,
+                 &r.mby_top, &r.mby_bottom, &r.qp_delta) != 5) {
+        throw Exception("Bad schedule, region does not parse. line=%zu.",
+                        number);
+      }
+      roi.num_roi++;
+      roi.roi_present = true;
+      entry.set |= ScheduleEntry::SET_ROI;
+    } else {
+      throw Exception("Bad schedule, unknown setting %s. line=%zu.", s,
+                      number);
+    }
+  }
+}
+
+ScheduleEntry &EncoderSchedule::getEntry(unsigned int frame) {
+  vector<ScheduleEntry>::iterator it =
+      lower_bound(entries.begin(), entries.end(), frame, lessFrame);
+
+  if (it == entries.end() || it->frame != frame) {
+    ScheduleEntry entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.frame = frame;
+    entry.roi.pic_index = frame;
+    it = entries.insert(it, entry);
+  }
+
+  return *it;
+}
@@ -0,0 +1,111 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+
+
+#ifndef __MVX_SCHEDULE_H__
+#define __MVX_SCHEDULE_H__
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include <linux/videodev2.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "mvx-v4l2-controls.h"
+
+/****************************************************************************
+ * Encoder schedule
+ ****************************************************************************/
+
+/* Most controls one schedule entry sets. */
+#define SCHEDULE_MAX_CONTROLS 5
+
+/* Changes that take effect at one input frame. */
+struct ScheduleEntry {
+  enum {
+    SET_BITRATE = 1 << 0,
+    SET_FRAMERATE = 1 << 1,
+    SET_MIN_QP = 1 << 2,
+    SET_MAX_QP = 1 << 3,
+    SET_IDR = 1 << 4,
+    SET_ROI = 1 << 5
+  };
+
+  unsigned int frame;
+  uint32_t set;
+  uint32_t bitrate;
+  uint32_t framerate; /* Frames per second in Q16. */
+  uint32_t minQP;
+  uint32_t maxQP;
+  v4l2_mvx_roi_regions roi;
+};
+
+/*
+ * Per frame encoder parameter changes. A schedule file has one line per
+ * frame that changes, blank lines and lines starting with # are skipped:
+ *
+ *   frame=<n> [bitrate=<bps>] [fps=<fps>] [min_qp=<qp>] [max_qp=<qp>]
+ *             [idr] [roi_qp=<qp>] [roi={left,right,top,bottom,qp_delta}...]
+ *
+ * Frames count the raw frames queued to the encoder from 0. Lines for the
+ * same frame are merged, later values win. Everything but the ROI regions
+ * is applied with one VIDIOC_S_EXT_CTRLS just before the frame is queued.
+ */
+class EncoderSchedule {
+ public:
+  void load(const char *path);
+  void load(std::istream &is);
+
+  /* Entry of a frame, NULL if nothing changes at it. */
+  const ScheduleEntry *find(unsigned int frame) const;
+  size_t size() const { return entries.size(); }
+
+  /* Controls of an entry in the order they must be set, returns the count. */
+  static size_t getControls(const ScheduleEntry &entry,
+                            v4l2_ext_control controls[SCHEDULE_MAX_CONTROLS]);
+
+ private:
+  void parseLine(const std::string &line, size_t number);
+  ScheduleEntry &getEntry(unsigned int frame);
+
+  std::vector<ScheduleEntry> entries;
+};
+
+#endif /* __MVX_SCHEDULE_H__ */
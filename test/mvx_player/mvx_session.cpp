@@ -0,0 +1,500 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include "mvx_session.hpp"
+
+#include <poll.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <streambuf>
+
+#include "mvx_player.hpp"
+
+using namespace std;
+
+/****************************************************************************
+ * Log buffer
+ ****************************************************************************/
+
+/* Stream buffer that hands each complete line to a callback. */
+class LogBuffer : public streambuf {
+ public:
+  void setCallback(const MvxSession::LogCallback &callback) {
+    this->callback = callback;
+  }
+
+ protected:
+  virtual int overflow(int c) {
+    if (c == EOF) {
+      return 0;
+    }
+
+    if (c != '\n') {
+      line += static_cast<char>(c);
+    } else {
+      if (callback) {
+        callback(line);
+      }
+      line.clear();
+    }
+
+    return c;
+  }
+
+ private:
+  MvxSession::LogCallback callback;
+  string line;
+};
+
+/****************************************************************************
+ * Packet queue
+ ****************************************************************************/
+
+struct Packet {
+  vector<uint8_t> data;
+  uint64_t timestamp;
+  uint32_t flags;
+};
+
+/*
+ * Packets between the application and a session thread. A depth of 0 never
+ * blocks push(). After end() the queue drains, after abort() it is empty
+ * and refuses new packets.
+ */
+class PacketQueue {
+ public:
+  PacketQueue(size_t depth) : depth(depth), ended(false), aborted(false) {}
+
+  bool push(Packet &packet);
+  MvxSession::PullResult pop(Packet &packet, int timeout);
+  bool isDrained();
+  void end();
+  void abort();
+
+ private:
+  size_t depth;
+  deque<Packet> packets;
+  bool ended;
+  bool aborted;
+  mutex lock;
+  condition_variable changed;
+};
+
+bool PacketQueue::push(Packet &packet) {
+  unique_lock<mutex> guard(lock);
+
+  while (depth != 0 && packets.size() >= depth && !aborted) {
+    changed.wait(guard);
+  }
+
+  if (aborted || ended) {
+    return false;
+  }
+
+  packets.push_back(Packet());
+  packets.back().data.swap(packet.data);
+  packets.back().timestamp = packet.timestamp;
+  packets.back().flags = packet.flags;
+  changed.notify_all();
+
+  return true;
+}
+
+MvxSession::PullResult PacketQueue::pop(Packet &packet, int timeout) {
+  unique_lock<mutex> guard(lock);
+  chrono::steady_clock::time_point deadline =
+      chrono::steady_clock::now() + chrono::milliseconds(timeout);
+
+  while (packets.empty() && !ended && !aborted) {
+    if (timeout < 0) {
+      changed.wait(guard);
+    } else if (changed.wait_until(guard, deadline) == cv_status::timeout) {
+      return MvxSession::PULL_TIMEOUT;
+    }
+  }
+
+  if (packets.empty() || aborted) {
+    return MvxSession::PULL_END;
+  }
+
+  packet.data.swap(packets.front().data);
+  packet.timestamp = packets.front().timestamp;
+  packet.flags = packets.front().flags;
+  packets.pop_front();
+  changed.notify_all();
+
+  return MvxSession::PULL_OK;
+}
+
+bool PacketQueue::isDrained() {
+  lock_guard<mutex> guard(lock);
+
+  return (ended && packets.empty()) || aborted;
+}
+
+void PacketQueue::end() {
+  lock_guard<mutex> guard(lock);
+
+  ended = true;
+  changed.notify_all();
+}
+
+void PacketQueue::abort() {
+  lock_guard<mutex> guard(lock);
+
+  aborted = true;
+  packets.clear();
+  changed.notify_all();
+}
+
+/****************************************************************************
+ * Session input and output
+ ****************************************************************************/
+
+/*
+ * Takes one pushed packet per buffer. Runs on the input stage thread, so
+ * waiting for the application does not hold up the capture port.
+ */
+class SessionInput {
+ public:
+  SessionInput(const MvxSessionConfig &config, PacketQueue &queue);
+  ~SessionInput() { delete input; }
+
+  Input &get() { return *input; }
+
+ private:
+  bool next(MemoryUnit &unit);
+
+  PacketQueue &queue;
+  Packet packet;
+  InputCallback *input;
+};
+
+SessionInput::SessionInput(const MvxSessionConfig &config, PacketQueue &queue)
+    : queue(queue) {
+  InputCallback::Source source = [this](MemoryUnit &unit) {
+    return next(unit);
+  };
+
+  if (config.encode) {
+    input = new InputCallback(config.inputFormat, config.width, config.height,
+                              config.strideAlign, source);
+  } else {
+    input = new InputCallback(config.inputFormat, source);
+  }
+}
+
+/* The packet stays ours until the next call, after the copy is done. */
+bool SessionInput::next(MemoryUnit &unit) {
+  if (queue.pop(packet, -1) != MvxSession::PULL_OK) {
+    return false;
+  }
+
+  unit.spans[0].iov_base = packet.data.data();
+  unit.spans[0].iov_len = packet.data.size();
+  unit.count = 1;
+  unit.timestamp = packet.timestamp;
+
+  return true;
+}
+
+/*
+ * Hands every output frame or access unit to the callback, or to the pull
+ * queue. Runs on the output stage thread.
+ */
+class SessionOutput : public OutputCallback {
+ public:
+  SessionOutput(const MvxSessionConfig &config, PacketQueue &queue)
+      : OutputCallback(config.outputFormat), queue(queue) {}
+
+  void setCallback(const MvxSession::OutputCallback &callback) {
+    this->callback = callback;
+  }
+
+ protected:
+  virtual void deliver(const MemoryUnit &unit);
+
+ private:
+  PacketQueue &queue;
+  MvxSession::OutputCallback callback;
+};
+
+void SessionOutput::deliver(const MemoryUnit &unit) {
+  MvxPacket packet;
+
+  packet.timestamp = unit.timestamp;
+  packet.flags = 0;
+  packet.flags |=
+      (unit.flags & V4L2_BUF_FLAG_KEYFRAME) ? MVX_PACKET_KEYFRAME : 0;
+  packet.flags |= (unit.flags & V4L2_BUF_FLAG_MVX_CODEC_CONFIG)
+                      ? MVX_PACKET_CODEC_CONFIG
+                      : 0;
+  packet.flags |= (unit.flags & V4L2_BUF_FLAG_LAST) ? MVX_PACKET_EOS : 0;
+
+  /* A single plane goes out without a copy. */
+  if (callback && unit.count == 1) {
+    packet.data = unit.spans[0].iov_base;
+    packet.size = unit.spans[0].iov_len;
+    callback(packet);
+    return;
+  }
+
+  Packet copy;
+  for (size_t i = 0; i < unit.count; ++i) {
+    const uint8_t *data = static_cast<const uint8_t *>(unit.spans[i].iov_base);
+    copy.data.insert(copy.data.end(), data, data + unit.spans[i].iov_len);
+  }
+
+  if (callback) {
+    packet.data = copy.data.data();
+    packet.size = copy.data.size();
+    callback(packet);
+  } else {
+    copy.timestamp = packet.timestamp;
+    copy.flags = packet.flags;
+    queue.push(copy);
+  }
+}
+
+/****************************************************************************
+ * Session
+ ****************************************************************************/
+
+MvxSessionConfig::MvxSessionConfig()
+    : device("/dev/video0"),
+      encode(false),
+      inputFormat(V4L2_PIX_FMT_H264),
+      outputFormat(V4L2_PIX_FMT_NV12),
+      width(0),
+      height(0),
+      strideAlign(1),
+      fps(0),
+      bitrate(0),
+      inputBuffers(0),
+      outputBuffers(0),
+      queueDepth(8),
+      watchdog(0) {}
+
+/* Hidden, members of nested classes are exported with the outer class. */
+struct __attribute__((visibility("hidden"))) MvxSession::Impl {
+  Impl(const MvxSessionConfig &config)
+      : config(config),
+        log(&logBuffer),
+        inputQueue(config.queueDepth),
+        outputQueue(0),
+        input(config, inputQueue),
+        output(config, outputQueue),
+        codec(NULL),
+        started(false),
+        joined(false),
+        result(1) {}
+
+  static void *run(void *arg);
+  void configure();
+
+  MvxSessionConfig config;
+  LogBuffer logBuffer;
+  ostream log;
+  PacketQueue inputQueue;
+  PacketQueue outputQueue;
+  SessionInput input;
+  SessionOutput output;
+  Codec *codec;
+  pthread_t thread;
+  bool started;
+  bool joined;
+  int result;
+  string error;
+};
+
+/* Same loop as Codec::stream(), keeping the error for getError(). */
+void *MvxSession::Impl::run(void *arg) {
+  Impl *impl = static_cast<Impl *>(arg);
+
+  try {
+    bool eos = false;
+
+    impl->codec->start();
+    while (!eos) {
+      struct pollfd p[CODEC_POLL_FDS];
+      size_t nfds = impl->codec->getPollFds(p, CODEC_POLL_FDS);
+
+      if (poll(p, nfds, -1) < 0) {
+        throw Exception("Poll returned error code.");
+      }
+
+      eos = impl->codec->handlePollFds(p, nfds);
+    }
+    impl->codec->finish();
+    impl->result = 0;
+  } catch (std::exception &e) {
+    impl->error = e.what();
+    impl->log << "Error: " << e.what() << endl;
+  } catch (...) {
+    impl->error = "Unknown exception on the session thread.";
+    impl->log << "Error: " << impl->error << endl;
+  }
+
+  /* Unblock the input stage and the application. */
+  impl->inputQueue.abort();
+  impl->outputQueue.end();
+
+  return NULL;
+}
+
+void MvxSession::Impl::configure() {
+  if (config.encode) {
+    Encoder *encoder = new Encoder(config.device.c_str(), input.get(),
+                                   output, false, log);
+    codec = encoder;
+    if (config.fps != 0) {
+      encoder->setFramerate(config.fps);
+    }
+    if (config.bitrate != 0) {
+      encoder->setBitrate(config.bitrate);
+    }
+  } else {
+    Decoder *decoder = new Decoder(config.device.c_str(), input.get(),
+                                   output, false, log);
+    codec = decoder;
+    decoder->setNaluFormat(V4L2_OPT_NALU_FORMAT_ONE_FRAME_PER_BUFFER);
+    if (config.fps != 0) {
+      decoder->setFramerate(config.fps);
+    }
+  }
+
+  codec->setWatchdog(config.watchdog);
+  if (config.inputBuffers != 0 || config.outputBuffers != 0) {
+    codec->setBufferCounts(config.inputBuffers, config.outputBuffers);
+  }
+}
+
+MvxSession::MvxSession(const MvxSessionConfig &config)
+    : impl(new Impl(config)) {}
+
+MvxSession::~MvxSession() {
+  if (impl->started && !impl->joined) {
+    impl->inputQueue.abort();
+    pthread_join(impl->thread, NULL);
+  }
+
+  delete impl->codec;
+  delete impl;
+}
+
+unsigned int MvxSession::getVersion() {
+  return (MVX_SESSION_VERSION_MAJOR << 16) | MVX_SESSION_VERSION_MINOR;
+}
+
+void MvxSession::setOutputCallback(const OutputCallback &callback) {
+  impl->output.setCallback(callback);
+}
+
+void MvxSession::setLogCallback(const LogCallback &callback) {
+  impl->logBuffer.setCallback(callback);
+}
+
+bool MvxSession::start() {
+  if (impl->started) {
+    return false;
+  }
+
+  try {
+    impl->configure();
+  } catch (std::exception &e) {
+    impl->error = e.what();
+    return false;
+  } catch (...) {
+    impl->error = "Unknown exception while configuring the session.";
+    return false;
+  }
+
+  if (pthread_create(&impl->thread, NULL, Impl::run, impl) != 0) {
+    impl->error = "Failed to create session thread.";
+    return false;
+  }
+
+  impl->started = true;
+  return true;
+}
+
+/* Copies the packet, blocks while queueDepth packets are waiting. */
+bool MvxSession::push(const void *data, size_t size, uint64_t timestamp) {
+  Packet packet;
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+
+  packet.data.assign(bytes, bytes + size);
+  packet.timestamp = timestamp;
+  packet.flags = 0;
+
+  return impl->inputQueue.push(packet);
+}
+
+void MvxSession::end() { impl->inputQueue.end(); }
+
+MvxSession::PullResult MvxSession::pull(vector<uint8_t> &data,
+                                        uint64_t &timestamp, uint32_t &flags,
+                                        int timeout) {
+  Packet packet;
+  PullResult result = impl->outputQueue.pop(packet, timeout);
+
+  if (result == PULL_OK) {
+    data.swap(packet.data);
+    timestamp = packet.timestamp;
+    flags = packet.flags;
+  }
+
+  return result;
+}
+
+int MvxSession::wait() {
+  if (!impl->started) {
+    return 1;
+  }
+
+  if (!impl->joined) {
+    pthread_join(impl->thread, NULL);
+    impl->joined = true;
+  }
+
+  return impl->result;
+}
+
+const string &MvxSession::getError() const { return impl->error; }
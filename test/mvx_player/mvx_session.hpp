@@ -0,0 +1,144 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+#ifndef __MVX_SESSION_H__
+#define __MVX_SESSION_H__
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/****************************************************************************
+ * Version
+ ****************************************************************************/
+
+/*
+ * The API of libmvxplayer. The major version, also the soname version, is
+ * bumped on any incompatible change. Only the classes in this header are
+ * exported from the library.
+ */
+#define MVX_SESSION_VERSION_MAJOR 1
+#define MVX_SESSION_VERSION_MINOR 0
+
+#define MVX_SESSION_EXPORT __attribute__((visibility("default")))
+
+/****************************************************************************
+ * Session
+ ****************************************************************************/
+
+/* Flags of an MvxPacket. */
+#define MVX_PACKET_KEYFRAME (1 << 0)
+#define MVX_PACKET_CODEC_CONFIG (1 << 1)
+#define MVX_PACKET_EOS (1 << 2)
+
+/*
+ * An access unit of bitstream or a raw frame. Frames have their planes one
+ * after the other, each padded to the stride alignment of the session.
+ */
+struct MvxPacket {
+  const void *data;
+  size_t size;
+  uint64_t timestamp; /* us */
+  uint32_t flags;
+};
+
+struct MVX_SESSION_EXPORT MvxSessionConfig {
+  MvxSessionConfig();
+
+  std::string device;
+  bool encode;
+  uint32_t inputFormat; /* V4L2 fourcc */
+  uint32_t outputFormat;
+  unsigned int width; /* Of raw frames, encode only. */
+  unsigned int height;
+  unsigned int strideAlign;
+  unsigned int fps;     /* 0 for the driver default. */
+  unsigned int bitrate; /* bps, encode only, 0 for the driver default. */
+  unsigned int inputBuffers; /* 0 for the default. */
+  unsigned int outputBuffers;
+  unsigned int queueDepth; /* Packets push() buffers before it blocks. */
+  int watchdog;            /* ms without progress before failing, 0 off. */
+};
+
+/*
+ * One decode or encode session on a VPU device, fed and drained from memory.
+ *
+ * start() configures the device and runs the session on its own threads.
+ * The application then push()es access units (decode) or frames (encode)
+ * and calls end() after the last one. Output is handed to the output
+ * callback if one is set, and queued for pull() otherwise. wait() returns
+ * once the end of stream has come out of the device.
+ *
+ * Callbacks are called from session threads and must not call back into
+ * the session. push() and pull() may be called from different threads.
+ */
+class MVX_SESSION_EXPORT MvxSession {
+ public:
+  typedef std::function<void(const MvxPacket &packet)> OutputCallback;
+  typedef std::function<void(const std::string &line)> LogCallback;
+
+  enum PullResult { PULL_OK, PULL_TIMEOUT, PULL_END };
+
+  explicit MvxSession(const MvxSessionConfig &config);
+  ~MvxSession();
+
+  static unsigned int getVersion();
+
+  void setOutputCallback(const OutputCallback &callback);
+  void setLogCallback(const LogCallback &callback);
+
+  bool start();
+  bool push(const void *data, size_t size, uint64_t timestamp);
+  void end();
+  PullResult pull(std::vector<uint8_t> &data, uint64_t &timestamp,
+                  uint32_t &flags, int timeout = -1);
+  int wait();
+
+  const std::string &getError() const;
+
+ private:
+  MvxSession(const MvxSession &);
+  MvxSession &operator=(const MvxSession &);
+
+  struct Impl;
+  Impl *impl;
+};
+
+#endif /* __MVX_SESSION_H__ */
@@ -0,0 +1,166 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include "mvx_trace.hpp"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <fstream>
+
+#include "mvx_player.hpp"
+
+using namespace std;
+
+/****************************************************************************
+ * Trace
+ ****************************************************************************/
+
+atomic<bool> Trace::enabled(false);
+size_t Trace::size = TRACE_RING_SIZE;
+mutex Trace::mutex;
+vector<Trace::Ring *> Trace::rings;
+thread_local Trace::Ring *Trace::ring = NULL;
+
+void Trace::enable(size_t size) {
+  Trace::size = size > 0 ? size : 1;
+  enabled = true;
+}
+
+uint64_t Trace::now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+Trace::Ring *Trace::getRing() {
+  if (ring == NULL) {
+    lock_guard<std::mutex> lock(mutex);
+
+    ring = new Ring();
+    ring->tid = rings.size() + 1;
+    ring->events.resize(size);
+    ring->head = 0;
+    rings.push_back(ring);
+  }
+
+  return ring;
+}
+
+void Trace::record(const TraceEvent &event) {
+  Ring *r = getRing();
+  uint64_t head = r->head.load(memory_order_relaxed);
+
+  r->events[head % r->events.size()] = event;
+  r->head.store(head + 1, memory_order_release);
+}
+
+void Trace::complete(const char *name, const char *category, int session,
+                     int index, uint64_t start) {
+  if (!isEnabled()) {
+    return;
+  }
+
+  TraceEvent event = {start, now() - start, name, category, session, index,
+                      'X'};
+  record(event);
+}
+
+void Trace::instant(const char *name, const char *category, int session,
+                    int index) {
+  if (!isEnabled()) {
+    return;
+  }
+
+  TraceEvent event = {now(), 0, name, category, session, index, 'i'};
+  record(event);
+}
+
+void Trace::write(ostream &os) {
+  lock_guard<std::mutex> lock(mutex);
+  const char *separator = "";
+  char line[256];
+
+  os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+  for (size_t i = 0; i < rings.size(); ++i) {
+    Ring *r = rings[i];
+    uint64_t head = r->head.load(memory_order_acquire);
+    uint64_t count = head < r->events.size() ? head : r->events.size();
+
+    for (uint64_t j = head - count; j < head; ++j) {
+      const TraceEvent &e = r->events[j % r->events.size()];
+
+      /* Chrome trace times are in microseconds. */
+      snprintf(line, sizeof(line),
+               "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+               "\"ts\":%" PRIu64 ".%03" PRIu64 ",",
+               separator, e.name, e.category, e.phase, e.start / 1000,
+               e.start % 1000);
+      os << line;
+
+      if (e.phase == 'X') {
+        snprintf(line, sizeof(line), "\"dur\":%" PRIu64 ".%03" PRIu64 ",",
+                 e.duration / 1000, e.duration % 1000);
+        os << line;
+      } else {
+        os << "\"s\":\"t\",";
+      }
+
+      snprintf(line, sizeof(line),
+               "\"pid\":%d,\"tid\":%d,\"args\":{\"index\":%d}}", e.session,
+               r->tid, e.index);
+      os << line;
+      separator = ",";
+    }
+  }
+
+  os << "\n]}\n";
+}
+
+void Trace::write(const char *path) {
+  ofstream os(path);
+
+  if (!os) {
+    throw Exception("Failed to open trace file. path=%s.", path);
+  }
+
+  write(os);
+}
@@ -0,0 +1,127 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+#ifndef __MVX_TRACE_H__
+#define __MVX_TRACE_H__
+
+/****************************************************************************
+ * Includes
+ ****************************************************************************/
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+/****************************************************************************
+ * Trace
+ ****************************************************************************/
+
+/* Events kept per thread, older events are overwritten. */
+#define TRACE_RING_SIZE 65536
+
+struct TraceEvent {
+  uint64_t start; /* ns, CLOCK_MONOTONIC */
+  uint64_t duration;
+  const char *name;
+  const char *category;
+  int session;
+  int index;
+  char phase; /* 'X' complete, 'i' instant */
+};
+
+/*
+ * Per buffer timeline of a run, exported as Chrome trace JSON which both
+ * chrome://tracing and Perfetto open. Every thread records into its own ring
+ * with no locking; the rings are only read by write() once streaming has
+ * stopped. Names and categories must be string literals.
+ */
+class Trace {
+ public:
+  static void enable(size_t size = TRACE_RING_SIZE);
+  static bool isEnabled() {
+    return enabled.load(std::memory_order_relaxed);
+  }
+
+  static uint64_t now();
+  static void complete(const char *name, const char *category, int session,
+                       int index, uint64_t start);
+  static void instant(const char *name, const char *category, int session,
+                      int index);
+
+  static void write(std::ostream &os);
+  static void write(const char *path);
+
+ private:
+  struct Ring {
+    int tid;
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> head;
+  };
+
+  static Ring *getRing();
+  static void record(const TraceEvent &event);
+
+  static std::atomic<bool> enabled;
+  static size_t size;
+  static std::mutex mutex;
+  static std::vector<Ring *> rings;
+  static thread_local Ring *ring;
+};
+
+/* Records a complete event spanning the scope. */
+class TraceScope {
+ public:
+  TraceScope(const char *name, const char *category, int session, int index)
+      : name(name),
+        category(category),
+        session(session),
+        index(index),
+        start(Trace::isEnabled() ? Trace::now() : 0) {}
+  ~TraceScope() {
+    if (start != 0) {
+      Trace::complete(name, category, session, index, start);
+    }
+  }
+
+ private:
+  const char *name;
+  const char *category;
+  int session;
+  int index;
+  uint64_t start;
+};
+
+#endif /* __MVX_TRACE_H__ */
@@ -131,15 +131,44 @@ class parser {
     bool new_frame;
     bool config;
     bool slice;
+    bool idr;  // Slice of an IDR picture.
+    int qp;  // Slice QP, -1 if the header could not be followed that far.
     info() {
       new_frame = false;
       config = false;
       slice = false;
+      idr = false;
+      qp = -1;
     }
   };
   virtual bool parse(reader::packet_info packet, info &inf) = 0;
   virtual ~parser() {}
   virtual void reset() {}
+
+  // Bytes of a slice NAL looked at, enough to reach slice_qp_delta.
+  static const uint32_t header_bytes = 256;
+
+ protected:
+  uint32_t u(bitreader &b, uint32_t n) { return n > 0 ? b.read_bits(n) : 0; }
+
+  uint32_t ue(bitreader &b) { return b.read_exp_golomb(); }
+
+  int32_t se(bitreader &b) {
+    uint32_t c = ue(b);
+    if ((c & 1) == 0) {
+      return -(c >> 1);
+    } else {
+      return 1 + (c >> 1);
+    }
+  }
+
+  static uint32_t ceil_log2(uint32_t v) {
+    uint32_t n = 0;
+    while ((1u << n) < v) {
+      n++;
+    }
+    return n;
+  }
 };
 
 class h264_parser : public parser {
@@ -149,20 +178,39 @@ class h264_parser : public parser {
     int pic_order_cnt_type;
     int log2_max_pic_order_cnt_lsb;
     bool delta_pic_order_always_zero_flag;
+    int chroma_format_idc;
+    bool separate_colour_plane_flag;
     sps_data() {
       log2_max_frame_num = 0;
       frame_mbs_only_flag = false;
       pic_order_cnt_type = 0;
       log2_max_pic_order_cnt_lsb = 0;
       delta_pic_order_always_zero_flag = false;
+      chroma_format_idc = 1;
+      separate_colour_plane_flag = false;
     }
   };
   struct pps_data {
     int sps_id;
     bool pic_order_present_flag;
+    bool entropy_coding_mode_flag;
+    bool slice_groups;
+    int num_ref_idx_default_active[2];
+    bool weighted_pred_flag;
+    int weighted_bipred_idc;
+    int pic_init_qp;
+    bool redundant_pic_cnt_present_flag;
     pps_data() {
       sps_id = 0;
       pic_order_present_flag = false;
+      entropy_coding_mode_flag = false;
+      slice_groups = false;
+      num_ref_idx_default_active[0] = 1;
+      num_ref_idx_default_active[1] = 1;
+      weighted_pred_flag = false;
+      weighted_bipred_idc = 0;
+      pic_init_qp = 26;
+      redundant_pic_cnt_present_flag = false;
     }
   };
 
@@ -195,7 +243,8 @@ class h264_parser : public parser {
     // const int buf_size = 256;
     // uint8_t buf[buf_size];
     // uint32_t bytes = packet.write_to_buffer(buf,32);
-    uint32_t bytes = packet.buf_bytes <= 32 ? packet.buf_bytes : 32;
+    uint32_t bytes =
+        packet.buf_bytes <= header_bytes ? packet.buf_bytes : header_bytes;
     bitreader b(packet.buf, bytes);
 
     b.read_bits(1);  // forbidden_zero_bit
@@ -211,15 +260,22 @@ class h264_parser : public parser {
       case 5:  // slice
       {
         inf.slice = true;
+        inf.idr = nal_unit_type == 5;
 
         ue(b);  // first_mb_in_slice
-        ue(b);  // slice_type
+        int slice_type = ue(b) % 5;
         int pps_id = ue(b);
+        if (pps_id >= 256) {
+          break;
+        }
         pps_data &p = pps[pps_id];
         sps_data &s = sps[p.sps_id];
         int log2_max_frame_num = s.log2_max_frame_num;
 
-        int frame_num = b.read_bits(log2_max_frame_num);
+        if (s.separate_colour_plane_flag) {
+          b.read_bits(2);  // colour_plane_id
+        }
+        int frame_num = u(b, log2_max_frame_num);
 
         int field_mode = 0;
         if (!s.frame_mbs_only_flag) {
@@ -239,7 +295,7 @@ class h264_parser : public parser {
         int pic_order_cnt_0 = 0;
         int pic_order_cnt_1 = 0;
         if (pic_order_cnt_type == 0) {
-          pic_order_cnt_0 = b.read_bits(s.log2_max_pic_order_cnt_lsb);
+          pic_order_cnt_0 = u(b, s.log2_max_pic_order_cnt_lsb);
           if (p.pic_order_present_flag && field_mode == 0) {
             pic_order_cnt_1 = se(b);
           }
@@ -281,6 +337,12 @@ class h264_parser : public parser {
         last_frame_num = frame_num;
         last_pic_order_cnt_0 = pic_order_cnt_0;
         last_pic_order_cnt_1 = pic_order_cnt_1;
+
+        int qp = slice_qp(b, p, s, slice_type, nal_unit_type, nal_ref_idc,
+                          field_mode != 0);
+        if (!b.eos) {
+          inf.qp = qp;
+        }
         // printf("first_mb_in_slice %d, slice_type %d, pps_id %d, frame_num %d
         // pic_order_cnt_type %d pic_order_cnt_0 %d pic_order_cnt_1 %d
         // log2_max_pic_order_cnt_lsb %d \n",first_mb_in_slice,slice_type
@@ -301,14 +363,32 @@ class h264_parser : public parser {
         inf.config = true;
         int pic_parameter_set_id = ue(b);
         int seq_parameter_set_id = ue(b);
-        b.read_bits(1);  // entropy_coding_mode_flag
+        if (pic_parameter_set_id >= 256 || seq_parameter_set_id >= 32) {
+          break;
+        }
+        pps_data &p = pps[pic_parameter_set_id];
+        p.entropy_coding_mode_flag = b.read_bits(1);
 
         /* bottom_field_pic_order_in_frame_present_flag */
         bool pic_order_present_flag = b.read_bits(1);
 
-        pps[pic_parameter_set_id].sps_id = seq_parameter_set_id;
-        pps[pic_parameter_set_id].pic_order_present_flag =
-            pic_order_present_flag;
+        p.sps_id = seq_parameter_set_id;
+        p.pic_order_present_flag = pic_order_present_flag;
+
+        /* Slice groups are not followed, their slices report no QP. */
+        p.slice_groups = ue(b) > 0;  // num_slice_groups_minus1
+        if (!p.slice_groups) {
+          p.num_ref_idx_default_active[0] = ue(b) + 1;
+          p.num_ref_idx_default_active[1] = ue(b) + 1;
+          p.weighted_pred_flag = b.read_bits(1);
+          p.weighted_bipred_idc = b.read_bits(2);
+          p.pic_init_qp = 26 + se(b);
+          se(b);           // pic_init_qs_minus26
+          se(b);           // chroma_qp_index_offset
+          b.read_bits(1);  // deblocking_filter_control_present_flag
+          b.read_bits(1);  // constrained_intra_pred_flag
+          p.redundant_pic_cnt_present_flag = b.read_bits(1);
+        }
         // printf("PPS pic_parameter_set_id %d, pic_parameter_set_id
         // %d\n",pic_parameter_set_id,pic_parameter_set_id);
         break;
@@ -326,17 +406,24 @@ class h264_parser : public parser {
         b.read_bits(8);  // constra_and_res
         b.read_bits(8);  // level_idc
         int sps_id = ue(b);
+        if (sps_id >= 32) {
+          break;
+        }
+        sps_data *s = &sps[sps_id];
 
         // printf("profile_idc %d, cc %d, level %d, id
         // %d\n",profile_idc,constra_and_res,level_idc,sps_id);
 
+        s->chroma_format_idc = 1;
+        s->separate_colour_plane_flag = false;
         if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 ||
             profile_idc == 244 || profile_idc == 44 || profile_idc == 83 ||
             profile_idc == 86 || profile_idc == 118 || profile_idc == 128) {
           int chroma_format_idc = ue(b);
 
+          s->chroma_format_idc = chroma_format_idc;
           if (chroma_format_idc == 3) {
-            b.read_bits(1);  // separate_colour_plane_flag
+            s->separate_colour_plane_flag = b.read_bits(1);
           }
           ue(b);           // bit_depth_luma_minus8
           ue(b);           // bit_depth_chroma_minus8
@@ -361,7 +448,6 @@ class h264_parser : public parser {
         int log2_max_frame_num = ue(b) + 4;
         // printf("log2_max_frame_num %d\n",log2_max_frame_num);
 
-        sps_data *s = &sps[sps_id];
         s->log2_max_frame_num = log2_max_frame_num;
 
         int pic_order_cnt_type = ue(b);
@@ -401,15 +487,106 @@ class h264_parser : public parser {
   }
 
  private:
-  uint32_t ue(bitreader &b) { return b.read_exp_golomb(); }
+  enum slice_type { SLICE_P, SLICE_B, SLICE_I, SLICE_SP, SLICE_SI };
+
+  // Walks the rest of a slice header, from redundant_pic_cnt to
+  // slice_qp_delta, and returns the slice QP or -1.
+  int slice_qp(bitreader &b, const pps_data &p, const sps_data &s,
+               int slice_type, int nal_unit_type, int nal_ref_idc,
+               bool field_pic) {
+    int num_ref_idx_active[2] = {p.num_ref_idx_default_active[0],
+                                 p.num_ref_idx_default_active[1]};
+    bool inter = slice_type != SLICE_I && slice_type != SLICE_SI;
+    int lists = slice_type == SLICE_B ? 2 : 1;
+
+    if (p.slice_groups) {
+      return -1;
+    }
+    if (p.redundant_pic_cnt_present_flag) {
+      ue(b);  // redundant_pic_cnt
+    }
+    if (slice_type == SLICE_B) {
+      b.read_bits(1);  // direct_spatial_mv_pred_flag
+    }
+    if (inter) {
+      if (b.read_bits(1)) {  // num_ref_idx_active_override_flag
+        for (int i = 0; i < lists; i++) {
+          num_ref_idx_active[i] = ue(b) + 1;
+        }
+      }
 
-  int32_t se(bitreader &b) {
-    uint32_t c = ue(b);
-    if ((c & 1) == 0) {
-      return -(c >> 1);
-    } else {
-      return 1 + (c >> 1);
+      // ref_pic_list_modification
+      for (int i = 0; i < lists && !b.eos; i++) {
+        if (b.read_bits(1)) {
+          uint32_t idc;
+          do {
+            idc = ue(b);  // modification_of_pic_nums_idc
+            if (idc != 3) {
+              ue(b);  // abs_diff_pic_num_minus1 or long_term_pic_num
+            }
+          } while (idc != 3 && !b.eos);
+        }
+      }
+    }
+
+    if ((p.weighted_pred_flag &&
+         (slice_type == SLICE_P || slice_type == SLICE_SP)) ||
+        (p.weighted_bipred_idc == 1 && slice_type == SLICE_B)) {
+      int max_refs = field_pic ? 32 : 16;
+      bool chroma = s.chroma_format_idc != 0 && !s.separate_colour_plane_flag;
+
+      ue(b);  // luma_log2_weight_denom
+      if (chroma) {
+        ue(b);  // chroma_log2_weight_denom
+      }
+      for (int i = 0; i < lists; i++) {
+        if (num_ref_idx_active[i] > max_refs) {
+          return -1;
+        }
+        for (int j = 0; j < num_ref_idx_active[i] && !b.eos; j++) {
+          if (b.read_bits(1)) {  // luma_weight_flag
+            se(b);
+            se(b);
+          }
+          if (chroma && b.read_bits(1)) {  // chroma_weight_flag
+            for (int k = 0; k < 4; k++) {
+              se(b);
+            }
+          }
+        }
+      }
+    }
+
+    // dec_ref_pic_marking
+    if (nal_ref_idc != 0) {
+      if (nal_unit_type == 5) {
+        b.read_bits(1);  // no_output_of_prior_pics_flag
+        b.read_bits(1);  // long_term_reference_flag
+      } else if (b.read_bits(1)) {  // adaptive_ref_pic_marking_mode_flag
+        uint32_t mmco;
+        do {
+          mmco = ue(b);  // memory_management_control_operation
+          if (mmco == 1 || mmco == 3) {
+            ue(b);  // difference_of_pic_nums_minus1
+          }
+          if (mmco == 2) {
+            ue(b);  // long_term_pic_num
+          }
+          if (mmco == 3 || mmco == 6) {
+            ue(b);  // long_term_frame_idx
+          }
+          if (mmco == 4) {
+            ue(b);  // max_long_term_frame_idx_plus1
+          }
+        } while (mmco != 0 && !b.eos);
+      }
+    }
+
+    if (p.entropy_coding_mode_flag && inter) {
+      ue(b);  // cabac_init_idc
     }
+
+    return p.pic_init_qp + se(b);  // slice_qp_delta
   }
 
   void scaling_list(bitreader &b, int sizeOfScalingList) {
@@ -429,6 +606,51 @@ class h264_parser : public parser {
 class hevc_parser : public parser {
   // int find_new_frame_count;
 
+  struct st_rps {
+    int num_negative;
+    int num_positive;
+    int delta_poc_s0[16];
+    bool used_s0[16];
+    int delta_poc_s1[16];
+    bool used_s1[16];
+    st_rps() {
+      num_negative = 0;
+      num_positive = 0;
+    }
+  };
+  struct sps_data {
+    bool valid;
+    int chroma_array_type;
+    bool separate_colour_plane_flag;
+    int log2_max_pic_order_cnt_lsb;
+    int pic_size_in_ctbs;
+    bool sample_adaptive_offset_enabled_flag;
+    int num_short_term_ref_pic_sets;
+    st_rps rps[64];
+    bool long_term_ref_pics_present_flag;
+    int num_long_term_ref_pics_sps;
+    bool used_by_curr_pic_lt_sps[32];
+    bool temporal_mvp_enabled_flag;
+    sps_data() { valid = false; }
+  };
+  struct pps_data {
+    bool valid;
+    int sps_id;
+    bool dependent_slice_segments_enabled_flag;
+    bool output_flag_present_flag;
+    int num_extra_slice_header_bits;
+    bool cabac_init_present_flag;
+    int num_ref_idx_default_active[2];
+    int init_qp;
+    bool weighted_pred_flag;
+    bool weighted_bipred_flag;
+    bool lists_modification_present_flag;
+    pps_data() { valid = false; }
+  };
+
+  sps_data sps[16];
+  pps_data pps[64];
+
  public:
   hevc_parser() {}
 
@@ -436,7 +658,8 @@ class hevc_parser : public parser {
     // uint8_t buf[32];
     // uint32_t r = packet.write_to_buffer(buf,32);
     // bitreader b(buf,r);
-    uint32_t bytes = packet.buf_bytes <= 32 ? packet.buf_bytes : 32;
+    uint32_t bytes =
+        packet.buf_bytes <= header_bytes ? packet.buf_bytes : header_bytes;
     bitreader b(packet.buf, bytes);
 
     int forbidden_zero_bit = b.read_bits(1);
@@ -470,31 +693,506 @@ class hevc_parser : public parser {
       case HEVC_NAL_CRA: {
         // printf("Slice\n");
         inf.slice = true;
+        inf.idr = nal_unit_type == HEVC_NAL_IDR_W_RADL ||
+                  nal_unit_type == HEVC_NAL_IDR_N_LP;
 
         uint32_t first_slice_segment_in_pic = b.read_bits(1);
         if (first_slice_segment_in_pic) {
           inf.new_frame = true;
         }
+
+        int qp = slice_qp(b, nal_unit_type, first_slice_segment_in_pic);
+        if (!b.eos) {
+          inf.qp = qp;
+        }
         break;
       }
       case HEVC_NAL_VPS:
         // printf("VPS\n");
         inf.config = true;
         break;
-      case HEVC_NAL_SPS:
+      case HEVC_NAL_SPS: {
         // printf("SPS\n");
         inf.config = true;
+
+        bitreader bs(packet.buf + 2, packet.buf_bytes - 2);
+        parse_sps(bs);
         break;
-      case HEVC_NAL_PPS:
+      }
+      case HEVC_NAL_PPS: {
         // printf("PPS\n");
         inf.config = true;
+
+        bitreader bp(packet.buf + 2, packet.buf_bytes - 2);
+        parse_pps(bp);
         break;
+      }
       default:
         // printf("NAL %d\n",nal_unit_type);
         break;
     }
     return true;
   }
+
+ private:
+  enum slice_type { SLICE_B, SLICE_P, SLICE_I };
+
+  void skip_bits(bitreader &b, uint32_t n) {
+    while (n > 0 && !b.eos) {
+      uint32_t k = n > 16 ? 16 : n;
+      b.read_bits(k);
+      n -= k;
+    }
+  }
+
+  void profile_tier_level(bitreader &b, int max_sub_layers_minus1) {
+    bool profile_present[8];
+    bool level_present[8];
+
+    skip_bits(b, 96);  // general profile, tier and level
+    for (int i = 0; i < max_sub_layers_minus1; i++) {
+      profile_present[i] = b.read_bits(1);
+      level_present[i] = b.read_bits(1);
+    }
+    if (max_sub_layers_minus1 > 0) {
+      skip_bits(b, 2 * (8 - max_sub_layers_minus1));  // reserved_zero_2bits
+    }
+    for (int i = 0; i < max_sub_layers_minus1; i++) {
+      skip_bits(b, profile_present[i] ? 88 : 0);
+      skip_bits(b, level_present[i] ? 8 : 0);
+    }
+  }
+
+  void scaling_list_data(bitreader &b) {
+    for (int size_id = 0; size_id < 4; size_id++) {
+      for (int matrix_id = 0; matrix_id < 6 && !b.eos;
+           matrix_id += (size_id == 3) ? 3 : 1) {
+        if (!b.read_bits(1)) {  // scaling_list_pred_mode_flag
+          ue(b);                // scaling_list_pred_matrix_id_delta
+          continue;
+        }
+        int coef_num = 1 << (4 + (size_id << 1));
+        if (coef_num > 64) {
+          coef_num = 64;
+        }
+        if (size_id > 1) {
+          se(b);  // scaling_list_dc_coef_minus8
+        }
+        for (int i = 0; i < coef_num && !b.eos; i++) {
+          se(b);  // scaling_list_delta_coef
+        }
+      }
+    }
+  }
+
+  // Parses st_ref_pic_set(idx) into r, deriving the delta POCs of
+  // predicted sets from the set they refer to. Returns false on bad data.
+  bool st_ref_pic_set(bitreader &b, const sps_data &s, int idx, st_rps &r) {
+    bool inter_ref_pic_set_prediction_flag = false;
+
+    if (idx != 0) {
+      inter_ref_pic_set_prediction_flag = b.read_bits(1);
+    }
+
+    if (inter_ref_pic_set_prediction_flag) {
+      uint32_t delta_idx_minus1 = 0;
+      if (idx == s.num_short_term_ref_pic_sets) {
+        delta_idx_minus1 = ue(b);
+      }
+      if (delta_idx_minus1 >= (uint32_t)idx) {
+        return false;
+      }
+      const st_rps &ref = s.rps[idx - (delta_idx_minus1 + 1)];
+      int sign = b.read_bits(1);  // delta_rps_sign
+      int delta_rps = (1 - 2 * sign) * (int)(ue(b) + 1);
+      int num_delta_pocs = ref.num_negative + ref.num_positive;
+      bool used[17];
+      bool use_delta[17];
+
+      for (int j = 0; j <= num_delta_pocs; j++) {
+        used[j] = b.read_bits(1);
+        use_delta[j] = used[j] ? true : b.read_bits(1);
+      }
+
+      int i = 0;
+      for (int j = ref.num_positive - 1; j >= 0; j--) {
+        int d = ref.delta_poc_s1[j] + delta_rps;
+        if (d < 0 && use_delta[ref.num_negative + j] && i < 16) {
+          r.delta_poc_s0[i] = d;
+          r.used_s0[i++] = used[ref.num_negative + j];
+        }
+      }
+      if (delta_rps < 0 && use_delta[num_delta_pocs] && i < 16) {
+        r.delta_poc_s0[i] = delta_rps;
+        r.used_s0[i++] = used[num_delta_pocs];
+      }
+      for (int j = 0; j < ref.num_negative; j++) {
+        int d = ref.delta_poc_s0[j] + delta_rps;
+        if (d < 0 && use_delta[j] && i < 16) {
+          r.delta_poc_s0[i] = d;
+          r.used_s0[i++] = used[j];
+        }
+      }
+      r.num_negative = i;
+
+      i = 0;
+      for (int j = ref.num_negative - 1; j >= 0; j--) {
+        int d = ref.delta_poc_s0[j] + delta_rps;
+        if (d > 0 && use_delta[j] && i < 16) {
+          r.delta_poc_s1[i] = d;
+          r.used_s1[i++] = used[j];
+        }
+      }
+      if (delta_rps > 0 && use_delta[num_delta_pocs] && i < 16) {
+        r.delta_poc_s1[i] = delta_rps;
+        r.used_s1[i++] = used[num_delta_pocs];
+      }
+      for (int j = 0; j < ref.num_positive; j++) {
+        int d = ref.delta_poc_s1[j] + delta_rps;
+        if (d > 0 && use_delta[ref.num_negative + j] && i < 16) {
+          r.delta_poc_s1[i] = d;
+          r.used_s1[i++] = used[ref.num_negative + j];
+        }
+      }
+      r.num_positive = i;
+    } else {
+      uint32_t num_negative = ue(b);
+      uint32_t num_positive = ue(b);
+      if (num_negative > 16 || num_positive > 16 - num_negative) {
+        return false;
+      }
+
+      int poc = 0;
+      for (uint32_t i = 0; i < num_negative; i++) {
+        poc -= ue(b) + 1;  // delta_poc_s0_minus1
+        r.delta_poc_s0[i] = poc;
+        r.used_s0[i] = b.read_bits(1);
+      }
+      poc = 0;
+      for (uint32_t i = 0; i < num_positive; i++) {
+        poc += ue(b) + 1;  // delta_poc_s1_minus1
+        r.delta_poc_s1[i] = poc;
+        r.used_s1[i] = b.read_bits(1);
+      }
+      r.num_negative = num_negative;
+      r.num_positive = num_positive;
+    }
+
+    return !b.eos;
+  }
+
+  // Keeps the SPS fields the slice header layout depends on.
+  void parse_sps(bitreader &b) {
+    b.read_bits(4);  // sps_video_parameter_set_id
+    int max_sub_layers_minus1 = b.read_bits(3);
+    b.read_bits(1);  // sps_temporal_id_nesting_flag
+    profile_tier_level(b, max_sub_layers_minus1);
+
+    uint32_t sps_id = ue(b);
+    if (sps_id >= 16 || max_sub_layers_minus1 > 6) {
+      return;
+    }
+    sps_data &s = sps[sps_id];
+    s.valid = false;
+
+    int chroma_format_idc = ue(b);
+    s.separate_colour_plane_flag = false;
+    if (chroma_format_idc == 3) {
+      s.separate_colour_plane_flag = b.read_bits(1);
+    }
+    s.chroma_array_type = s.separate_colour_plane_flag ? 0 : chroma_format_idc;
+    uint32_t width = ue(b);   // pic_width_in_luma_samples
+    uint32_t height = ue(b);  // pic_height_in_luma_samples
+    if (b.read_bits(1)) {     // conformance_window_flag
+      for (int i = 0; i < 4; i++) {
+        ue(b);
+      }
+    }
+    ue(b);  // bit_depth_luma_minus8
+    ue(b);  // bit_depth_chroma_minus8
+    s.log2_max_pic_order_cnt_lsb = ue(b) + 4;
+    bool sub_layer_ordering_info_present = b.read_bits(1);
+    for (int i = sub_layer_ordering_info_present ? 0 : max_sub_layers_minus1;
+         i <= max_sub_layers_minus1; i++) {
+      ue(b);  // sps_max_dec_pic_buffering_minus1
+      ue(b);  // sps_max_num_reorder_pics
+      ue(b);  // sps_max_latency_increase_plus1
+    }
+    uint32_t log2_min_cb = ue(b) + 3;
+    uint32_t log2_ctb = log2_min_cb + ue(b);
+    if (log2_ctb > 6) {
+      return;
+    }
+    uint32_t ctb = 1u << log2_ctb;
+    s.pic_size_in_ctbs = ((width + ctb - 1) >> log2_ctb) *
+                         ((height + ctb - 1) >> log2_ctb);
+    ue(b);                 // log2_min_luma_transform_block_size_minus2
+    ue(b);                 // log2_diff_max_min_luma_transform_block_size
+    ue(b);                 // max_transform_hierarchy_depth_inter
+    ue(b);                 // max_transform_hierarchy_depth_intra
+    if (b.read_bits(1)) {  // scaling_list_enabled_flag
+      if (b.read_bits(1)) {  // sps_scaling_list_data_present_flag
+        scaling_list_data(b);
+      }
+    }
+    b.read_bits(1);  // amp_enabled_flag
+    s.sample_adaptive_offset_enabled_flag = b.read_bits(1);
+    if (b.read_bits(1)) {  // pcm_enabled_flag
+      b.read_bits(8);      // pcm sample bit depths
+      ue(b);               // log2_min_pcm_luma_coding_block_size_minus3
+      ue(b);               // log2_diff_max_min_pcm_luma_coding_block_size
+      b.read_bits(1);      // pcm_loop_filter_disabled_flag
+    }
+    uint32_t num_sets = ue(b);
+    if (num_sets > 64) {
+      return;
+    }
+    s.num_short_term_ref_pic_sets = num_sets;
+    for (uint32_t i = 0; i < num_sets; i++) {
+      if (!st_ref_pic_set(b, s, i, s.rps[i])) {
+        return;
+      }
+    }
+    s.long_term_ref_pics_present_flag = b.read_bits(1);
+    s.num_long_term_ref_pics_sps = 0;
+    if (s.long_term_ref_pics_present_flag) {
+      uint32_t num = ue(b);
+      if (num > 32) {
+        return;
+      }
+      s.num_long_term_ref_pics_sps = num;
+      for (uint32_t i = 0; i < num; i++) {
+        u(b, s.log2_max_pic_order_cnt_lsb);  // lt_ref_pic_poc_lsb_sps
+        s.used_by_curr_pic_lt_sps[i] = b.read_bits(1);
+      }
+    }
+    s.temporal_mvp_enabled_flag = b.read_bits(1);
+    s.valid = !b.eos;
+  }
+
+  // Keeps the PPS fields the slice header layout and QP depend on.
+  void parse_pps(bitreader &b) {
+    uint32_t pps_id = ue(b);
+    uint32_t sps_id = ue(b);
+    if (pps_id >= 64 || sps_id >= 16) {
+      return;
+    }
+    pps_data &p = pps[pps_id];
+    p.valid = false;
+    p.sps_id = sps_id;
+    p.dependent_slice_segments_enabled_flag = b.read_bits(1);
+    p.output_flag_present_flag = b.read_bits(1);
+    p.num_extra_slice_header_bits = b.read_bits(3);
+    b.read_bits(1);  // sign_data_hiding_enabled_flag
+    p.cabac_init_present_flag = b.read_bits(1);
+    p.num_ref_idx_default_active[0] = ue(b) + 1;
+    p.num_ref_idx_default_active[1] = ue(b) + 1;
+    p.init_qp = 26 + se(b);
+    b.read_bits(1);        // constrained_intra_pred_flag
+    b.read_bits(1);        // transform_skip_enabled_flag
+    if (b.read_bits(1)) {  // cu_qp_delta_enabled_flag
+      ue(b);               // diff_cu_qp_delta_depth
+    }
+    se(b);           // pps_cb_qp_offset
+    se(b);           // pps_cr_qp_offset
+    b.read_bits(1);  // pps_slice_chroma_qp_offsets_present_flag
+    p.weighted_pred_flag = b.read_bits(1);
+    p.weighted_bipred_flag = b.read_bits(1);
+    b.read_bits(1);                  // transquant_bypass_enabled_flag
+    bool tiles = b.read_bits(1);     // tiles_enabled_flag
+    b.read_bits(1);                  // entropy_coding_sync_enabled_flag
+    if (tiles) {
+      uint32_t columns = ue(b) + 1;  // num_tile_columns_minus1
+      uint32_t rows = ue(b) + 1;     // num_tile_rows_minus1
+      if (!b.read_bits(1)) {         // uniform_spacing_flag
+        for (uint32_t i = 0; i + 1 < columns && !b.eos; i++) {
+          ue(b);  // column_width_minus1
+        }
+        for (uint32_t i = 0; i + 1 < rows && !b.eos; i++) {
+          ue(b);  // row_height_minus1
+        }
+      }
+      b.read_bits(1);  // loop_filter_across_tiles_enabled_flag
+    }
+    b.read_bits(1);        // pps_loop_filter_across_slices_enabled_flag
+    if (b.read_bits(1)) {  // deblocking_filter_control_present_flag
+      b.read_bits(1);      // deblocking_filter_override_enabled_flag
+      if (!b.read_bits(1)) {  // pps_deblocking_filter_disabled_flag
+        se(b);                // pps_beta_offset_div2
+        se(b);                // pps_tc_offset_div2
+      }
+    }
+    if (b.read_bits(1)) {  // pps_scaling_list_data_present_flag
+      scaling_list_data(b);
+    }
+    p.lists_modification_present_flag = b.read_bits(1);
+    p.valid = !b.eos;
+  }
+
+  // Walks a slice segment header up to slice_qp_delta and returns the
+  // slice QP, or -1 for dependent segments and unknown parameter sets.
+  int slice_qp(bitreader &b, int nal_unit_type, bool first_slice_segment) {
+    if (nal_unit_type >= HEVC_NAL_BLA_W_LP &&
+        nal_unit_type <= HEVC_NAL_RSV_IRAP_VCL23) {
+      b.read_bits(1);  // no_output_of_prior_pics_flag
+    }
+    uint32_t pps_id = ue(b);
+    if (pps_id >= 64 || !pps[pps_id].valid ||
+        !sps[pps[pps_id].sps_id].valid) {
+      return -1;
+    }
+    const pps_data &p = pps[pps_id];
+    const sps_data &s = sps[p.sps_id];
+
+    if (!first_slice_segment) {
+      if (p.dependent_slice_segments_enabled_flag && b.read_bits(1)) {
+        return -1;  // dependent_slice_segment_flag
+      }
+      u(b, ceil_log2(s.pic_size_in_ctbs));  // slice_segment_address
+    }
+    skip_bits(b, p.num_extra_slice_header_bits);
+    uint32_t slice_type = ue(b);
+    if (p.output_flag_present_flag) {
+      b.read_bits(1);  // pic_output_flag
+    }
+    if (s.separate_colour_plane_flag) {
+      b.read_bits(2);  // colour_plane_id
+    }
+
+    bool temporal_mvp = false;
+    int num_pic_total_curr = 0;
+    if (nal_unit_type != HEVC_NAL_IDR_W_RADL &&
+        nal_unit_type != HEVC_NAL_IDR_N_LP) {
+      st_rps local;
+      const st_rps *r = &local;
+
+      u(b, s.log2_max_pic_order_cnt_lsb);  // slice_pic_order_cnt_lsb
+      if (!b.read_bits(1)) {  // short_term_ref_pic_set_sps_flag
+        if (!st_ref_pic_set(b, s, s.num_short_term_ref_pic_sets, local)) {
+          return -1;
+        }
+      } else {
+        uint32_t idx =
+            u(b, ceil_log2(s.num_short_term_ref_pic_sets));  // set index
+        if (idx >= (uint32_t)s.num_short_term_ref_pic_sets) {
+          return -1;
+        }
+        r = &s.rps[idx];
+      }
+      for (int i = 0; i < r->num_negative; i++) {
+        num_pic_total_curr += r->used_s0[i];
+      }
+      for (int i = 0; i < r->num_positive; i++) {
+        num_pic_total_curr += r->used_s1[i];
+      }
+
+      if (s.long_term_ref_pics_present_flag) {
+        uint32_t num_lt_sps = 0;
+        if (s.num_long_term_ref_pics_sps > 0) {
+          num_lt_sps = ue(b);  // num_long_term_sps
+        }
+        uint32_t num_lt = num_lt_sps + ue(b);  // num_long_term_pics
+        if (num_lt > 32) {
+          return -1;
+        }
+        for (uint32_t i = 0; i < num_lt && !b.eos; i++) {
+          if (i < num_lt_sps) {
+            uint32_t idx = u(b, ceil_log2(s.num_long_term_ref_pics_sps));
+            if (idx >= (uint32_t)s.num_long_term_ref_pics_sps) {
+              return -1;
+            }
+            num_pic_total_curr += s.used_by_curr_pic_lt_sps[idx];
+          } else {
+            u(b, s.log2_max_pic_order_cnt_lsb);  // poc_lsb_lt
+            num_pic_total_curr += b.read_bits(1);
+          }
+          if (b.read_bits(1)) {  // delta_poc_msb_present_flag
+            ue(b);               // delta_poc_msb_cycle_lt
+          }
+        }
+      }
+      if (s.temporal_mvp_enabled_flag) {
+        temporal_mvp = b.read_bits(1);
+      }
+    }
+
+    if (s.sample_adaptive_offset_enabled_flag) {
+      b.read_bits(1);  // slice_sao_luma_flag
+      if (s.chroma_array_type != 0) {
+        b.read_bits(1);  // slice_sao_chroma_flag
+      }
+    }
+
+    if (slice_type == SLICE_P || slice_type == SLICE_B) {
+      int lists = slice_type == SLICE_B ? 2 : 1;
+      int num_ref_idx_active[2] = {p.num_ref_idx_default_active[0],
+                                   p.num_ref_idx_default_active[1]};
+
+      if (b.read_bits(1)) {  // num_ref_idx_active_override_flag
+        for (int i = 0; i < lists; i++) {
+          num_ref_idx_active[i] = ue(b) + 1;
+        }
+      }
+      if (num_ref_idx_active[0] > 16 || num_ref_idx_active[1] > 16) {
+        return -1;
+      }
+      if (p.lists_modification_present_flag && num_pic_total_curr > 1) {
+        uint32_t n = ceil_log2(num_pic_total_curr);
+        for (int i = 0; i < lists; i++) {
+          if (b.read_bits(1)) {  // ref_pic_list_modification_flag
+            skip_bits(b, n * num_ref_idx_active[i]);  // list_entry
+          }
+        }
+      }
+      if (slice_type == SLICE_B) {
+        b.read_bits(1);  // mvd_l1_zero_flag
+      }
+      if (p.cabac_init_present_flag) {
+        b.read_bits(1);  // cabac_init_flag
+      }
+      if (temporal_mvp) {
+        bool collocated_from_l0 = true;
+        if (slice_type == SLICE_B) {
+          collocated_from_l0 = b.read_bits(1);
+        }
+        if (num_ref_idx_active[collocated_from_l0 ? 0 : 1] > 1) {
+          ue(b);  // collocated_ref_idx
+        }
+      }
+      if ((p.weighted_pred_flag && slice_type == SLICE_P) ||
+          (p.weighted_bipred_flag && slice_type == SLICE_B)) {
+        ue(b);  // luma_log2_weight_denom
+        if (s.chroma_array_type != 0) {
+          se(b);  // delta_chroma_log2_weight_denom
+        }
+        for (int i = 0; i < lists; i++) {
+          bool luma[16];
+          bool chroma[16];
+
+          for (int j = 0; j < num_ref_idx_active[i]; j++) {
+            luma[j] = b.read_bits(1);
+          }
+          for (int j = 0; j < num_ref_idx_active[i]; j++) {
+            chroma[j] = s.chroma_array_type != 0 && b.read_bits(1);
+          }
+          for (int j = 0; j < num_ref_idx_active[i] && !b.eos; j++) {
+            if (luma[j]) {
+              se(b);  // delta_luma_weight
+              se(b);  // luma_offset
+            }
+            for (int k = 0; chroma[j] && k < 4; k++) {
+              se(b);  // delta_chroma_weight and delta_chroma_offset
+            }
+          }
+        }
+      }
+      ue(b);  // five_minus_max_num_merge_cand
+    }
+
+    return p.init_qp + se(b);  // slice_qp_delta
+  }
+
+ public:
   enum hevc_nal_unit_type {
     HEVC_NAL_TRAIL_N = 0,  // 0
     HEVC_NAL_TRAIL_R,      // 1
@@ -568,6 +1266,7 @@ class start_code_reader : public reader {
   uint32_t bitstream_buf_size;
   uint32_t bitstream_pos;
   uint32_t frame_cnt;
+  bool frame_idr;
 
  public:
   start_code_reader(const std::string &name) {
@@ -582,6 +1281,7 @@ class start_code_reader : public reader {
     bitstream_buf_size = 0;
     bitstream_pos = 0;
     frame_cnt = 0;
+    frame_idr = false;
 
     codec_id = get_codec_id(name);
     switch (codec_id) {
@@ -624,6 +1324,7 @@ class start_code_reader : public reader {
     bitstream_buf_size = 0;
     bitstream_pos = 0;
     frame_cnt = 0;
+    frame_idr = false;
 
     // codec_id = get_codec_id(name);
     switch (name) {
@@ -673,6 +1374,9 @@ class start_code_reader : public reader {
 
   void set_eos(bool is_eos) { this->is_eos = is_eos; }
 
+  // Whether the last frame found by find_one_frame() is an IDR picture.
+  bool is_idr_frame() { return frame_idr; }
+
   bool is_parser_valid() { return (NULL != dec); }
 
   int get_start_code_len(uint32_t prefix) {
@@ -722,6 +1426,7 @@ class start_code_reader : public reader {
 
     frame_size = 0;
     slice_cnt = 0;
+    frame_idr = false;
 
     prefix = ~0u;
     ret = seek_prefix_in_buffer(buffer, buffer_size, found_pos0, prefix);
@@ -779,6 +1484,7 @@ class start_code_reader : public reader {
 
       if (info.slice) {
         slice_cnt++;
+        frame_idr = frame_idr || info.idr;
       }
 
       if (info.config ||
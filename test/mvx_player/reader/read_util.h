@@ -78,6 +78,9 @@ class bitreader {
     return val;
   }
   uint32_t peek_bits(uint32_t n) {
+    if (n == 0) {
+      return 0;
+    }
     while (e < n) {
       if (off >= size) {
         eos = true;
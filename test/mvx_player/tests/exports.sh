@@ -0,0 +1,16 @@
+#!/bin/sh
+#
+# libmvxplayer must only export the session API of mvx_session.hpp.
+#
+# usage: exports.sh <libmvxplayer.so>
+
+set -e
+
+extra=$(nm -D --defined-only "$1" | awk '{ print $3 }' |
+	grep -v -E '^_ZN?K?(10MvxSession|16MvxSessionConfig)' || true)
+
+if [ -n "$extra" ]; then
+	echo "Unexpected exports:"
+	echo "$extra"
+	exit 1
+fi
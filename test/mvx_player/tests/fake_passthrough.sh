@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Encode and decode against the in-process fake device. The fake copies
+# every input buffer to an output buffer, so the output must match the
+# input byte for byte.
+#
+# usage: fake_passthrough.sh <bin dir> <coverage dir>
+
+set -e
+
+bin=$1
+data=$2
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Ten 64x64 YUV420 frames.
+head -c 61440 /dev/urandom > "$tmp/in.yuv"
+"$bin/mvx_encoder" --dev fake --memory mmap -w 64 -h 64 -f raw \
+	"$tmp/in.yuv" "$tmp/out.h264"
+cmp "$tmp/in.yuv" "$tmp/out.h264"
+
+"$bin/mvx_decoder" --dev fake --memory mmap -f raw -i h264 \
+	"$data/input.h264" "$tmp/out.yuv"
+cmp "$data/input.h264" "$tmp/out.yuv"
+
+# Several sessions, on their own threads, an event loop and a stage pool.
+for opts in "" "--event_loop 2" "--stage_threads 2"; do
+	"$bin/mvx_decoder_multi" --dev fake --memory mmap -f raw -i h264 -n 2 \
+		$opts "$data/input.h264" "$tmp/multi.yuv"
+	cmp "$data/input.h264" "$tmp/multi.yuv.0"
+	cmp "$data/input.h264" "$tmp/multi.yuv.1"
+
+	"$bin/mvx_encoder_multi" --dev fake --memory mmap -w 64 -h 64 -f raw \
+		-n 2 $opts "$tmp/in.yuv" "$tmp/multi.h264"
+	cmp "$tmp/in.yuv" "$tmp/multi.h264.0"
+	cmp "$tmp/in.yuv" "$tmp/multi.h264.1"
+done
+
+# One stream of three closed GOPs, split over three sessions.
+cat "$data/input.h264" "$data/input.h264" "$data/input.h264" > "$tmp/in.h264"
+"$bin/mvx_decoder_multi" --dev fake --memory mmap -f raw -i h264 -n 3 \
+	--segmented "$tmp/in.h264" "$tmp/seg.yuv"
+cmp "$tmp/in.h264" "$tmp/seg.yuv"
+
+# Stills, each output named after the input it came from.
+mkdir "$tmp/stills"
+for name in a b c d e; do
+	head -c 6144 /dev/urandom > "$tmp/stills/$name.yuv"
+done
+"$bin/mvx_encoder" --dev fake --memory mmap -w 64 -h 64 -f raw --batch \
+	-o h264 "$tmp/stills" "$tmp/stills.h264"
+"$bin/mvx_decoder" --dev fake --memory mmap -f raw -i h264 --batch \
+	-o yuv420 "$tmp/stills" "$tmp/stills.yuv"
+for name in a b c d e; do
+	cmp "$tmp/stills/$name.yuv" "$tmp/stills.h264/$name.yuv.h264"
+	cmp "$tmp/stills/$name.yuv" "$tmp/stills.yuv/$name.yuv.yuv420"
+done
+
+# A warm session over a list, which fails on an input it cannot open.
+mkdir "$tmp/warm"
+cp "$data/input.h264" "$tmp/warm/a.h264"
+cp "$data/input.h264" "$tmp/warm/b.h264"
+"$bin/mvx_decoder" --dev fake --memory mmap -f raw -i h264 --warm \
+	-o yuv420 "$tmp/warm" "$tmp/warm.yuv"
+cmp "$data/input.h264" "$tmp/warm.yuv/a.h264.yuv420"
+cmp "$data/input.h264" "$tmp/warm.yuv/b.h264.yuv420"
+
+printf '%s\n' "$tmp/warm/a.h264" "$tmp/warm/missing.h264" > "$tmp/warm.list"
+if "$bin/mvx_decoder" --dev fake --memory mmap -f raw -i h264 --warm \
+	-o yuv420 "$tmp/warm.list" "$tmp/warm.list.yuv"; then
+	echo "Warm decode of a missing input did not fail."
+	exit 1
+fi
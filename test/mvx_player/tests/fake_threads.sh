@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Several sessions against the fake device in every threaded mode. Built
+# with MVX_TSAN, a data race fails the test through the sanitizer's exit
+# code.
+#
+# usage: fake_threads.sh <bin dir> <coverage dir> <modes...>
+
+set -e
+
+bin=$1
+data=$2
+shift 2
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Sixty 64x64 YUV420 frames.
+head -c 368640 /dev/urandom > "$tmp/in.yuv"
+"$bin/mvx_encoder" --dev fake --memory mmap -w 64 -h 64 -f ivf \
+	"$tmp/in.yuv" "$tmp/in.ivf"
+
+for mode in "$@"; do
+	opts=$(echo "$mode" | tr ',' ' ')
+
+	"$bin/mvx_decoder_multi" --dev fake:latency=200 --memory mmap -f raw \
+		-i h264 -n 4 $opts "$data/input.h264" "$tmp/out.yuv"
+	"$bin/mvx_encoder_multi" --dev fake:latency=200 --memory mmap -w 64 \
+		-h 64 -f raw -n 4 $opts "$tmp/in.yuv" "$tmp/out.h264"
+
+	for i in 0 1 2 3; do
+		cmp "$data/input.h264" "$tmp/out.yuv.$i"
+		cmp "$tmp/in.yuv" "$tmp/out.h264.$i"
+	done
+
+	# The skew moves every capture timestamp off its input, so a mode
+	# that skips the output timestamp check reports no mismatch.
+	"$bin/mvx_decoder_multi" --dev fake:latency=200,skew=1 --memory mmap \
+		-f ivf -i h264 -n 4 $opts "$tmp/in.ivf" "$tmp/out.yuv" \
+		2> "$tmp/err.log"
+	if ! grep -q "Incorrect timestamp" "$tmp/err.log"; then
+		echo "No timestamp check in mode '$mode'." >&2
+		exit 1
+	fi
+done
@@ -0,0 +1,219 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+/*
+ * Counts heap allocations with a replaced operator new. After the first
+ * frames have sized the caches, a frame must not allocate: neither in the
+ * Buffer accessors on a USERPTR P010 buffer, nor when streaming raw frames
+ * through an encoder on the in-process fake device.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <new>
+#include <sstream>
+#include <vector>
+
+#include "mvx_player.hpp"
+
+using namespace std;
+
+#define TEST_WIDTH 64
+#define TEST_HEIGHT 64
+#define TEST_FRAMES 300
+
+/* Frames left out at each end, while caches are sized and streams drain. */
+#define TEST_SKIP 50
+
+static atomic<size_t> allocations(0);
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, memory_order_relaxed);
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p == NULL) {
+    throw bad_alloc();
+  }
+
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+/* What the device hands back for a frame: every plane filled. */
+static void dequeue(Buffer &buffer) {
+  v4l2_buffer b = buffer.getBuffer();
+  v4l2_plane planes[VIDEO_MAX_PLANES];
+
+  memcpy(planes, b.m.planes, sizeof(planes[0]) * b.length);
+  for (size_t i = 0; i < b.length; ++i) {
+    planes[i].bytesused = planes[i].length;
+    planes[i].data_offset = 0;
+  }
+
+  b.m.planes = planes;
+  buffer.update(b);
+}
+
+static int testAccessors() {
+  const size_t size[2] = {TEST_WIDTH * TEST_HEIGHT * 2,
+                          TEST_WIDTH * TEST_HEIGHT};
+  v4l2_format format;
+  v4l2_buffer b;
+  v4l2_plane planes[VIDEO_MAX_PLANES];
+  size_t first = 0;
+
+  memset(&format, 0, sizeof(format));
+  format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  format.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_P010;
+  format.fmt.pix_mp.width = TEST_WIDTH;
+  format.fmt.pix_mp.height = TEST_HEIGHT;
+  format.fmt.pix_mp.num_planes = 2;
+
+  memset(&b, 0, sizeof(b));
+  memset(planes, 0, sizeof(planes));
+  b.type = format.type;
+  b.memory = V4L2_MEMORY_USERPTR;
+  b.length = 2;
+  b.m.planes = planes;
+  for (size_t i = 0; i < 2; ++i) {
+    planes[i].length = size[i];
+  }
+
+  try {
+    Buffer buffer(b, -1, format);
+
+    for (size_t frame = 0; frame < TEST_FRAMES; ++frame) {
+      if (frame == TEST_SKIP) {
+        first = allocations.load(memory_order_relaxed);
+      }
+
+      /* Input side: fill the planes, then queue. */
+      PlaneView iov = buffer.getImageSize();
+      for (size_t i = 0; i < iov.size(); ++i) {
+        memset(iov[i].iov_base, frame, iov[i].iov_len);
+      }
+      buffer.setBytesUsed(iov);
+      buffer.getBytesUsed();
+
+      /* Output side: dequeue, then write out. */
+      dequeue(buffer);
+      buffer.getBytesUsed();
+      buffer.convert10Bit();
+    }
+  } catch (Exception &e) {
+    fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+  }
+
+  size_t count = allocations.load(memory_order_relaxed) - first;
+  if (count != 0) {
+    fprintf(stderr, "FAIL: %zu allocations in %d accessor frames\n", count,
+            TEST_FRAMES - TEST_SKIP);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int testStream() {
+  vector<uint8_t> frame(TEST_WIDTH * TEST_HEIGHT * 3 / 2, 0x80);
+  size_t queued = 0;
+  size_t delivered = 0;
+  size_t first = 0;
+  size_t last = 0;
+
+  InputCallback::Source source = [&](MemoryUnit &unit) {
+    if (queued == TEST_FRAMES) {
+      return false;
+    }
+
+    unit.spans[0].iov_base = &frame[0];
+    unit.spans[0].iov_len = frame.size();
+    unit.count = 1;
+    unit.timestamp = queued++ * 33333;
+    return true;
+  };
+
+  OutputCallback::Sink sink = [&](const MemoryUnit &) {
+    if (++delivered == TEST_SKIP) {
+      first = allocations.load(memory_order_relaxed);
+    } else if (delivered == TEST_FRAMES - TEST_SKIP) {
+      last = allocations.load(memory_order_relaxed);
+    }
+  };
+
+  ostringstream log;
+  InputCallback input(V4L2_PIX_FMT_YUV420M, TEST_WIDTH, TEST_HEIGHT, 1,
+                      source);
+  OutputCallback output(V4L2_PIX_FMT_H264, sink);
+
+  try {
+    Encoder encoder("fake", input, output, true, log);
+    encoder.setMemoryType(V4L2_MEMORY_MMAP);
+    if (encoder.stream() != 0) {
+      fprintf(stderr, "FAIL: stream\n");
+      return 1;
+    }
+  } catch (Exception &e) {
+    fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+  }
+
+  if (delivered < TEST_FRAMES) {
+    fprintf(stderr, "FAIL: delivered %zu of %d frames\n", delivered,
+            TEST_FRAMES);
+    return 1;
+  }
+
+  if (last != first) {
+    fprintf(stderr, "FAIL: %zu allocations in %d streamed frames\n",
+            last - first, TEST_FRAMES - 2 * TEST_SKIP);
+    return 1;
+  }
+
+  return 0;
+}
+
+int main() {
+  int failed = 0;
+
+  failed += testAccessors();
+  failed += testStream();
+
+  return failed == 0 ? 0 : 1;
+}
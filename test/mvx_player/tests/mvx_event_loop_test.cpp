@@ -0,0 +1,170 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+/*
+ * EventLoop against eventfds standing in for device descriptors. Every
+ * source keeps itself busy and pokes its neighbour, so sessions move between
+ * threads and get events while another thread handles them. Run it in an
+ * MVX_TSAN build to check the hand over of sessions between threads.
+ */
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "mvx_event_loop.hpp"
+#include "mvx_player.hpp"
+
+using namespace std;
+
+/* Handled events per session before it is done. */
+#define TEST_ROUNDS 200
+
+class BusySource : public EventSource {
+ public:
+  BusySource()
+      : neighbour(NULL), handled(0), started(false), finished(false) {}
+
+  virtual void start() {
+    started = true;
+    token.notify();
+  }
+
+  virtual size_t getPollFds(struct pollfd fds[], size_t max) {
+    if (max < 1) {
+      return 0;
+    }
+
+    fds[0].fd = token.getFd();
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+
+    return 1;
+  }
+
+  virtual bool handlePollFds(const struct pollfd fds[], size_t nfds) {
+    if (nfds != 1 || (fds[0].revents & POLLIN) == 0) {
+      return false;
+    }
+
+    token.clear();
+    neighbour->token.notify();
+    if (++handled >= TEST_ROUNDS) {
+      return true;
+    }
+
+    token.notify();
+    return false;
+  }
+
+  virtual void finish() { finished = true; }
+
+  EventNotifier token;
+  BusySource *neighbour;
+  unsigned int handled;
+  bool started;
+  bool finished;
+};
+
+/* Fails on its first event. */
+class FailingSource : public BusySource {
+ public:
+  virtual bool handlePollFds(const struct pollfd fds[], size_t nfds) {
+    (void)fds;
+    (void)nfds;
+    throw Exception("Failing on purpose.");
+  }
+};
+
+static int check(bool ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int testSessions(size_t sessions, size_t threads) {
+  vector<BusySource> sources(sessions);
+  EventLoop loop(threads, 5000);
+  int failed = 0;
+
+  for (size_t i = 0; i < sessions; ++i) {
+    sources[i].neighbour = &sources[(i + 1) % sessions];
+    loop.add(sources[i]);
+  }
+
+  failed += check(loop.run() == 0, "sessions run");
+  for (size_t i = 0; i < sessions; ++i) {
+    failed += check(loop.getResult(i) == 0, "sessions result");
+    failed += check(sources[i].started && sources[i].finished,
+                    "sessions start and finish");
+    failed += check(sources[i].handled == TEST_ROUNDS, "sessions rounds");
+  }
+
+  return failed;
+}
+
+/* A failing session does not hold up the others. */
+static int testFailure(size_t threads) {
+  BusySource ok;
+  FailingSource bad;
+  EventLoop loop(threads, 5000);
+  int failed = 0;
+
+  ok.neighbour = &ok;
+  bad.neighbour = &bad;
+  loop.add(ok);
+  loop.add(bad);
+
+  failed += check(loop.run() == 1, "failure run");
+  failed += check(loop.getResult(0) == 0, "failure good result");
+  failed += check(loop.getResult(1) == 1, "failure bad result");
+  failed += check(!bad.finished, "failure not finished");
+
+  return failed;
+}
+
+int main() {
+  int failed = 0;
+
+  failed += testSessions(1, 1);
+  failed += testSessions(32, 1);
+  failed += testSessions(32, 4);
+  failed += testSessions(64, 8);
+  failed += testFailure(1);
+  failed += testFailure(2);
+
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+/*
+ * The confidential and proprietary information contained in this file may
+ * only be used by a person authorised under and to the extent permitted
+ * by a subsisting licensing agreement from Arm Technology (China) Co., Ltd.
+ *
+ *            (C) COPYRIGHT 2021-2021 Arm Technology (China) Co., Ltd.
+ *                ALL RIGHTS RESERVED
+ *
+ * This entire notice must be reproduced on all copies of this file
+ * and copies of this file may only be made by a person if such person is
+ * permitted to do so under the terms of a subsisting license agreement
+ * from Arm Technology (China) Co., Ltd.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ */
+
+
+/*
+ * Strides and plane sizes from Codec::getSize() and plane offsets from
+ * PlaneLayout for every raw format Codec::getStride() knows.
+ */
+
+#include <stdio.h>
+
+#include "mvx_player.hpp"
+
+using namespace std;
+
+struct Layout {
+  const char *name;
+  uint32_t format;
+  size_t width;
+  size_t height;
+  size_t strideAlign;
+  size_t alignment;
+  bool separate;
+  size_t nplanes;
+  size_t stride[3];
+  size_t size[3];
+  size_t offset[3];
+  size_t total;
+};
+
+static const Layout layouts[] = {
+    {"yuv420m", V4L2_PIX_FMT_YUV420M, 100, 50, 16, 4096, false, 3,
+     {112, 64, 64}, {5600, 1600, 1600}, {0, 8192, 12288}, 13888},
+    {"yuv420m odd", V4L2_PIX_FMT_YUV420M, 99, 49, 1, 64, false, 3,
+     {99, 50, 50}, {4851, 1225, 1225}, {0, 4864, 6144}, 7369},
+    {"yuv420m separate", V4L2_PIX_FMT_YUV420M, 100, 50, 16, 4096, true, 3,
+     {112, 64, 64}, {5600, 1600, 1600}, {0, 0, 0}, 8800},
+    {"nv12", V4L2_PIX_FMT_NV12, 100, 50, 16, 4096, false, 2,
+     {112, 112, 0}, {5600, 2800, 0}, {0, 8192, 0}, 10992},
+    {"nv21", V4L2_PIX_FMT_NV21, 100, 50, 16, 64, false, 2,
+     {112, 112, 0}, {5600, 2800, 0}, {0, 5632, 0}, 8432},
+    {"p010", V4L2_PIX_FMT_P010, 100, 50, 16, 4096, false, 2,
+     {208, 208, 0}, {10400, 5200, 0}, {0, 12288, 0}, 17488},
+    {"y0l2", V4L2_PIX_FMT_Y0L2, 100, 50, 16, 4096, false, 1,
+     {400, 0, 0}, {10000, 0, 0}, {0, 0, 0}, 10000},
+    {"yuyv", V4L2_PIX_FMT_YUYV, 100, 50, 16, 4096, false, 1,
+     {208, 0, 0}, {10400, 0, 0}, {0, 0, 0}, 10400},
+    {"uyvy", V4L2_PIX_FMT_UYVY, 100, 50, 16, 4096, false, 1,
+     {208, 0, 0}, {10400, 0, 0}, {0, 0, 0}, 10400},
+    {"y210", V4L2_PIX_FMT_Y210, 100, 50, 16, 4096, false, 1,
+     {400, 0, 0}, {20000, 0, 0}, {0, 0, 0}, 20000},
+    {"argb8888", DRM_FORMAT_ARGB8888, 100, 50, 16, 4096, false, 1,
+     {400, 0, 0}, {20000, 0, 0}, {0, 0, 0}, 20000},
+    {"abgr8888", DRM_FORMAT_ABGR8888, 100, 50, 16, 4096, false, 1,
+     {400, 0, 0}, {20000, 0, 0}, {0, 0, 0}, 20000},
+    {"rgba8888", DRM_FORMAT_RGBA8888, 100, 50, 16, 4096, false, 1,
+     {400, 0, 0}, {20000, 0, 0}, {0, 0, 0}, 20000},
+    {"bgra8888", DRM_FORMAT_BGRA8888, 100, 50, 16, 4096, false, 1,
+     {400, 0, 0}, {20000, 0, 0}, {0, 0, 0}, 20000},
+};
+
+static int testLayout(const Layout &l) {
+  size_t nplanes;
+  size_t stride[3];
+  size_t size[3];
+  size_t frameSize = Codec::getSize(l.format, l.width, l.height,
+                                    l.strideAlign, nplanes, stride, size);
+  PlaneLayout layout;
+  int failed = 0;
+
+  layout.compute(size, nplanes, l.alignment, l.separate);
+
+  if (nplanes != l.nplanes) {
+    fprintf(stderr, "FAIL: %s planes %zu, expected %zu\n", l.name, nplanes,
+            l.nplanes);
+    return 1;
+  }
+
+  for (size_t i = 0; i < 3; ++i) {
+    if (stride[i] != l.stride[i] || size[i] != l.size[i]) {
+      fprintf(stderr,
+              "FAIL: %s plane %zu stride %zu size %zu, expected %zu %zu\n",
+              l.name, i, stride[i], size[i], l.stride[i], l.size[i]);
+      failed++;
+    }
+  }
+
+  for (size_t i = 0; i < nplanes; ++i) {
+    if (layout.getOffset(i) != l.offset[i]) {
+      fprintf(stderr, "FAIL: %s plane %zu offset %zu, expected %zu\n",
+              l.name, i, layout.getOffset(i), l.offset[i]);
+      failed++;
+    }
+  }
+
+  if (layout.getTotalSize() != l.total) {
+    fprintf(stderr, "FAIL: %s total %zu, expected %zu\n", l.name,
+            layout.getTotalSize(), l.total);
+    failed++;
+  }
+
+  if (frameSize != size[0] + size[1] + size[2]) {
+    fprintf(stderr, "FAIL: %s frame size %zu\n", l.name, frameSize);
+    failed++;
+  }
+
+  return failed;
+}
+
+int main() {
+  int failed = 0;
+
+  for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+    failed += testLayout(layouts[i]);
+  }
+
+  return failed == 0 ? 0 : 1;
+}